@@ -0,0 +1,826 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    Benchmark driver for the example filesystems.  The filesystem is
+    linked in with its main() renamed to fusebench_fs_main() and
+    fuse_main_real() renamed to fuse_bench_main(), so instead of
+    mounting, its operations are handed to this file.  Requests are
+    then fed through a loopback channel, without the kernel:
+
+    gcc -Wall `pkg-config fuse --cflags --libs` -include fusebench.h \
+        -Dmain=fusebench_fs_main -Dfuse_main_real=fuse_bench_main \
+        fusebench.c hello.c -o bench_hello
+
+    A lowlevel filesystem is hooked where it parses the command line,
+    mounts, runs the session loop and unmounts:
+
+    gcc -Wall `pkg-config fuse --cflags --libs` -include fusebench.h \
+        -Dmain=fusebench_fs_main \
+        -Dfuse_parse_cmdline=fuse_bench_parse_cmdline \
+        -Dfuse_mount=fuse_bench_mount -Dfuse_unmount=fuse_bench_unmount \
+        -Dfuse_session_loop=fuse_bench_session_loop \
+        -Dfuse_session_loop_mt=fuse_bench_session_loop \
+        fusebench.c fusexmp_ll.c -o bench_fusexmp_ll
+*/
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
+#include <fuse_kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "fusebench.h"
+
+/* The build renames the filesystem's main(), but this one is ours */
+#undef main
+
+#ifndef FUSEBENCH_FILE
+#define FUSEBENCH_FILE "/hello"
+#endif
+
+int fuse_bench_main(int argc, char *argv[], const struct fuse_operations *op,
+                    size_t op_size, void *user_data);
+int fuse_bench_parse_cmdline(struct fuse_args *args, char **mountpoint,
+                             int *multithreaded, int *foreground);
+struct fuse_chan *fuse_bench_mount(const char *mountpoint,
+                                   struct fuse_args *args);
+int fuse_bench_session_loop(struct fuse_session *se);
+void fuse_bench_unmount(const char *mountpoint, struct fuse_chan *ch);
+
+enum {
+    BENCH_LOOKUP,
+    BENCH_GETATTR,
+    BENCH_READ,
+    BENCH_WRITE,
+    BENCH_READDIR,
+    BENCH_FORGET,
+    BENCH_NUM_OPS
+};
+
+static const char *bench_names[BENCH_NUM_OPS] = {
+    "lookup", "getattr", "read", "write", "readdir", "forget"
+};
+
+struct bench_conf {
+    unsigned count;
+    unsigned size;
+    char *ops;
+    char *file;
+    char *dir;
+    int help;
+};
+
+struct bench {
+    struct bench_conf conf;
+    struct fuse_chan *ch;
+    uint64_t unique;
+    char *req;
+    size_t reqsize;
+    char *reply;
+    size_t replysize;
+    int error;
+    uint64_t *lat;
+    uint64_t dir_ino;
+    uint64_t parent_ino;
+    uint64_t file_ino;
+    const char *file_name;
+    uint64_t lookup_ino;
+    const char *lookup_name;
+    char *root_name;
+    int lookup_error;
+    uint64_t lookups;
+    int created;
+    int run[BENCH_NUM_OPS];
+};
+
+#define BENCH_OPT(t, p) { t, offsetof(struct bench_conf, p), 1 }
+
+static const struct fuse_opt bench_opts[] = {
+    BENCH_OPT("-n %u",          count),
+    BENCH_OPT("--count=%u",     count),
+    BENCH_OPT("--size=%u",      size),
+    BENCH_OPT("--ops=%s",       ops),
+    BENCH_OPT("--file=%s",      file),
+    BENCH_OPT("--dir=%s",       dir),
+    BENCH_OPT("-h",             help),
+    BENCH_OPT("--help",         help),
+    FUSE_OPT_END
+};
+
+static void usage(const char *progname)
+{
+    fprintf(stderr,
+"usage: %s [options]\n"
+"\n"
+"Benchmark options:\n"
+"    -n N, --count=N        requests per operation (100000)\n"
+"    --size=N               read and write size (4096)\n"
+"    --ops=LIST             operations to run, separated by commas\n"
+"                           (lookup,getattr,read,write,readdir,forget)\n"
+"    --file=PATH            file to look up, stat, read and write (%s)\n"
+"    --dir=PATH             directory to read (/)\n"
+"\n"
+"Other -o options are passed to the library, see 'fuse -h'.\n",
+            progname, FUSEBENCH_FILE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1) {
+#endif
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        ts.tv_sec = tv.tv_sec;
+        ts.tv_nsec = tv.tv_usec * 1000;
+#ifdef CLOCK_MONOTONIC
+    }
+#endif
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Send one request with the given argument blocks.  Returns the
+ * length of the reply payload, or -errno if the filesystem replied
+ * with an error.  The payload is left in b->reply.
+ */
+static int bench_send(struct bench *b, uint32_t opcode, uint64_t nodeid,
+                      const void *arg1, size_t len1,
+                      const void *arg2, size_t len2)
+{
+    struct fuse_in_header *in = (struct fuse_in_header *) b->req;
+    struct fuse_out_header *out = (struct fuse_out_header *) b->reply;
+    size_t len = sizeof(*in) + len1 + len2;
+    int res;
+
+    if (len > b->reqsize)
+        return -E2BIG;
+
+    memset(in, 0, sizeof(*in));
+    in->len = len;
+    in->opcode = opcode;
+    in->unique = ++b->unique;
+    in->nodeid = nodeid;
+    in->uid = getuid();
+    in->gid = getgid();
+    in->pid = getpid();
+    if (len1)
+        memcpy(b->req + sizeof(*in), arg1, len1);
+    if (len2)
+        memcpy(b->req + sizeof(*in) + len1, arg2, len2);
+
+    res = fuse_loopback_chan_process(b->ch, b->req, len, b->reply,
+                                     b->replysize);
+    if (res <= 0)
+        return res;
+    if ((size_t) res < sizeof(*out) || (size_t) res > b->replysize)
+        return -EPROTO;
+    if (out->error)
+        return out->error;
+    return res - sizeof(*out);
+}
+
+static void *bench_payload(struct bench *b)
+{
+    return b->reply + sizeof(struct fuse_out_header);
+}
+
+static int bench_lookup(struct bench *b, uint64_t parent, const char *name,
+                        uint64_t *ino)
+{
+    int res = bench_send(b, FUSE_LOOKUP, parent, name, strlen(name) + 1,
+                         NULL, 0);
+    if (res >= 0) {
+        struct fuse_entry_out *arg = (struct fuse_entry_out *) bench_payload(b);
+        if (ino)
+            *ino = arg->nodeid;
+        return 0;
+    }
+    return res;
+}
+
+static void bench_forget(struct bench *b, uint64_t ino, uint64_t nlookup)
+{
+    struct fuse_forget_in arg;
+
+    if (ino == FUSE_ROOT_ID || !nlookup)
+        return;
+    memset(&arg, 0, sizeof(arg));
+    arg.nlookup = nlookup;
+    bench_send(b, FUSE_FORGET, ino, &arg, sizeof(arg), NULL, 0);
+}
+
+static int bench_open(struct bench *b, uint32_t opcode, uint64_t ino,
+                      int flags, uint64_t *fh)
+{
+    struct fuse_open_in arg;
+    int res;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.flags = flags;
+    res = bench_send(b, opcode, ino, &arg, sizeof(arg), NULL, 0);
+    if (res >= 0) {
+        *fh = ((struct fuse_open_out *) bench_payload(b))->fh;
+        return 0;
+    }
+    return res;
+}
+
+static void bench_release(struct bench *b, uint32_t opcode, uint64_t ino,
+                          int flags, uint64_t fh)
+{
+    struct fuse_release_in arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.fh = fh;
+    arg.flags = flags;
+    bench_send(b, opcode, ino, &arg, sizeof(arg), NULL, 0);
+}
+
+/* Look up every component of an absolute path, leaving one lookup
+   reference on each.  The parent and the last name are returned too,
+   the root is its own parent. */
+static int bench_resolve(struct bench *b, const char *path, uint64_t *ino,
+                         uint64_t *parent, const char **name)
+{
+    char *copy = strdup(path);
+    char *s = copy;
+    char *comp;
+    uint64_t cur = FUSE_ROOT_ID;
+    int res = 0;
+
+    if (copy == NULL)
+        return -ENOMEM;
+    if (parent)
+        *parent = FUSE_ROOT_ID;
+    if (name)
+        *name = NULL;
+    while ((comp = strsep(&s, "/")) != NULL) {
+        if (!*comp)
+            continue;
+        if (parent)
+            *parent = cur;
+        if (name)
+            *name = path + (comp - copy);
+        res = bench_lookup(b, cur, comp, &cur);
+        if (res) {
+            /* Only a missing last component may be created */
+            if (name && s && s[strspn(s, "/")])
+                *name = NULL;
+            break;
+        }
+    }
+    free(copy);
+    *ino = cur;
+    return res;
+}
+
+/* The root has no name of its own, so lookup and forget use the first
+   entry listed in it.  One lookup reference is left on it. */
+static int bench_root_name(struct bench *b)
+{
+    struct fuse_read_in arg;
+    const char *buf;
+    size_t off = 0;
+    uint64_t fh;
+    int res;
+
+    res = bench_open(b, FUSE_OPENDIR, FUSE_ROOT_ID, O_RDONLY, &fh);
+    if (res)
+        return res;
+    memset(&arg, 0, sizeof(arg));
+    arg.fh = fh;
+    arg.size = 4096;
+    res = bench_send(b, FUSE_READDIR, FUSE_ROOT_ID, &arg, sizeof(arg),
+                     NULL, 0);
+    buf = (const char *) bench_payload(b);
+    while (res > 0 && off + FUSE_NAME_OFFSET <= (size_t) res) {
+        const struct fuse_dirent *de;
+        size_t len;
+
+        de = (const struct fuse_dirent *) (buf + off);
+        len = de->namelen;
+
+        if (!len || off + FUSE_DIRENT_SIZE(de) > (size_t) res)
+            break;
+        off += FUSE_DIRENT_SIZE(de);
+        if ((len == 1 && de->name[0] == '.') ||
+            (len == 2 && de->name[0] == '.' && de->name[1] == '.'))
+            continue;
+        b->root_name = (char *) malloc(len + 1);
+        if (b->root_name == NULL) {
+            res = -ENOMEM;
+            break;
+        }
+        memcpy(b->root_name, de->name, len);
+        b->root_name[len] = '\0';
+        break;
+    }
+    bench_release(b, FUSE_RELEASEDIR, FUSE_ROOT_ID, O_RDONLY, fh);
+    if (res < 0)
+        return res;
+    if (b->root_name == NULL)
+        return -ENOENT;
+
+    res = bench_lookup(b, FUSE_ROOT_ID, b->root_name, &b->lookup_ino);
+    if (res)
+        return res;
+    b->lookup_name = b->root_name;
+    return 0;
+}
+
+static int bench_create(struct bench *b)
+{
+    struct fuse_mknod_in arg;
+    int res;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.mode = S_IFREG | 0644;
+    res = bench_send(b, FUSE_MKNOD, b->parent_ino, &arg, sizeof(arg),
+                     b->file_name, strlen(b->file_name) + 1);
+    if (res >= 0) {
+        b->file_ino = ((struct fuse_entry_out *) bench_payload(b))->nodeid;
+        b->created = 1;
+        return 0;
+    }
+    return res;
+}
+
+static int cmp_u64(const void *p1, const void *p2)
+{
+    uint64_t a = *(const uint64_t *) p1;
+    uint64_t b = *(const uint64_t *) p2;
+    return a < b ? -1 : a > b;
+}
+
+static void bench_report(struct bench *b, int op, unsigned n,
+                         unsigned errors, int firsterr, uint64_t total)
+{
+    uint64_t *lat = b->lat;
+    double secs = total / 1e9;
+
+    if (!n) {
+        printf("%-8s %10s\n", bench_names[op], "skipped");
+        return;
+    }
+    qsort(lat, n, sizeof(lat[0]), cmp_u64);
+    printf("%-8s %10u %8u %12.0f %9.2f %9.2f %9.2f %9.2f",
+           bench_names[op], n, errors, secs > 0 ? n / secs : 0.0,
+           total / 1e3 / n, lat[n / 2] / 1e3,
+           lat[(unsigned) ((n - 1) * 0.99)] / 1e3, lat[n - 1] / 1e3);
+    if (errors)
+        printf("  (%s)", strerror(-firsterr));
+    printf("\n");
+}
+
+typedef int (*bench_func_t)(struct bench *b, unsigned i, uint64_t fh);
+
+static void bench_loop(struct bench *b, int op, bench_func_t func,
+                       uint64_t fh)
+{
+    unsigned n = b->conf.count;
+    unsigned errors = 0;
+    int firsterr = 0;
+    uint64_t total = 0;
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        uint64_t start = now_ns();
+        int res = func(b, i, fh);
+        b->lat[i] = now_ns() - start;
+        total += b->lat[i];
+        if (res < 0) {
+            if (!errors)
+                firsterr = res;
+            errors++;
+        }
+    }
+    bench_report(b, op, n, errors, firsterr, total);
+}
+
+static void bench_fail(int op, const char *what, int err)
+{
+    printf("%-8s %10s  (%s: %s)\n", bench_names[op], "failed", what,
+           strerror(-err));
+}
+
+/* A filesystem with nothing under the root has no name to look up */
+static void bench_no_name(struct bench *b, int op)
+{
+    if (b->lookup_error == -ENOENT || b->lookup_error == -ENOSYS)
+        printf("%-8s %10s  (nothing to look up under /)\n", bench_names[op],
+               "skipped");
+    else
+        bench_fail(op, "/", b->lookup_error);
+}
+
+static int do_lookup(struct bench *b, unsigned i, uint64_t fh)
+{
+    int res;
+
+    (void) i;
+    (void) fh;
+    res = bench_lookup(b, b->parent_ino, b->lookup_name, NULL);
+    if (!res)
+        b->lookups++;
+    return res;
+}
+
+static int do_getattr(struct bench *b, unsigned i, uint64_t fh)
+{
+    (void) i;
+    (void) fh;
+    return bench_send(b, FUSE_GETATTR, b->file_ino, NULL, 0, NULL, 0);
+}
+
+/* Reads and writes cycle through the first 256 blocks of the file */
+static int do_read(struct bench *b, unsigned i, uint64_t fh)
+{
+    struct fuse_read_in arg;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.fh = fh;
+    arg.offset = (uint64_t) (i % 256) * b->conf.size;
+    arg.size = b->conf.size;
+    return bench_send(b, FUSE_READ, b->file_ino, &arg, sizeof(arg), NULL, 0);
+}
+
+static int do_write(struct bench *b, unsigned i, uint64_t fh)
+{
+    struct fuse_write_in arg;
+    char *data = b->reply;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.fh = fh;
+    arg.offset = (uint64_t) (i % 256) * b->conf.size;
+    arg.size = b->conf.size;
+    /* The contents don't matter, send whatever the last reply was */
+    return bench_send(b, FUSE_WRITE, b->file_ino, &arg, sizeof(arg),
+                      data, b->conf.size);
+}
+
+static int do_readdir(struct bench *b, unsigned i, uint64_t fh)
+{
+    struct fuse_read_in arg;
+
+    (void) i;
+    memset(&arg, 0, sizeof(arg));
+    arg.fh = fh;
+    arg.size = 4096;
+    return bench_send(b, FUSE_READDIR, b->dir_ino, &arg, sizeof(arg),
+                      NULL, 0);
+}
+
+static int do_forget(struct bench *b, unsigned i, uint64_t fh)
+{
+    struct fuse_forget_in arg;
+
+    (void) i;
+    (void) fh;
+    memset(&arg, 0, sizeof(arg));
+    arg.nlookup = 1;
+    return bench_send(b, FUSE_FORGET, b->lookup_ino, &arg, sizeof(arg),
+                      NULL, 0);
+}
+
+static void bench_file_op(struct bench *b, int op, bench_func_t func,
+                          int flags)
+{
+    uint64_t fh;
+    int res;
+
+    if (b->error) {
+        bench_fail(op, b->conf.file, b->error);
+        return;
+    }
+    res = bench_open(b, FUSE_OPEN, b->file_ino, flags, &fh);
+    if (res) {
+        bench_fail(op, "open", res);
+        return;
+    }
+    bench_loop(b, op, func, fh);
+    bench_release(b, FUSE_RELEASE, b->file_ino, flags, fh);
+}
+
+static void bench_run_op(struct bench *b, int op)
+{
+    uint64_t fh;
+    int res;
+
+    switch (op) {
+    case BENCH_LOOKUP:
+        if (b->error)
+            bench_fail(op, b->conf.file, b->error);
+        else if (!b->lookup_name)
+            bench_no_name(b, op);
+        else
+            bench_loop(b, op, do_lookup, 0);
+        break;
+
+    case BENCH_GETATTR:
+        if (b->error)
+            bench_fail(op, b->conf.file, b->error);
+        else
+            bench_loop(b, op, do_getattr, 0);
+        break;
+
+    case BENCH_READ:
+        bench_file_op(b, op, do_read, O_RDONLY);
+        break;
+
+    case BENCH_WRITE:
+        bench_file_op(b, op, do_write, O_WRONLY);
+        break;
+
+    case BENCH_READDIR:
+        res = bench_open(b, FUSE_OPENDIR, b->dir_ino, O_RDONLY, &fh);
+        if (res) {
+            bench_fail(op, "opendir", res);
+            break;
+        }
+        bench_loop(b, op, do_readdir, fh);
+        bench_release(b, FUSE_RELEASEDIR, b->dir_ino, O_RDONLY, fh);
+        break;
+
+    case BENCH_FORGET:
+        if (b->error) {
+            bench_fail(op, b->conf.file, b->error);
+            break;
+        }
+        if (!b->lookup_name) {
+            bench_no_name(b, op);
+            break;
+        }
+        /* Forget the references piled up by lookup, taking some
+           more if there weren't enough */
+        while (b->lookups < b->conf.count) {
+            if (bench_lookup(b, b->parent_ino, b->lookup_name, NULL))
+                break;
+            b->lookups++;
+        }
+        if (b->lookups < b->conf.count) {
+            bench_fail(op, "lookup", -EIO);
+            break;
+        }
+        bench_loop(b, op, do_forget, 0);
+        b->lookups -= b->conf.count;
+        break;
+    }
+}
+
+static int bench_parse_ops(const char *ops, int *run)
+{
+    char *copy;
+    char *s;
+    char *tok;
+    int op;
+
+    if (!ops) {
+        for (op = 0; op < BENCH_NUM_OPS; op++)
+            run[op] = 1;
+        return 0;
+    }
+    copy = strdup(ops);
+    if (copy == NULL)
+        return -1;
+    s = copy;
+    while ((tok = strsep(&s, ",")) != NULL) {
+        if (!*tok)
+            continue;
+        for (op = 0; op < BENCH_NUM_OPS; op++) {
+            if (strcmp(tok, bench_names[op]) == 0) {
+                run[op] = 1;
+                break;
+            }
+        }
+        if (op == BENCH_NUM_OPS) {
+            fprintf(stderr, "fusebench: unknown operation `%s'\n", tok);
+            free(copy);
+            return -1;
+        }
+    }
+    free(copy);
+    return 0;
+}
+
+static int bench_init(struct bench *b)
+{
+    struct fuse_init_in arg;
+    int res;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.major = FUSE_KERNEL_VERSION;
+    arg.minor = FUSE_KERNEL_MINOR_VERSION;
+    arg.max_readahead = 131072;
+    res = bench_send(b, FUSE_INIT, 0, &arg, sizeof(arg), NULL, 0);
+    if (res < 0) {
+        fprintf(stderr, "fusebench: INIT failed: %s\n", strerror(-res));
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_run(struct bench *b)
+{
+    const int *run = b->run;
+    uint64_t ino;
+    int op;
+    int res;
+
+    res = bench_resolve(b, b->conf.dir, &ino, NULL, NULL);
+    b->dir_ino = res ? FUSE_ROOT_ID : ino;
+
+    res = bench_resolve(b, b->conf.file, &b->file_ino, &b->parent_ino,
+                        &b->file_name);
+    if (res == -ENOENT && b->file_name && run[BENCH_WRITE])
+        res = bench_create(b);
+    b->error = res;
+    if (!b->error && b->file_name) {
+        b->lookup_ino = b->file_ino;
+        b->lookup_name = b->file_name;
+    } else if (!b->error && (run[BENCH_LOOKUP] || run[BENCH_FORGET])) {
+        b->lookup_error = bench_root_name(b);
+    }
+
+    printf("%-8s %10s %8s %12s %9s %9s %9s %9s\n", "op", "count", "errors",
+           "ops/sec", "avg(us)", "p50(us)", "p99(us)", "max(us)");
+    for (op = 0; op < BENCH_NUM_OPS; op++)
+        if (run[op])
+            bench_run_op(b, op);
+
+    if (b->created)
+        bench_send(b, FUSE_UNLINK, b->parent_ino, b->file_name,
+                   strlen(b->file_name) + 1, NULL, 0);
+    if (b->lookup_name)
+        bench_forget(b, b->lookup_ino, b->lookups + 1);
+}
+
+/* Parse the benchmark options out of args.  Returns 1 if only help
+   was asked for */
+static int bench_setup(struct bench *b, struct fuse_args *args)
+{
+    int res;
+
+    memset(b, 0, sizeof(*b));
+    b->conf.count = 100000;
+    b->conf.size = 4096;
+
+    if (fuse_opt_parse(args, &b->conf, bench_opts, NULL) == -1)
+        return -1;
+    if (b->conf.help) {
+        usage(args->argv[0]);
+        return 1;
+    }
+    if (bench_parse_ops(b->conf.ops, b->run) == -1)
+        return -1;
+    if (!b->conf.file)
+        b->conf.file = strdup(FUSEBENCH_FILE);
+    if (!b->conf.dir)
+        b->conf.dir = strdup("/");
+    if (b->conf.file == NULL || b->conf.dir == NULL) {
+        fprintf(stderr, "fusebench: memory allocation failed\n");
+        return -1;
+    }
+    /* The last component is used as a name, don't let it end in '/' */
+    res = strlen(b->conf.file);
+    while (res > 1 && b->conf.file[res - 1] == '/')
+        b->conf.file[--res] = '\0';
+    if (!b->conf.count)
+        b->conf.count = 1;
+    return 0;
+}
+
+/* Allocate the buffers, once the channel exists */
+static int bench_alloc(struct bench *b)
+{
+    b->reqsize = fuse_chan_bufsize(b->ch);
+    b->replysize = b->reqsize;
+    if (b->conf.size > b->reqsize - sizeof(struct fuse_in_header) -
+        sizeof(struct fuse_write_in)) {
+        fprintf(stderr, "fusebench: size too large, maximum is %u\n",
+                (unsigned) (b->reqsize - sizeof(struct fuse_in_header) -
+                            sizeof(struct fuse_write_in)));
+        return -1;
+    }
+    b->req = (char *) calloc(1, b->reqsize);
+    b->reply = (char *) calloc(1, b->replysize);
+    b->lat = (uint64_t *) calloc(b->conf.count, sizeof(uint64_t));
+    if (b->req == NULL || b->reply == NULL || b->lat == NULL) {
+        fprintf(stderr, "fusebench: memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void bench_free(struct bench *b)
+{
+    free(b->req);
+    free(b->reply);
+    free(b->lat);
+    free(b->root_name);
+    free(b->conf.ops);
+    free(b->conf.file);
+    free(b->conf.dir);
+}
+
+int fuse_bench_main(int argc, char *argv[], const struct fuse_operations *op,
+                    size_t op_size, void *user_data)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct bench b;
+    struct fuse *f = NULL;
+    int res = 1;
+
+    if (bench_setup(&b, &args) != 0)
+        goto out;
+
+    b.ch = fuse_loopback_chan_new(0);
+    if (b.ch == NULL)
+        goto out;
+    f = fuse_new(b.ch, &args, op, op_size, user_data);
+    if (f == NULL) {
+        fuse_chan_destroy(b.ch);
+        goto out;
+    }
+
+    if (bench_alloc(&b) == -1 || bench_init(&b) == -1)
+        goto out;
+    bench_run(&b);
+    res = 0;
+
+ out:
+    if (f)
+        fuse_destroy(f);
+    bench_free(&b);
+    fuse_opt_free_args(&args);
+    return res;
+}
+
+/* A lowlevel filesystem is benchmarked from its mount to its unmount */
+static struct bench bench_ll;
+
+int fuse_bench_parse_cmdline(struct fuse_args *args, char **mountpoint,
+                             int *multithreaded, int *foreground)
+{
+    if (bench_setup(&bench_ll, args) != 0)
+        return -1;
+    if (mountpoint) {
+        *mountpoint = strdup("fusebench");
+        if (*mountpoint == NULL)
+            return -1;
+    }
+    if (multithreaded)
+        *multithreaded = 0;
+    if (foreground)
+        *foreground = 1;
+    return 0;
+}
+
+struct fuse_chan *fuse_bench_mount(const char *mountpoint,
+                                   struct fuse_args *args)
+{
+    (void) mountpoint;
+    (void) args;
+
+    bench_ll.ch = fuse_loopback_chan_new(0);
+    return bench_ll.ch;
+}
+
+int fuse_bench_session_loop(struct fuse_session *se)
+{
+    (void) se;
+
+    if (bench_alloc(&bench_ll) == -1 || bench_init(&bench_ll) == -1)
+        return -1;
+    bench_run(&bench_ll);
+    return 0;
+}
+
+void fuse_bench_unmount(const char *mountpoint, struct fuse_chan *ch)
+{
+    (void) mountpoint;
+
+    fuse_chan_destroy(ch);
+    bench_free(&bench_ll);
+}
+
+int main(int argc, char *argv[])
+{
+    return fusebench_fs_main(argc, argv);
+}
@@ -0,0 +1,13 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Included ahead of an example filesystem built into a benchmark, so
+   its renamed main() has a prototype.  Nothing else may be declared
+   here, the filesystem hasn't set FUSE_USE_VERSION yet. */
+
+int fusebench_fs_main(int argc, char *argv[]);
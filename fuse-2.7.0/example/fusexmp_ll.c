@@ -0,0 +1,1119 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+
+    gcc -Wall `pkg-config fuse --cflags --libs` fusexmp_ll.c -o fusexmp_ll
+*/
+
+/*
+ * Passthrough of the root filesystem using the lowlevel interface.
+ *
+ * Unlike fusexmp and fusexmp_fh, no path is ever built.  Every inode
+ * handed to the kernel is a node remembering its parent and name,
+ * and the backing filesystem is accessed with the *at() functions
+ * relative to the parent's directory.  Open directory descriptors are
+ * kept for the most recently used directories, up to the fd_cache
+ * option.  Others are reopened from their parent when needed again.
+ */
+
+#define FUSE_USE_VERSION 26
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+
+#include <fuse_lowlevel.h>
+#include <fuse_opt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+struct xmp_node {
+    struct xmp_node *parent;
+    char *name;
+    struct xmp_node *hash_next;
+    uint64_t generation;
+    uint64_t nlookup;
+    unsigned refctr;
+    /* Cached directory descriptor, or -1 */
+    int fd;
+    unsigned fd_users;
+    struct xmp_node *lru_prev;
+    struct xmp_node *lru_next;
+};
+
+struct xmp_conf {
+    unsigned fd_cache;
+    double timeout;
+};
+
+struct xmp {
+    pthread_mutex_t lock;
+    struct xmp_node root;
+    struct xmp_node **hash;
+    size_t hash_size;
+    size_t hash_use;
+    uint64_t generation;
+    /* Nodes with a cached descriptor, most recently used first */
+    struct xmp_node lru;
+    unsigned fd_count;
+    struct xmp_conf conf;
+};
+
+struct xmp_dirp {
+    DIR *dp;
+    struct dirent *entry;
+    off_t offset;
+};
+
+static struct xmp xmp;
+
+static struct xmp_node *get_node(fuse_ino_t ino)
+{
+    if (ino == FUSE_ROOT_ID)
+        return &xmp.root;
+    return (struct xmp_node *) (uintptr_t) ino;
+}
+
+static fuse_ino_t node_ino(struct xmp_node *node)
+{
+    if (node == &xmp.root)
+        return FUSE_ROOT_ID;
+    return (uintptr_t) node;
+}
+
+static size_t name_hash(struct xmp_node *parent, const char *name)
+{
+    size_t hash = (uintptr_t) parent;
+
+    for (; *name; name++)
+        hash = hash * 31 + (unsigned char) *name;
+    return hash & (xmp.hash_size - 1);
+}
+
+static int hash_resize(void)
+{
+    size_t oldsize = xmp.hash_size;
+    struct xmp_node **oldhash = xmp.hash;
+    size_t newsize = oldsize ? oldsize * 2 : 256;
+    size_t i;
+
+    xmp.hash = (struct xmp_node **) calloc(newsize, sizeof(xmp.hash[0]));
+    if (xmp.hash == NULL) {
+        xmp.hash = oldhash;
+        return -1;
+    }
+    xmp.hash_size = newsize;
+    for (i = 0; i < oldsize; i++) {
+        struct xmp_node *node = oldhash[i];
+        while (node != NULL) {
+            struct xmp_node *next = node->hash_next;
+            size_t hash = name_hash(node->parent, node->name);
+            node->hash_next = xmp.hash[hash];
+            xmp.hash[hash] = node;
+            node = next;
+        }
+    }
+    free(oldhash);
+    return 0;
+}
+
+static struct xmp_node *lookup_node(struct xmp_node *parent, const char *name)
+{
+    struct xmp_node *node;
+
+    for (node = xmp.hash[name_hash(parent, name)]; node != NULL;
+         node = node->hash_next)
+        if (node->parent == parent && strcmp(node->name, name) == 0)
+            return node;
+    return NULL;
+}
+
+static void hash_node(struct xmp_node *node)
+{
+    size_t hash = name_hash(node->parent, node->name);
+
+    node->hash_next = xmp.hash[hash];
+    xmp.hash[hash] = node;
+    xmp.hash_use++;
+}
+
+static void unhash_node(struct xmp_node *node)
+{
+    struct xmp_node **np = &xmp.hash[name_hash(node->parent, node->name)];
+
+    for (; *np != NULL; np = &(*np)->hash_next)
+        if (*np == node) {
+            *np = node->hash_next;
+            node->hash_next = NULL;
+            xmp.hash_use--;
+            return;
+        }
+}
+
+static void lru_remove(struct xmp_node *node)
+{
+    node->lru_prev->lru_next = node->lru_next;
+    node->lru_next->lru_prev = node->lru_prev;
+}
+
+static void lru_add(struct xmp_node *node)
+{
+    node->lru_next = xmp.lru.lru_next;
+    node->lru_prev = &xmp.lru;
+    xmp.lru.lru_next->lru_prev = node;
+    xmp.lru.lru_next = node;
+}
+
+static void unref_node(struct xmp_node *node);
+
+static void close_node_fd(struct xmp_node *node)
+{
+    lru_remove(node);
+    close(node->fd);
+    node->fd = -1;
+    xmp.fd_count--;
+}
+
+/* Close the least recently used descriptors not in use */
+static void trim_fds(void)
+{
+    struct xmp_node *node = xmp.lru.lru_prev;
+
+    while (xmp.fd_count > xmp.conf.fd_cache && node != &xmp.lru) {
+        struct xmp_node *prev = node->lru_prev;
+        if (!node->fd_users)
+            close_node_fd(node);
+        node = prev;
+    }
+}
+
+/* Drop the name of a node removed from the backing filesystem */
+static void detach_node(struct xmp_node *node)
+{
+    if (node->parent != NULL) {
+        struct xmp_node *parent = node->parent;
+        unhash_node(node);
+        node->parent = NULL;
+        unref_node(parent);
+    }
+}
+
+static void unref_node(struct xmp_node *node)
+{
+    if (--node->refctr || node == &xmp.root)
+        return;
+
+    if (node->fd != -1)
+        close_node_fd(node);
+    detach_node(node);
+    free(node->name);
+    free(node);
+}
+
+/* Find or create the node for a name and take a lookup reference */
+static struct xmp_node *find_node(struct xmp_node *parent, const char *name)
+{
+    struct xmp_node *node;
+
+    pthread_mutex_lock(&xmp.lock);
+    node = lookup_node(parent, name);
+    if (node == NULL) {
+        if (xmp.hash_use >= xmp.hash_size && hash_resize() == -1)
+            goto out;
+        node = (struct xmp_node *) calloc(1, sizeof(struct xmp_node));
+        if (node == NULL)
+            goto out;
+        node->name = strdup(name);
+        if (node->name == NULL) {
+            free(node);
+            node = NULL;
+            goto out;
+        }
+        node->fd = -1;
+        node->generation = ++xmp.generation;
+        node->parent = parent;
+        parent->refctr++;
+        hash_node(node);
+    }
+    if (!node->nlookup++)
+        node->refctr++;
+ out:
+    pthread_mutex_unlock(&xmp.lock);
+    return node;
+}
+
+static void forget_node(struct xmp_node *node, uint64_t nlookup)
+{
+    if (node == &xmp.root)
+        return;
+    if (nlookup > node->nlookup)
+        nlookup = node->nlookup;
+    node->nlookup -= nlookup;
+    if (nlookup && !node->nlookup)
+        unref_node(node);
+}
+
+/*
+ * Get a descriptor for a directory node, opening it relative to its
+ * parent if it's not cached.  Returns -errno on failure, otherwise
+ * the descriptor must be released with put_dirfd().
+ */
+static int get_dirfd(struct xmp_node *node)
+{
+    struct xmp_node *parent;
+    char name[NAME_MAX + 1];
+    int parentfd;
+    int fd;
+
+    pthread_mutex_lock(&xmp.lock);
+    if (node->fd != -1) {
+        node->fd_users++;
+        if (node != &xmp.root) {
+            lru_remove(node);
+            lru_add(node);
+        }
+        fd = node->fd;
+        pthread_mutex_unlock(&xmp.lock);
+        return fd;
+    }
+    parent = node->parent;
+    if (parent == NULL) {
+        pthread_mutex_unlock(&xmp.lock);
+        return -ESTALE;
+    }
+    strncpy(name, node->name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    /* Keep the node and its parent around while unlocked */
+    node->refctr++;
+    parent->refctr++;
+    pthread_mutex_unlock(&xmp.lock);
+
+    parentfd = get_dirfd(parent);
+    if (parentfd < 0)
+        fd = parentfd;
+    else {
+        fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+        if (fd == -1)
+            fd = -errno;
+    }
+
+    pthread_mutex_lock(&xmp.lock);
+    if (parentfd >= 0)
+        parent->fd_users--;
+    if (fd >= 0) {
+        if (node->fd == -1) {
+            node->fd = fd;
+            lru_add(node);
+            xmp.fd_count++;
+        } else {
+            /* Raced with another opener */
+            close(fd);
+            lru_remove(node);
+            lru_add(node);
+        }
+        fd = node->fd;
+        node->fd_users++;
+        trim_fds();
+    }
+    unref_node(parent);
+    unref_node(node);
+    pthread_mutex_unlock(&xmp.lock);
+    return fd;
+}
+
+static void put_dirfd(struct xmp_node *node)
+{
+    pthread_mutex_lock(&xmp.lock);
+    node->fd_users--;
+    if (!node->fd_users)
+        trim_fds();
+    pthread_mutex_unlock(&xmp.lock);
+}
+
+/* Where a node can be reached with the *at() functions */
+struct xmp_at {
+    struct xmp_node *dir;
+    int fd;
+    char name[NAME_MAX + 1];
+};
+
+static int get_at(struct xmp_node *node, struct xmp_at *at)
+{
+    struct xmp_node *dir;
+
+    pthread_mutex_lock(&xmp.lock);
+    if (node == &xmp.root) {
+        dir = node;
+        strcpy(at->name, ".");
+    } else {
+        dir = node->parent;
+        if (dir == NULL) {
+            pthread_mutex_unlock(&xmp.lock);
+            return -ESTALE;
+        }
+        strncpy(at->name, node->name, sizeof(at->name) - 1);
+        at->name[sizeof(at->name) - 1] = '\0';
+    }
+    dir->refctr++;
+    pthread_mutex_unlock(&xmp.lock);
+
+    at->dir = dir;
+    at->fd = get_dirfd(dir);
+    if (at->fd < 0) {
+        int err = at->fd;
+        pthread_mutex_lock(&xmp.lock);
+        unref_node(dir);
+        pthread_mutex_unlock(&xmp.lock);
+        return err;
+    }
+    return 0;
+}
+
+static void put_at(struct xmp_at *at)
+{
+    pthread_mutex_lock(&xmp.lock);
+    at->dir->fd_users--;
+    unref_node(at->dir);
+    trim_fds();
+    pthread_mutex_unlock(&xmp.lock);
+}
+
+static int do_lookup(fuse_ino_t parent, const char *name,
+                     struct fuse_entry_param *e)
+{
+    struct xmp_node *dir = get_node(parent);
+    struct xmp_node *node;
+    int dirfd;
+    int res;
+
+    memset(e, 0, sizeof(*e));
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0)
+        return dirfd;
+    res = fstatat(dirfd, name, &e->attr, AT_SYMLINK_NOFOLLOW);
+    put_dirfd(dir);
+    if (res == -1)
+        return -errno;
+
+    node = find_node(dir, name);
+    if (node == NULL)
+        return -ENOMEM;
+    e->ino = node_ino(node);
+    e->generation = node->generation;
+    e->attr_timeout = xmp.conf.timeout;
+    e->entry_timeout = xmp.conf.timeout;
+    return 0;
+}
+
+static void reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name,
+                        int res)
+{
+    struct fuse_entry_param e;
+
+    if (res == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    res = do_lookup(parent, name, &e);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void xmp_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    int res;
+
+    res = do_lookup(parent, name, &e);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_entry(req, &e);
+}
+
+static void xmp_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    pthread_mutex_lock(&xmp.lock);
+    forget_node(get_node(ino), nlookup);
+    pthread_mutex_unlock(&xmp.lock);
+    fuse_reply_none(req);
+}
+
+static void xmp_forget_multi(fuse_req_t req, size_t count,
+                             struct fuse_forget_data *forgets)
+{
+    size_t i;
+
+    pthread_mutex_lock(&xmp.lock);
+    for (i = 0; i < count; i++)
+        forget_node(get_node(forgets[i].ino), forgets[i].nlookup);
+    pthread_mutex_unlock(&xmp.lock);
+    fuse_reply_none(req);
+}
+
+static void xmp_getattr(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    struct xmp_at at;
+    struct stat stbuf;
+    int res;
+
+    (void) fi;
+
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = fstatat(at.fd, at.name, &stbuf, AT_SYMLINK_NOFOLLOW);
+    if (res == -1)
+        res = -errno;
+    put_at(&at);
+    if (res)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_attr(req, &stbuf, xmp.conf.timeout);
+}
+
+static void xmp_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                        int valid, struct fuse_file_info *fi)
+{
+    struct xmp_at at;
+    struct stat stbuf;
+    int res;
+
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    if (valid & FUSE_SET_ATTR_MODE) {
+        if (fi)
+            res = fchmod(fi->fh, attr->st_mode);
+        else
+            res = fchmodat(at.fd, at.name, attr->st_mode, 0);
+        if (res == -1)
+            goto out_errno;
+    }
+    if (valid & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID)) {
+        uid_t uid = (valid & FUSE_SET_ATTR_UID) ? attr->st_uid : (uid_t) -1;
+        gid_t gid = (valid & FUSE_SET_ATTR_GID) ? attr->st_gid : (gid_t) -1;
+
+        res = fchownat(at.fd, at.name, uid, gid, AT_SYMLINK_NOFOLLOW);
+        if (res == -1)
+            goto out_errno;
+    }
+    if (valid & FUSE_SET_ATTR_SIZE) {
+        if (fi)
+            res = ftruncate(fi->fh, attr->st_size);
+        else {
+            int fd = openat(at.fd, at.name, O_WRONLY | O_NOFOLLOW);
+            if (fd == -1)
+                goto out_errno;
+            res = ftruncate(fd, attr->st_size);
+            close(fd);
+        }
+        if (res == -1)
+            goto out_errno;
+    }
+    if (valid & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        struct timespec tv[2];
+
+        tv[0].tv_sec = attr->st_atime;
+        tv[0].tv_nsec = attr->st_atim.tv_nsec;
+        tv[1].tv_sec = attr->st_mtime;
+        tv[1].tv_nsec = attr->st_mtim.tv_nsec;
+        if (!(valid & FUSE_SET_ATTR_ATIME))
+            tv[0].tv_nsec = UTIME_OMIT;
+        if (!(valid & FUSE_SET_ATTR_MTIME))
+            tv[1].tv_nsec = UTIME_OMIT;
+        res = utimensat(at.fd, at.name, tv, AT_SYMLINK_NOFOLLOW);
+        if (res == -1)
+            goto out_errno;
+    }
+    res = fstatat(at.fd, at.name, &stbuf, AT_SYMLINK_NOFOLLOW);
+    if (res == -1)
+        goto out_errno;
+    put_at(&at);
+    fuse_reply_attr(req, &stbuf, xmp.conf.timeout);
+    return;
+
+ out_errno:
+    res = errno;
+    put_at(&at);
+    fuse_reply_err(req, res);
+}
+
+static void xmp_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[PATH_MAX + 1];
+    struct xmp_at at;
+    int res;
+
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = readlinkat(at.fd, at.name, buf, sizeof(buf) - 1);
+    if (res == -1)
+        res = -errno;
+    put_at(&at);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else {
+        buf[res] = '\0';
+        fuse_reply_readlink(req, buf);
+    }
+}
+
+static void xmp_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode, dev_t rdev)
+{
+    struct xmp_node *dir = get_node(parent);
+    int dirfd;
+    int res;
+
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0) {
+        fuse_reply_err(req, -dirfd);
+        return;
+    }
+    if (S_ISFIFO(mode))
+        res = mkfifoat(dirfd, name, mode);
+    else
+        res = mknodat(dirfd, name, mode, rdev);
+    put_dirfd(dir);
+    reply_entry(req, parent, name, res);
+}
+
+static void xmp_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      mode_t mode)
+{
+    struct xmp_node *dir = get_node(parent);
+    int dirfd;
+    int res;
+
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0) {
+        fuse_reply_err(req, -dirfd);
+        return;
+    }
+    res = mkdirat(dirfd, name, mode);
+    put_dirfd(dir);
+    reply_entry(req, parent, name, res);
+}
+
+static void xmp_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                        const char *name)
+{
+    struct xmp_node *dir = get_node(parent);
+    int dirfd;
+    int res;
+
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0) {
+        fuse_reply_err(req, -dirfd);
+        return;
+    }
+    res = symlinkat(link, dirfd, name);
+    put_dirfd(dir);
+    reply_entry(req, parent, name, res);
+}
+
+static void do_remove(fuse_req_t req, fuse_ino_t parent, const char *name,
+                      int flags)
+{
+    struct xmp_node *dir = get_node(parent);
+    int dirfd;
+    int res;
+
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0) {
+        fuse_reply_err(req, -dirfd);
+        return;
+    }
+    res = unlinkat(dirfd, name, flags);
+    if (res == -1)
+        res = errno;
+    else {
+        struct xmp_node *node;
+
+        pthread_mutex_lock(&xmp.lock);
+        node = lookup_node(dir, name);
+        if (node != NULL)
+            detach_node(node);
+        pthread_mutex_unlock(&xmp.lock);
+    }
+    put_dirfd(dir);
+    fuse_reply_err(req, res);
+}
+
+static void xmp_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    do_remove(req, parent, name, 0);
+}
+
+static void xmp_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    do_remove(req, parent, name, AT_REMOVEDIR);
+}
+
+static void xmp_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname)
+{
+    struct xmp_node *dir = get_node(parent);
+    struct xmp_node *newdir = get_node(newparent);
+    int dirfd;
+    int newdirfd;
+    int res;
+
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0) {
+        fuse_reply_err(req, -dirfd);
+        return;
+    }
+    newdirfd = get_dirfd(newdir);
+    if (newdirfd < 0) {
+        put_dirfd(dir);
+        fuse_reply_err(req, -newdirfd);
+        return;
+    }
+    res = renameat(dirfd, name, newdirfd, newname);
+    if (res == -1)
+        res = errno;
+    else {
+        struct xmp_node *node;
+        struct xmp_node *target;
+        char *newstr = strdup(newname);
+
+        pthread_mutex_lock(&xmp.lock);
+        target = lookup_node(newdir, newname);
+        node = lookup_node(dir, name);
+        if (target != NULL && target != node)
+            detach_node(target);
+        if (node != NULL) {
+            if (newstr != NULL) {
+                /* Keep the cached descriptor, it follows the rename */
+                unhash_node(node);
+                free(node->name);
+                node->name = newstr;
+                newstr = NULL;
+                newdir->refctr++;
+                node->parent = newdir;
+                hash_node(node);
+                unref_node(dir);
+            } else
+                detach_node(node);
+        }
+        pthread_mutex_unlock(&xmp.lock);
+        free(newstr);
+    }
+    put_dirfd(newdir);
+    put_dirfd(dir);
+    fuse_reply_err(req, res);
+}
+
+static void xmp_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                     const char *newname)
+{
+    struct xmp_node *newdir = get_node(newparent);
+    struct xmp_at at;
+    int newdirfd;
+    int res;
+
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    newdirfd = get_dirfd(newdir);
+    if (newdirfd < 0) {
+        put_at(&at);
+        fuse_reply_err(req, -newdirfd);
+        return;
+    }
+    res = linkat(at.fd, at.name, newdirfd, newname, 0);
+    put_dirfd(newdir);
+    put_at(&at);
+    reply_entry(req, newparent, newname, res);
+}
+
+static void xmp_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    struct xmp_at at;
+    int res;
+
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    res = faccessat(at.fd, at.name, mask, 0);
+    if (res == -1)
+        res = errno;
+    put_at(&at);
+    fuse_reply_err(req, res);
+}
+
+static void xmp_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       mode_t mode, struct fuse_file_info *fi)
+{
+    struct xmp_node *dir = get_node(parent);
+    struct fuse_entry_param e;
+    int dirfd;
+    int fd;
+    int res;
+
+    dirfd = get_dirfd(dir);
+    if (dirfd < 0) {
+        fuse_reply_err(req, -dirfd);
+        return;
+    }
+    fd = openat(dirfd, name, (fi->flags | O_CREAT) & ~O_NOFOLLOW, mode);
+    put_dirfd(dir);
+    if (fd == -1) {
+        fuse_reply_err(req, errno);
+        return;
+    }
+    res = do_lookup(parent, name, &e);
+    if (res) {
+        close(fd);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fi->fh = fd;
+    if (fuse_reply_create(req, &e, fi) == -ENOENT)
+        close(fd);
+}
+
+static void xmp_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct xmp_at at;
+    int fd;
+    int res;
+
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        fuse_reply_err(req, -res);
+        return;
+    }
+    fd = openat(at.fd, at.name, fi->flags & ~(O_CREAT | O_NOFOLLOW));
+    res = errno;
+    put_at(&at);
+    if (fd == -1) {
+        fuse_reply_err(req, res);
+        return;
+    }
+    fi->fh = fd;
+    if (fuse_reply_open(req, fi) == -ENOENT)
+        close(fd);
+}
+
+static void xmp_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                     struct fuse_file_info *fi)
+{
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+
+    (void) ino;
+
+    /* Let the library splice from the file if it can */
+    buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf.buf[0].fd = fi->fh;
+    buf.buf[0].pos = off;
+    fuse_reply_data(req, &buf, 0);
+}
+
+static void xmp_write_buf(fuse_req_t req, fuse_ino_t ino,
+                          struct fuse_bufvec *in_buf, off_t off,
+                          struct fuse_file_info *fi)
+{
+    struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+    ssize_t res;
+
+    (void) ino;
+
+    out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    out_buf.buf[0].fd = fi->fh;
+    out_buf.buf[0].pos = off;
+    res = fuse_buf_copy(&out_buf, in_buf, 0);
+    if (res < 0)
+        fuse_reply_err(req, -res);
+    else
+        fuse_reply_write(req, res);
+}
+
+static void xmp_flush(fuse_req_t req, fuse_ino_t ino,
+                      struct fuse_file_info *fi)
+{
+    int res;
+
+    (void) ino;
+    /* See the comment in fusexmp_fh.c */
+    res = close(dup(fi->fh));
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void xmp_release(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    (void) ino;
+    close(fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void xmp_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                      struct fuse_file_info *fi)
+{
+    int res;
+
+    (void) ino;
+#ifndef HAVE_FDATASYNC
+    (void) datasync;
+#else
+    if (datasync)
+        res = fdatasync(fi->fh);
+    else
+#endif
+        res = fsync(fi->fh);
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static struct xmp_dirp *get_dirp(struct fuse_file_info *fi)
+{
+    return (struct xmp_dirp *) (uintptr_t) fi->fh;
+}
+
+static void xmp_opendir(fuse_req_t req, fuse_ino_t ino,
+                        struct fuse_file_info *fi)
+{
+    struct xmp_dirp *d;
+    struct xmp_at at;
+    int fd;
+    int res;
+
+    d = (struct xmp_dirp *) calloc(1, sizeof(struct xmp_dirp));
+    if (d == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    res = get_at(get_node(ino), &at);
+    if (res) {
+        free(d);
+        fuse_reply_err(req, -res);
+        return;
+    }
+    /* A stream of its own, the cached descriptor is shared */
+    fd = openat(at.fd, at.name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    res = errno;
+    put_at(&at);
+    if (fd == -1 || (d->dp = fdopendir(fd)) == NULL) {
+        if (fd != -1) {
+            res = errno;
+            close(fd);
+        }
+        free(d);
+        fuse_reply_err(req, res);
+        return;
+    }
+    fi->fh = (uintptr_t) d;
+    if (fuse_reply_open(req, fi) == -ENOENT) {
+        closedir(d->dp);
+        free(d);
+    }
+}
+
+static void xmp_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                        off_t off, struct fuse_file_info *fi)
+{
+    struct xmp_dirp *d = get_dirp(fi);
+    char *buf;
+    size_t len = 0;
+
+    (void) ino;
+
+    buf = (char *) malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    if (off != d->offset) {
+        seekdir(d->dp, off);
+        d->entry = NULL;
+        d->offset = off;
+    }
+    while (1) {
+        struct stat st;
+        size_t entlen;
+
+        if (d->entry == NULL) {
+            d->entry = readdir(d->dp);
+            if (d->entry == NULL)
+                break;
+        }
+        memset(&st, 0, sizeof(st));
+        st.st_ino = d->entry->d_ino;
+        st.st_mode = d->entry->d_type << 12;
+        entlen = fuse_add_direntry(req, buf + len, size - len,
+                                   d->entry->d_name, &st,
+                                   telldir(d->dp));
+        if (entlen > size - len)
+            break;
+        len += entlen;
+        d->offset = telldir(d->dp);
+        d->entry = NULL;
+    }
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+static void xmp_releasedir(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi)
+{
+    struct xmp_dirp *d = get_dirp(fi);
+
+    (void) ino;
+    closedir(d->dp);
+    free(d);
+    fuse_reply_err(req, 0);
+}
+
+static void xmp_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
+                         struct fuse_file_info *fi)
+{
+    struct xmp_dirp *d = get_dirp(fi);
+    int res;
+
+    (void) ino;
+    (void) datasync;
+    res = fsync(dirfd(d->dp));
+    fuse_reply_err(req, res == -1 ? errno : 0);
+}
+
+static void xmp_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs stbuf;
+    int res;
+
+    (void) ino;
+    res = fstatvfs(xmp.root.fd, &stbuf);
+    if (res == -1)
+        fuse_reply_err(req, errno);
+    else
+        fuse_reply_statfs(req, &stbuf);
+}
+
+static struct fuse_lowlevel_ops xmp_oper = {
+    .lookup		= xmp_lookup,
+    .forget		= xmp_forget,
+    .forget_multi	= xmp_forget_multi,
+    .getattr		= xmp_getattr,
+    .setattr		= xmp_setattr,
+    .readlink		= xmp_readlink,
+    .mknod		= xmp_mknod,
+    .mkdir		= xmp_mkdir,
+    .symlink		= xmp_symlink,
+    .unlink		= xmp_unlink,
+    .rmdir		= xmp_rmdir,
+    .rename		= xmp_rename,
+    .link		= xmp_link,
+    .access		= xmp_access,
+    .create		= xmp_create,
+    .open		= xmp_open,
+    .read		= xmp_read,
+    .write_buf		= xmp_write_buf,
+    .flush		= xmp_flush,
+    .release		= xmp_release,
+    .fsync		= xmp_fsync,
+    .opendir		= xmp_opendir,
+    .readdir		= xmp_readdir,
+    .releasedir		= xmp_releasedir,
+    .fsyncdir		= xmp_fsyncdir,
+    .statfs		= xmp_statfs,
+};
+
+#define XMP_OPT(t, p) { t, offsetof(struct xmp_conf, p), 0 }
+
+static const struct fuse_opt xmp_opts[] = {
+    XMP_OPT("fd_cache=%u",	fd_cache),
+    XMP_OPT("timeout=%lf",	timeout),
+    FUSE_OPT_END
+};
+
+static int xmp_init_root(void)
+{
+    pthread_mutex_init(&xmp.lock, NULL);
+    xmp.lru.lru_next = xmp.lru.lru_prev = &xmp.lru;
+    xmp.root.refctr = 1;
+    xmp.root.nlookup = 1;
+    xmp.root.fd = open("/", O_RDONLY | O_DIRECTORY);
+    if (xmp.root.fd == -1) {
+        perror("fusexmp_ll: failed to open root");
+        return -1;
+    }
+    if (hash_resize() == -1) {
+        fprintf(stderr, "fusexmp_ll: memory allocation failed\n");
+        close(xmp.root.fd);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int err = -1;
+
+    xmp.conf.fd_cache = 256;
+    xmp.conf.timeout = 1.0;
+    if (fuse_opt_parse(&args, &xmp.conf, xmp_opts, NULL) == -1 ||
+        xmp_init_root() == -1)
+        return 1;
+
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded,
+                           &foreground) != -1 &&
+        (ch = fuse_mount(mountpoint, &args)) != NULL) {
+        struct fuse_session *se;
+
+        se = fuse_lowlevel_new(&args, &xmp_oper, sizeof(xmp_oper), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1 &&
+                fuse_daemonize(foreground) != -1) {
+                fuse_session_add_chan(se, ch);
+                if (multithreaded)
+                    err = fuse_session_loop_mt(se);
+                else
+                    err = fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+        free(mountpoint);
+    }
+    fuse_opt_free_args(&args);
+
+    return err ? 1 : 0;
+}
@@ -43,6 +43,9 @@ struct fuse;
 /** Structure containing a raw command */
 struct fuse_cmd;
 
+/** Handle of an asynchronous operation, see fuse_async_done() */
+struct fuse_async;
+
 /** Function to add an entry in a readdir() operation
  *
  * @param buf the buffer passed to the readdir() operation
@@ -260,10 +263,12 @@ struct fuse_operations {
      * The filesystem may choose between two modes of operation:
      *
      * 1) The readdir implementation ignores the offset parameter, and
-     * passes zero to the filler function's offset.  The filler
-     * function will not return '1' (unless an error happens), so the
-     * whole directory is read in a single readdir operation.  This
-     * works just like the old getdir() method.
+     * passes zero to the filler function's offset.  The whole
+     * directory is listed in each readdir operation, but the filler
+     * function returns '1' once the library has buffered enough
+     * entries (or an error happens), after which the rest need not
+     * be listed.  The library calls readdir again, and skips the
+     * entries already returned, when it needs the following ones.
      *
      * 2) The readdir implementation keeps track of the offsets of the
      * directory entries.  It uses the offset parameter and always
@@ -419,6 +424,47 @@ struct fuse_operations {
      * Introduced in version 2.6
      */
     int (*bmap) (const char *, size_t blocksize, uint64_t *idx);
+
+    /**
+     * Read data from an open file asynchronously
+     *
+     * Same as read, except that the operation needn't be finished
+     * when the method returns.  Instead it is completed by calling
+     * fuse_async_done() with the 'async' handle, from any thread.
+     * 'path', 'buf' and 'fi' remain valid until then.
+     *
+     * Return zero if the operation was started, or -errno if it
+     * failed right away, in which case fuse_async_done() must not be
+     * called.
+     *
+     * If both read and read_async are defined, read_async is used.
+     *
+     * Introduced in version 2.8
+     */
+    int (*read_async) (const char *, char *, size_t, off_t,
+                       struct fuse_file_info *, struct fuse_async *async);
+
+    /**
+     * Write data to an open file asynchronously
+     *
+     * See read_async.  Unlike 'path' and 'fi', the data in 'buf' is
+     * only valid until the method returns, so it must be copied if
+     * the write is not submitted by then.
+     *
+     * Introduced in version 2.8
+     */
+    int (*write_async) (const char *, const char *, size_t, off_t,
+                        struct fuse_file_info *, struct fuse_async *async);
+
+    /**
+     * Synchronize file contents asynchronously
+     *
+     * See read_async.
+     *
+     * Introduced in version 2.8
+     */
+    int (*fsync_async) (const char *, int, struct fuse_file_info *,
+                        struct fuse_async *async);
 };
 
 /** Extra context that may be needed by some filesystems
@@ -546,6 +592,28 @@ int fuse_loop_mt(struct fuse *f);
  */
 struct fuse_context *fuse_get_context(void);
 
+/**
+ * Complete an asynchronous operation
+ *
+ * Sends the reply for an operation started by one of the *_async
+ * methods.  The result is what the synchronous variant of the method
+ * would have returned: the number of bytes transferred for read and
+ * write, zero for fsync, or -errno on error.
+ *
+ * May be called from any thread, exactly once for each operation, and
+ * 'async' must not be used afterwards.  It briefly takes internal
+ * locks of the library, which are never held while calling the
+ * filesystem, so it may be called with the filesystem's own locks
+ * held, but not from a signal handler.  Since no thread is tied up
+ * while an operation is in flight, a filesystem using these methods
+ * can keep many requests outstanding with the single threaded
+ * fuse_loop().
+ *
+ * @param async the handle passed to the method
+ * @param res the result of the operation
+ */
+void fuse_async_done(struct fuse_async *async, int res);
+
 /**
  * Check if a request has already been interrupted
  *
@@ -555,9 +623,16 @@ struct fuse_context *fuse_get_context(void);
 int fuse_interrupted(void);
 
 /**
- * Obsolete, doesn't do anything
+ * Invalidate the library side cache of a path
+ *
+ * Drops the cached attributes of the path and of its parent, and the
+ * record of the path not existing.  This only has an effect if the
+ * 'attr_cache' or 'negative_cache' options are enabled, and should be
+ * called by filesystems that get changed other than through FUSE.
  *
- * @return -EINVAL
+ * @param f the FUSE handle, e.g. fuse_get_context()->fuse
+ * @param path the path, or NULL to invalidate everything
+ * @return 0 on success, -ENOMEM on failure
  */
 int fuse_invalidate(struct fuse *f, const char *path);
 
@@ -107,10 +107,25 @@ struct fuse_conn_info {
      */
     unsigned max_readahead;
 
+    /**
+     * Is READDIRPLUS supported (read-write)
+     */
+    unsigned readdirplus;
+
+    /**
+     * Is the writeback cache enabled (read-write)
+     *
+     * Writes are collected in the kernel page cache and sent later,
+     * possibly merged, with the handle of any file open for writing.
+     * The kernel's idea of the file size takes precedence over the
+     * size returned by getattr while this is set.
+     */
+    unsigned writeback_cache;
+
     /**
      * For future use.
      */
-    unsigned reserved[27];
+    unsigned reserved[25];
 };
 
 struct fuse_session;
@@ -100,6 +100,15 @@ struct fuse_ctx {
     pid_t pid;
 };
 
+/** One element of the batch passed to the forget_multi method */
+struct fuse_forget_data {
+    /** Inode number */
+    fuse_ino_t ino;
+
+    /** The number of lookups to forget */
+    uint64_t nlookup;
+};
+
 /* 'to_set' flags in setattr */
 #define FUSE_SET_ATTR_MODE	(1 << 0)
 #define FUSE_SET_ATTR_UID	(1 << 1)
@@ -108,6 +117,172 @@ struct fuse_ctx {
 #define FUSE_SET_ATTR_ATIME	(1 << 4)
 #define FUSE_SET_ATTR_MTIME	(1 << 5)
 
+/* ----------------------------------------------------------- *
+ * Data buffers                                                *
+ * ----------------------------------------------------------- */
+
+/**
+ * Buffer flags
+ */
+enum fuse_buf_flags {
+    /**
+     * Buffer contains a file descriptor
+     *
+     * If this flag is set, the .fd field is valid, otherwise the
+     * .mem field is valid.
+     */
+    FUSE_BUF_IS_FD = (1 << 1),
+
+    /**
+     * Seek on the file descriptor
+     *
+     * If this flag is set then the .pos field is valid and is
+     * used to seek to the given offset before performing
+     * operation on file descriptor.
+     */
+    FUSE_BUF_FD_SEEK = (1 << 2),
+
+    /**
+     * Retry operation on file descriptor
+     *
+     * If this flag is set then retry operation on file descriptor
+     * until .size bytes have been copied or an error or EOF is
+     * detected.
+     */
+    FUSE_BUF_FD_RETRY = (1 << 3),
+};
+
+/**
+ * Buffer copy flags
+ */
+enum fuse_buf_copy_flags {
+    /**
+     * Don't use splice(2)
+     *
+     * Always fall back to using read and write instead of
+     * splice(2) to copy data from one file descriptor to another.
+     */
+    FUSE_BUF_NO_SPLICE = (1 << 1),
+
+    /**
+     * Try to move data with splice.
+     *
+     * If splice is used, try to move pages from the source to the
+     * destination instead of copying.  See documentation of
+     * SPLICE_F_MOVE in splice(2) man page.
+     */
+    FUSE_BUF_SPLICE_MOVE = (1 << 2),
+};
+
+/**
+ * Single data buffer
+ *
+ * Generic data buffer for I/O, extended attributes, etc...  Data may
+ * be supplied as a memory pointer or as a file descriptor
+ */
+struct fuse_buf {
+    /**
+     * Size of data in bytes
+     */
+    size_t size;
+
+    /**
+     * Buffer flags
+     */
+    enum fuse_buf_flags flags;
+
+    /**
+     * Memory pointer
+     *
+     * Used unless FUSE_BUF_IS_FD flag is set.
+     */
+    void *mem;
+
+    /**
+     * File descriptor
+     *
+     * Used if FUSE_BUF_IS_FD flag is set.
+     */
+    int fd;
+
+    /**
+     * File position
+     *
+     * Used if FUSE_BUF_FD_SEEK flag is set.
+     */
+    off_t pos;
+};
+
+/**
+ * Data buffer vector
+ *
+ * An array of data buffers, each containing a memory pointer or a
+ * file descriptor.
+ *
+ * Allocate dynamically to add more than one buffer.
+ */
+struct fuse_bufvec {
+    /**
+     * Number of buffers in the array
+     */
+    size_t count;
+
+    /**
+     * Index of current buffer within the array
+     */
+    size_t idx;
+
+    /**
+     * Current offset within the current buffer
+     */
+    size_t off;
+
+    /**
+     * Array of buffers
+     */
+    struct fuse_buf buf[1];
+};
+
+/* Initialize bufvec with a single buffer of given size */
+#define FUSE_BUFVEC_INIT(size__) 				\
+    ((struct fuse_bufvec) {					\
+        /* .count= */ 1,					\
+        /* .idx =  */ 0,					\
+        /* .off =  */ 0,					\
+        /* .buf =  */ { /* [0] = */ {				\
+            /* .size =  */ (size__),				\
+            /* .flags = */ (enum fuse_buf_flags) 0,		\
+            /* .mem =   */ NULL,				\
+            /* .fd =    */ -1,					\
+            /* .pos =   */ 0,					\
+        } }							\
+    } )
+
+/**
+ * Get total size of data in a fuse buffer vector
+ *
+ * @param bufv buffer vector
+ * @return size of data
+ */
+size_t fuse_buf_size(const struct fuse_bufvec *bufv);
+
+/**
+ * Copy data from one buffer vector to another
+ *
+ * Memory to memory copies use memcpy(), copies involving a file
+ * descriptor use read(2)/write(2), and descriptor to descriptor
+ * copies use splice(2) where possible, unless FUSE_BUF_NO_SPLICE is
+ * given.  The copy stops at the end of either vector, or on a short
+ * read from a file descriptor (EOF).
+ *
+ * @param dst destination buffer vector
+ * @param src source buffer vector
+ * @param flags flags controlling the copy
+ * @return actual number of bytes copied or -errno on error
+ */
+ssize_t fuse_buf_copy(struct fuse_bufvec *dst, struct fuse_bufvec *src,
+                      enum fuse_buf_copy_flags flags);
+
 /* ----------------------------------------------------------- *
  * Request methods and replies                                 *
  * ----------------------------------------------------------- */
@@ -790,6 +965,91 @@ struct fuse_lowlevel_ops {
      */
     void (*bmap) (fuse_req_t req, fuse_ino_t ino, size_t blocksize,
                   uint64_t idx);
+
+    /**
+     * Write data made available in a buffer
+     *
+     * This is a more generic version of the ->write() method.  If
+     * this method is implemented, then ->write() will not be called.
+     *
+     * With the 'splice_read' option the data of large writes is
+     * handed over as a pipe file descriptor instead of being copied
+     * into memory first.  Use fuse_buf_copy() to move it to its
+     * destination, ideally a file descriptor, so the data never
+     * passes through userspace.
+     *
+     * The buffer is only valid until the method returns, so the data
+     * has to be consumed (or copied) before returning, even if the
+     * reply is sent later.
+     *
+     * Introduced in version 2.8
+     *
+     * Valid replies:
+     *   fuse_reply_write
+     *   fuse_reply_err
+     *
+     * @param req request handle
+     * @param ino the inode number
+     * @param bufv buffer containing the data
+     * @param off offset to write to
+     * @param fi file information
+     */
+    void (*write_buf) (fuse_req_t req, fuse_ino_t ino,
+                       struct fuse_bufvec *bufv, off_t off,
+                       struct fuse_file_info *fi);
+
+    /**
+     * Read directory with attributes
+     *
+     * Send a buffer filled using fuse_add_direntry_plus(), with size
+     * not exceeding the requested size.  Send an empty buffer on end
+     * of stream.
+     *
+     * Every entry with a non-zero ino counts as a lookup, just as if
+     * it was returned by the lookup method.  The kernel sends a
+     * forget for each of these eventually.  "." and ".." should be
+     * added with a zero ino.
+     *
+     * This is only used if the kernel supports it, both sides speak
+     * protocol 7.21 or later, and fuse_conn_info.readdirplus is left
+     * set by the init method.
+     *
+     * fi->fh will contain the value set by the opendir method, or
+     * will be undefined if the opendir method didn't set any value.
+     *
+     * Introduced in version 2.8
+     *
+     * Valid replies:
+     *   fuse_reply_buf
+     *   fuse_reply_err
+     *
+     * @param req request handle
+     * @param ino the inode number
+     * @param size maximum number of bytes to send
+     * @param off offset to continue reading the directory stream
+     * @param fi file information
+     */
+    void (*readdirplus) (fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t off, struct fuse_file_info *fi);
+
+    /**
+     * Forget about multiple inodes
+     *
+     * Same as the forget method, but for a batch of inodes sent in
+     * a single message.  If this isn't implemented, the forget
+     * method is called for each element of the batch.
+     *
+     * Introduced in version 2.8
+     *
+     * Valid replies:
+     *   fuse_reply_none
+     *
+     * @param req request handle
+     * @param count the number of elements in the forgets array
+     * @param forgets the inodes and lookup counts to forget
+     */
+    void (*forget_multi) (fuse_req_t req, size_t count,
+                          struct fuse_forget_data *forgets);
 };
 
 /**
@@ -811,7 +1071,7 @@ int fuse_reply_err(fuse_req_t req, int err);
  * Don't send reply
  *
  * Possible requests:
- *   forget
+ *   forget, forget_multi
  *
  * @param req request handle
  */
@@ -925,6 +1185,25 @@ int fuse_reply_buf(fuse_req_t req, const char *buf, size_t size);
  */
 int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count);
 
+/**
+ * Reply with data copied/moved from buffer(s)
+ *
+ * With the 'splice_write' option, data given as file descriptors is
+ * spliced directly into the fuse device without passing through
+ * userspace.  Otherwise, or if splicing isn't possible, the data is
+ * copied into a temporary buffer and sent with writev().
+ *
+ * Possible requests:
+ *   read, readdir, getxattr, listxattr
+ *
+ * @param req request handle
+ * @param bufv buffer vector
+ * @param flags flags controlling the copy
+ * @return zero for success, -errno for failure to send reply
+ */
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
+                    enum fuse_buf_copy_flags flags);
+
 /**
  * Reply with filesystem statistics
  *
@@ -1005,6 +1284,25 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
                          const char *name, const struct stat *stbuf,
                          off_t off);
 
+/**
+ * Add a directory entry with attributes to the buffer
+ *
+ * Same as fuse_add_direntry(), except that the whole lookup result is
+ * sent along with the entry, for the readdirplus method.  The inode
+ * number of the entry is taken from e->attr.st_ino.
+ *
+ * @param req request handle
+ * @param buf the point where the new entry will be added to the buffer
+ * @param bufsize remaining size of the buffer
+ * @param name the name of the entry
+ * @param e the entry parameters, as for fuse_reply_entry()
+ * @param off the offset of the next entry
+ * @return the space needed for the entry
+ */
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e, off_t off);
+
 /* ----------------------------------------------------------- *
  * Utility functions                                           *
  * ----------------------------------------------------------- */
@@ -1078,6 +1376,98 @@ struct fuse_session *fuse_lowlevel_new(struct fuse_args *args,
                                        const struct fuse_lowlevel_ops *op,
                                        size_t op_size, void *userdata);
 
+/* ----------------------------------------------------------- *
+ * Request statistics                                          *
+ * ----------------------------------------------------------- */
+
+/** Number of buckets in the latency histogram of fuse_opstats */
+#define FUSE_OPSTATS_BUCKETS 24
+
+/**
+ * Statistics of the requests with one opcode
+ *
+ * These are only collected if the session was created with the
+ * "stats" option.  Latency is measured from the request being handed
+ * to the library until the reply is sent.
+ */
+struct fuse_opstats {
+    /** Name of the opcode, NULL if the opcode is not known */
+    const char *name;
+
+    /** Number of requests received */
+    uint64_t count;
+
+    /** Number of requests completed */
+    uint64_t completed;
+
+    /** Number of requests replied to with an error */
+    uint64_t errors;
+
+    /** Sum of the latencies of completed requests in nanoseconds */
+    uint64_t total_ns;
+
+    /** Largest latency in nanoseconds */
+    uint64_t max_ns;
+
+    /**
+     * Latency histogram.  hist[0] counts latencies below 1us,
+     * hist[i] those between 2^(i-1) and 2^i us, and the last bucket
+     * all the longer ones.
+     */
+    uint64_t hist[FUSE_OPSTATS_BUCKETS];
+};
+
+/**
+ * Get the statistics of one opcode
+ *
+ * The statistics of all threads are summed up.  Opcodes are those of
+ * the kernel interface, all of them can be iterated by starting from
+ * zero until this function fails.
+ *
+ * @param se the session created by fuse_lowlevel_new()
+ * @param opcode the opcode
+ * @param stats the statistics are stored here
+ * @return 0 on success, -1 if statistics are disabled or the opcode
+ *         is out of range
+ */
+int fuse_lowlevel_get_stats(struct fuse_session *se, unsigned opcode,
+                            struct fuse_opstats *stats);
+
+/**
+ * Print the statistics of all opcodes which have been used to stderr
+ *
+ * This is also done on receiving the signal given with the
+ * "stats_signal=N" option.
+ *
+ * @param se the session created by fuse_lowlevel_new()
+ */
+void fuse_lowlevel_dump_stats(struct fuse_session *se);
+
+/* ----------------------------------------------------------- *
+ * Request tracing                                             *
+ * ----------------------------------------------------------- */
+
+/**
+ * Write the recorded trace to a file
+ *
+ * The trace is only recorded if the session was created with the
+ * "trace" option.  Each thread keeps its last "trace_size=N" events,
+ * which are written in the Chrome trace event format and can be loaded
+ * into chrome://tracing or Perfetto.  Every request is shown as a span
+ * from its arrival to the reply, with the time spent reading from the
+ * device, dispatching, in the filesystem and waiting for locks on the
+ * thread that processed it.
+ *
+ * This is also done on receiving the signal given with the
+ * "trace_signal=N" option.
+ *
+ * @param se the session created by fuse_lowlevel_new()
+ * @param path the file to write, NULL for the one given with
+ *             "trace_file=FILE", or fuse-trace.PID.json
+ * @return 0 on success, -1 if tracing is disabled or on failure
+ */
+int fuse_lowlevel_dump_trace(struct fuse_session *se, const char *path);
+
 /* ----------------------------------------------------------- *
  * Session interface                                           *
  * ----------------------------------------------------------- */
@@ -1135,10 +1525,11 @@ struct fuse_session *fuse_session_new(struct fuse_session_ops *op, void *data);
 /**
  * Assign a channel to a session
  *
- * Note: currently only a single channel may be assigned.  This may
- * change in the future
+ * More than one channel may be assigned, for example a cloned device
+ * file per worker thread.  The channel the filesystem was mounted
+ * with must be assigned first.
  *
- * If a session is destroyed, the assigned channel is also destroyed
+ * If a session is destroyed, the assigned channels are also destroyed
  *
  * @param se the session
  * @param ch the channel
@@ -1179,6 +1570,34 @@ struct fuse_chan *fuse_session_next_chan(struct fuse_session *se,
 void fuse_session_process(struct fuse_session *se, const char *buf, size_t len,
                           struct fuse_chan *ch);
 
+/**
+ * Receive a raw request into a buffer
+ *
+ * On entry buf->mem must point to a buffer of buf->size bytes.  For a
+ * low level session with the 'splice_read' option, the request may
+ * instead be left in a pipe, in which case FUSE_BUF_IS_FD is set in
+ * buf->flags.  Such a buffer must be passed to
+ * fuse_session_process_buf() in the same thread, before receiving
+ * the next request.
+ *
+ * @param se the session
+ * @param buf the buffer to store the request in
+ * @param chp pointer to the channel, updated to the receiving channel
+ * @return the actual size of the raw request, or -errno on error
+ */
+int fuse_session_receive_buf(struct fuse_session *se, struct fuse_buf *buf,
+                             struct fuse_chan **chp);
+
+/**
+ * Process a raw request supplied in a buffer
+ *
+ * @param se the session
+ * @param buf buffer returned by fuse_session_receive_buf()
+ * @param ch channel on which the request was received
+ */
+void fuse_session_process_buf(struct fuse_session *se,
+                              const struct fuse_buf *buf, struct fuse_chan *ch);
+
 /**
  * Destroy a session
  *
@@ -1224,6 +1643,134 @@ int fuse_session_loop(struct fuse_session *se);
  */
 int fuse_session_loop_mt(struct fuse_session *se);
 
+/* ----------------------------------------------------------- *
+ * Event loop                                                  *
+ * ----------------------------------------------------------- */
+
+/**
+ * Single threaded event loop
+ *
+ * Polls the channels of a session together with file descriptors and
+ * timers supplied by the filesystem, and runs their callbacks in the
+ * same thread as the request handlers.  A handler may start an
+ * operation (e.g. send a request to a server), return without
+ * replying, and reply from the callback of the operation's file
+ * descriptor or timer.  The request arguments are only valid until
+ * the handler returns, so anything needed later must be copied.
+ *
+ * Only available on Linux.
+ */
+struct fuse_evloop;
+
+/**
+ * Callback of a file descriptor
+ *
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param revents the events that occurred (POLLIN, POLLOUT, POLLERR, POLLHUP)
+ * @param data user data passed to fuse_evloop_add_fd()
+ */
+typedef void (*fuse_evloop_fd_func_t)(struct fuse_evloop *loop, int fd,
+                                      int revents, void *data);
+
+/**
+ * Callback of a timer
+ *
+ * @param loop the event loop
+ * @param data user data passed to fuse_evloop_add_timer()
+ */
+typedef void (*fuse_evloop_timer_func_t)(struct fuse_evloop *loop,
+                                         void *data);
+
+/**
+ * Create an event loop for a session
+ *
+ * The channels of the session having a file descriptor are switched
+ * to non-blocking mode until the loop is destroyed.
+ *
+ * @param se the session
+ * @return the event loop, or NULL on failure
+ */
+struct fuse_evloop *fuse_evloop_new(struct fuse_session *se);
+
+/**
+ * Destroy an event loop
+ *
+ * Pending timers are deleted without being called.  Must be called
+ * before the session is destroyed.
+ *
+ * @param loop the event loop
+ */
+void fuse_evloop_destroy(struct fuse_evloop *loop);
+
+/**
+ * Run the event loop until the session is exited
+ *
+ * @param loop the event loop
+ * @return 0 on success, -1 on error
+ */
+int fuse_evloop_run(struct fuse_evloop *loop);
+
+/**
+ * Watch a file descriptor
+ *
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param events the events to wait for (POLLIN, POLLOUT)
+ * @param func the callback
+ * @param data user data passed to the callback
+ * @return zero on success, -errno on failure
+ */
+int fuse_evloop_add_fd(struct fuse_evloop *loop, int fd, int events,
+                       fuse_evloop_fd_func_t func, void *data);
+
+/**
+ * Change the events a file descriptor is watched for
+ *
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @param events the events to wait for (POLLIN, POLLOUT)
+ * @return zero on success, -errno on failure
+ */
+int fuse_evloop_mod_fd(struct fuse_evloop *loop, int fd, int events);
+
+/**
+ * Stop watching a file descriptor
+ *
+ * This must be called before the file descriptor is closed.  It is
+ * safe to call from any callback of the loop.
+ *
+ * @param loop the event loop
+ * @param fd the file descriptor
+ * @return zero on success, -errno on failure
+ */
+int fuse_evloop_del_fd(struct fuse_evloop *loop, int fd);
+
+/**
+ * Add a timer
+ *
+ * The timer fires once, after which it is deleted.
+ *
+ * @param loop the event loop
+ * @param timeout seconds until the timer fires
+ * @param func the callback
+ * @param data user data passed to the callback
+ * @return the timer, or NULL on failure
+ */
+struct fuse_evloop_timer *fuse_evloop_add_timer(struct fuse_evloop *loop,
+                                                double timeout,
+                                                fuse_evloop_timer_func_t func,
+                                                void *data);
+
+/**
+ * Delete a timer that has not fired yet
+ *
+ * @param loop the event loop
+ * @param timer the timer returned by fuse_evloop_add_timer()
+ */
+void fuse_evloop_del_timer(struct fuse_evloop *loop,
+                           struct fuse_evloop_timer *timer);
+
 /* ----------------------------------------------------------- *
  * Channel interface                                           *
  * ----------------------------------------------------------- */
@@ -1343,7 +1890,44 @@ int fuse_chan_send(struct fuse_chan *ch, const struct iovec iov[],
 void fuse_chan_destroy(struct fuse_chan *ch);
 
 /* ----------------------------------------------------------- *
- * Compatibility stuff                                         *
+ * Loopback channel                                            *
+ * ----------------------------------------------------------- */
+
+/**
+ * Create an in-process channel
+ *
+ * The channel is not connected to the kernel.  Raw requests are
+ * injected with fuse_loopback_chan_process(), which makes it possible
+ * to exercise or benchmark a filesystem without mounting it.  Running
+ * a session loop on this channel returns immediately.
+ *
+ * @param bufsize the maximum request size, zero means the default
+ * @return the new channel object, or NULL on failure
+ */
+struct fuse_chan *fuse_loopback_chan_new(size_t bufsize);
+
+/**
+ * Process a raw request on a loopback channel and wait for the reply
+ *
+ * The request must start with a complete fuse_in_header, whose len
+ * field equals len.  The channel must already be assigned to a
+ * session.  Calls are serialized, but the reply may be sent from any
+ * thread, so filesystems that complete requests asynchronously work
+ * too.  The reply, header included, is truncated to size bytes.
+ *
+ * @param ch the loopback channel
+ * @param req the raw request
+ * @param len the length of the request
+ * @param reply buffer for the reply, may be NULL
+ * @param size the size of the reply buffer
+ * @return the full length of the reply, zero if the request had no
+ *         reply (e.g. FORGET), or -errno on error
+ */
+int fuse_loopback_chan_process(struct fuse_chan *ch, const void *req,
+                               size_t len, void *reply, size_t size);
+
+/* ----------------------------------------------------------- *
+ * Compatibility stuff                                        *
  * ----------------------------------------------------------- */
 
 #if FUSE_USE_VERSION < 26
@@ -16,6 +16,7 @@
 #include <linux/pagemap.h>
 #include <linux/file.h>
 #include <linux/slab.h>
+#include <asm/uaccess.h>
 
 #ifdef MODULE_ALIAS_MISCDEV
 MODULE_ALIAS_MISCDEV(FUSE_MINOR);
@@ -23,15 +24,39 @@ MODULE_ALIAS_MISCDEV(FUSE_MINOR);
 
 static struct kmem_cache *fuse_req_cachep;
 
-static struct fuse_conn *fuse_get_conn(struct file *file)
+static struct fuse_dev *fuse_get_dev(struct file *file)
 {
 	/*
 	 * Lockless access is OK, because file->private data is set
-	 * once during mount and is valid until the file is released.
+	 * once during mount or cloning and is valid until the file is
+	 * released.
 	 */
 	return file->private_data;
 }
 
+static struct fuse_conn *fuse_get_conn(struct file *file)
+{
+	struct fuse_dev *fud = fuse_get_dev(file);
+	return fud ? fud->fc : NULL;
+}
+
+struct fuse_dev *fuse_dev_alloc(struct fuse_conn *fc)
+{
+	struct fuse_dev *fud = kmalloc(sizeof(struct fuse_dev), GFP_KERNEL);
+	if (fud) {
+		fud->fc = fuse_conn_get(fc);
+		fud->queue = 0;
+	}
+
+	return fud;
+}
+
+void fuse_dev_free(struct fuse_dev *fud)
+{
+	fuse_conn_put(fud->fc);
+	kfree(fud);
+}
+
 static void fuse_request_init(struct fuse_req *req)
 {
 	memset(req, 0, sizeof(*req));
@@ -257,6 +282,46 @@ static void queue_interrupt(struct fuse_conn *fc, struct fuse_req *req)
 	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
 }
 
+struct fuse_forget_link *fuse_alloc_forget(void)
+{
+	struct fuse_forget_link *forget;
+
+	forget = kmalloc(sizeof(struct fuse_forget_link), GFP_KERNEL);
+	if (forget)
+		forget->next = NULL;
+
+	return forget;
+}
+
+/*
+ * Forgets need no reply, so they are not sent as requests, but put on
+ * a list, and only assembled into a message when userspace reads
+ * them.  Readers are only woken when the list becomes non-empty, so
+ * a burst of forgets (e.g. the inode cache being shrunk) costs a
+ * single wakeup.
+ */
+void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
+		       u64 nodeid, u64 nlookup)
+{
+	forget->forget_one.nodeid = nodeid;
+	forget->forget_one.nlookup = nlookup;
+	forget->next = NULL;
+
+	spin_lock(&fc->lock);
+	if (fc->connected) {
+		int was_empty = !fc->forget_list_head.next;
+
+		fc->forget_list_tail->next = forget;
+		fc->forget_list_tail = forget;
+		if (was_empty) {
+			wake_up(&fc->waitq);
+			kill_fasync(&fc->fasync, SIGIO, POLL_IN);
+		}
+	} else
+		kfree(forget);
+	spin_unlock(&fc->lock);
+}
+
 /* Called with fc->lock held.  Releases, and then reacquires it. */
 static void request_wait_answer(struct fuse_conn *fc, struct fuse_req *req)
 {
@@ -339,16 +404,26 @@ static u64 fuse_get_unique(struct fuse_conn *fc)
 
 static void queue_request(struct fuse_conn *fc, struct fuse_req *req)
 {
+	struct fuse_queue *fq;
+
 	req->in.h.unique = fuse_get_unique(fc);
 	req->in.h.len = sizeof(struct fuse_in_header) +
 		len_args(req->in.numargs, (struct fuse_arg *) req->in.args);
-	list_add_tail(&req->list, &fc->pending);
+	fq = &fc->queues[raw_smp_processor_id() % fc->num_queues];
+	list_add_tail(&req->list, &fq->pending);
 	req->state = FUSE_REQ_PENDING;
 	if (!req->waiting) {
 		req->waiting = 1;
 		atomic_inc(&fc->num_waiting);
 	}
-	wake_up(&fc->waitq);
+	/*
+	 * Prefer a reader bound to this queue, otherwise let any
+	 * reader of the connection steal the request.
+	 */
+	if (waitqueue_active(&fq->waitq))
+		wake_up(&fq->waitq);
+	else
+		wake_up(&fc->waitq);
 	kill_fasync(&fc->fasync, SIGIO, POLL_IN);
 }
 
@@ -619,17 +694,45 @@ static int fuse_copy_args(struct fuse_copy_state *cs, unsigned numargs,
 	return err;
 }
 
+/*
+ * Find a non-empty pending list, starting with the given queue and
+ * stealing from the others if it is empty
+ *
+ * Called with fc->lock held
+ */
+static struct list_head *next_pending(struct fuse_conn *fc, unsigned queue)
+{
+	unsigned i;
+
+	for (i = 0; i < fc->num_queues; i++) {
+		struct fuse_queue *fq;
+		fq = &fc->queues[(queue + i) % fc->num_queues];
+		if (!list_empty(&fq->pending))
+			return &fq->pending;
+	}
+	return NULL;
+}
+
+static int forget_pending(struct fuse_conn *fc)
+{
+	return fc->forget_list_head.next != NULL;
+}
+
 static int request_pending(struct fuse_conn *fc)
 {
-	return !list_empty(&fc->pending) || !list_empty(&fc->interrupts);
+	return next_pending(fc, 0) || !list_empty(&fc->interrupts) ||
+		forget_pending(fc);
 }
 
-/* Wait until a request is available on the pending list */
-static void request_wait(struct fuse_conn *fc)
+/* Wait until a request is available on one of the pending lists */
+static void request_wait(struct fuse_conn *fc, unsigned queue)
 {
 	DECLARE_WAITQUEUE(wait, current);
+	DECLARE_WAITQUEUE(qwait, current);
+	struct fuse_queue *fq = &fc->queues[queue];
 
 	add_wait_queue_exclusive(&fc->waitq, &wait);
+	add_wait_queue_exclusive(&fq->waitq, &qwait);
 	while (fc->connected && !request_pending(fc)) {
 		set_current_state(TASK_INTERRUPTIBLE);
 		if (signal_pending(current))
@@ -640,6 +743,7 @@ static void request_wait(struct fuse_conn *fc)
 		spin_lock(&fc->lock);
 	}
 	set_current_state(TASK_RUNNING);
+	remove_wait_queue(&fq->waitq, &qwait);
 	remove_wait_queue(&fc->waitq, &wait);
 }
 
@@ -682,11 +786,143 @@ static int fuse_read_interrupt(struct fuse_conn *fc, struct fuse_req *req,
 	return err ? err : reqsize;
 }
 
+/*
+ * Unlink at most 'max' forgets from the head of the forget list and
+ * return them as a NULL terminated chain
+ *
+ * Called with fc->lock held
+ */
+static struct fuse_forget_link *dequeue_forget(struct fuse_conn *fc,
+					       unsigned max, unsigned *countp)
+{
+	struct fuse_forget_link *head = fc->forget_list_head.next;
+	struct fuse_forget_link **newhead = &head;
+	unsigned count;
+
+	for (count = 0; *newhead != NULL && count < max; count++)
+		newhead = &(*newhead)->next;
+
+	fc->forget_list_head.next = *newhead;
+	*newhead = NULL;
+	if (fc->forget_list_head.next == NULL)
+		fc->forget_list_tail = &fc->forget_list_head;
+
+	if (countp != NULL)
+		*countp = count;
+
+	return head;
+}
+
+/*
+ * Transfer a single FORGET to userspace, for filesystems which don't
+ * know about BATCH_FORGET
+ *
+ * Called with fc->lock held, releases it
+ */
+static int fuse_read_single_forget(struct fuse_conn *fc,
+				   const struct iovec *iov,
+				   unsigned long nr_segs)
+{
+	struct fuse_copy_state cs;
+	struct fuse_in_header ih;
+	struct fuse_forget_in arg;
+	struct fuse_forget_link *forget = dequeue_forget(fc, 1, NULL);
+	unsigned reqsize = sizeof(ih) + sizeof(arg);
+	int err;
+
+	memset(&ih, 0, sizeof(ih));
+	memset(&arg, 0, sizeof(arg));
+	ih.len = reqsize;
+	ih.opcode = FUSE_FORGET;
+	ih.unique = fuse_get_unique(fc);
+	ih.nodeid = forget->forget_one.nodeid;
+	arg.nlookup = forget->forget_one.nlookup;
+
+	spin_unlock(&fc->lock);
+	kfree(forget);
+	if (iov_length(iov, nr_segs) < reqsize)
+		return -EINVAL;
+
+	fuse_copy_init(&cs, fc, 1, NULL, iov, nr_segs);
+	err = fuse_copy_one(&cs, &ih, sizeof(ih));
+	if (!err)
+		err = fuse_copy_one(&cs, &arg, sizeof(arg));
+	fuse_copy_finish(&cs);
+
+	return err ? err : reqsize;
+}
+
+/*
+ * Transfer as many queued forgets as fit into the userspace buffer in
+ * a single BATCH_FORGET message
+ *
+ * Called with fc->lock held, releases it
+ */
+static int fuse_read_batch_forget(struct fuse_conn *fc,
+				  const struct iovec *iov,
+				  unsigned long nr_segs)
+{
+	struct fuse_copy_state cs;
+	struct fuse_in_header ih;
+	struct fuse_batch_forget_in arg;
+	struct fuse_forget_link *head;
+	size_t nbytes = iov_length(iov, nr_segs);
+	unsigned reqsize = sizeof(ih) + sizeof(arg);
+	unsigned max_forgets;
+	unsigned count;
+	int err;
+
+	if (nbytes < reqsize + sizeof(struct fuse_forget_one)) {
+		spin_unlock(&fc->lock);
+		return -EINVAL;
+	}
+
+	max_forgets = (nbytes - reqsize) / sizeof(struct fuse_forget_one);
+	head = dequeue_forget(fc, max_forgets, &count);
+	reqsize += count * sizeof(struct fuse_forget_one);
+
+	memset(&ih, 0, sizeof(ih));
+	memset(&arg, 0, sizeof(arg));
+	ih.len = reqsize;
+	ih.opcode = FUSE_BATCH_FORGET;
+	ih.unique = fuse_get_unique(fc);
+	arg.count = count;
+
+	spin_unlock(&fc->lock);
+	fuse_copy_init(&cs, fc, 1, NULL, iov, nr_segs);
+	err = fuse_copy_one(&cs, &ih, sizeof(ih));
+	if (!err)
+		err = fuse_copy_one(&cs, &arg, sizeof(arg));
+
+	while (head) {
+		struct fuse_forget_link *forget = head;
+
+		if (!err)
+			err = fuse_copy_one(&cs, &forget->forget_one,
+					    sizeof(forget->forget_one));
+		head = forget->next;
+		kfree(forget);
+	}
+	fuse_copy_finish(&cs);
+
+	return err ? err : reqsize;
+}
+
+/* Called with fc->lock held, releases it */
+static int fuse_read_forget(struct fuse_conn *fc, const struct iovec *iov,
+			    unsigned long nr_segs)
+{
+	if (fc->batch_forget)
+		return fuse_read_batch_forget(fc, iov, nr_segs);
+	else
+		return fuse_read_single_forget(fc, iov, nr_segs);
+}
+
 /*
  * Read a single request into the userspace filesystem's buffer.  This
  * function waits until a request is available, then removes it from
  * the pending list and copies request data to userspace buffer.  If
- * no reply is needed (FORGET) or request has been aborted or there
+ * no reply is needed or request has been aborted or there
  * was an error during the copying then it's finished by calling
  * request_end().  Otherwise add it to the processing list, and set
  * the 'sent' flag.
@@ -699,10 +935,12 @@ static ssize_t fuse_dev_readv(struct file *file, const struct iovec *iov,
 	struct fuse_in *in;
 	struct fuse_copy_state cs;
 	unsigned reqsize;
-	struct fuse_conn *fc = fuse_get_conn(file);
-	if (!fc)
+	struct fuse_conn *fc;
+	struct fuse_dev *fud = fuse_get_dev(file);
+	if (!fud)
 		return -EPERM;
 
+	fc = fud->fc;
  restart:
 	spin_lock(&fc->lock);
 	err = -EAGAIN;
@@ -710,7 +948,7 @@ static ssize_t fuse_dev_readv(struct file *file, const struct iovec *iov,
 	    !request_pending(fc))
 		goto err_unlock;
 
-	request_wait(fc);
+	request_wait(fc, fud->queue);
 	err = -ENODEV;
 	if (!fc->connected)
 		goto err_unlock;
@@ -724,7 +962,22 @@ static ssize_t fuse_dev_readv(struct file *file, const struct iovec *iov,
 		return fuse_read_interrupt(fc, req, iov, nr_segs);
 	}
 
-	req = list_entry(fc->pending.next, struct fuse_req, list);
+	/*
+	 * Forgets are sent right away if there's nothing else to do.
+	 * Otherwise they are interleaved with the pending requests, 16
+	 * reads of forgets for every 8 requests, so that neither of
+	 * them can starve the other.
+	 */
+	if (forget_pending(fc)) {
+		if (!next_pending(fc, fud->queue) || fc->forget_batch-- > 0)
+			return fuse_read_forget(fc, iov, nr_segs);
+
+		if (fc->forget_batch <= -8)
+			fc->forget_batch = 16;
+	}
+
+	req = list_entry(next_pending(fc, fud->queue)->next, struct fuse_req,
+			 list);
 	req->state = FUSE_REQ_READING;
 	list_move(&req->list, &fc->io);
 
@@ -937,11 +1190,14 @@ static ssize_t fuse_dev_write(struct kiocb *iocb, const struct iovec *iov,
 static unsigned fuse_dev_poll(struct file *file, poll_table *wait)
 {
 	unsigned mask = POLLOUT | POLLWRNORM;
-	struct fuse_conn *fc = fuse_get_conn(file);
-	if (!fc)
+	struct fuse_conn *fc;
+	struct fuse_dev *fud = fuse_get_dev(file);
+	if (!fud)
 		return POLLERR;
 
+	fc = fud->fc;
 	poll_wait(file, &fc->waitq, wait);
+	poll_wait(file, &fc->queues[fud->queue].waitq, wait);
 
 	spin_lock(&fc->lock);
 	if (!fc->connected)
@@ -969,6 +1225,15 @@ static void end_requests(struct fuse_conn *fc, struct list_head *head)
 	}
 }
 
+/* Abort the requests on all pending lists */
+static void end_pending_requests(struct fuse_conn *fc)
+{
+	unsigned i;
+
+	for (i = 0; i < fc->num_queues; i++)
+		end_requests(fc, &fc->queues[i].pending);
+}
+
 /*
  * Abort requests under I/O
  *
@@ -1030,7 +1295,7 @@ void fuse_abort_conn(struct fuse_conn *fc)
 		fc->connected = 0;
 		fc->blocked = 0;
 		end_io_requests(fc);
-		end_requests(fc, &fc->pending);
+		end_pending_requests(fc);
 		end_requests(fc, &fc->processing);
 		wake_up_all(&fc->waitq);
 		wake_up_all(&fc->blocked_waitq);
@@ -1039,22 +1304,105 @@ void fuse_abort_conn(struct fuse_conn *fc)
 	spin_unlock(&fc->lock);
 }
 
+/*
+ * The connection is only torn down when the last of its devices is
+ * released; readers still sleeping on a clone are woken so they
+ * notice the disconnect.
+ */
 static int fuse_dev_release(struct inode *inode, struct file *file)
 {
-	struct fuse_conn *fc = fuse_get_conn(file);
-	if (fc) {
+	struct fuse_dev *fud = fuse_get_dev(file);
+	if (fud) {
+		struct fuse_conn *fc = fud->fc;
 		spin_lock(&fc->lock);
-		fc->connected = 0;
-		end_requests(fc, &fc->pending);
-		end_requests(fc, &fc->processing);
+		if (!--fc->num_devs) {
+			fc->connected = 0;
+			end_pending_requests(fc);
+			end_requests(fc, &fc->processing);
+		}
 		spin_unlock(&fc->lock);
+		wake_up_all(&fc->waitq);
 		fasync_helper(-1, file, 0, &fc->fasync);
-		fuse_conn_put(fc);
+		fuse_dev_free(fud);
+	}
+
+	return 0;
+}
+
+/*
+ * Attach a newly opened device to an existing connection
+ *
+ * Each clone gets its own queue, until FUSE_MAX_QUEUES is reached,
+ * after which queues are shared.  Queues are never removed, requests
+ * left on the queue of a released clone are picked up by the other
+ * readers.
+ */
+static int fuse_dev_clone(struct fuse_conn *fc, struct file *new)
+{
+	struct fuse_dev *fud;
+
+	/* Already mounted or cloned */
+	if (new->private_data)
+		return -EINVAL;
+
+	fud = fuse_dev_alloc(fc);
+	if (!fud)
+		return -ENOMEM;
+
+	spin_lock(&fc->lock);
+	if (!fc->connected) {
+		spin_unlock(&fc->lock);
+		fuse_dev_free(fud);
+		return -ENODEV;
 	}
+	if (fc->num_queues < FUSE_MAX_QUEUES)
+		fc->num_queues++;
+	fud->queue = fc->num_devs++ % fc->num_queues;
+	spin_unlock(&fc->lock);
 
+	new->private_data = fud;
 	return 0;
 }
 
+static long fuse_dev_ioctl(struct file *file, unsigned int cmd,
+			   unsigned long arg)
+{
+	int err;
+	__u32 oldfd;
+	struct file *old;
+	struct fuse_dev *fud;
+
+	if (cmd != FUSE_DEV_IOC_CLONE)
+		return -ENOTTY;
+
+	if (get_user(oldfd, (__u32 __user *) arg))
+		return -EFAULT;
+
+	old = fget(oldfd);
+	if (!old)
+		return -EINVAL;
+
+	err = -EINVAL;
+	if (old->f_op == &fuse_dev_operations) {
+		mutex_lock(&fuse_mutex);
+		fud = fuse_get_dev(old);
+		if (fud)
+			err = fuse_dev_clone(fud->fc, file);
+		mutex_unlock(&fuse_mutex);
+	}
+	fput(old);
+
+	return err;
+}
+
+#ifndef HAVE_UNLOCKED_IOCTL
+static int fuse_dev_ioctl_locked(struct inode *inode, struct file *file,
+				 unsigned int cmd, unsigned long arg)
+{
+	return fuse_dev_ioctl(file, cmd, arg);
+}
+#endif
+
 static int fuse_dev_fasync(int fd, struct file *file, int on)
 {
 	struct fuse_conn *fc = fuse_get_conn(file);
@@ -1080,6 +1428,12 @@ struct file_operations fuse_dev_operations = {
 	.aio_write	= fuse_dev_write,
 #endif
 	.poll		= fuse_dev_poll,
+#ifdef HAVE_UNLOCKED_IOCTL
+	.unlocked_ioctl	= fuse_dev_ioctl,
+	.compat_ioctl	= fuse_dev_ioctl,
+#else
+	.ioctl		= fuse_dev_ioctl_locked,
+#endif
 	.release	= fuse_dev_release,
 	.fasync		= fuse_dev_fasync,
 };
@@ -138,7 +138,7 @@ static int fuse_dentry_revalidate(struct dentry *entry, struct nameidata *nd)
 		struct fuse_entry_out outarg;
 		struct fuse_conn *fc;
 		struct fuse_req *req;
-		struct fuse_req *forget_req;
+		struct fuse_forget_link *forget;
 		struct dentry *parent;
 
 		/* For negative dentries, always do a fresh lookup */
@@ -150,8 +150,8 @@ static int fuse_dentry_revalidate(struct dentry *entry, struct nameidata *nd)
 		if (IS_ERR(req))
 			return 0;
 
-		forget_req = fuse_get_req(fc);
-		if (IS_ERR(forget_req)) {
+		forget = fuse_alloc_forget();
+		if (!forget) {
 			fuse_put_request(fc, req);
 			return 0;
 		}
@@ -168,15 +168,14 @@ static int fuse_dentry_revalidate(struct dentry *entry, struct nameidata *nd)
 		if (!err) {
 			struct fuse_inode *fi = get_fuse_inode(inode);
 			if (outarg.nodeid != get_node_id(inode)) {
-				fuse_send_forget(fc, forget_req,
-						 outarg.nodeid, 1);
+				fuse_queue_forget(fc, forget, outarg.nodeid, 1);
 				return 0;
 			}
 			spin_lock(&fc->lock);
 			fi->nlookup ++;
 			spin_unlock(&fc->lock);
 		}
-		fuse_put_request(fc, forget_req);
+		kfree(forget);
 		if (err || (outarg.attr.mode ^ inode->i_mode) & S_IFMT)
 			return 0;
 
@@ -229,7 +228,7 @@ static struct dentry *fuse_lookup(struct inode *dir, struct dentry *entry,
 	struct dentry *newent;
 	struct fuse_conn *fc = get_fuse_conn(dir);
 	struct fuse_req *req;
-	struct fuse_req *forget_req;
+	struct fuse_forget_link *forget;
 
 	if (entry->d_name.len > FUSE_NAME_MAX)
 		return ERR_PTR(-ENAMETOOLONG);
@@ -238,10 +237,10 @@ static struct dentry *fuse_lookup(struct inode *dir, struct dentry *entry,
 	if (IS_ERR(req))
 		return ERR_PTR(PTR_ERR(req));
 
-	forget_req = fuse_get_req(fc);
-	if (IS_ERR(forget_req)) {
+	forget = fuse_alloc_forget();
+	if (!forget) {
 		fuse_put_request(fc, req);
-		return ERR_PTR(PTR_ERR(forget_req));
+		return ERR_PTR(-ENOMEM);
 	}
 
 	fuse_lookup_init(req, dir, entry, &outarg);
@@ -257,11 +256,11 @@ static struct dentry *fuse_lookup(struct inode *dir, struct dentry *entry,
 		inode = fuse_iget(dir->i_sb, outarg.nodeid, outarg.generation,
 				  &outarg.attr);
 		if (!inode) {
-			fuse_send_forget(fc, forget_req, outarg.nodeid, 1);
+			fuse_queue_forget(fc, forget, outarg.nodeid, 1);
 			return ERR_PTR(-ENOMEM);
 		}
 	}
-	fuse_put_request(fc, forget_req);
+	kfree(forget);
 	if (err && err != -ENOENT)
 		return ERR_PTR(err);
 
@@ -313,7 +312,7 @@ static int fuse_create_open(struct inode *dir, struct dentry *entry, int mode,
 	struct inode *inode;
 	struct fuse_conn *fc = get_fuse_conn(dir);
 	struct fuse_req *req;
-	struct fuse_req *forget_req;
+	struct fuse_forget_link *forget;
 	struct fuse_open_in inarg;
 	struct fuse_open_out outopen;
 	struct fuse_entry_out outentry;
@@ -324,14 +323,14 @@ static int fuse_create_open(struct inode *dir, struct dentry *entry, int mode,
 	if (fc->no_create)
 		return -ENOSYS;
 
-	forget_req = fuse_get_req(fc);
-	if (IS_ERR(forget_req))
-		return PTR_ERR(forget_req);
+	forget = fuse_alloc_forget();
+	if (!forget)
+		return -ENOMEM;
 
 	req = fuse_get_req(fc);
 	err = PTR_ERR(req);
 	if (IS_ERR(req))
-		goto out_put_forget_req;
+		goto out_free_forget;
 
 	err = -ENOMEM;
 	ff = fuse_file_alloc();
@@ -373,10 +372,10 @@ static int fuse_create_open(struct inode *dir, struct dentry *entry, int mode,
 		flags &= ~(O_CREAT | O_EXCL | O_TRUNC);
 		ff->fh = outopen.fh;
 		fuse_sync_release(fc, ff, outentry.nodeid, flags);
-		fuse_send_forget(fc, forget_req, outentry.nodeid, 1);
+		fuse_queue_forget(fc, forget, outentry.nodeid, 1);
 		return -ENOMEM;
 	}
-	fuse_put_request(fc, forget_req);
+	kfree(forget);
 	d_instantiate(entry, inode);
 	fuse_change_timeout(entry, &outentry);
 	file = lookup_instantiate_filp(nd, entry, generic_file_open);
@@ -392,8 +391,8 @@ static int fuse_create_open(struct inode *dir, struct dentry *entry, int mode,
 	fuse_file_free(ff);
  out_put_request:
 	fuse_put_request(fc, req);
- out_put_forget_req:
-	fuse_put_request(fc, forget_req);
+ out_free_forget:
+	kfree(forget);
 	return err;
 }
 #endif
@@ -408,12 +407,12 @@ static int create_new_entry(struct fuse_conn *fc, struct fuse_req *req,
 	struct fuse_entry_out outarg;
 	struct inode *inode;
 	int err;
-	struct fuse_req *forget_req;
+	struct fuse_forget_link *forget;
 
-	forget_req = fuse_get_req(fc);
-	if (IS_ERR(forget_req)) {
+	forget = fuse_alloc_forget();
+	if (!forget) {
 		fuse_put_request(fc, req);
-		return PTR_ERR(forget_req);
+		return -ENOMEM;
 	}
 
 	req->in.h.nodeid = get_node_id(dir);
@@ -424,22 +423,22 @@ static int create_new_entry(struct fuse_conn *fc, struct fuse_req *req,
 	err = req->out.h.error;
 	fuse_put_request(fc, req);
 	if (err)
-		goto out_put_forget_req;
+		goto out_free_forget;
 
 	err = -EIO;
 	if (invalid_nodeid(outarg.nodeid))
-		goto out_put_forget_req;
+		goto out_free_forget;
 
 	if ((outarg.attr.mode ^ mode) & S_IFMT)
-		goto out_put_forget_req;
+		goto out_free_forget;
 
 	inode = fuse_iget(dir->i_sb, outarg.nodeid, outarg.generation,
 			  &outarg.attr);
 	if (!inode) {
-		fuse_send_forget(fc, forget_req, outarg.nodeid, 1);
+		fuse_queue_forget(fc, forget, outarg.nodeid, 1);
 		return -ENOMEM;
 	}
-	fuse_put_request(fc, forget_req);
+	kfree(forget);
 
 	if (S_ISDIR(inode->i_mode)) {
 		struct dentry *alias;
@@ -461,8 +460,8 @@ static int create_new_entry(struct fuse_conn *fc, struct fuse_req *req,
 	fuse_invalidate_attr(dir);
 	return 0;
 
- out_put_forget_req:
-	fuse_put_request(fc, forget_req);
+ out_free_forget:
+	kfree(forget);
 	return err;
 }
 
@@ -880,6 +879,139 @@ static int parse_dirfile(char *buf, size_t nbytes, struct file *file,
 	return 0;
 }
 
+/*
+ * Send a FORGET for a lookup done by READDIRPLUS which could not be
+ * turned into a dentry
+ */
+static void fuse_force_forget(struct file *file, u64 nodeid)
+{
+	struct inode *inode = file->f_dentry->d_inode;
+	struct fuse_conn *fc = get_fuse_conn(inode);
+	struct fuse_forget_link *forget;
+
+	forget = kmalloc(sizeof(*forget), GFP_KERNEL | __GFP_NOFAIL);
+	fuse_queue_forget(fc, forget, nodeid, 1);
+}
+
+/*
+ * Instantiate or refresh the dentry of a READDIRPLUS entry, so that
+ * the following lookup and getattr are served from the cache
+ *
+ * The lookup count taken by userspace is transferred to the inode.
+ * If the entry can't be linked into the dcache the inode is dropped
+ * again, and the count is returned to userspace when it is evicted.
+ *
+ * Called with the directory's i_mutex held, same as ->lookup()
+ */
+static int fuse_direntplus_link(struct file *file,
+				struct fuse_direntplus *direntplus)
+{
+	struct fuse_entry_out *o = &direntplus->entry_out;
+	struct fuse_dirent *dirent = &direntplus->dirent;
+	struct dentry *parent = file->f_dentry;
+	struct inode *dir = parent->d_inode;
+	struct fuse_conn *fc = get_fuse_conn(dir);
+	struct dentry *dentry;
+	struct dentry *alias;
+	struct inode *inode;
+	struct qstr name;
+
+	if (!o->nodeid)
+		return 0;
+
+	name.name = dirent->name;
+	name.len = dirent->namelen;
+	name.hash = full_name_hash(name.name, name.len);
+
+	/* Userspace doesn't look these up */
+	if (name.name[0] == '.' &&
+	    (name.len == 1 || (name.len == 2 && name.name[1] == '.')))
+		return 0;
+
+	if (invalid_nodeid(o->nodeid) || !fuse_valid_type(o->attr.mode))
+		return -EIO;
+
+	inode = fuse_iget(dir->i_sb, o->nodeid, o->generation, &o->attr);
+	if (!inode)
+		return -ENOMEM;
+
+	dentry = d_lookup(parent, &name);
+	if (dentry) {
+		if (dentry->d_inode == inode)
+			fuse_change_timeout(dentry, o);
+		else
+			fuse_invalidate_entry(dentry);
+		dput(dentry);
+		iput(inode);
+		return 0;
+	}
+
+	dentry = d_alloc(parent, &name);
+	if (!dentry) {
+		iput(inode);
+		return 0;
+	}
+
+	if (S_ISDIR(inode->i_mode)) {
+		mutex_lock(&fc->inst_mutex);
+		alias = fuse_d_add_directory(dentry, inode);
+		mutex_unlock(&fc->inst_mutex);
+		if (IS_ERR(alias)) {
+			iput(inode);
+			dput(dentry);
+			return 0;
+		}
+	} else
+		alias = d_splice_alias(inode, dentry);
+
+	if (alias) {
+		dput(dentry);
+		dentry = alias;
+	}
+	dentry->d_op = &fuse_dentry_operations;
+	fuse_change_timeout(dentry, o);
+	dput(dentry);
+	return 0;
+}
+
+/*
+ * Unlike parse_dirfile(), this goes through the whole reply even
+ * after filldir() is full, since every entry carries a lookup count
+ * which has to be either linked or forgotten
+ */
+static int parse_dirplusfile(char *buf, size_t nbytes, struct file *file,
+			     void *dstbuf, filldir_t filldir)
+{
+	int over = 0;
+
+	while (nbytes >= FUSE_NAME_OFFSET_DIRENTPLUS) {
+		struct fuse_direntplus *direntplus =
+			(struct fuse_direntplus *) buf;
+		struct fuse_dirent *dirent = &direntplus->dirent;
+		size_t reclen = FUSE_DIRENTPLUS_SIZE(direntplus);
+
+		if (!dirent->namelen || dirent->namelen > FUSE_NAME_MAX)
+			return -EIO;
+		if (reclen > nbytes)
+			break;
+
+		if (!over) {
+			over = filldir(dstbuf, dirent->name, dirent->namelen,
+				       file->f_pos, dirent->ino, dirent->type);
+			if (!over)
+				file->f_pos = dirent->off;
+		}
+
+		buf += reclen;
+		nbytes -= reclen;
+
+		if (fuse_direntplus_link(file, direntplus))
+			fuse_force_forget(file, direntplus->entry_out.nodeid);
+	}
+
+	return 0;
+}
+
 static int fuse_readdir(struct file *file, void *dstbuf, filldir_t filldir)
 {
 	int err;
@@ -888,6 +1020,7 @@ static int fuse_readdir(struct file *file, void *dstbuf, filldir_t filldir)
 	struct inode *inode = file->f_dentry->d_inode;
 	struct fuse_conn *fc = get_fuse_conn(inode);
 	struct fuse_req *req;
+	int plus = fc->do_readdirplus;
 
 	if (is_bad_inode(inode))
 		return -EIO;
@@ -903,14 +1036,20 @@ static int fuse_readdir(struct file *file, void *dstbuf, filldir_t filldir)
 	}
 	req->num_pages = 1;
 	req->pages[0] = page;
-	fuse_read_fill(req, file, inode, file->f_pos, PAGE_SIZE, FUSE_READDIR);
+	fuse_read_fill(req, file, inode, file->f_pos, PAGE_SIZE,
+		       plus ? FUSE_READDIRPLUS : FUSE_READDIR);
 	request_send(fc, req);
 	nbytes = req->out.args[0].size;
 	err = req->out.h.error;
 	fuse_put_request(fc, req);
-	if (!err)
-		err = parse_dirfile(page_address(page), nbytes, file, dstbuf,
-				    filldir);
+	if (!err) {
+		if (plus)
+			err = parse_dirplusfile(page_address(page), nbytes,
+						file, dstbuf, filldir);
+		else
+			err = parse_dirfile(page_address(page), nbytes, file,
+					    dstbuf, filldir);
+	}
 
 	__free_page(page);
 	fuse_invalidate_attr(inode); /* atime changed */
@@ -1079,6 +1218,13 @@ static int fuse_setattr(struct dentry *entry, struct iattr *attr)
 			send_sig(SIGXFSZ, current, 0);
 			return -EFBIG;
 		}
+
+		/* Cached writes must reach the server before the truncate */
+		if (fc->writeback_cache && S_ISREG(inode->i_mode)) {
+			err = fuse_write_back(inode);
+			if (err)
+				return err;
+		}
 	}
 
 	req = fuse_get_req(fc);
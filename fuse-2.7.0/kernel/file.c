@@ -9,6 +9,7 @@
 #include "fuse_i.h"
 
 #include <linux/pagemap.h>
+#include <linux/writeback.h>
 #include <linux/slab.h>
 #include <linux/kernel.h>
 #include <linux/sched.h>
@@ -59,7 +60,8 @@ struct fuse_file *fuse_file_alloc(void)
 		if (!ff->reserved_req) {
 			kfree(ff);
 			ff = NULL;
-		}
+		} else
+			INIT_LIST_HEAD(&ff->write_entry);
 	}
 	return ff;
 }
@@ -73,6 +75,8 @@ void fuse_file_free(struct fuse_file *ff)
 void fuse_finish_open(struct inode *inode, struct file *file,
 		      struct fuse_file *ff, struct fuse_open_out *outarg)
 {
+	struct fuse_conn *fc = get_fuse_conn(inode);
+
 	if (outarg->open_flags & FOPEN_DIRECT_IO)
 		file->f_op = &fuse_direct_io_file_operations;
 	if (!(outarg->open_flags & FOPEN_KEEP_CACHE))
@@ -83,6 +87,12 @@ void fuse_finish_open(struct inode *inode, struct file *file,
 #endif
 	ff->fh = outarg->fh;
 	file->private_data = ff;
+	if (fc->writeback_cache && S_ISREG(inode->i_mode) &&
+	    (file->f_mode & FMODE_WRITE)) {
+		spin_lock(&fc->lock);
+		list_add(&ff->write_entry, &get_fuse_inode(inode)->write_files);
+		spin_unlock(&fc->lock);
+	}
 }
 
 int fuse_open_common(struct inode *inode, struct file *file, int isdir)
@@ -141,6 +151,32 @@ struct fuse_req *fuse_release_fill(struct fuse_file *ff, u64 nodeid, int flags,
 	return req;
 }
 
+int fuse_write_back(struct inode *inode)
+{
+	struct address_space *mapping = inode->i_mapping;
+	int err = filemap_fdatawrite(mapping);
+	int err2 = filemap_fdatawait(mapping);
+
+	return err ? err : err2;
+}
+
+/*
+ * Cached pages may be written back with the handle of any writable
+ * file on the inode.  Flush them while this file is still on the
+ * list, then take it off and wait for writeback which picked up its
+ * handle before that.
+ */
+static void fuse_release_write_file(struct inode *inode, struct fuse_file *ff)
+{
+	struct fuse_conn *fc = get_fuse_conn(inode);
+
+	fuse_write_back(inode);
+	spin_lock(&fc->lock);
+	list_del_init(&ff->write_entry);
+	spin_unlock(&fc->lock);
+	filemap_fdatawait(inode->i_mapping);
+}
+
 int fuse_release_common(struct inode *inode, struct file *file, int isdir)
 {
 	struct fuse_file *ff = file->private_data;
@@ -148,6 +184,9 @@ int fuse_release_common(struct inode *inode, struct file *file, int isdir)
 		struct fuse_conn *fc = get_fuse_conn(inode);
 		struct fuse_req *req;
 
+		if (!list_empty(&ff->write_entry))
+			fuse_release_write_file(inode, ff);
+
 		req = fuse_release_fill(ff, get_node_id(inode), file->f_flags,
 					isdir ? FUSE_RELEASEDIR : FUSE_RELEASE);
 
@@ -205,12 +244,17 @@ static int fuse_flush(struct file *file)
 	struct fuse_req *req;
 	struct fuse_flush_in inarg;
 	int err;
+	int werr = 0;
 
 	if (is_bad_inode(inode))
 		return -EIO;
 
+	/* Report errors writing back cached pages on close */
+	if (fc->writeback_cache)
+		werr = fuse_write_back(inode);
+
 	if (fc->no_flush)
-		return 0;
+		return werr;
 
 	req = fuse_get_req_nofail(fc, file);
 	memset(&inarg, 0, sizeof(inarg));
@@ -233,7 +277,7 @@ static int fuse_flush(struct file *file)
 		fc->no_flush = 1;
 		err = 0;
 	}
-	return err;
+	return werr ? werr : err;
 }
 
 int fuse_fsync_common(struct file *file, struct dentry *de, int datasync,
@@ -311,21 +355,22 @@ static size_t fuse_send_read(struct fuse_req *req, struct file *file,
 	return req->out.args[0].size;
 }
 
-static int fuse_readpage(struct file *file, struct page *page)
+/*
+ * Read a locked page and leave it locked
+ */
+static int fuse_do_readpage(struct file *file, struct page *page)
 {
 	struct inode *inode = page->mapping->host;
 	struct fuse_conn *fc = get_fuse_conn(inode);
 	struct fuse_req *req;
 	int err;
 
-	err = -EIO;
 	if (is_bad_inode(inode))
-		goto out;
+		return -EIO;
 
 	req = fuse_get_req(fc);
-	err = PTR_ERR(req);
 	if (IS_ERR(req))
-		goto out;
+		return PTR_ERR(req);
 
 	req->out.page_zeroing = 1;
 	req->num_pages = 1;
@@ -336,7 +381,12 @@ static int fuse_readpage(struct file *file, struct page *page)
 	if (!err)
 		SetPageUptodate(page);
 	fuse_invalidate_attr(inode); /* atime changed */
- out:
+	return err;
+}
+
+static int fuse_readpage(struct file *file, struct page *page)
+{
+	int err = fuse_do_readpage(file, page);
 	unlock_page(page);
 	return err;
 }
@@ -439,18 +489,19 @@ static int fuse_readpages(struct file *file, struct address_space *mapping,
 	return err;
 }
 
-static size_t fuse_send_write(struct fuse_req *req, struct file *file,
-			      struct inode *inode, loff_t pos, size_t count)
+static size_t fuse_send_write_fh(struct fuse_req *req, u64 fh,
+				 struct inode *inode, loff_t pos, size_t count,
+				 int write_flags)
 {
 	struct fuse_conn *fc = get_fuse_conn(inode);
-	struct fuse_file *ff = file->private_data;
 	struct fuse_write_in inarg;
 	struct fuse_write_out outarg;
 
 	memset(&inarg, 0, sizeof(struct fuse_write_in));
-	inarg.fh = ff->fh;
+	inarg.fh = fh;
 	inarg.offset = pos;
 	inarg.size = count;
+	inarg.write_flags = write_flags;
 	req->in.h.opcode = FUSE_WRITE;
 	req->in.h.nodeid = get_node_id(inode);
 	req->in.argpages = 1;
@@ -465,10 +516,58 @@ static size_t fuse_send_write(struct fuse_req *req, struct file *file,
 	return outarg.size;
 }
 
+static size_t fuse_send_write(struct fuse_req *req, struct file *file,
+			      struct inode *inode, loff_t pos, size_t count)
+{
+	struct fuse_file *ff = file->private_data;
+	return fuse_send_write_fh(req, ff->fh, inode, pos, count, 0);
+}
+
 static int fuse_prepare_write(struct file *file, struct page *page,
 			      unsigned offset, unsigned to)
 {
-	/* No op */
+	struct inode *inode = page->mapping->host;
+	struct fuse_conn *fc = get_fuse_conn(inode);
+	void *kaddr;
+
+	/* Without the writeback cache the write is sent in commit_write */
+	if (!fc->writeback_cache || PageUptodate(page) ||
+	    (offset == 0 && to == PAGE_CACHE_SIZE))
+		return 0;
+
+	/*
+	 * The whole page is written back later, so the part outside
+	 * this write must be valid: read it in, unless the page is
+	 * beyond the end of file
+	 */
+	if (page_offset(page) < i_size_read(inode))
+		return fuse_do_readpage(file, page);
+
+	kaddr = kmap_atomic(page, KM_USER0);
+	memset(kaddr, 0, PAGE_CACHE_SIZE);
+	flush_dcache_page(page);
+	kunmap_atomic(kaddr, KM_USER0);
+	SetPageUptodate(page);
+	return 0;
+}
+
+/*
+ * In writeback cache mode the page was made uptodate by
+ * fuse_prepare_write() or is overwritten completely, so it only needs
+ * to be dirtied
+ */
+static int fuse_commit_write_cached(struct inode *inode, struct page *page,
+				    unsigned offset, unsigned to)
+{
+	struct fuse_conn *fc = get_fuse_conn(inode);
+	loff_t pos = page_offset(page) + to;
+
+	SetPageUptodate(page);
+	spin_lock(&fc->lock);
+	if (pos > inode->i_size)
+		i_size_write(inode, pos);
+	spin_unlock(&fc->lock);
+	set_page_dirty(page);
 	return 0;
 }
 
@@ -486,6 +585,9 @@ static int fuse_commit_write(struct file *file, struct page *page,
 	if (is_bad_inode(inode))
 		return -EIO;
 
+	if (fc->writeback_cache)
+		return fuse_commit_write_cached(inode, page, offset, to);
+
 	req = fuse_get_req(fc);
 	if (IS_ERR(req))
 		return PTR_ERR(req);
@@ -512,6 +614,182 @@ static int fuse_commit_write(struct file *file, struct page *page,
 	return err;
 }
 
+/*
+ * Find a handle for writing back cached pages.  The pages must already
+ * be under writeback, so that fuse_release_write_file() waits for them
+ * before the file is released.
+ */
+static int fuse_write_fh(struct inode *inode, u64 *fhp)
+{
+	struct fuse_conn *fc = get_fuse_conn(inode);
+	struct fuse_inode *fi = get_fuse_inode(inode);
+	int found = 0;
+
+	spin_lock(&fc->lock);
+	if (!list_empty(&fi->write_files)) {
+		struct fuse_file *ff;
+		ff = list_entry(fi->write_files.next, struct fuse_file,
+				write_entry);
+		*fhp = ff->fh;
+		found = 1;
+	}
+	spin_unlock(&fc->lock);
+	return found;
+}
+
+/*
+ * Write a run of contiguous pages under writeback with one request
+ */
+static int fuse_send_writepages(struct fuse_req *req, struct inode *inode)
+{
+	struct fuse_conn *fc = get_fuse_conn(inode);
+	loff_t pos = page_offset(req->pages[0]);
+	loff_t size = i_size_read(inode);
+	size_t count = req->num_pages << PAGE_CACHE_SHIFT;
+	int redirty = 0;
+	int err = 0;
+	unsigned i;
+	u64 fh;
+
+	/* Don't extend the file with the tail of the last page */
+	if (pos + count > size)
+		count = size > pos ? size - pos : 0;
+
+	if (!fuse_write_fh(inode, &fh)) {
+		/* No file open for writing, keep the pages dirty */
+		redirty = 1;
+	} else if (count) {
+		size_t nres;
+
+		req->page_offset = 0;
+		nres = fuse_send_write_fh(req, fh, inode, pos, count,
+					  FUSE_WRITE_CACHE);
+		err = req->out.h.error;
+		if (!err && nres != count)
+			err = -EIO;
+	}
+
+	for (i = 0; i < req->num_pages; i++) {
+		struct page *page = req->pages[i];
+		if (redirty)
+			__set_page_dirty_nobuffers(page);
+		else if (err)
+			SetPageError(page);
+		end_page_writeback(page);
+	}
+	if (err)
+		set_bit(AS_EIO, &inode->i_mapping->flags);
+	fuse_put_request(fc, req);
+	fuse_invalidate_attr(inode);
+	return err;
+}
+
+static int fuse_writepage(struct page *page, struct writeback_control *wbc)
+{
+	struct inode *inode = page->mapping->host;
+	struct fuse_conn *fc = get_fuse_conn(inode);
+	struct fuse_req *req;
+
+	if (is_bad_inode(inode)) {
+		unlock_page(page);
+		return -EIO;
+	}
+
+	/*
+	 * Writing back from reclaim could deadlock if the filesystem
+	 * daemon itself is short of memory, leave it to the flusher
+	 */
+	if (wbc->for_reclaim)
+		goto redirty;
+
+	req = fuse_get_req(fc);
+	if (IS_ERR(req))
+		goto redirty;
+
+	set_page_writeback(page);
+	unlock_page(page);
+	req->num_pages = 1;
+	req->pages[0] = page;
+	return fuse_send_writepages(req, inode);
+
+ redirty:
+	__set_page_dirty_nobuffers(page);
+	unlock_page(page);
+	return 0;
+}
+
+#ifdef KERNEL_2_6_22_PLUS
+struct fuse_writepages_data {
+	struct fuse_req *req;
+	struct inode *inode;
+	int err;
+};
+
+static int fuse_writepages_fill(struct page *page,
+				struct writeback_control *wbc, void *_data)
+{
+	struct fuse_writepages_data *data = _data;
+	struct fuse_req *req = data->req;
+	struct inode *inode = data->inode;
+	struct fuse_conn *fc = get_fuse_conn(inode);
+
+	if (req &&
+	    (req->num_pages == FUSE_MAX_PAGES_PER_REQ ||
+	     (req->num_pages + 1) * PAGE_CACHE_SIZE > fc->max_write ||
+	     req->pages[req->num_pages - 1]->index + 1 != page->index)) {
+		int err = fuse_send_writepages(req, inode);
+		if (err)
+			data->err = err;
+		data->req = req = NULL;
+	}
+	if (!req) {
+		req = fuse_get_req(fc);
+		if (IS_ERR(req)) {
+			__set_page_dirty_nobuffers(page);
+			unlock_page(page);
+			return PTR_ERR(req);
+		}
+		data->req = req;
+	}
+	set_page_writeback(page);
+	unlock_page(page);
+	req->pages[req->num_pages] = page;
+	req->num_pages ++;
+	return 0;
+}
+
+/*
+ * Coalesce contiguous dirty pages into requests of up to max_write
+ * bytes
+ */
+static int fuse_writepages(struct address_space *mapping,
+			   struct writeback_control *wbc)
+{
+	struct inode *inode = mapping->host;
+	struct fuse_writepages_data data;
+	int err;
+	u64 fh;
+
+	if (is_bad_inode(inode))
+		return -EIO;
+
+	/* Nothing to write with until a file is opened for writing */
+	if (!fuse_write_fh(inode, &fh))
+		return 0;
+
+	data.req = NULL;
+	data.inode = inode;
+	data.err = 0;
+	err = write_cache_pages(mapping, wbc, fuse_writepages_fill, &data);
+	if (data.req) {
+		int err2 = fuse_send_writepages(data.req, inode);
+		if (err2)
+			data.err = err2;
+	}
+	return err ? err : data.err;
+}
+#endif
+
 static void fuse_release_user_pages(struct fuse_req *req, int write)
 {
 	unsigned i;
@@ -564,6 +842,13 @@ static ssize_t fuse_direct_io(struct file *file, const char __user *buf,
 	if (is_bad_inode(inode))
 		return -EIO;
 
+	/* Cached pages must not be overtaken by direct I/O */
+	if (fc->writeback_cache) {
+		int err = fuse_write_back(inode);
+		if (err)
+			return err;
+	}
+
 	req = fuse_get_req(fc);
 	if (IS_ERR(req))
 		return PTR_ERR(req);
@@ -652,6 +937,11 @@ static int fuse_file_mmap(struct file *file, struct vm_area_struct *vma)
 
 static int fuse_set_page_dirty(struct page *page)
 {
+	struct fuse_conn *fc = get_fuse_conn(page->mapping->host);
+
+	if (fc->writeback_cache)
+		return __set_page_dirty_nobuffers(page);
+
 	printk("fuse_set_page_dirty: should not happen\n");
 	dump_stack();
 	return 0;
@@ -882,6 +1172,10 @@ static struct file_operations fuse_direct_io_file_operations = {
 
 static struct address_space_operations fuse_file_aops  = {
 	.readpage	= fuse_readpage,
+	.writepage	= fuse_writepage,
+#ifdef KERNEL_2_6_22_PLUS
+	.writepages	= fuse_writepages,
+#endif
 	.prepare_write	= fuse_prepare_write,
 	.commit_write	= fuse_commit_write,
 	.readpages	= fuse_readpages,
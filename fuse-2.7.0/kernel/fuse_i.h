@@ -116,6 +116,9 @@
     doing the mount will be allowed to access the filesystem */
 #define FUSE_ALLOW_OTHER         (1 << 1)
 
+/** Maximum number of request queues on a connection */
+#define FUSE_MAX_QUEUES 32
+
 /** List of active connections */
 extern struct list_head fuse_conn_list;
 
@@ -134,11 +137,20 @@ struct fuse_inode {
 	/** Number of lookups on this inode */
 	u64 nlookup;
 
-	/** The request used for sending the FORGET message */
-	struct fuse_req *forget_req;
+	/** Preallocated entry used for queuing the FORGET message */
+	struct fuse_forget_link *forget;
 
 	/** Time in jiffies until the file attributes are valid */
 	u64 i_time;
+
+	/** Files open for writing, used for writing back cached pages */
+	struct list_head write_files;
+};
+
+/** A queued FORGET, linked on fc->forget_list_head */
+struct fuse_forget_link {
+	struct fuse_forget_one forget_one;
+	struct fuse_forget_link *next;
 };
 
 /** FUSE specific file data */
@@ -148,6 +160,9 @@ struct fuse_file {
 
 	/** File handle used by userspace */
 	u64 fh;
+
+	/** Entry on inode's write_files list */
+	struct list_head write_entry;
 };
 
 /** One input argument of a request */
@@ -274,7 +289,6 @@ struct fuse_req {
 
 	/** Data for asynchronous requests */
 	union {
-		struct fuse_forget_in forget_in;
 		struct fuse_release_in release_in;
 		struct fuse_init_in init_in;
 		struct fuse_init_out init_out;
@@ -307,6 +321,35 @@ struct fuse_req {
 	struct file *stolen_file;
 };
 
+/**
+ * A queue of pending requests.
+ *
+ * Requests are queued on the queue belonging to the submitting CPU,
+ * so that a daemon thread reading a cloned device bound to that CPU
+ * finds them without contending with the other readers.
+ */
+struct fuse_queue {
+	/** The list of pending requests */
+	struct list_head pending;
+
+	/** Readers bound to this queue are waiting on this */
+	wait_queue_head_t waitq;
+};
+
+/**
+ * An open instance of the fuse device.
+ *
+ * The file used for mounting, and any files cloned from it with
+ * FUSE_DEV_IOC_CLONE, each have one of these in private_data.
+ */
+struct fuse_dev {
+	/** The connection this device is attached to */
+	struct fuse_conn *fc;
+
+	/** The queue this device reads from first */
+	unsigned queue;
+};
+
 /**
  * A Fuse connection.
  *
@@ -339,11 +382,17 @@ struct fuse_conn {
 	/** Maximum write size */
 	unsigned max_write;
 
-	/** Readers of the connection are waiting on this */
+	/** All readers of the connection are waiting on this */
 	wait_queue_head_t waitq;
 
-	/** The list of pending requests */
-	struct list_head pending;
+	/** The pending request queues */
+	struct fuse_queue queues[FUSE_MAX_QUEUES];
+
+	/** Number of queues in use */
+	unsigned num_queues;
+
+	/** Number of open devices attached to this connection */
+	unsigned num_devs;
 
 	/** The list of requests being processed */
 	struct list_head processing;
@@ -357,6 +406,14 @@ struct fuse_conn {
 	/** Pending interrupts */
 	struct list_head interrupts;
 
+	/** Queued forgets.  These don't need a request each, and are
+	    sent to userspace in batches if it supports BATCH_FORGET */
+	struct fuse_forget_link forget_list_head;
+	struct fuse_forget_link *forget_list_tail;
+
+	/** Balances reading forgets against reading requests */
+	int forget_batch;
+
 	/** Flag indicating if connection is blocked.  This will be
 	    the case before the INIT reply is received, and if there
 	    are too many outstading backgrounds requests */
@@ -383,6 +440,15 @@ struct fuse_conn {
 	/** Do readpages asynchronously?  Only set in INIT */
 	unsigned async_read : 1;
 
+	/** Read directories with READDIRPLUS?  Only set in INIT */
+	unsigned do_readdirplus : 1;
+
+	/** Send forgets with BATCH_FORGET?  Only set in INIT */
+	unsigned batch_forget : 1;
+
+	/** Cache writes in the page cache?  Only set in INIT */
+	unsigned writeback_cache : 1;
+
 	/*
 	 * The following bitfields are only for optimization purposes
 	 * and hence races in setting them will not cause malfunction
@@ -485,10 +551,15 @@ struct inode *fuse_iget(struct super_block *sb, unsigned long nodeid,
 			int generation, struct fuse_attr *attr);
 
 /**
- * Send FORGET command
+ * Allocate an entry for queuing a FORGET
+ */
+struct fuse_forget_link *fuse_alloc_forget(void);
+
+/**
+ * Queue a FORGET for sending.  Takes ownership of 'forget'
  */
-void fuse_send_forget(struct fuse_conn *fc, struct fuse_req *req,
-		      unsigned long nodeid, u64 nlookup);
+void fuse_queue_forget(struct fuse_conn *fc, struct fuse_forget_link *forget,
+		       u64 nodeid, u64 nlookup);
 
 /**
  * Initialize READ or READDIR request
@@ -520,6 +591,11 @@ int fuse_release_common(struct inode *inode, struct file *file, int isdir);
 int fuse_fsync_common(struct file *file, struct dentry *de, int datasync,
 		      int isdir);
 
+/**
+ * Write back dirty pages of the inode and wait for completion
+ */
+int fuse_write_back(struct inode *inode);
+
 /**
  * Initialize file operations on a regular file
  */
@@ -622,6 +698,16 @@ struct fuse_conn *fuse_conn_get(struct fuse_conn *fc);
  */
 void fuse_conn_put(struct fuse_conn *fc);
 
+/**
+ * Allocate a device attached to the connection
+ */
+struct fuse_dev *fuse_dev_alloc(struct fuse_conn *fc);
+
+/**
+ * Free a device and release its reference to the connection
+ */
+void fuse_dev_free(struct fuse_dev *fud);
+
 /**
  * Add connection to control filesystem
  */
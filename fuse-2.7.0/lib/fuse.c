@@ -48,6 +48,8 @@ struct fuse_config {
     double attr_timeout;
     double ac_attr_timeout;
     int ac_attr_timeout_set;
+    double attr_cache_timeout;
+    double negative_cache_timeout;
     int debug;
     int hard_remove;
     int use_ino;
@@ -60,6 +62,7 @@ struct fuse_config {
     int auto_cache;
     int intr;
     int intr_signal;
+    int readdirplus;
     int help;
     char *modules;
 };
@@ -76,20 +79,104 @@ struct fusemod_so {
     int ctr;
 };
 
+/* Linear hashing: the buckets below 'split' in the lower half have
+   already been split into the upper half, so the table grows (and
+   shrinks) one bucket at a time instead of rehashing everything at once */
+struct node_table {
+    struct node **array;
+    size_t use;
+    size_t size;
+    size_t split;
+};
+
+#define NODE_TABLE_MIN_SIZE 8192
+
+/* Forgotten nodes are reclaimed once this many have accumulated, at
+   most this many per hold of f->lock */
+#define FUSE_RECLAIM_BATCH 256
+
+/* Names known not to exist, see the negative_cache option */
+struct neg_entry {
+    struct neg_entry *next;
+    fuse_ino_t parent;
+    unsigned int generation;
+    struct timespec expires;
+    char name[1];
+};
+
+struct neg_table {
+    struct neg_entry **array;
+    size_t size;
+    size_t use;
+};
+
+/*
+ * Nodes are carved out of NODE_SLAB_SIZE blocks instead of being
+ * malloc'ed one by one.  The NODE_CLASSES sizes differ in the room left
+ * after the node for its name, so that most names are stored inline;
+ * longer ones are malloc'ed.  Freed nodes are kept on a free list per
+ * class, the blocks are only released by fuse_destroy().
+ */
+#define NODE_SLAB_SIZE (64 * 1024)
+#define NODE_CLASSES 4
+#define NODE_NAME_STEP 16
+
+struct node_slab {
+    struct node_slab *next;
+};
+
+struct node_arena {
+    struct node *free[NODE_CLASSES];
+    char *next[NODE_CLASSES];
+    char *end[NODE_CLASSES];
+    struct node_slab *slabs;
+};
+
+/*
+ * f->lock comes with FUSE_LOCK_STRIPES stripe locks, so that lookups
+ * don't all serialize on a single mutex.  Changing the node tables,
+ * the paths or the caches takes f->lock and every stripe, see
+ * lock_nodes(), and that's what "holding f->lock" means below.  The
+ * lookup paths which only read those take just one stripe with
+ * lock_stripe(), and update the few counters they need to (nlookup,
+ * refctr, treelock, open_count) atomically.  Anything else, like adding
+ * a node or rebuilding a path, is retried with lock_nodes().  f->lock
+ * is always taken before the stripes.
+ *
+ * With just a stripe, the node_info of a node is only accessed under
+ * its info lock, see lock_info(), which is taken last.  Holding all
+ * the stripes keeps those threads out, so lock_nodes() is enough.
+ */
+#define FUSE_LOCK_STRIPE_BITS 4
+#define FUSE_LOCK_STRIPES (1 << FUSE_LOCK_STRIPE_BITS)
+
+/* Padded to a cache line, so that the stripes don't share one */
+union lock_stripe {
+    pthread_mutex_t lock;
+    char pad[64];
+};
+
 struct fuse {
     struct fuse_session *se;
-    struct node **name_table;
-    size_t name_table_size;
-    struct node **id_table;
-    size_t id_table_size;
+    struct node_table name_table;
+    struct node_table id_table;
+    struct neg_table neg_table;
+    unsigned int cache_generation;
     fuse_ino_t ctr;
     unsigned int generation;
     unsigned int hidectr;
     pthread_mutex_t lock;
-    pthread_rwlock_t tree_lock;
+    union lock_stripe stripes[FUSE_LOCK_STRIPES];
+    union lock_stripe info_locks[FUSE_LOCK_STRIPES];
+    pthread_cond_t tree_cond;
+    int tree_waiters;
+    unsigned int lock_seed;
     struct fuse_config conf;
     int intr_installed;
     struct fuse_fs *fs;
+    struct node *reclaim_list;
+    size_t reclaim_count;
+    struct node_arena node_arena;
 };
 
 struct lock {
@@ -99,32 +186,82 @@ struct lock {
     pid_t pid;
     uint64_t owner;
     struct lock *next;
+    /* Interval tree of the node's locks, see locks_conflict() */
+    struct lock *left;
+    struct lock *right;
+    unsigned int prio;
+    off_t max_end;
+};
+
+/* A full path, shared by the node that caches it and the requests using it */
+struct node_path {
+    int refctr;
+    size_t len;
+    char str[1];
+};
+
+/* State of a node used only with some options or on open files,
+   allocated on first use */
+struct node_info {
+    struct stat attr;
+    struct timespec attr_expires;
+    unsigned int attr_generation;
+    int cache_valid;
+    struct timespec stat_updated;
+    struct timespec mtime;
+    off_t size;
+    struct lock *locks;
 };
 
 struct node {
     struct node *name_next;
     struct node *id_next;
     fuse_ino_t nodeid;
-    unsigned int generation;
-    int refctr;
     struct node *parent;
     char *name;
     uint64_t nlookup;
+    struct node_path *path;
+    struct node_info *info;
+    struct node *reclaim_next;
+    unsigned int generation;
+    int refctr;
+    /* Bumped when path is replaced */
+    unsigned int path_seq;
+    /* The parent's path_seq when path was built */
+    unsigned int path_generation;
+    int treelock;
+    int treelock_wanted;
     int open_count;
-    int is_hidden;
-    struct timespec stat_updated;
-    struct timespec mtime;
-    off_t size;
-    int cache_valid;
-    struct lock *locks;
+    unsigned int is_hidden : 1;
+    unsigned int on_reclaim_list : 1;
+    unsigned int name_class : 2;
+    /* Inline room for the name, see struct node_arena */
+    char iname[1];
+};
+
+/*
+ * Directory entries from a filesystem ignoring the readdir offset are
+ * buffered in chunks, an entry never straddling two of them.  At most
+ * FUSE_DH_MAX_CHUNKS are used per handle, which is a window into the
+ * directory; offsets past it are filled by reading the directory
+ * again and skipping the entries before the window.
+ */
+#define FUSE_DH_CHUNK_SIZE (32 * 1024)
+#define FUSE_DH_MAX_CHUNKS 16
+
+struct fuse_dh_chunk {
+    struct fuse_dh_chunk *next;
+    unsigned len;
+    unsigned count;
+    char data[FUSE_DH_CHUNK_SIZE];
 };
 
 struct fuse_dh {
     pthread_mutex_t lock;
     struct fuse *fuse;
     fuse_req_t req;
+    /* Reply for a filesystem using offsets */
     char *contents;
-    int allocated;
     unsigned len;
     unsigned size;
     unsigned needlen;
@@ -132,6 +269,44 @@ struct fuse_dh {
     uint64_t fh;
     int error;
     fuse_ino_t nodeid;
+    /* The window, holding the entries at offsets start..end-1 */
+    struct fuse_dh_chunk *chunks;
+    struct fuse_dh_chunk *fill;
+    unsigned nfilled;
+    unsigned maxchunks;
+    off_t start;
+    off_t end;
+    off_t skip;
+    int full;
+    int eof;
+    /* Cursor, the position of the entry at offset 'pos' */
+    struct fuse_dh_chunk *pos_chunk;
+    unsigned pos_off;
+    off_t pos;
+    /* Attributes passed to the filler, in the order of the entries,
+       for readdirplus with use_ino.  A zero st_mode means none */
+    struct stat *attrs;
+    unsigned nattrs;
+    unsigned attrs_size;
+    int noattrs;
+};
+
+/* An operation started with one of the *_async methods */
+struct fuse_async {
+    void (*complete) (struct fuse_async *async, int res);
+    struct fuse *fuse;
+    fuse_req_t req;
+    fuse_ino_t ino;
+    char *path;
+    char *buf;
+    size_t size;
+    struct fuse_file_info fi;
+
+    /* Only used when the operation is waited for synchronously */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int res;
 };
 
 /* old dir handle */
@@ -246,12 +421,124 @@ static void fuse_put_module(struct fuse_module *m)
     pthread_mutex_unlock(&fuse_context_lock);
 }
 
+static void lock_nodes(struct fuse *f)
+{
+    int i;
+
+    pthread_mutex_lock(&f->lock);
+    for (i = 0; i < FUSE_LOCK_STRIPES; i++)
+        pthread_mutex_lock(&f->stripes[i].lock);
+}
+
+static void unlock_nodes(struct fuse *f)
+{
+    int i;
+
+    for (i = FUSE_LOCK_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&f->stripes[i].lock);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* Lock the stripe of the calling thread, which keeps the nodes from
+   changing under it, but not from being looked up by other threads */
+static union lock_stripe *lock_stripe(struct fuse *f)
+{
+    uint64_t hash = (uintptr_t) pthread_self() * 0x9e3779b97f4a7c15ULL;
+    union lock_stripe *s = &f->stripes[hash >> (64 - FUSE_LOCK_STRIPE_BITS)];
+
+    pthread_mutex_lock(&s->lock);
+    return s;
+}
+
+static void unlock_stripe(union lock_stripe *s)
+{
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Lock the node_info of a node, with a stripe held.  Released with
+   unlock_stripe() */
+static union lock_stripe *lock_info(struct fuse *f, struct node *node)
+{
+    uint64_t hash = (uintptr_t) node * 0x9e3779b97f4a7c15ULL;
+    union lock_stripe *s;
+
+    s = &f->info_locks[hash >> (64 - FUSE_LOCK_STRIPE_BITS)];
+    pthread_mutex_lock(&s->lock);
+    return s;
+}
+
+static int node_table_init(struct node_table *t)
+{
+    t->size = NODE_TABLE_MIN_SIZE;
+    t->array = (struct node **) calloc(1, sizeof(struct node *) * t->size);
+    if (t->array == NULL) {
+        fprintf(stderr, "fuse: memory allocation failed\n");
+        return -1;
+    }
+    t->use = 0;
+    t->split = 0;
+    return 0;
+}
+
+/* Pick the bucket for a full hash value, depending on whether its bucket
+   in the lower half has been split yet */
+static size_t node_table_bucket(struct node_table *t, size_t hash)
+{
+    size_t oldhash = hash % (t->size / 2);
+
+    if (oldhash >= t->split)
+        return oldhash;
+    else
+        return hash % t->size;
+}
+
+static int node_table_grow(struct node_table *t)
+{
+    size_t newsize = t->size * 2;
+    struct node **newarray;
+
+    newarray = (struct node **) realloc(t->array,
+                                        sizeof(struct node *) * newsize);
+    if (newarray == NULL)
+        return -1;
+
+    memset(newarray + t->size, 0, sizeof(struct node *) * t->size);
+    t->array = newarray;
+    t->size = newsize;
+    t->split = 0;
+    return 0;
+}
+
+static void node_table_shrink(struct node_table *t)
+{
+    size_t newsize = t->size / 2;
+    struct node **newarray;
+
+    if (newsize < NODE_TABLE_MIN_SIZE)
+        return;
+
+    /* The upper half is empty once every bucket has been merged back */
+    newarray = (struct node **) realloc(t->array,
+                                        sizeof(struct node *) * newsize);
+    if (newarray != NULL)
+        t->array = newarray;
+    t->size = newsize;
+    t->split = newsize / 2;
+}
+
+static size_t id_hash(struct fuse *f, fuse_ino_t nodeid)
+{
+    size_t hash = (uint32_t) nodeid * 2654435761U;
+
+    return node_table_bucket(&f->id_table, hash);
+}
+
 static struct node *get_node_nocheck(struct fuse *f, fuse_ino_t nodeid)
 {
-    size_t hash = nodeid % f->id_table_size;
+    size_t hash = id_hash(f, nodeid);
     struct node *node;
 
-    for (node = f->id_table[hash]; node != NULL; node = node->id_next)
+    for (node = f->id_table.array[hash]; node != NULL; node = node->id_next)
         if (node->nodeid == nodeid)
             return node;
 
@@ -269,33 +556,231 @@ static struct node *get_node(struct fuse *f, fuse_ino_t nodeid)
     return node;
 }
 
-static void free_node(struct node *node)
+static struct node_path *alloc_path(size_t len)
+{
+    struct node_path *p;
+
+    p = (struct node_path *) malloc(sizeof(struct node_path) + len);
+    if (p == NULL) {
+        fprintf(stderr, "fuse: memory allocation failed\n");
+        return NULL;
+    }
+    p->refctr = 1;
+    p->len = len;
+    p->str[len] = '\0';
+    return p;
+}
+
+static void get_path_ref(struct node_path *p)
+{
+    __sync_fetch_and_add(&p->refctr, 1);
+}
+
+static void put_path(struct node_path *p)
+{
+    if (__sync_sub_and_fetch(&p->refctr, 1) == 0)
+        free(p);
+}
+
+/* Release a path returned by build_path() */
+static void put_path_str(char *path)
 {
-    free(node->name);
-    free(node);
+    if (path)
+        put_path((struct node_path *)
+                 (path - offsetof(struct node_path, str)));
+}
+
+/* Drop the path cached on a node.  Cached paths of nodes below it are
+   stale too, see cached_path() */
+static void invalidate_path(struct node *node)
+{
+    if (node->path) {
+        put_path(node->path);
+        node->path = NULL;
+    }
+}
+
+static void free_locks(struct lock *l)
+{
+    while (l) {
+        struct lock *right = l->right;
+        free_locks(l->left);
+        free(l);
+        l = right;
+    }
+}
+
+static size_t node_size(unsigned int class)
+{
+    size_t size = offsetof(struct node, iname) + (class + 1) * NODE_NAME_STEP;
+    return (size + 7) & ~(size_t) 7;
+}
+
+/* Allocate a zeroed node with inline room for a name of namelen bytes */
+static struct node *alloc_node(struct fuse *f, size_t namelen)
+{
+    struct node_arena *a = &f->node_arena;
+    unsigned int class = namelen / NODE_NAME_STEP;
+    struct node *node;
+    size_t size;
+
+    if (class >= NODE_CLASSES)
+        class = 0;
+    size = node_size(class);
+    node = a->free[class];
+    if (node != NULL)
+        a->free[class] = node->name_next;
+    else {
+        if (a->next[class] == NULL ||
+            (size_t) (a->end[class] - a->next[class]) < size) {
+            struct node_slab *slab;
+
+            slab = (struct node_slab *) malloc(NODE_SLAB_SIZE);
+            if (slab == NULL)
+                return NULL;
+            slab->next = a->slabs;
+            a->slabs = slab;
+            a->next[class] = (char *) slab + sizeof(struct node_slab);
+            a->end[class] = (char *) slab + NODE_SLAB_SIZE;
+        }
+        node = (struct node *) a->next[class];
+        a->next[class] += size;
+    }
+    memset(node, 0, size);
+    node->name_class = class;
+    return node;
+}
+
+static int set_node_name(struct node *node, const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len < (node->name_class + 1) * NODE_NAME_STEP)
+        node->name = memcpy(node->iname, name, len + 1);
+    else {
+        node->name = strdup(name);
+        if (node->name == NULL)
+            return -1;
+    }
+    return 0;
+}
+
+static void free_node_name(struct node *node)
+{
+    if (node->name != node->iname)
+        free(node->name);
+    node->name = NULL;
+}
+
+static void free_node(struct fuse *f, struct node *node)
+{
+    struct node_arena *a = &f->node_arena;
+
+    if (node->info) {
+        free_locks(node->info->locks);
+        free(node->info);
+    }
+    if (node->path)
+        put_path(node->path);
+    free_node_name(node);
+    node->name_next = a->free[node->name_class];
+    a->free[node->name_class] = node;
+}
+
+static void free_node_slabs(struct fuse *f)
+{
+    struct node_slab *slab = f->node_arena.slabs;
+
+    while (slab != NULL) {
+        struct node_slab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    memset(&f->node_arena, 0, sizeof(f->node_arena));
+}
+
+/* Return the rarely needed part of a node, allocating it on first use */
+static struct node_info *get_node_info(struct node *node)
+{
+    if (node->info == NULL)
+        node->info = (struct node_info *) calloc(1, sizeof(struct node_info));
+    return node->info;
+}
+
+/* Move the nodes of the next unsplit bucket to their new bucket in the
+   upper half, doubling the table once all of them have been split */
+static void rehash_id(struct fuse *f)
+{
+    struct node_table *t = &f->id_table;
+    struct node **nodep;
+    size_t hash;
+
+    if (t->split == t->size / 2)
+        return;
+
+    hash = t->split++;
+    nodep = &t->array[hash];
+    while (*nodep != NULL) {
+        struct node *node = *nodep;
+        size_t newhash = id_hash(f, node->nodeid);
+
+        if (newhash != hash) {
+            *nodep = node->id_next;
+            node->id_next = t->array[newhash];
+            t->array[newhash] = node;
+        } else
+            nodep = &node->id_next;
+    }
+    if (t->split == t->size / 2)
+        node_table_grow(t);
+}
+
+/* Undo the last split by appending the upper bucket to its lower
+   partner, halving the table once nothing is left in the upper half */
+static void remerge_id(struct fuse *f)
+{
+    struct node_table *t = &f->id_table;
+    struct node **upper;
+    struct node **nodep;
+
+    if (t->split == 0)
+        node_table_shrink(t);
+    if (t->split == 0)
+        return;
+
+    t->split--;
+    upper = &t->array[t->split + t->size / 2];
+    for (nodep = &t->array[t->split]; *nodep != NULL;
+         nodep = &(*nodep)->id_next);
+    *nodep = *upper;
+    *upper = NULL;
 }
 
 static void unhash_id(struct fuse *f, struct node *node)
 {
-    size_t hash = node->nodeid % f->id_table_size;
-    struct node **nodep = &f->id_table[hash];
+    struct node **nodep = &f->id_table.array[id_hash(f, node->nodeid)];
 
     for (; *nodep != NULL; nodep = &(*nodep)->id_next)
         if (*nodep == node) {
             *nodep = node->id_next;
+            f->id_table.use--;
+            if (f->id_table.use < f->id_table.size / 4)
+                remerge_id(f);
             return;
         }
 }
 
 static void hash_id(struct fuse *f, struct node *node)
 {
-    size_t hash = node->nodeid % f->id_table_size;
-    node->id_next = f->id_table[hash];
-    f->id_table[hash] = node;
+    size_t hash = id_hash(f, node->nodeid);
+    node->id_next = f->id_table.array[hash];
+    f->id_table.array[hash] = node;
+    f->id_table.use++;
+    if (f->id_table.use >= f->id_table.size / 2)
+        rehash_id(f);
 }
 
-static unsigned int name_hash(struct fuse *f, fuse_ino_t parent,
-                              const char *name)
+static unsigned int string_hash(const char *name)
 {
     unsigned int hash = *name;
 
@@ -303,7 +788,57 @@ static unsigned int name_hash(struct fuse *f, fuse_ino_t parent,
         for (name += 1; *name != '\0'; name++)
             hash = (hash << 5) - hash + *name;
 
-    return (hash + parent) % f->name_table_size;
+    return hash;
+}
+
+static size_t name_hash(struct fuse *f, fuse_ino_t parent, const char *name)
+{
+    return node_table_bucket(&f->name_table, string_hash(name) + parent);
+}
+
+static void rehash_name(struct fuse *f)
+{
+    struct node_table *t = &f->name_table;
+    struct node **nodep;
+    size_t hash;
+
+    if (t->split == t->size / 2)
+        return;
+
+    hash = t->split++;
+    nodep = &t->array[hash];
+    while (*nodep != NULL) {
+        struct node *node = *nodep;
+        size_t newhash = name_hash(f, node->parent->nodeid, node->name);
+
+        if (newhash != hash) {
+            *nodep = node->name_next;
+            node->name_next = t->array[newhash];
+            t->array[newhash] = node;
+        } else
+            nodep = &node->name_next;
+    }
+    if (t->split == t->size / 2)
+        node_table_grow(t);
+}
+
+static void remerge_name(struct fuse *f)
+{
+    struct node_table *t = &f->name_table;
+    struct node **upper;
+    struct node **nodep;
+
+    if (t->split == 0)
+        node_table_shrink(t);
+    if (t->split == 0)
+        return;
+
+    t->split--;
+    upper = &t->array[t->split + t->size / 2];
+    for (nodep = &t->array[t->split]; *nodep != NULL;
+         nodep = &(*nodep)->name_next);
+    *nodep = *upper;
+    *upper = NULL;
 }
 
 static void unref_node(struct fuse *f, struct node *node);
@@ -312,15 +847,18 @@ static void unhash_name(struct fuse *f, struct node *node)
 {
     if (node->name) {
         size_t hash = name_hash(f, node->parent->nodeid, node->name);
-        struct node **nodep = &f->name_table[hash];
+        struct node **nodep = &f->name_table.array[hash];
 
         for (; *nodep != NULL; nodep = &(*nodep)->name_next)
             if (*nodep == node) {
                 *nodep = node->name_next;
                 node->name_next = NULL;
+                f->name_table.use--;
+                if (f->name_table.use < f->name_table.size / 4)
+                    remerge_name(f);
+                invalidate_path(node);
                 unref_node(f, node->parent);
-                free(node->name);
-                node->name = NULL;
+                free_node_name(node);
                 node->parent = NULL;
                 return;
             }
@@ -335,14 +873,16 @@ static int hash_name(struct fuse *f, struct node *node, fuse_ino_t parentid,
 {
     size_t hash = name_hash(f, parentid, name);
     struct node *parent = get_node(f, parentid);
-    node->name = strdup(name);
-    if (node->name == NULL)
+    if (set_node_name(node, name) == -1)
         return -1;
 
     parent->refctr ++;
     node->parent = parent;
-    node->name_next = f->name_table[hash];
-    f->name_table[hash] = node;
+    node->name_next = f->name_table.array[hash];
+    f->name_table.array[hash] = node;
+    f->name_table.use++;
+    if (f->name_table.use >= f->name_table.size / 2)
+        rehash_name(f);
     return 0;
 }
 
@@ -353,7 +893,7 @@ static void delete_node(struct fuse *f, struct node *node)
 
     assert(!node->name);
     unhash_id(f, node);
-    free_node(node);
+    free_node(f, node);
 }
 
 static void unref_node(struct fuse *f, struct node *node)
@@ -364,141 +904,744 @@ static void unref_node(struct fuse *f, struct node *node)
         delete_node(f, node);
 }
 
-static fuse_ino_t next_id(struct fuse *f)
+/* Drop a reference with only a stripe held.  Returns 0 if it is the
+   last one, which has to be dropped with unref_node() instead */
+static int unref_node_shared(struct node *node)
+{
+    int refctr = node->refctr;
+
+    while (refctr > 1) {
+        int old = __sync_val_compare_and_swap(&node->refctr, refctr,
+                                              refctr - 1);
+        if (old == refctr)
+            return 1;
+        refctr = old;
+    }
+    return 0;
+}
+
+static fuse_ino_t next_id(struct fuse *f)
+{
+    do {
+        f->ctr = (f->ctr + 1) & 0xffffffff;
+        if (!f->ctr)
+            f->generation ++;
+    } while (f->ctr == 0 || f->ctr == FUSE_UNKNOWN_INO ||
+             get_node_nocheck(f, f->ctr) != NULL);
+    return f->ctr;
+}
+
+static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
+                                const char *name)
+{
+    size_t hash = name_hash(f, parent, name);
+    struct node *node;
+
+    for (node = f->name_table.array[hash]; node != NULL;
+         node = node->name_next)
+        if (node->parent->nodeid == parent && strcmp(node->name, name) == 0)
+            return node;
+
+    return NULL;
+}
+
+static struct node *find_node(struct fuse *f, fuse_ino_t parent,
+                              const char *name)
+{
+    union lock_stripe *s;
+    struct node *node;
+
+    s = lock_stripe(f);
+    node = lookup_node(f, parent, name);
+    if (node != NULL)
+        __sync_fetch_and_add(&node->nlookup, 1);
+    unlock_stripe(s);
+    if (node != NULL)
+        return node;
+
+    lock_nodes(f);
+    node = lookup_node(f, parent, name);
+    if (node == NULL) {
+        node = alloc_node(f, strlen(name));
+        if (node == NULL)
+            goto out_err;
+
+        node->refctr = 1;
+        node->nodeid = next_id(f);
+        node->generation = f->generation;
+        if (hash_name(f, node, parent, name) == -1) {
+            free_node(f, node);
+            node = NULL;
+            goto out_err;
+        }
+        hash_id(f, node);
+    }
+    node->nlookup ++;
+ out_err:
+    unlock_nodes(f);
+    return node;
+}
+
+static struct node_path *join_path(struct node_path *dir, const char *name)
+{
+    struct node_path *p;
+    size_t namelen = strlen(name);
+    /* Only the root ends in a slash */
+    size_t dirlen = dir->len == 1 ? 0 : dir->len;
+
+    if (dirlen + 1 + namelen >= FUSE_MAX_PATH) {
+        fprintf(stderr, "fuse: path too long: ...%s\n", name);
+        return NULL;
+    }
+
+    p = alloc_path(dirlen + 1 + namelen);
+    if (p != NULL) {
+        memcpy(p->str, dir->str, dirlen);
+        p->str[dirlen] = '/';
+        memcpy(p->str + dirlen + 1, name, namelen);
+    }
+    return p;
+}
+
+/* The cached path of a node if it's still valid, or NULL.  It is valid
+   if every path up to the root is cached and was built from its
+   parent's current one, so a rename or removal only invalidates the
+   paths below the node it changed */
+static struct node_path *cached_path(struct node *node)
+{
+    struct node *n;
+
+    for (n = node; n->nodeid != FUSE_ROOT_ID; n = n->parent)
+        if (n->path == NULL || n->parent == NULL ||
+            n->path_generation != n->parent->path_seq)
+            return NULL;
+    return n->path ? node->path : NULL;
+}
+
+/* Return the cached path of a node, building it (and the paths of its
+   parents) if it's missing or stale.  Called with f->lock held, the
+   returned path is only valid until the lock is released unless a
+   reference is taken */
+static struct node_path *node_path(struct fuse *f, struct node *node)
+{
+    struct node_path *p;
+
+    if (cached_path(node))
+        return node->path;
+    if (node->path) {
+        put_path(node->path);
+        node->path = NULL;
+    }
+
+    if (node->nodeid == FUSE_ROOT_ID) {
+        p = alloc_path(1);
+        if (p == NULL)
+            return NULL;
+        p->str[0] = '/';
+    } else {
+        struct node_path *dir;
+
+        if (node->name == NULL || node->parent == NULL)
+            return NULL;
+
+        dir = node_path(f, node->parent);
+        if (dir == NULL)
+            return NULL;
+
+        p = join_path(dir, node->name);
+        if (p == NULL)
+            return NULL;
+    }
+
+    node->path = p;
+    node->path_seq++;
+    if (node->parent != NULL)
+        node->path_generation = node->parent->path_seq;
+    return p;
+}
+
+/* Append name to a referenced path, consuming the reference */
+static char *append_name(struct node_path *dir, const char *name)
+{
+    struct node_path *p;
+
+    if (name == NULL)
+        return dir->str;
+
+    p = join_path(dir, name);
+    put_path(dir);
+    return p ? p->str : NULL;
+}
+
+/* Build the path of a node, with name appended if not NULL.  This
+   doesn't lock anything, see get_path() for that */
+static char *build_path(struct fuse *f, fuse_ino_t nodeid, const char *name)
+{
+    union lock_stripe *s;
+    struct node_path *dir;
+
+    s = lock_stripe(f);
+    dir = cached_path(get_node(f, nodeid));
+    if (dir != NULL)
+        get_path_ref(dir);
+    unlock_stripe(s);
+
+    if (dir == NULL) {
+        lock_nodes(f);
+        dir = node_path(f, get_node(f, nodeid));
+        if (dir != NULL)
+            get_path_ref(dir);
+        unlock_nodes(f);
+    }
+
+    if (dir == NULL)
+        return NULL;
+    return append_name(dir, name);
+}
+
+/*
+ * Instead of locking the whole tree, requests lock the nodes they work
+ * on.  The path of a node is read locked from the node up to, but not
+ * including, the root.  Operations changing a name also write lock the
+ * node having that name, if it is known.  A write locked node only
+ * holds up requests on itself and on the nodes below it, so a rename
+ * in one directory doesn't stall the rest of the filesystem.
+ *
+ * All nodes needed by a request are taken at once or not at all, so
+ * waiting for them can't deadlock.  A writer that has to wait for the
+ * readers of a node to go away marks it wanted, which keeps new
+ * readers off until the writer got it.  Everything is protected by
+ * f->lock, and waiters sleep on f->tree_cond.  A reader whose path is
+ * free to lock only needs a stripe, see get_path_shared().
+ */
+#define TREELOCK_WRITE -1
+
+static int in_chain(struct node *node, struct node *target)
+{
+    for (; node != NULL; node = node->parent)
+        if (node == target)
+            return 1;
+    return 0;
+}
+
+static int chain_lockable(struct node *node, int reader)
+{
+    for (; node != NULL && node->nodeid != FUSE_ROOT_ID; node = node->parent)
+        if (node->treelock == TREELOCK_WRITE ||
+            (reader && node->treelock_wanted))
+            return 0;
+    return 1;
+}
+
+static void lock_chain(struct node *node)
+{
+    node->refctr++;
+    for (; node != NULL && node->nodeid != FUSE_ROOT_ID; node = node->parent)
+        node->treelock++;
+}
+
+/* lock_chain() with only a stripe held, for readers */
+static void lock_chain_shared(struct node *node)
+{
+    __sync_fetch_and_add(&node->refctr, 1);
+    for (; node != NULL && node->nodeid != FUSE_ROOT_ID; node = node->parent)
+        __sync_fetch_and_add(&node->treelock, 1);
+}
+
+static void unlock_chain(struct fuse *f, struct node *node)
+{
+    struct node *start = node;
+
+    for (; node != NULL && node->nodeid != FUSE_ROOT_ID; node = node->parent) {
+        assert(node->treelock > 0);
+        node->treelock--;
+    }
+    unref_node(f, start);
+}
+
+static void wake_tree_waiters(struct fuse *f)
+{
+    if (f->tree_waiters)
+        pthread_cond_broadcast(&f->tree_cond);
+}
+
+/* The stripes are dropped while waiting, but f->lock is held until the
+   wait begins.  So a reader which saw tree_waiters set under its stripe
+   and then broadcasts with f->lock held can't be missed */
+static void wait_tree(struct fuse *f)
+{
+    int i;
+
+    f->tree_waiters++;
+    for (i = FUSE_LOCK_STRIPES - 1; i >= 0; i--)
+        pthread_mutex_unlock(&f->stripes[i].lock);
+    pthread_cond_wait(&f->tree_cond, &f->lock);
+    for (i = 0; i < FUSE_LOCK_STRIPES; i++)
+        pthread_mutex_lock(&f->stripes[i].lock);
+    f->tree_waiters--;
+}
+
+static void want_node(struct fuse *f, struct node **wantp, struct node *node)
+{
+    if (*wantp == node)
+        return;
+    if (*wantp != NULL) {
+        if (!--(*wantp)->treelock_wanted)
+            wake_tree_waiters(f);
+        unref_node(f, *wantp);
+    }
+    *wantp = node;
+    if (node != NULL) {
+        node->refctr++;
+        node->treelock_wanted++;
+    }
+}
+
+/*
+ * Read lock the paths of dir1 and dir2 (if not zero), and write lock
+ * the nodes named wname1 and wname2 in them (if not NULL).  Called with
+ * f->lock held, which is dropped while waiting.
+ */
+static int tree_lock(struct fuse *f, fuse_ino_t dir1, const char *wname1,
+                     fuse_ino_t dir2, const char *wname2,
+                     struct node **wnode1, struct node **wnode2)
+{
+    struct node *want = NULL;
+    int reader = wname1 == NULL && wname2 == NULL;
+    uint64_t trace_start = 0;
+    int err;
+
+    while (1) {
+        struct node *n1 = get_node(f, dir1);
+        struct node *n2 = dir2 ? get_node(f, dir2) : NULL;
+        struct node *w1 = wname1 ? lookup_node(f, dir1, wname1) : NULL;
+        struct node *w2 = wname2 ? lookup_node(f, dir2, wname2) : NULL;
+        struct node *busy = NULL;
+
+        if (w2 == w1)
+            w2 = NULL;
+        /* Moving a directory below itself, or over one of its parents */
+        if (w1 != NULL && in_chain(n2, w1)) {
+            err = -EINVAL;
+            break;
+        }
+        if (w2 != NULL && in_chain(n1, w2)) {
+            err = -ENOTEMPTY;
+            break;
+        }
+
+        if (chain_lockable(n1, reader) &&
+            (n2 == NULL || chain_lockable(n2, reader))) {
+            if (w1 != NULL && w1->treelock)
+                busy = w1;
+            else if (w2 != NULL && w2->treelock)
+                busy = w2;
+            else {
+                lock_chain(n1);
+                if (n2 != NULL)
+                    lock_chain(n2);
+                if (w1 != NULL) {
+                    w1->refctr++;
+                    w1->treelock = TREELOCK_WRITE;
+                }
+                if (w2 != NULL) {
+                    w2->refctr++;
+                    w2->treelock = TREELOCK_WRITE;
+                }
+                if (wnode1 != NULL)
+                    *wnode1 = w1;
+                if (wnode2 != NULL)
+                    *wnode2 = w2;
+                err = 0;
+                break;
+            }
+        }
+
+        if (busy != NULL && busy->treelock > 0)
+            want_node(f, &want, busy);
+        if (!trace_start)
+            trace_start = fuse_trace_begin();
+        wait_tree(f);
+    }
+    want_node(f, &want, NULL);
+    fuse_trace_end("tree_lock", trace_start);
+    return err;
+}
+
+static void tree_unlock(struct fuse *f, fuse_ino_t dir1, struct node *wnode1,
+                        fuse_ino_t dir2, struct node *wnode2)
+{
+    unlock_chain(f, get_node(f, dir1));
+    if (dir2)
+        unlock_chain(f, get_node(f, dir2));
+    if (wnode1 != NULL) {
+        assert(wnode1->treelock == TREELOCK_WRITE);
+        wnode1->treelock = 0;
+        unref_node(f, wnode1);
+    }
+    if (wnode2 != NULL) {
+        assert(wnode2->treelock == TREELOCK_WRITE);
+        wnode2->treelock = 0;
+        unref_node(f, wnode2);
+    }
+    wake_tree_waiters(f);
+}
+
+static void unlock_path(struct fuse *f, fuse_ino_t nodeid, struct node *wnode)
+{
+    union lock_stripe *s;
+    struct node *node;
+    int waiters;
+
+    if (wnode != NULL) {
+        lock_nodes(f);
+        tree_unlock(f, nodeid, wnode, 0, NULL);
+        unlock_nodes(f);
+        return;
+    }
+
+    s = lock_stripe(f);
+    node = get_node(f, nodeid);
+    for (; node != NULL && node->nodeid != FUSE_ROOT_ID; node = node->parent) {
+        assert(node->treelock > 0);
+        __sync_fetch_and_sub(&node->treelock, 1);
+    }
+    node = get_node(f, nodeid);
+    if (!unref_node_shared(node)) {
+        unlock_stripe(s);
+        lock_nodes(f);
+        unref_node(f, node);
+        wake_tree_waiters(f);
+        unlock_nodes(f);
+        return;
+    }
+    waiters = f->tree_waiters;
+    unlock_stripe(s);
+    if (waiters) {
+        pthread_mutex_lock(&f->lock);
+        pthread_cond_broadcast(&f->tree_cond);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+/* Read lock the path of a node and return its cached path, if that can
+   be done with just a stripe: nothing on the path is write locked or
+   wanted, and the cached path is valid.  Returns NULL otherwise */
+static struct node_path *get_path_shared(struct fuse *f, fuse_ino_t nodeid)
+{
+    union lock_stripe *s;
+    struct node *node;
+    struct node_path *p;
+
+    s = lock_stripe(f);
+    node = get_node(f, nodeid);
+    p = cached_path(node);
+    if (p != NULL && chain_lockable(node, 1)) {
+        lock_chain_shared(node);
+        get_path_ref(p);
+    } else
+        p = NULL;
+    unlock_stripe(s);
+    return p;
+}
+
+static char *get_path_common(struct fuse *f, fuse_ino_t nodeid,
+                             const char *name, struct node **wnodep)
+{
+    uint64_t trace_start = fuse_trace_begin();
+    struct node *wnode = NULL;
+    struct node_path *dir = NULL;
+    char *path;
+
+    if (wnodep == NULL)
+        dir = get_path_shared(f, nodeid);
+    if (dir != NULL)
+        path = append_name(dir, name);
+    else {
+        lock_nodes(f);
+        tree_lock(f, nodeid, wnodep ? name : NULL, 0, NULL, &wnode, NULL);
+        unlock_nodes(f);
+
+        path = build_path(f, nodeid, name);
+    }
+    if (path == NULL)
+        unlock_path(f, nodeid, wnode);
+    else if (wnodep != NULL)
+        *wnodep = wnode;
+    fuse_trace_end("get_path", trace_start);
+    return path;
+}
+
+/* Get the path of a node (and name in it) and read lock it.  Returns
+   NULL if the node has no path, in which case nothing is locked */
+static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
+{
+    return get_path_common(f, nodeid, name, NULL);
+}
+
+static char *get_path(struct fuse *f, fuse_ino_t nodeid)
+{
+    return get_path_common(f, nodeid, NULL, NULL);
+}
+
+/* Like get_path_name(), and also write lock the node called name */
+static char *get_path_wrlock(struct fuse *f, fuse_ino_t nodeid,
+                             const char *name, struct node **wnodep)
+{
+    return get_path_common(f, nodeid, name, wnodep);
+}
+
+/* Get and lock two paths at once, for rename and link */
+static int get_path2(struct fuse *f, fuse_ino_t nodeid1, const char *name1,
+                     fuse_ino_t nodeid2, const char *name2,
+                     char **path1, char **path2,
+                     struct node **wnode1, struct node **wnode2)
+{
+    uint64_t trace_start = fuse_trace_begin();
+    struct node *w1 = NULL;
+    struct node *w2 = NULL;
+    int err;
+
+    lock_nodes(f);
+    err = tree_lock(f, nodeid1, wnode1 ? name1 : NULL,
+                    nodeid2, wnode2 ? name2 : NULL, &w1, &w2);
+    unlock_nodes(f);
+    if (err)
+        goto out;
+
+    *path1 = build_path(f, nodeid1, name1);
+    *path2 = build_path(f, nodeid2, name2);
+    if (*path1 == NULL || *path2 == NULL) {
+        put_path_str(*path1);
+        put_path_str(*path2);
+        lock_nodes(f);
+        tree_unlock(f, nodeid1, w1, nodeid2, w2);
+        unlock_nodes(f);
+        err = -ENOENT;
+        goto out;
+    }
+    if (wnode1 != NULL)
+        *wnode1 = w1;
+    if (wnode2 != NULL)
+        *wnode2 = w2;
+ out:
+    fuse_trace_end("get_path", trace_start);
+    return err;
+}
+
+/* Release a path returned by get_path() or get_path_name() */
+static void free_path(struct fuse *f, fuse_ino_t nodeid, char *path)
+{
+    if (path) {
+        put_path_str(path);
+        unlock_path(f, nodeid, NULL);
+    }
+}
+
+static void free_path_wrlock(struct fuse *f, fuse_ino_t nodeid,
+                             struct node *wnode, char *path)
+{
+    if (path) {
+        put_path_str(path);
+        unlock_path(f, nodeid, wnode);
+    }
+}
+
+static void free_path2(struct fuse *f, fuse_ino_t nodeid1, fuse_ino_t nodeid2,
+                       struct node *wnode1, struct node *wnode2,
+                       char *path1, char *path2)
 {
-    do {
-        f->ctr = (f->ctr + 1) & 0xffffffff;
-        if (!f->ctr)
-            f->generation ++;
-    } while (f->ctr == 0 || f->ctr == FUSE_UNKNOWN_INO ||
-             get_node_nocheck(f, f->ctr) != NULL);
-    return f->ctr;
+    put_path_str(path1);
+    put_path_str(path2);
+    lock_nodes(f);
+    tree_unlock(f, nodeid1, wnode1, nodeid2, wnode2);
+    unlock_nodes(f);
 }
 
-static struct node *lookup_node(struct fuse *f, fuse_ino_t parent,
-                                const char *name)
+/*
+ * Nodes whose lookup count drops to zero stay hashed and are only put
+ * on the reclaim list.  Unhashing them one by one, interleaved with
+ * the table resizing this causes, is what makes a storm of forgets
+ * expensive.  A node looked up again before it is reclaimed is simply
+ * reused.
+ */
+static void forget_node_locked(struct fuse *f, fuse_ino_t nodeid,
+                               uint64_t nlookup)
 {
-    size_t hash = name_hash(f, parent, name);
     struct node *node;
+    if (nodeid == FUSE_ROOT_ID)
+        return;
+    node = get_node(f, nodeid);
+    assert(node->nlookup >= nlookup);
+    node->nlookup -= nlookup;
+    if (!node->nlookup && !node->on_reclaim_list) {
+        node->on_reclaim_list = 1;
+        node->reclaim_next = f->reclaim_list;
+        f->reclaim_list = node;
+        f->reclaim_count++;
+    }
+}
 
-    for (node = f->name_table[hash]; node != NULL; node = node->name_next)
-        if (node->parent->nodeid == parent && strcmp(node->name, name) == 0)
-            return node;
-
-    return NULL;
+/*
+ * Free the nodes on the reclaim list which haven't been looked up
+ * again since.  The lock is dropped after every FUSE_RECLAIM_BATCH
+ * nodes, so that other requests are not held up for long.
+ */
+static void reclaim_nodes(struct fuse *f)
+{
+    struct node *list = f->reclaim_list;
+
+    f->reclaim_list = NULL;
+    f->reclaim_count = 0;
+    while (list != NULL) {
+        size_t i;
+
+        for (i = 0; list != NULL && i < FUSE_RECLAIM_BATCH; i++) {
+            struct node *node = list;
+
+            list = node->reclaim_next;
+            if (node->treelock) {
+                /* Its path is in use, leave it for the next round */
+                node->reclaim_next = f->reclaim_list;
+                f->reclaim_list = node;
+                f->reclaim_count++;
+                continue;
+            }
+            node->reclaim_next = NULL;
+            node->on_reclaim_list = 0;
+            if (!node->nlookup) {
+                unhash_name(f, node);
+                unref_node(f, node);
+            }
+        }
+        if (list != NULL) {
+            unlock_nodes(f);
+            lock_nodes(f);
+        }
+    }
 }
 
-static struct node *find_node(struct fuse *f, fuse_ino_t parent,
-                              const char *name)
+/* Drop nlookup lookups with only a stripe held.  Returns 0 if that
+   would leave none, which has to be done with forget_node_locked() */
+static int forget_node_shared(struct fuse *f, fuse_ino_t nodeid,
+                              uint64_t nlookup)
 {
+    union lock_stripe *s;
     struct node *node;
+    uint64_t old;
+    int res = 1;
 
-    pthread_mutex_lock(&f->lock);
-    node = lookup_node(f, parent, name);
-    if (node == NULL) {
-        node = (struct node *) calloc(1, sizeof(struct node));
-        if (node == NULL)
-            goto out_err;
+    if (nodeid == FUSE_ROOT_ID)
+        return 1;
+    s = lock_stripe(f);
+    node = get_node(f, nodeid);
+    old = node->nlookup;
+    while (1) {
+        uint64_t cur;
 
-        node->refctr = 1;
-        node->nodeid = next_id(f);
-        node->open_count = 0;
-        node->is_hidden = 0;
-        node->generation = f->generation;
-        if (hash_name(f, node, parent, name) == -1) {
-            free(node);
-            node = NULL;
-            goto out_err;
+        assert(old >= nlookup);
+        if (old == nlookup) {
+            res = 0;
+            break;
         }
-        hash_id(f, node);
+        cur = __sync_val_compare_and_swap(&node->nlookup, old, old - nlookup);
+        if (cur == old)
+            break;
+        old = cur;
     }
-    node->nlookup ++;
- out_err:
-    pthread_mutex_unlock(&f->lock);
-    return node;
+    unlock_stripe(s);
+    return res;
 }
 
-static char *add_name(char *buf, char *s, const char *name)
+static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
 {
-    size_t len = strlen(name);
-    s -= len;
-    if (s <= buf) {
-        fprintf(stderr, "fuse: path too long: ...%s\n", s + len);
-        return NULL;
-    }
-    strncpy(s, name, len);
-    s--;
-    *s = '/';
+    if (forget_node_shared(f, nodeid, nlookup))
+        return;
+    lock_nodes(f);
+    forget_node_locked(f, nodeid, nlookup);
+    if (f->reclaim_count >= FUSE_RECLAIM_BATCH)
+        reclaim_nodes(f);
+    unlock_nodes(f);
+}
 
-    return s;
+/*
+ * Library side cache of attributes and of names that don't exist, for
+ * filesystems that don't keep one of their own.  The attributes live
+ * in the node, under its info lock or f->lock.  The missing names are
+ * in a separate hash table keyed by parent and name, protected by
+ * f->lock.
+ */
+static void invalidate_attr(struct node *node)
+{
+    if (node->info) {
+        node->info->attr_expires.tv_sec = 0;
+        node->info->attr_expires.tv_nsec = 0;
+    }
 }
 
-static char *get_path_name(struct fuse *f, fuse_ino_t nodeid, const char *name)
+static void invalidate_attr_id(struct fuse *f, fuse_ino_t nodeid)
 {
-    char buf[FUSE_MAX_PATH];
-    char *s = buf + FUSE_MAX_PATH - 1;
-    struct node *node;
-
-    *s = '\0';
-
-    if (name != NULL) {
-        s = add_name(buf, s, name);
-        if (s == NULL)
-            return NULL;
-    }
+    struct node *node = get_node_nocheck(f, nodeid);
+    if (node != NULL)
+        invalidate_attr(node);
+}
 
-    pthread_mutex_lock(&f->lock);
-    for (node = get_node(f, nodeid); node && node->nodeid != FUSE_ROOT_ID;
-         node = node->parent) {
-        if (node->name == NULL) {
-            s = NULL;
-            break;
-        }
+static struct neg_entry **neg_find(struct fuse *f, fuse_ino_t parent,
+                                   const char *name)
+{
+    struct neg_table *t = &f->neg_table;
+    size_t hash = (string_hash(name) + parent) & (t->size - 1);
+    struct neg_entry **entp;
 
-        s = add_name(buf, s, node->name);
-        if (s == NULL)
+    for (entp = &t->array[hash]; *entp != NULL; entp = &(*entp)->next)
+        if ((*entp)->parent == parent && strcmp((*entp)->name, name) == 0)
             break;
-    }
-    pthread_mutex_unlock(&f->lock);
 
-    if (node == NULL || s == NULL)
-        return NULL;
-    else if (*s == '\0')
-        return strdup("/");
-    else
-        return strdup(s);
+    return entp;
 }
 
-static char *get_path(struct fuse *f, fuse_ino_t nodeid)
+static void neg_unlink(struct fuse *f, struct neg_entry **entp)
 {
-    return get_path_name(f, nodeid, NULL);
+    struct neg_entry *ent = *entp;
+
+    *entp = ent->next;
+    f->neg_table.use--;
+    free(ent);
 }
 
-static void forget_node(struct fuse *f, fuse_ino_t nodeid, uint64_t nlookup)
+static void neg_remove(struct fuse *f, fuse_ino_t parent, const char *name)
 {
-    struct node *node;
-    if (nodeid == FUSE_ROOT_ID)
+    struct neg_entry **entp;
+
+    if (!f->neg_table.use)
         return;
-    pthread_mutex_lock(&f->lock);
-    node = get_node(f, nodeid);
-    assert(node->nlookup >= nlookup);
-    node->nlookup -= nlookup;
-    if (!node->nlookup) {
-        unhash_name(f, node);
-        unref_node(f, node);
-    }
-    pthread_mutex_unlock(&f->lock);
+    entp = neg_find(f, parent, name);
+    if (*entp != NULL)
+        neg_unlink(f, entp);
+}
+
+static void neg_clear(struct fuse *f)
+{
+    struct neg_table *t = &f->neg_table;
+    size_t i;
+
+    for (i = 0; t->use && i < t->size; i++)
+        while (t->array[i] != NULL)
+            neg_unlink(f, &t->array[i]);
 }
 
 static void remove_node(struct fuse *f, fuse_ino_t dir, const char *name)
 {
     struct node *node;
 
-    pthread_mutex_lock(&f->lock);
+    lock_nodes(f);
     node = lookup_node(f, dir, name);
-    if (node != NULL)
+    if (node != NULL) {
+        invalidate_attr(node);
         unhash_name(f, node);
-    pthread_mutex_unlock(&f->lock);
+    }
+    invalidate_attr_id(f, dir);
+    unlock_nodes(f);
 }
 
 static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
@@ -508,7 +1651,7 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
     struct node *newnode;
     int err = 0;
 
-    pthread_mutex_lock(&f->lock);
+    lock_nodes(f);
     node  = lookup_node(f, olddir, oldname);
     newnode  = lookup_node(f, newdir, newname);
     if (node == NULL)
@@ -520,9 +1663,14 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
             err = -EBUSY;
             goto out;
         }
+        invalidate_attr(newnode);
         unhash_name(f, newnode);
     }
 
+    invalidate_attr(node);
+    invalidate_attr_id(f, olddir);
+    invalidate_attr_id(f, newdir);
+    neg_remove(f, newdir, newname);
     unhash_name(f, node);
     if (hash_name(f, node, newdir, newname) == -1) {
         err = -ENOMEM;
@@ -533,7 +1681,7 @@ static int rename_node(struct fuse *f, fuse_ino_t olddir, const char *oldname,
         node->is_hidden = 1;
 
  out:
-    pthread_mutex_unlock(&f->lock);
+    unlock_nodes(f);
     return err;
 }
 
@@ -564,6 +1712,7 @@ struct fuse_intr_data {
     pthread_t id;
     pthread_cond_t cond;
     int finished;
+    uint64_t trace_start;
 };
 
 static void fuse_interrupt(fuse_req_t req, void *d_)
@@ -607,16 +1756,19 @@ static void fuse_do_prepare_interrupt(fuse_req_t req, struct fuse_intr_data *d)
     fuse_req_interrupt_func(req, fuse_interrupt, d);
 }
 
+/* These bracket the filesystem methods, so also trace the time spent there */
 static inline void fuse_finish_interrupt(struct fuse *f, fuse_req_t req,
                                          struct fuse_intr_data *d)
 {
     if (f->conf.intr)
         fuse_do_finish_interrupt(f, req, d);
+    fuse_trace_end("fs", d->trace_start);
 }
 
 static inline void fuse_prepare_interrupt(struct fuse *f, fuse_req_t req,
                                           struct fuse_intr_data *d)
 {
+    d->trace_start = fuse_trace_begin();
     if (f->conf.intr)
         fuse_do_prepare_interrupt(req, d);
 }
@@ -742,6 +1894,47 @@ static inline int fuse_compat_statfs(struct fuse_fs *fs, const char *path,
 
 #endif /* __FreeBSD__ */
 
+void fuse_async_done(struct fuse_async *async, int res)
+{
+    async->complete(async, res);
+}
+
+static void fuse_async_wake(struct fuse_async *async, int res)
+{
+    pthread_mutex_lock(&async->lock);
+    async->res = res;
+    async->done = 1;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void fuse_async_init_wait(struct fuse_async *async)
+{
+    memset(async, 0, sizeof(struct fuse_async));
+    async->complete = fuse_async_wake;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+}
+
+/*
+ * Wait for an operation started on a layer that only implements the
+ * asynchronous method, e.g. when called from a module stacked on top
+ * of it.  'res' is the return value of the method.
+ */
+static int fuse_async_wait(struct fuse_async *async, int res)
+{
+    if (res >= 0) {
+        pthread_mutex_lock(&async->lock);
+        while (!async->done)
+            pthread_cond_wait(&async->cond, &async->lock);
+        pthread_mutex_unlock(&async->lock);
+        res = async->res;
+    }
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->lock);
+    return res;
+}
+
 int fuse_fs_getattr(struct fuse_fs *fs, const char *path, struct stat *buf)
 {
     fuse_get_context()->private_data = fs->user_data;
@@ -845,7 +2038,12 @@ int fuse_fs_read(struct fuse_fs *fs, const char *path, char *buf, size_t size,
     fuse_get_context()->private_data = fs->user_data;
     if (fs->op.read)
         return fs->op.read(path, buf, size, off, fi);
-    else
+    else if (fs->op.read_async) {
+        struct fuse_async async;
+        fuse_async_init_wait(&async);
+        return fuse_async_wait(&async, fs->op.read_async(path, buf, size,
+                                                         off, fi, &async));
+    } else
         return -ENOSYS;
 }
 
@@ -855,7 +2053,12 @@ int fuse_fs_write(struct fuse_fs *fs, const char *path, const char *buf,
     fuse_get_context()->private_data = fs->user_data;
     if (fs->op.write)
         return fs->op.write(path, buf, size, off, fi);
-    else
+    else if (fs->op.write_async) {
+        struct fuse_async async;
+        fuse_async_init_wait(&async);
+        return fuse_async_wait(&async, fs->op.write_async(path, buf, size,
+                                                          off, fi, &async));
+    } else
         return -ENOSYS;
 }
 
@@ -865,7 +2068,12 @@ int fuse_fs_fsync(struct fuse_fs *fs, const char *path, int datasync,
     fuse_get_context()->private_data = fs->user_data;
     if (fs->op.fsync)
         return fs->op.fsync(path, datasync, fi);
-    else
+    else if (fs->op.fsync_async) {
+        struct fuse_async async;
+        fuse_async_init_wait(&async);
+        return fuse_async_wait(&async, fs->op.fsync_async(path, datasync, fi,
+                                                          &async));
+    } else
         return -ENOSYS;
 }
 
@@ -1095,104 +2303,380 @@ int fuse_fs_removexattr(struct fuse_fs *fs, const char *path, const char *name)
 
 static int is_open(struct fuse *f, fuse_ino_t dir, const char *name)
 {
+    union lock_stripe *s;
     struct node *node;
     int isopen = 0;
-    pthread_mutex_lock(&f->lock);
+    s = lock_stripe(f);
     node = lookup_node(f, dir, name);
     if (node && node->open_count > 0)
         isopen = 1;
-    pthread_mutex_unlock(&f->lock);
+    unlock_stripe(s);
     return isopen;
 }
 
-static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
-                         char *newname, size_t bufsize)
+static char *hidden_name(struct fuse *f, fuse_ino_t dir, const char *oldname,
+                         char *newname, size_t bufsize)
+{
+    struct stat buf;
+    struct node *node;
+    struct node *newnode;
+    char *newpath;
+    int res;
+    int failctr = 10;
+
+    do {
+        lock_nodes(f);
+        node = lookup_node(f, dir, oldname);
+        if (node == NULL) {
+            unlock_nodes(f);
+            return NULL;
+        }
+        do {
+            f->hidectr ++;
+            snprintf(newname, bufsize, ".fuse_hidden%08x%08x",
+                     (unsigned int) node->nodeid, f->hidectr);
+            newnode = lookup_node(f, dir, newname);
+        } while(newnode);
+        unlock_nodes(f);
+
+        newpath = build_path(f, dir, newname);
+        if (!newpath)
+            break;
+
+        res = fuse_fs_getattr(f->fs, newpath, &buf);
+        if (res == -ENOENT)
+            break;
+        put_path_str(newpath);
+        newpath = NULL;
+    } while(res == 0 && --failctr);
+
+    return newpath;
+}
+
+static int hide_node(struct fuse *f, const char *oldpath,
+                     fuse_ino_t dir, const char *oldname)
+{
+    char newname[64];
+    char *newpath;
+    int err = -EBUSY;
+
+    newpath = hidden_name(f, dir, oldname, newname, sizeof(newname));
+    if (newpath) {
+        err = fuse_fs_rename(f->fs, oldpath, newpath);
+        if (!err)
+            err = rename_node(f, dir, oldname, dir, newname, 1);
+        put_path_str(newpath);
+    }
+    return err;
+}
+
+static int mtime_eq(const struct stat *stbuf, const struct timespec *ts)
+{
+    return stbuf->st_mtime == ts->tv_sec && ST_MTIM_NSEC(stbuf) == ts->tv_nsec;
+}
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+static void curr_time(struct timespec *now)
+{
+    static clockid_t clockid = CLOCK_MONOTONIC;
+    int res = clock_gettime(clockid, now);
+    if (res == -1 && errno == EINVAL) {
+        clockid = CLOCK_REALTIME;
+        res = clock_gettime(clockid, now);
+    }
+    if (res == -1) {
+        perror("fuse: clock_gettime");
+        abort();
+    }
+}
+
+static void update_stat(struct node *node, const struct stat *stbuf)
+{
+    struct node_info *info = get_node_info(node);
+
+    if (info == NULL)
+        return;
+    if (info->cache_valid && (!mtime_eq(stbuf, &info->mtime) ||
+                              stbuf->st_size != info->size))
+        info->cache_valid = 0;
+    info->mtime.tv_sec = stbuf->st_mtime;
+    info->mtime.tv_nsec = ST_MTIM_NSEC(stbuf);
+    info->size = stbuf->st_size;
+    curr_time(&info->stat_updated);
+}
+
+static void set_expires(struct timespec *ts, double timeout)
+{
+    curr_time(ts);
+    ts->tv_sec += (time_t) timeout;
+    ts->tv_nsec += (long) ((timeout - (time_t) timeout) * 1000000000.0);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int is_expired(const struct timespec *expires,
+                      const struct timespec *now)
+{
+    return now->tv_sec > expires->tv_sec ||
+        (now->tv_sec == expires->tv_sec && now->tv_nsec >= expires->tv_nsec);
+}
+
+static void cache_attr(struct fuse *f, struct node *node,
+                       const struct stat *stbuf)
+{
+    struct node_info *info;
+
+    if (f->conf.attr_cache_timeout <= 0.0)
+        return;
+    info = get_node_info(node);
+    if (info == NULL)
+        return;
+    info->attr = *stbuf;
+    info->attr_generation = f->cache_generation;
+    set_expires(&info->attr_expires, f->conf.attr_cache_timeout);
+}
+
+/* A node_info that was never filled has expired at time zero */
+static int cached_attr(struct fuse *f, struct node *node, struct stat *stbuf)
+{
+    struct node_info *info = node->info;
+    struct timespec now;
+
+    if (info == NULL || info->attr_generation != f->cache_generation)
+        return 0;
+    curr_time(&now);
+    if (is_expired(&info->attr_expires, &now))
+        return 0;
+    *stbuf = info->attr;
+    return 1;
+}
+
+/* Drop the expired entries, and if that didn't make enough room,
+   double the size of the table */
+static void neg_table_resize(struct fuse *f)
+{
+    struct neg_table *t = &f->neg_table;
+    struct neg_entry **newarray;
+    size_t newsize;
+    struct timespec now;
+    size_t i;
+
+    curr_time(&now);
+    for (i = 0; i < t->size; i++) {
+        struct neg_entry **entp = &t->array[i];
+        while (*entp != NULL) {
+            if (is_expired(&(*entp)->expires, &now))
+                neg_unlink(f, entp);
+            else
+                entp = &(*entp)->next;
+        }
+    }
+    if (t->size && t->use < t->size / 2)
+        return;
+
+    newsize = t->size ? t->size * 2 : 64;
+    newarray = (struct neg_entry **) calloc(newsize, sizeof(newarray[0]));
+    if (newarray == NULL)
+        return;
+    for (i = 0; i < t->size; i++) {
+        while (t->array[i] != NULL) {
+            struct neg_entry *ent = t->array[i];
+            size_t hash = (string_hash(ent->name) + ent->parent) &
+                (newsize - 1);
+            t->array[i] = ent->next;
+            ent->next = newarray[hash];
+            newarray[hash] = ent;
+        }
+    }
+    free(t->array);
+    t->array = newarray;
+    t->size = newsize;
+}
+
+static void cache_negative(struct fuse *f, fuse_ino_t parent,
+                           const char *name)
+{
+    struct neg_table *t = &f->neg_table;
+    struct node *pnode = get_node_nocheck(f, parent);
+    struct neg_entry **entp;
+    struct neg_entry *ent;
+
+    if (pnode == NULL)
+        return;
+    if (t->use >= t->size)
+        neg_table_resize(f);
+    if (!t->size)
+        return;
+
+    entp = neg_find(f, parent, name);
+    ent = *entp;
+    if (ent == NULL) {
+        ent = (struct neg_entry *) malloc(sizeof(struct neg_entry) +
+                                          strlen(name));
+        if (ent == NULL)
+            return;
+        strcpy(ent->name, name);
+        ent->parent = parent;
+        ent->next = NULL;
+        *entp = ent;
+        t->use++;
+    }
+    ent->generation = pnode->generation;
+    set_expires(&ent->expires, f->conf.negative_cache_timeout);
+}
+
+/* The parent's generation tells if its node ID got reused since.  This
+   only reads the table, so that it can be called with just a stripe
+   held; stale entries are overwritten or dropped by cache_negative() */
+static int cached_negative(struct fuse *f, fuse_ino_t parent,
+                           const char *name)
+{
+    struct neg_entry **entp;
+    struct node *pnode;
+    struct timespec now;
+
+    if (!f->neg_table.use)
+        return 0;
+    entp = neg_find(f, parent, name);
+    if (*entp == NULL)
+        return 0;
+    pnode = get_node_nocheck(f, parent);
+    curr_time(&now);
+    if (pnode == NULL || (*entp)->generation != pnode->generation ||
+        is_expired(&(*entp)->expires, &now))
+        return 0;
+    return 1;
+}
+
+static int cache_enabled(struct fuse *f)
 {
-    struct stat buf;
-    struct node *node;
-    struct node *newnode;
-    char *newpath;
-    int res;
-    int failctr = 10;
+    return f->conf.attr_cache_timeout > 0.0 ||
+        f->conf.negative_cache_timeout > 0.0;
+}
 
-    do {
-        pthread_mutex_lock(&f->lock);
-        node = lookup_node(f, dir, oldname);
-        if (node == NULL) {
-            pthread_mutex_unlock(&f->lock);
-            return NULL;
-        }
-        do {
-            f->hidectr ++;
-            snprintf(newname, bufsize, ".fuse_hidden%08x%08x",
-                     (unsigned int) node->nodeid, f->hidectr);
-            newnode = lookup_node(f, dir, newname);
-        } while(newnode);
-        pthread_mutex_unlock(&f->lock);
+static void cache_invalidate(struct fuse *f, fuse_ino_t nodeid)
+{
+    if (f->conf.attr_cache_timeout > 0.0) {
+        union lock_stripe *s = lock_stripe(f);
+        struct node *node = get_node_nocheck(f, nodeid);
 
-        newpath = get_path_name(f, dir, newname);
-        if (!newpath)
-            break;
+        if (node != NULL) {
+            union lock_stripe *i = lock_info(f, node);
+            invalidate_attr(node);
+            unlock_stripe(i);
+        }
+        unlock_stripe(s);
+    }
+}
 
-        res = fuse_fs_getattr(f->fs, newpath, &buf);
-        if (res == -ENOENT)
-            break;
-        free(newpath);
-        newpath = NULL;
-    } while(res == 0 && --failctr);
+/* Update the cached attributes of a node with ones just fetched */
+static void cache_update(struct fuse *f, fuse_ino_t nodeid,
+                         const struct stat *stbuf)
+{
+    union lock_stripe *s;
+    union lock_stripe *i;
+    struct node *node;
 
-    return newpath;
+    if (!f->conf.auto_cache && f->conf.attr_cache_timeout <= 0.0)
+        return;
+    s = lock_stripe(f);
+    node = get_node(f, nodeid);
+    i = lock_info(f, node);
+    if (f->conf.auto_cache)
+        update_stat(node, stbuf);
+    cache_attr(f, node, stbuf);
+    unlock_stripe(i);
+    unlock_stripe(s);
+}
+
+/* A name was created in parent, which changes the parent too */
+static void cache_created(struct fuse *f, fuse_ino_t parent, const char *name)
+{
+    if (cache_enabled(f)) {
+        lock_nodes(f);
+        neg_remove(f, parent, name);
+        invalidate_attr_id(f, parent);
+        unlock_nodes(f);
+    }
 }
 
-static int hide_node(struct fuse *f, const char *oldpath,
-                     fuse_ino_t dir, const char *oldname)
+static void cache_removed(struct fuse *f, fuse_ino_t parent, const char *name)
 {
-    char newname[64];
-    char *newpath;
-    int err = -EBUSY;
-
-    newpath = hidden_name(f, dir, oldname, newname, sizeof(newname));
-    if (newpath) {
-        err = fuse_fs_rename(f->fs, oldpath, newpath);
-        if (!err)
-            err = rename_node(f, dir, oldname, dir, newname, 1);
-        free(newpath);
+    if (f->conf.negative_cache_timeout > 0.0) {
+        lock_nodes(f);
+        cache_negative(f, parent, name);
+        unlock_nodes(f);
     }
-    return err;
 }
 
-static int mtime_eq(const struct stat *stbuf, const struct timespec *ts)
+static void fill_entry(struct fuse *f, struct node *node,
+                       struct fuse_entry_param *e)
 {
-    return stbuf->st_mtime == ts->tv_sec && ST_MTIM_NSEC(stbuf) == ts->tv_nsec;
+    e->ino = node->nodeid;
+    e->generation = node->generation;
+    e->entry_timeout = f->conf.entry_timeout;
+    e->attr_timeout = f->conf.attr_timeout;
+    set_stat(f, e->ino, &e->attr);
+    if (f->conf.debug)
+        fprintf(stderr, "   NODEID: %lu\n", (unsigned long) e->ino);
 }
 
-#ifndef CLOCK_MONOTONIC
-#define CLOCK_MONOTONIC CLOCK_REALTIME
-#endif
+/*
+ * Answer a lookup from the cache, without building the path.  Returns
+ * 1 and sets *errp if the answer was found, taking a lookup reference
+ * on the node just like find_node() does.
+ */
+static int lookup_cached(struct fuse *f, fuse_ino_t parent, const char *name,
+                         struct fuse_entry_param *e, int *errp)
+{
+    union lock_stripe *s;
+    struct node *node;
+    int found = 0;
 
-static void curr_time(struct timespec *now)
-{
-    static clockid_t clockid = CLOCK_MONOTONIC;
-    int res = clock_gettime(clockid, now);
-    if (res == -1 && errno == EINVAL) {
-        clockid = CLOCK_REALTIME;
-        res = clock_gettime(clockid, now);
-    }
-    if (res == -1) {
-        perror("fuse: clock_gettime");
-        abort();
+    if (!cache_enabled(f))
+        return 0;
+
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    s = lock_stripe(f);
+    node = lookup_node(f, parent, name);
+    if (node != NULL) {
+        union lock_stripe *i = lock_info(f, node);
+        if (cached_attr(f, node, &e->attr)) {
+            __sync_fetch_and_add(&node->nlookup, 1);
+            found = 1;
+            *errp = 0;
+        }
+        unlock_stripe(i);
+    } else if (cached_negative(f, parent, name)) {
+        found = 1;
+        *errp = -ENOENT;
     }
+    unlock_stripe(s);
+
+    if (found && !*errp)
+        fill_entry(f, node, e);
+    return found;
 }
 
-static void update_stat(struct node *node, const struct stat *stbuf)
+/* Take a lookup reference on the node called name, whose attributes
+   are in e->attr, and fill in the rest of e */
+static int lookup_found(struct fuse *f, fuse_ino_t nodeid, const char *name,
+                        struct fuse_entry_param *e)
 {
-    if (node->cache_valid && (!mtime_eq(stbuf, &node->mtime) ||
-                              stbuf->st_size != node->size))
-        node->cache_valid = 0;
-    node->mtime.tv_sec = stbuf->st_mtime;
-    node->mtime.tv_nsec = ST_MTIM_NSEC(stbuf);
-    node->size = stbuf->st_size;
-    curr_time(&node->stat_updated);
+    struct node *node;
+
+    node = find_node(f, nodeid, name);
+    if (node == NULL)
+        return -ENOMEM;
+
+    cache_update(f, node->nodeid, &e->attr);
+    fill_entry(f, node, e);
+    return 0;
 }
 
 static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
@@ -1206,26 +2690,12 @@ static int lookup_path(struct fuse *f, fuse_ino_t nodeid,
         res = fuse_fs_fgetattr(f->fs, path, &e->attr, fi);
     else
         res = fuse_fs_getattr(f->fs, path, &e->attr);
-    if (res == 0) {
-        struct node *node;
-
-        node = find_node(f, nodeid, name);
-        if (node == NULL)
-            res = -ENOMEM;
-        else {
-            e->ino = node->nodeid;
-            e->generation = node->generation;
-            e->entry_timeout = f->conf.entry_timeout;
-            e->attr_timeout = f->conf.attr_timeout;
-            if (f->conf.auto_cache) {
-                pthread_mutex_lock(&f->lock);
-                update_stat(node, &e->attr);
-                pthread_mutex_unlock(&f->lock);
-            }
-            set_stat(f, e->ino, &e->attr);
-            if (f->conf.debug)
-                fprintf(stderr, "   NODEID: %lu\n", (unsigned long) e->ino);
-        }
+    if (res == 0)
+        res = lookup_found(f, nodeid, name, e);
+    else if (res == -ENOENT && f->conf.negative_cache_timeout > 0.0) {
+        lock_nodes(f);
+        cache_negative(f, nodeid, name);
+        unlock_nodes(f);
     }
     return res;
 }
@@ -1326,6 +2796,8 @@ static void fuse_lib_init(void *data, struct fuse_conn_info *conn)
 
     memset(c, 0, sizeof(*c));
     c->ctx.fuse = f;
+    if (!f->conf.readdirplus)
+        conn->readdirplus = 0;
     fuse_fs_init(f->fs, conn);
 }
 
@@ -1358,8 +2830,17 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
     char *path;
     int err;
 
+    if (lookup_cached(f, parent, name, &e, &err)) {
+        if (err == -ENOENT && f->conf.negative_timeout != 0.0) {
+            e.ino = 0;
+            e.entry_timeout = f->conf.negative_timeout;
+            err = 0;
+        }
+        reply_entry(req, &e, err);
+        return;
+    }
+
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path_name(f, parent, name);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1373,9 +2854,8 @@ static void fuse_lib_lookup(fuse_req_t req, fuse_ino_t parent,
             err = 0;
         }
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, parent, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_entry(req, &e, err);
 }
 
@@ -1389,6 +2869,24 @@ static void fuse_lib_forget(fuse_req_t req, fuse_ino_t ino,
     fuse_reply_none(req);
 }
 
+static void fuse_lib_forget_multi(fuse_req_t req, size_t count,
+                                  struct fuse_forget_data *forgets)
+{
+    struct fuse *f = req_fuse(req);
+    size_t i;
+
+    if (f->conf.debug)
+        fprintf(stderr, "BATCH_FORGET %zu\n", count);
+
+    lock_nodes(f);
+    for (i = 0; i < count; i++)
+        forget_node_locked(f, forgets[i].ino, forgets[i].nlookup);
+    if (f->reclaim_count >= FUSE_RECLAIM_BATCH)
+        reclaim_nodes(f);
+    unlock_nodes(f);
+    fuse_reply_none(req);
+}
+
 static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
                              struct fuse_file_info *fi)
 {
@@ -1400,23 +2898,36 @@ static void fuse_lib_getattr(fuse_req_t req, fuse_ino_t ino,
     (void) fi;
     memset(&buf, 0, sizeof(buf));
 
+    if (f->conf.attr_cache_timeout > 0.0) {
+        union lock_stripe *s;
+        union lock_stripe *i;
+        struct node *node;
+        int found;
+
+        s = lock_stripe(f);
+        node = get_node(f, ino);
+        i = lock_info(f, node);
+        found = cached_attr(f, node, &buf);
+        unlock_stripe(i);
+        unlock_stripe(s);
+        if (found) {
+            set_stat(f, ino, &buf);
+            fuse_reply_attr(req, &buf, f->conf.attr_timeout);
+            return;
+        }
+    }
+
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_getattr(f->fs, path, &buf);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     if (!err) {
-        if (f->conf.auto_cache) {
-            pthread_mutex_lock(&f->lock);
-            update_stat(get_node(f, ino), &buf);
-            pthread_mutex_unlock(&f->lock);
-        }
+        cache_update(f, ino, &buf);
         set_stat(f, ino, &buf);
         fuse_reply_attr(req, &buf, f->conf.attr_timeout);
     } else
@@ -1440,7 +2951,6 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1473,19 +2983,17 @@ static void fuse_lib_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         if (!err)
             err = fuse_fs_getattr(f->fs,  path, &buf);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     if (!err) {
-        if (f->conf.auto_cache) {
-            pthread_mutex_lock(&f->lock);
-            update_stat(get_node(f, ino), &buf);
-            pthread_mutex_unlock(&f->lock);
-        }
+        cache_update(f, ino, &buf);
         set_stat(f, ino, &buf);
         fuse_reply_attr(req, &buf, f->conf.attr_timeout);
-    } else
+    } else {
+        /* Some of the attributes may have been changed nevertheless */
+        cache_invalidate(f, ino);
         reply_err(req, err);
+    }
 }
 
 static void fuse_lib_access(fuse_req_t req, fuse_ino_t ino, int mask)
@@ -1495,7 +3003,6 @@ static void fuse_lib_access(fuse_req_t req, fuse_ino_t ino, int mask)
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1504,9 +3011,8 @@ static void fuse_lib_access(fuse_req_t req, fuse_ino_t ino, int mask)
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_access(f->fs, path, mask);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
@@ -1518,16 +3024,14 @@ static void fuse_lib_readlink(fuse_req_t req, fuse_ino_t ino)
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_readlink(f->fs, path, linkname, sizeof(linkname));
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     if (!err) {
         linkname[PATH_MAX] = '\0';
         fuse_reply_readlink(req, linkname);
@@ -1544,7 +3048,6 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path_name(f, parent, name);
     if (path) {
         struct fuse_intr_data d;
@@ -1559,19 +3062,21 @@ static void fuse_lib_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
             fi.flags = O_CREAT | O_EXCL | O_WRONLY;
             err = fuse_fs_create(f->fs, path, mode, &fi);
             if (!err) {
+                cache_created(f, parent, name);
                 err = lookup_path(f, parent, name, path, &e, &fi);
                 fuse_fs_release(f->fs, path, &fi);
             }
         }
         if (err == -ENOSYS) {
             err = fuse_fs_mknod(f->fs, path, mode, rdev);
-            if (!err)
+            if (!err) {
+                cache_created(f, parent, name);
                 err = lookup_path(f, parent, name, path, &e, NULL);
+            }
         }
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, parent, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_entry(req, &e, err);
 }
 
@@ -1584,7 +3089,6 @@ static void fuse_lib_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path_name(f, parent, name);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1592,12 +3096,13 @@ static void fuse_lib_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
             fprintf(stderr, "MKDIR %s\n", path);
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_mkdir(f->fs, path, mode);
-        if (!err)
+        if (!err) {
+            cache_created(f, parent, name);
             err = lookup_path(f, parent, name, path, &e, NULL);
+        }
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, parent, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_entry(req, &e, err);
 }
 
@@ -1605,12 +3110,12 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
                             const char *name)
 {
     struct fuse *f = req_fuse_prepare(req);
+    struct node *wnode;
     char *path;
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_wrlock(&f->tree_lock);
-    path = get_path_name(f, parent, name);
+    path = get_path_wrlock(f, parent, name, &wnode);
     if (path != NULL) {
         struct fuse_intr_data d;
         if (f->conf.debug)
@@ -1623,22 +3128,23 @@ static void fuse_lib_unlink(fuse_req_t req, fuse_ino_t parent,
             if (!err)
                 remove_node(f, parent, name);
         }
+        if (!err)
+            cache_removed(f, parent, name);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path_wrlock(f, parent, wnode, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
 static void fuse_lib_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
     struct fuse *f = req_fuse_prepare(req);
+    struct node *wnode;
     char *path;
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_wrlock(&f->tree_lock);
-    path = get_path_name(f, parent, name);
+    path = get_path_wrlock(f, parent, name, &wnode);
     if (path != NULL) {
         struct fuse_intr_data d;
         if (f->conf.debug)
@@ -1646,11 +3152,12 @@ static void fuse_lib_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_rmdir(f->fs, path);
         fuse_finish_interrupt(f, req, &d);
-        if (!err)
+        if (!err) {
             remove_node(f, parent, name);
-        free(path);
+            cache_removed(f, parent, name);
+        }
+        free_path_wrlock(f, parent, wnode, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
@@ -1663,7 +3170,6 @@ static void fuse_lib_symlink(fuse_req_t req, const char *linkname,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path_name(f, parent, name);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1671,12 +3177,13 @@ static void fuse_lib_symlink(fuse_req_t req, const char *linkname,
             fprintf(stderr, "SYMLINK %s\n", path);
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_symlink(f->fs, linkname, path);
-        if (!err)
+        if (!err) {
+            cache_created(f, parent, name);
             err = lookup_path(f, parent, name, path, &e, NULL);
+        }
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, parent, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_entry(req, &e, err);
 }
 
@@ -1685,34 +3192,31 @@ static void fuse_lib_rename(fuse_req_t req, fuse_ino_t olddir,
                             const char *newname)
 {
     struct fuse *f = req_fuse_prepare(req);
+    struct node *wnode1;
+    struct node *wnode2;
     char *oldpath;
     char *newpath;
     int err;
 
-    err = -ENOENT;
-    pthread_rwlock_wrlock(&f->tree_lock);
-    oldpath = get_path_name(f, olddir, oldname);
-    if (oldpath != NULL) {
-        newpath = get_path_name(f, newdir, newname);
-        if (newpath != NULL) {
-            struct fuse_intr_data d;
-            if (f->conf.debug)
-                fprintf(stderr, "RENAME %s -> %s\n", oldpath, newpath);
-            err = 0;
-            fuse_prepare_interrupt(f, req, &d);
-            if (!f->conf.hard_remove && is_open(f, newdir, newname))
-                err = hide_node(f, newpath, newdir, newname);
-            if (!err) {
-                err = fuse_fs_rename(f->fs, oldpath, newpath);
-                if (!err)
-                    err = rename_node(f, olddir, oldname, newdir, newname, 0);
-            }
-            fuse_finish_interrupt(f, req, &d);
-            free(newpath);
+    err = get_path2(f, olddir, oldname, newdir, newname,
+                    &oldpath, &newpath, &wnode1, &wnode2);
+    if (!err) {
+        struct fuse_intr_data d;
+        if (f->conf.debug)
+            fprintf(stderr, "RENAME %s -> %s\n", oldpath, newpath);
+        fuse_prepare_interrupt(f, req, &d);
+        if (!f->conf.hard_remove && is_open(f, newdir, newname))
+            err = hide_node(f, newpath, newdir, newname);
+        if (!err) {
+            err = fuse_fs_rename(f->fs, oldpath, newpath);
+            if (!err)
+                err = rename_node(f, olddir, oldname, newdir, newname, 0);
+            if (!err)
+                cache_removed(f, olddir, oldname);
         }
-        free(oldpath);
+        fuse_finish_interrupt(f, req, &d);
+        free_path2(f, olddir, newdir, wnode1, wnode2, oldpath, newpath);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
@@ -1725,37 +3229,55 @@ static void fuse_lib_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
     char *newpath;
     int err;
 
-    err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
-    oldpath = get_path(f, ino);
-    if (oldpath != NULL) {
-        newpath =  get_path_name(f, newparent, newname);
-        if (newpath != NULL) {
-            struct fuse_intr_data d;
-            if (f->conf.debug)
-                fprintf(stderr, "LINK %s\n", newpath);
-            fuse_prepare_interrupt(f, req, &d);
-            err = fuse_fs_link(f->fs, oldpath, newpath);
-            if (!err)
-                err = lookup_path(f, newparent, newname, newpath, &e, NULL);
-            fuse_finish_interrupt(f, req, &d);
-            free(newpath);
+    err = get_path2(f, ino, NULL, newparent, newname,
+                    &oldpath, &newpath, NULL, NULL);
+    if (!err) {
+        struct fuse_intr_data d;
+        if (f->conf.debug)
+            fprintf(stderr, "LINK %s\n", newpath);
+        fuse_prepare_interrupt(f, req, &d);
+        err = fuse_fs_link(f->fs, oldpath, newpath);
+        if (!err) {
+            /* The link count of the target changed */
+            cache_invalidate(f, ino);
+            cache_created(f, newparent, newname);
+            err = lookup_path(f, newparent, newname, newpath, &e, NULL);
         }
-        free(oldpath);
+        fuse_finish_interrupt(f, req, &d);
+        free_path2(f, ino, newparent, NULL, NULL, oldpath, newpath);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_entry(req, &e, err);
 }
 
+static void open_count_inc(struct fuse *f, fuse_ino_t ino)
+{
+    union lock_stripe *s = lock_stripe(f);
+
+    __sync_fetch_and_add(&get_node(f, ino)->open_count, 1);
+    unlock_stripe(s);
+}
+
 static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
                             struct fuse_file_info *fi)
 {
+    union lock_stripe *s;
     struct node *node;
     int unlink_hidden = 0;
 
     fuse_fs_release(f->fs, path ? path : "-", fi);
 
-    pthread_mutex_lock(&f->lock);
+    /* is_hidden is only set with f->lock held */
+    s = lock_stripe(f);
+    node = get_node(f, ino);
+    if (!node->is_hidden) {
+        assert(node->open_count > 0);
+        __sync_fetch_and_sub(&node->open_count, 1);
+        unlock_stripe(s);
+        return;
+    }
+    unlock_stripe(s);
+
+    lock_nodes(f);
     node = get_node(f, ino);
     assert(node->open_count > 0);
     --node->open_count;
@@ -1763,7 +3285,7 @@ static void fuse_do_release(struct fuse *f, fuse_ino_t ino, const char *path,
         unlink_hidden = 1;
         node->is_hidden = 0;
     }
-    pthread_mutex_unlock(&f->lock);
+    unlock_nodes(f);
 
     if(unlink_hidden && path)
         fuse_fs_unlink(f->fs, path);
@@ -1780,12 +3302,12 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path_name(f, parent, name);
     if (path) {
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_create(f->fs, path, mode, fi);
         if (!err) {
+            cache_created(f, parent, name);
             err = lookup_path(f, parent, name, path, &e, fi);
             if (err)
                 fuse_fs_release(f->fs, path, fi);
@@ -1804,9 +3326,7 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
         fuse_finish_interrupt(f, req, &d);
     }
     if (!err) {
-        pthread_mutex_lock(&f->lock);
-        get_node(f, e.ino)->open_count++;
-        pthread_mutex_unlock(&f->lock);
+        open_count_inc(f, e.ino);
         if (fuse_reply_create(req, &e, fi) == -ENOENT) {
             /* The open syscall was interrupted, so it must be cancelled */
             fuse_prepare_interrupt(f, req, &d);
@@ -1821,9 +3341,8 @@ static void fuse_lib_create(fuse_req_t req, fuse_ino_t parent,
         reply_err(req, err);
 
     if (path)
-        free(path);
+        free_path(f, parent, path);
 
-    pthread_rwlock_unlock(&f->tree_lock);
 }
 
 static double diff_timespec(const struct timespec *t1,
@@ -1836,31 +3355,43 @@ static double diff_timespec(const struct timespec *t1,
 static void open_auto_cache(struct fuse *f, fuse_ino_t ino, const char *path,
                             struct fuse_file_info *fi)
 {
+    union lock_stripe *s;
+    union lock_stripe *i;
     struct node *node;
+    struct node_info *info;
 
-    pthread_mutex_lock(&f->lock);
+    s = lock_stripe(f);
     node = get_node(f, ino);
-    if (node->cache_valid) {
+    i = lock_info(f, node);
+    info = get_node_info(node);
+    if (info == NULL)
+        goto out;
+    if (info->cache_valid) {
         struct timespec now;
 
         curr_time(&now);
-        if (diff_timespec(&now, &node->stat_updated) > f->conf.ac_attr_timeout) {
+        if (diff_timespec(&now, &info->stat_updated) > f->conf.ac_attr_timeout) {
             struct stat stbuf;
             int err;
-            pthread_mutex_unlock(&f->lock);
+            /* The node is kept by the path lock of the open */
+            unlock_stripe(i);
+            unlock_stripe(s);
             err = fuse_fs_fgetattr(f->fs, path, &stbuf, fi);
-            pthread_mutex_lock(&f->lock);
+            s = lock_stripe(f);
+            i = lock_info(f, node);
             if (!err)
                 update_stat(node, &stbuf);
             else
-                node->cache_valid = 0;
+                info->cache_valid = 0;
         }
     }
-    if (node->cache_valid)
+    if (info->cache_valid)
         fi->keep_cache = 1;
 
-    node->cache_valid = 1;
-    pthread_mutex_unlock(&f->lock);
+    info->cache_valid = 1;
+ out:
+    unlock_stripe(i);
+    unlock_stripe(s);
 }
 
 static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
@@ -1872,12 +3403,13 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
     int err = 0;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path) {
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_open(f->fs, path, fi);
         if (!err) {
+            if (fi->flags & O_TRUNC)
+                cache_invalidate(f, ino);
             if (f->conf.direct_io)
                 fi->direct_io = 1;
             if (f->conf.kernel_cache)
@@ -1889,9 +3421,7 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
         fuse_finish_interrupt(f, req, &d);
     }
     if (!err) {
-        pthread_mutex_lock(&f->lock);
-        get_node(f, ino)->open_count++;
-        pthread_mutex_unlock(&f->lock);
+        open_count_inc(f, ino);
         if (fuse_reply_open(req, fi) == -ENOENT) {
             /* The open syscall was interrupted, so it must be cancelled */
             fuse_prepare_interrupt(f, req, &d);
@@ -1905,8 +3435,106 @@ static void fuse_lib_open(fuse_req_t req, fuse_ino_t ino,
         reply_err(req, err);
 
     if (path)
-        free(path);
-    pthread_rwlock_unlock(&f->tree_lock);
+        free_path(f, ino, path);
+}
+
+/*
+ * The asynchronous methods are called with the path locked, just like
+ * the synchronous ones, but it is unlocked as soon as they return.
+ * The path and the buffer are owned by the fuse_async object and
+ * freed on completion.
+ *
+ * Completion may run in any thread, and takes a lock stripe to update
+ * the attribute cache, see cache_invalidate().  No stripe is ever held
+ * while calling the filesystem, so that can't deadlock with locks of
+ * its own held by the completing thread.
+ */
+static struct fuse_async *fuse_async_new(struct fuse *f, fuse_req_t req,
+                                         fuse_ino_t ino,
+                                         struct fuse_file_info *fi,
+                                         void (*complete) (struct fuse_async *,
+                                                           int))
+{
+    struct fuse_async *async;
+
+    async = (struct fuse_async *) malloc(sizeof(struct fuse_async));
+    if (async == NULL) {
+        reply_err(req, -ENOMEM);
+        return NULL;
+    }
+    async->complete = complete;
+    async->fuse = f;
+    async->req = req;
+    async->ino = ino;
+    async->path = NULL;
+    async->buf = NULL;
+    async->size = 0;
+    async->fi = *fi;
+    return async;
+}
+
+static void fuse_async_free(struct fuse_async *async)
+{
+    put_path_str(async->path);
+    free(async->buf);
+    free(async);
+}
+
+static void fuse_async_read_done(struct fuse_async *async, int res)
+{
+    struct fuse *f = async->fuse;
+
+    if (res >= 0) {
+        if (f->conf.debug)
+            fprintf(stderr, "   READ[%llu] %u bytes\n",
+                    (unsigned long long) async->fi.fh, res);
+        if ((size_t) res > async->size)
+            fprintf(stderr, "fuse: read too many bytes");
+        fuse_reply_buf(async->req, async->buf, res);
+    } else
+        reply_err(async->req, res);
+
+    fuse_async_free(async);
+}
+
+static void fuse_lib_read_async(struct fuse *f, fuse_req_t req,
+                                fuse_ino_t ino, size_t size, off_t off,
+                                struct fuse_file_info *fi)
+{
+    struct fuse_async *async;
+    int res;
+
+    async = fuse_async_new(f, req, ino, fi, fuse_async_read_done);
+    if (async == NULL)
+        return;
+
+    async->size = size;
+    async->buf = (char *) malloc(size);
+    if (async->buf == NULL) {
+        reply_err(req, -ENOMEM);
+        fuse_async_free(async);
+        return;
+    }
+
+    res = -ENOENT;
+    async->path = get_path(f, ino);
+    if (async->path != NULL) {
+        if (f->conf.debug)
+            fprintf(stderr, "READ[%llu] %lu bytes from %llu\n",
+                    (unsigned long long) fi->fh, (unsigned long) size,
+                    (unsigned long long) off);
+
+        fuse_get_context()->private_data = f->fs->user_data;
+        res = f->fs->op.read_async(async->path, async->buf, size, off,
+                                   &async->fi, async);
+        /* The request may already be gone, only the string is kept */
+        unlock_path(f, ino, NULL);
+    }
+
+    if (res < 0) {
+        reply_err(req, res);
+        fuse_async_free(async);
+    }
 }
 
 static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
@@ -1917,6 +3545,11 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     char *buf;
     int res;
 
+    if (f->fs->op.read_async) {
+        fuse_lib_read_async(f, req, ino, size, off, fi);
+        return;
+    }
+
     buf = (char *) malloc(size);
     if (buf == NULL) {
         reply_err(req, -ENOMEM);
@@ -1924,7 +3557,6 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     }
 
     res = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1933,24 +3565,75 @@ static void fuse_lib_read(fuse_req_t req, fuse_ino_t ino, size_t size,
                     (unsigned long long) fi->fh, (unsigned long) size,
                     (unsigned long long) off);
 
-        fuse_prepare_interrupt(f, req, &d);
-        res = fuse_fs_read(f->fs, path, buf, size, off, fi);
-        fuse_finish_interrupt(f, req, &d);
-        free(path);
+        fuse_prepare_interrupt(f, req, &d);
+        res = fuse_fs_read(f->fs, path, buf, size, off, fi);
+        fuse_finish_interrupt(f, req, &d);
+        free_path(f, ino, path);
+    }
+
+    if (res >= 0) {
+        if (f->conf.debug)
+            fprintf(stderr, "   READ[%llu] %u bytes\n",
+                    (unsigned long long)fi->fh, res);
+        if ((size_t) res > size)
+            fprintf(stderr, "fuse: read too many bytes");
+        fuse_reply_buf(req, buf, res);
+    } else
+        reply_err(req, res);
+
+    free(buf);
+}
+
+static void fuse_async_write_done(struct fuse_async *async, int res)
+{
+    struct fuse *f = async->fuse;
+
+    cache_invalidate(f, async->ino);
+    if (res >= 0) {
+        if (f->conf.debug)
+            fprintf(stderr, "   WRITE%s[%llu] %u bytes\n",
+                    async->fi.writepage ? "PAGE" : "",
+                    (unsigned long long) async->fi.fh, res);
+        if ((size_t) res > async->size)
+            fprintf(stderr, "fuse: wrote too many bytes");
+        fuse_reply_write(async->req, res);
+    } else
+        reply_err(async->req, res);
+
+    fuse_async_free(async);
+}
+
+static void fuse_lib_write_async(struct fuse *f, fuse_req_t req,
+                                 fuse_ino_t ino, const char *buf,
+                                 size_t size, off_t off,
+                                 struct fuse_file_info *fi)
+{
+    struct fuse_async *async;
+    int res;
+
+    async = fuse_async_new(f, req, ino, fi, fuse_async_write_done);
+    if (async == NULL)
+        return;
+
+    async->size = size;
+    res = -ENOENT;
+    async->path = get_path(f, ino);
+    if (async->path != NULL) {
+        if (f->conf.debug)
+            fprintf(stderr, "WRITE%s[%llu] %lu bytes to %llu\n",
+                    fi->writepage ? "PAGE" : "", (unsigned long long) fi->fh,
+                    (unsigned long) size, (unsigned long long) off);
+
+        fuse_get_context()->private_data = f->fs->user_data;
+        res = f->fs->op.write_async(async->path, buf, size, off, &async->fi,
+                                    async);
+        unlock_path(f, ino, NULL);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
 
-    if (res >= 0) {
-        if (f->conf.debug)
-            fprintf(stderr, "   READ[%llu] %u bytes\n",
-                    (unsigned long long)fi->fh, res);
-        if ((size_t) res > size)
-            fprintf(stderr, "fuse: read too many bytes");
-        fuse_reply_buf(req, buf, res);
-    } else
+    if (res < 0) {
         reply_err(req, res);
-
-    free(buf);
+        fuse_async_free(async);
+    }
 }
 
 static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
@@ -1960,8 +3643,12 @@ static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
     char *path;
     int res;
 
+    if (f->fs->op.write_async) {
+        fuse_lib_write_async(f, req, ino, buf, size, off, fi);
+        return;
+    }
+
     res = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -1973,9 +3660,9 @@ static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
         fuse_prepare_interrupt(f, req, &d);
         res = fuse_fs_write(f->fs, path, buf, size, off, fi);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
+    cache_invalidate(f, ino);
 
     if (res >= 0) {
         if (f->conf.debug)
@@ -1989,6 +3676,40 @@ static void fuse_lib_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
         reply_err(req, res);
 }
 
+static void fuse_async_fsync_done(struct fuse_async *async, int res)
+{
+    reply_err(async->req, res);
+    fuse_async_free(async);
+}
+
+static void fuse_lib_fsync_async(struct fuse *f, fuse_req_t req,
+                                 fuse_ino_t ino, int datasync,
+                                 struct fuse_file_info *fi)
+{
+    struct fuse_async *async;
+    int err;
+
+    async = fuse_async_new(f, req, ino, fi, fuse_async_fsync_done);
+    if (async == NULL)
+        return;
+
+    err = -ENOENT;
+    async->path = get_path(f, ino);
+    if (async->path != NULL) {
+        if (f->conf.debug)
+            fprintf(stderr, "FSYNC[%llu]\n", (unsigned long long) fi->fh);
+
+        fuse_get_context()->private_data = f->fs->user_data;
+        err = f->fs->op.fsync_async(async->path, datasync, &async->fi, async);
+        unlock_path(f, ino, NULL);
+    }
+
+    if (err < 0) {
+        reply_err(req, err);
+        fuse_async_free(async);
+    }
+}
+
 static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
                        struct fuse_file_info *fi)
 {
@@ -1996,8 +3717,12 @@ static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
     char *path;
     int err;
 
+    if (f->fs->op.fsync_async) {
+        fuse_lib_fsync_async(f, req, ino, datasync, fi);
+        return;
+    }
+
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -2006,9 +3731,8 @@ static void fuse_lib_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_fsync(f->fs, path, datasync, fi);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
@@ -2051,7 +3775,6 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
     fi.flags = llfi->flags;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         fuse_prepare_interrupt(f, req, &d);
@@ -2072,8 +3795,7 @@ static void fuse_lib_opendir(fuse_req_t req, fuse_ino_t ino,
         reply_err(req, err);
         free(dh);
     }
-    free(path);
-    pthread_rwlock_unlock(&f->tree_lock);
+    free_path(f, ino, path);
 }
 
 static int extend_contents(struct fuse_dh *dh, unsigned minsize)
@@ -2097,6 +3819,83 @@ static int extend_contents(struct fuse_dh *dh, unsigned minsize)
     return 0;
 }
 
+/*
+ * Get the chunk to add an entry of 'entsize' bytes to.  The chunks of
+ * the previous window are reused before allocating new ones.  Returns
+ * NULL if the window is full or on error
+ */
+static struct fuse_dh_chunk *dh_fill_chunk(struct fuse_dh *dh, size_t entsize)
+{
+    struct fuse_dh_chunk *c = dh->fill;
+    struct fuse_dh_chunk *next;
+
+    if (c != NULL && c->len + entsize <= FUSE_DH_CHUNK_SIZE)
+        return c;
+    if (entsize > FUSE_DH_CHUNK_SIZE) {
+        dh->error = -ENAMETOOLONG;
+        return NULL;
+    }
+    if (dh->nfilled == dh->maxchunks) {
+        dh->full = 1;
+        return NULL;
+    }
+
+    next = c ? c->next : dh->chunks;
+    if (next == NULL) {
+        next = (struct fuse_dh_chunk *) malloc(sizeof(struct fuse_dh_chunk));
+        if (next == NULL) {
+            dh->error = -ENOMEM;
+            return NULL;
+        }
+        next->next = NULL;
+        if (c)
+            c->next = next;
+        else
+            dh->chunks = next;
+    }
+    next->len = 0;
+    next->count = 0;
+    dh->fill = next;
+    dh->nfilled++;
+    return next;
+}
+
+/* Remember the attributes of the entry just added, so that readdirplus
+   doesn't have to look it up.  Only done with use_ino, which tells that
+   the filesystem fills in the attributes it passes to the filler */
+static void dh_add_attr(struct fuse_dh *dh, const struct stat *statp)
+{
+    if (!dh->fuse->conf.readdirplus || !dh->fuse->conf.use_ino ||
+        dh->noattrs)
+        return;
+
+    if (dh->nattrs == dh->attrs_size) {
+        unsigned newsize = dh->attrs_size ? dh->attrs_size * 2 : 64;
+        struct stat *newattrs = (struct stat *)
+            realloc(dh->attrs, newsize * sizeof(struct stat));
+        if (newattrs == NULL) {
+            /* The entries after this one would get the wrong ones */
+            dh->noattrs = 1;
+            return;
+        }
+        dh->attrs = newattrs;
+        dh->attrs_size = newsize;
+    }
+    if (statp)
+        dh->attrs[dh->nattrs] = *statp;
+    else
+        memset(&dh->attrs[dh->nattrs], 0, sizeof(struct stat));
+    dh->nattrs++;
+}
+
+/* The attributes of the idx'th entry filled, if the filler got them */
+static const struct stat *dh_attr(struct fuse_dh *dh, size_t idx)
+{
+    if (dh->noattrs || idx >= dh->nattrs || !dh->attrs[idx].st_mode)
+        return NULL;
+    return &dh->attrs[idx];
+}
+
 static int fill_dir(void *dh_, const char *name, const struct stat *statp,
                     off_t off)
 {
@@ -2104,6 +3903,16 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
     struct stat stbuf;
     size_t newlen;
 
+    if (!off) {
+        if (dh->full)
+            return 1;
+        if (dh->skip) {
+            /* Returned from an earlier window */
+            dh->skip--;
+            return 0;
+        }
+    }
+
     if (statp)
         stbuf = *statp;
     else {
@@ -2133,15 +3942,22 @@ static int fill_dir(void *dh_, const char *name, const struct stat *statp,
                                              &stbuf, off);
         if (newlen > dh->needlen)
             return 1;
+        dh->len = newlen;
+        dh_add_attr(dh, statp);
     } else {
-        newlen = dh->len + fuse_add_direntry(dh->req, NULL, 0, name, NULL, 0);
-        if (extend_contents(dh, newlen) == -1)
+        size_t entsize = fuse_add_direntry(dh->req, NULL, 0, name, NULL, 0);
+        struct fuse_dh_chunk *c = dh_fill_chunk(dh, entsize);
+        if (c == NULL)
             return 1;
 
-        fuse_add_direntry(dh->req, dh->contents + dh->len, dh->size - dh->len,
-                          name, &stbuf, newlen);
+        /* The offset of an entry is its index in the directory */
+        dh->end++;
+        fuse_add_direntry(dh->req, c->data + c->len,
+                          FUSE_DH_CHUNK_SIZE - c->len, name, &stbuf, dh->end);
+        c->len += entsize;
+        c->count++;
+        dh_add_attr(dh, statp);
     }
-    dh->len = newlen;
     return 0;
 }
 
@@ -2151,7 +3967,6 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
 {
     int err = -ENOENT;
     char *path;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
@@ -2161,53 +3976,313 @@ static int readdir_fill(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
         dh->needlen = size;
         dh->filled = 1;
         dh->req = req;
+        /* Start with a small window, so that the first entries are
+           returned quickly, and grow it as the directory is read on */
+        if (!off || !dh->maxchunks)
+            dh->maxchunks = 1;
+        else if (dh->maxchunks < FUSE_DH_MAX_CHUNKS)
+            dh->maxchunks *= 2;
+        dh->fill = NULL;
+        dh->nfilled = 0;
+        dh->start = dh->end = dh->skip = off;
+        dh->full = 0;
+        dh->nattrs = 0;
+        dh->noattrs = 0;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_readdir(f->fs, path, dh, fill_dir, off, fi);
         fuse_finish_interrupt(f, req, &d);
         dh->req = NULL;
+        /* Some filesystems treat the filler stopping them as an error */
+        if (dh->full)
+            err = 0;
         if (!err)
             err = dh->error;
         if (err)
             dh->filled = 0;
-        free(path);
+        dh->eof = !dh->full;
+        dh->pos_chunk = dh->chunks;
+        dh->pos_off = 0;
+        dh->pos = off;
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     return err;
 }
 
+static size_t dh_entry_size(const struct fuse_dh_chunk *c, unsigned pos)
+{
+    const char *name;
+    size_t namelen;
+    struct stat stbuf;
+    off_t off;
+
+    return fuse_get_direntry(c->data + pos, c->len - pos, &name, &namelen,
+                             &stbuf, &off);
+}
+
+/*
+ * Fill the directory contents if needed, and find the entries to
+ * return for a request of 'size' bytes at 'off', one iovec per chunk.
+ * Called with dh->lock held
+ */
+static int readdir_slice(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
+                         size_t size, off_t off, struct fuse_dh *dh,
+                         struct fuse_file_info *fi, struct iovec *iov,
+                         int *countp)
+{
+    struct fuse_dh_chunk *c;
+    unsigned pos;
+    off_t i;
+    int count = 0;
+    int full = 0;
+
+    /* According to SUS, directory contents need to be refreshed on
+       rewinddir() */
+    if (!off || !dh->filled || off < dh->start || off > dh->end ||
+        (off == dh->end && !dh->eof)) {
+        int err = readdir_fill(f, req, ino, size, off, dh, fi);
+        if (err)
+            return err;
+    }
+    if (!dh->filled) {
+        iov[0].iov_base = dh->contents;
+        iov[0].iov_len = dh->len;
+        *countp = 1;
+        return 0;
+    }
+
+    /* Find the entry at 'off', starting from the cursor unless that is
+       already past it */
+    if (dh->pos <= off) {
+        c = dh->pos_chunk;
+        pos = dh->pos_off;
+        i = dh->pos;
+    } else {
+        c = dh->chunks;
+        pos = 0;
+        i = dh->start;
+    }
+    while (i < off) {
+        if (!pos && i + c->count <= off) {
+            i += c->count;
+            c = c->next;
+        } else if (pos == c->len) {
+            c = c->next;
+            pos = 0;
+        } else {
+            pos += dh_entry_size(c, pos);
+            i++;
+        }
+    }
+    dh->pos_chunk = c;
+    dh->pos_off = pos;
+    dh->pos = i;
+
+    while (i < dh->end && !full) {
+        size_t len = 0;
+
+        if (pos == c->len) {
+            c = c->next;
+            pos = 0;
+            continue;
+        }
+        iov[count].iov_base = c->data + pos;
+        while (i < dh->end && pos < c->len) {
+            size_t entsize = dh_entry_size(c, pos);
+            if (entsize > size) {
+                full = 1;
+                break;
+            }
+            len += entsize;
+            size -= entsize;
+            pos += entsize;
+            i++;
+        }
+        if (len) {
+            iov[count].iov_len = len;
+            count++;
+        }
+    }
+    *countp = count;
+    return 0;
+}
+
 static void fuse_lib_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
                              off_t off, struct fuse_file_info *llfi)
 {
     struct fuse *f = req_fuse_prepare(req);
     struct fuse_file_info fi;
     struct fuse_dh *dh = get_dirhandle(llfi, &fi);
+    struct iovec iov[FUSE_DH_MAX_CHUNKS];
+    int count;
+    int err;
 
     pthread_mutex_lock(&dh->lock);
-    /* According to SUS, directory contents need to be refreshed on
-       rewinddir() */
-    if (!off)
-        dh->filled = 0;
+    err = readdir_slice(f, req, ino, size, off, dh, &fi, iov, &count);
+    if (err)
+        reply_err(req, err);
+    else
+        fuse_reply_iov(req, iov, count);
+    pthread_mutex_unlock(&dh->lock);
+}
 
-    if (!dh->filled) {
-        int err = readdir_fill(f, req, ino, size, off, dh, &fi);
-        if (err) {
-            reply_err(req, err);
-            goto out;
+/*
+ * Look up a directory entry for readdirplus.  The attributes the
+ * filesystem passed to the filler are used if there are any (attr),
+ * otherwise the entry is looked up.  If that fails it is still listed,
+ * only without attributes, like in a plain readdir
+ */
+static void readdirplus_lookup(struct fuse *f, fuse_req_t req,
+                               fuse_ino_t parent, const char *name,
+                               const struct stat *attr,
+                               const struct stat *stbuf,
+                               struct fuse_entry_param *e)
+{
+    int err = -ENOENT;
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        ;
+    else if (attr != NULL) {
+        memset(e, 0, sizeof(struct fuse_entry_param));
+        e->attr = *attr;
+        err = lookup_found(f, parent, name, e);
+    } else if (!lookup_cached(f, parent, name, e, &err)) {
+        char *path;
+
+        path = get_path_name(f, parent, name);
+        if (path != NULL) {
+            struct fuse_intr_data d;
+            if (f->conf.debug)
+                fprintf(stderr, "LOOKUP %s\n", path);
+            fuse_prepare_interrupt(f, req, &d);
+            err = lookup_path(f, parent, name, path, e, NULL);
+            fuse_finish_interrupt(f, req, &d);
+            free_path(f, parent, path);
         }
     }
-    if (dh->filled) {
-        if (off < dh->len) {
-            if (off + size > dh->len)
-                size = dh->len - off;
-        } else
-            size = 0;
-    } else {
-        size = dh->len;
-        off = 0;
+    if (err) {
+        memset(e, 0, sizeof(struct fuse_entry_param));
+        e->attr = *stbuf;
+    }
+}
+
+/*
+ * The directory contents are collected the same way as for readdir,
+ * and each entry of the returned part is looked up while the reply is
+ * built, unless fill_dir() got its attributes.  Doing the lookups here
+ * rather than in fill_dir() means that only entries actually sent to
+ * the kernel take a lookup count.  The option is off by default, since
+ * without use_ino every entry costs a getattr
+ */
+static void fuse_lib_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                 off_t off, struct fuse_file_info *llfi)
+{
+    struct fuse *f = req_fuse_prepare(req);
+    struct fuse_file_info fi;
+    struct fuse_dh *dh = get_dirhandle(llfi, &fi);
+    struct iovec iov[FUSE_DH_MAX_CHUNKS];
+    size_t bufsize = size;
+    size_t len = 0;
+    fuse_ino_t *nodes = NULL;
+    size_t nnodes = 0;
+    size_t nodes_size = 0;
+    const char *src;
+    char *buf;
+    int count;
+    int seg;
+    size_t idx;
+    size_t i;
+    int err;
+
+    buf = (char *) malloc(bufsize);
+    if (buf == NULL) {
+        reply_err(req, -ENOMEM);
+        return;
+    }
+
+    pthread_mutex_lock(&dh->lock);
+    err = readdir_slice(f, req, ino, size, off, dh, &fi, iov, &count);
+    if (err) {
+        reply_err(req, err);
+        goto out;
+    }
+
+    seg = 0;
+    idx = 0;
+    src = count ? (const char *) iov[0].iov_base : NULL;
+    size = count ? iov[0].iov_len : 0;
+    while (1) {
+        struct fuse_entry_param e;
+        struct stat stbuf;
+        const char *name;
+        size_t namelen;
+        char *namebuf;
+        off_t nextoff;
+        size_t reclen;
+        size_t entlen;
+
+        reclen = fuse_get_direntry(src, size, &name, &namelen, &stbuf,
+                                   &nextoff);
+        if (!reclen) {
+            if (++seg >= count)
+                break;
+            src = (const char *) iov[seg].iov_base;
+            size = iov[seg].iov_len;
+            continue;
+        }
+
+        if (nnodes == nodes_size) {
+            size_t newsize = nodes_size ? nodes_size * 2 : 32;
+            fuse_ino_t *newnodes = (fuse_ino_t *)
+                realloc(nodes, newsize * sizeof(fuse_ino_t));
+            if (newnodes == NULL) {
+                err = -ENOMEM;
+                break;
+            }
+            nodes = newnodes;
+            nodes_size = newsize;
+        }
+        namebuf = (char *) malloc(namelen + 1);
+        if (namebuf == NULL) {
+            err = -ENOMEM;
+            break;
+        }
+        memcpy(namebuf, name, namelen);
+        namebuf[namelen] = '\0';
+
+        /* Windowed entries are numbered by their offset, the others
+           all come from the start of the buffer */
+        if (dh->filled)
+            idx = nextoff - 1 - dh->start;
+        readdirplus_lookup(f, req, ino, namebuf, dh_attr(dh, idx), &stbuf,
+                           &e);
+        idx++;
+        entlen = fuse_add_direntry_plus(req, buf + len, bufsize - len,
+                                        namebuf, &e, nextoff);
+        free(namebuf);
+        if (entlen > bufsize - len) {
+            if (e.ino)
+                forget_node(f, e.ino, 1);
+            break;
+        }
+        if (e.ino)
+            nodes[nnodes++] = e.ino;
+        len += entlen;
+        src += reclen;
+        size -= reclen;
+    }
+
+    /* An empty reply would mean end of directory */
+    if (err && !len)
+        reply_err(req, err);
+    else if (fuse_reply_buf(req, buf, len) == -ENOENT) {
+        /* Interrupted, the kernel won't send forgets for these */
+        for (i = 0; i < nnodes; i++)
+            forget_node(f, nodes[i], 1);
     }
-    fuse_reply_buf(req, dh->contents + off, size);
  out:
     pthread_mutex_unlock(&dh->lock);
+    free(nodes);
+    free(buf);
 }
 
 static void fuse_lib_releasedir(fuse_req_t req, fuse_ino_t ino,
@@ -2219,18 +4294,22 @@ static void fuse_lib_releasedir(fuse_req_t req, fuse_ino_t ino,
     struct fuse_dh *dh = get_dirhandle(llfi, &fi);
     char *path;
 
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     fuse_prepare_interrupt(f, req, &d);
     fuse_fs_releasedir(f->fs, path ? path : "-", &fi);
     fuse_finish_interrupt(f, req, &d);
     if (path)
-        free(path);
-    pthread_rwlock_unlock(&f->tree_lock);
+        free_path(f, ino, path);
     pthread_mutex_lock(&dh->lock);
     pthread_mutex_unlock(&dh->lock);
     pthread_mutex_destroy(&dh->lock);
+    while (dh->chunks != NULL) {
+        struct fuse_dh_chunk *c = dh->chunks;
+        dh->chunks = c->next;
+        free(c);
+    }
     free(dh->contents);
+    free(dh->attrs);
     free(dh);
     reply_err(req, 0);
 }
@@ -2246,16 +4325,14 @@ static void fuse_lib_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync,
     get_dirhandle(llfi, &fi);
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_fsyncdir(f->fs, path, datasync, &fi);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
@@ -2267,22 +4344,19 @@ static void fuse_lib_statfs(fuse_req_t req, fuse_ino_t ino)
     int err;
 
     memset(&buf, 0, sizeof(buf));
-    pthread_rwlock_rdlock(&f->tree_lock);
     if (!ino) {
         err = -ENOMEM;
-        path = strdup("/");
-    } else {
+        ino = FUSE_ROOT_ID;
+    } else
         err = -ENOENT;
-        path = get_path(f, ino);
-    }
+    path = get_path(f, ino);
     if (path) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_statfs(f->fs, path, &buf);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
 
     if (!err)
         fuse_reply_statfs(req, &buf);
@@ -2298,16 +4372,16 @@ static void fuse_lib_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_setxattr(f->fs, path, name, value, size, flags);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
+        if (!err)
+            cache_invalidate(f, ino);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
@@ -2318,16 +4392,14 @@ static int common_getxattr(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
     char *path;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_getxattr(f->fs, path, name, value, size);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     return err;
 }
 
@@ -2365,16 +4437,14 @@ static int common_listxattr(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_listxattr(f->fs, path, list, size);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     return err;
 }
 
@@ -2412,51 +4482,166 @@ static void fuse_lib_removexattr(fuse_req_t req, fuse_ino_t ino,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_removexattr(f->fs, path, name);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
+        if (!err)
+            cache_invalidate(f, ino);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     reply_err(req, err);
 }
 
-static struct lock *locks_conflict(struct node *node, const struct lock *lock)
+/*
+ * The locks of a node are kept in an interval tree: a treap ordered by
+ * start offset, where each lock also records the largest end offset
+ * in its subtree.  A search for the locks overlapping a range skips
+ * the subtrees ending before the range or starting after it, so it
+ * costs the height of the tree plus the number of overlapping locks,
+ * rather than the number of locks held on the file.
+ */
+static int lock_cmp(const struct lock *a, const struct lock *b)
+{
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+    if (a->owner != b->owner)
+        return a->owner < b->owner ? -1 : 1;
+    if (a != b)
+        return a < b ? -1 : 1;
+    return 0;
+}
+
+static void lock_update(struct lock *l)
 {
-    struct lock *l;
+    l->max_end = l->end;
+    if (l->left && l->left->max_end > l->max_end)
+        l->max_end = l->left->max_end;
+    if (l->right && l->right->max_end > l->max_end)
+        l->max_end = l->right->max_end;
+}
 
-    for (l = node->locks; l; l = l->next)
-        if (l->owner != lock->owner &&
-            lock->start <= l->end && l->start <= lock->end &&
-            (l->type == F_WRLCK || lock->type == F_WRLCK))
-            break;
+/* Join two treaps, all of a ordered before all of b */
+static struct lock *lock_join(struct lock *a, struct lock *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio) {
+        a->right = lock_join(a->right, b);
+        lock_update(a);
+        return a;
+    } else {
+        b->left = lock_join(a, b->left);
+        lock_update(b);
+        return b;
+    }
+}
+
+/* Split a treap into the locks ordered before key and the rest */
+static void lock_split(struct lock *t, const struct lock *key,
+                       struct lock **lp, struct lock **rp)
+{
+    if (!t) {
+        *lp = *rp = NULL;
+        return;
+    }
+    if (lock_cmp(t, key) < 0) {
+        *lp = t;
+        lock_split(t->right, key, &t->right, rp);
+    } else {
+        *rp = t;
+        lock_split(t->left, key, lp, &t->left);
+    }
+    lock_update(t);
+}
+
+static void lock_tree_insert(struct fuse *f, struct node_info *info,
+                             struct lock *lock)
+{
+    struct lock *l;
+    struct lock *r;
+    unsigned int seed;
+    unsigned int next;
 
-    return l;
+    /* xorshift, the priorities only need to be independent of the keys.
+       Nodes are locked separately, so the seed is shared between them. */
+    do {
+        seed = f->lock_seed;
+        next = seed ^ (seed << 13);
+        next ^= next >> 17;
+        next ^= next << 5;
+    } while (!__sync_bool_compare_and_swap(&f->lock_seed, seed, next));
+    lock->prio = next;
+    lock->left = lock->right = NULL;
+    lock_update(lock);
+    lock_split(info->locks, lock, &l, &r);
+    info->locks = lock_join(lock_join(l, lock), r);
+}
+
+static struct lock *lock_tree_remove(struct lock *t, struct lock *lock)
+{
+    if (t == lock)
+        return lock_join(t->left, t->right);
+    if (lock_cmp(lock, t) < 0)
+        t->left = lock_tree_remove(t->left, lock);
+    else
+        t->right = lock_tree_remove(t->right, lock);
+    lock_update(t);
+    return t;
 }
 
-static void delete_lock(struct lock **lockp)
+static struct lock *locks_conflict(struct lock *t, const struct lock *lock)
 {
-    struct lock *l = *lockp;
-    *lockp = l->next;
-    free(l);
+    while (t && t->max_end >= lock->start) {
+        struct lock *l = locks_conflict(t->left, lock);
+        if (l)
+            return l;
+        if (t->start > lock->end)
+            break;
+        if (t->owner != lock->owner && lock->start <= t->end &&
+            (t->type == F_WRLCK || lock->type == F_WRLCK))
+            return t;
+        t = t->right;
+    }
+    return NULL;
 }
 
-static void insert_lock(struct lock **pos, struct lock *lock)
+/* Chain the locks of owner overlapping [start, end] through ->next */
+static void locks_collect(struct lock *t, uint64_t owner, off_t start,
+                          off_t end, struct lock **listp)
 {
-    lock->next = *pos;
-    *pos = lock;
+    while (t && t->max_end >= start) {
+        locks_collect(t->left, owner, start, end, listp);
+        if (t->start > end)
+            break;
+        if (t->owner == owner && start <= t->end) {
+            t->next = *listp;
+            *listp = t;
+        }
+        t = t->right;
+    }
 }
 
-static int locks_insert(struct node *node, struct lock *lock)
+static int locks_insert(struct fuse *f, struct node *node, struct lock *lock)
 {
-    struct lock **lp;
+    struct node_info *info;
+    struct lock *l;
+    struct lock *next;
+    struct lock *list = NULL;
     struct lock *newl1 = NULL;
     struct lock *newl2 = NULL;
 
+    /* Nothing to unlock on a node that never had locks */
+    if (lock->type == F_UNLCK && node->info == NULL)
+        return 0;
+    info = get_node_info(node);
+    if (info == NULL)
+        return -ENOLCK;
+
     if (lock->type != F_UNLCK || lock->start != 0 || lock->end != OFFSET_MAX) {
         newl1 = malloc(sizeof(struct lock));
         newl2 = malloc(sizeof(struct lock));
@@ -2468,54 +4653,52 @@ static int locks_insert(struct node *node, struct lock *lock)
         }
     }
 
-    for (lp = &node->locks; *lp;) {
-        struct lock *l = *lp;
-        if (l->owner != lock->owner)
-            goto skip;
+    /* Locks of the same type are merged with adjacent ones too */
+    locks_collect(info->locks, lock->owner,
+                  lock->start ? lock->start - 1 : 0,
+                  lock->end != OFFSET_MAX ? lock->end + 1 : OFFSET_MAX,
+                  &list);
+    for (l = list; l; l = l->next)
+        if (l->type == lock->type &&
+            l->start <= lock->start && lock->end <= l->end)
+            goto out;
 
+    for (l = list; l; l = next) {
+        next = l->next;
         if (lock->type == l->type) {
-            if (l->end < lock->start - 1)
-                goto skip;
-            if (lock->end < l->start - 1)
-                break;
-            if (l->start <= lock->start && lock->end <= l->end)
-                goto out;
             if (l->start < lock->start)
                 lock->start = l->start;
             if (lock->end < l->end)
                 lock->end = l->end;
             goto delete;
-        } else {
-            if (l->end < lock->start)
-                goto skip;
-            if (lock->end < l->start)
-                break;
-            if (lock->start <= l->start && l->end <= lock->end)
-                goto delete;
-            if (l->end <= lock->end) {
-                l->end = lock->start - 1;
-                goto skip;
-            }
-            if (lock->start <= l->start) {
-                l->start = lock->end + 1;
-                break;
-            }
+        }
+        if (l->end < lock->start || lock->end < l->start)
+            continue;
+        if (lock->start <= l->start && l->end <= lock->end)
+            goto delete;
+
+        info->locks = lock_tree_remove(info->locks, l);
+        if (l->start < lock->start && lock->end < l->end) {
             *newl2 = *l;
             newl2->start = lock->end + 1;
-            l->end = lock->start - 1;
-            insert_lock(&l->next, newl2);
+            lock_tree_insert(f, info, newl2);
             newl2 = NULL;
+            l->end = lock->start - 1;
+        } else if (l->start < lock->start) {
+            l->end = lock->start - 1;
+        } else {
+            l->start = lock->end + 1;
         }
-    skip:
-        lp = &l->next;
+        lock_tree_insert(f, info, l);
         continue;
 
     delete:
-        delete_lock(lp);
+        info->locks = lock_tree_remove(info->locks, l);
+        free(l);
     }
     if (lock->type != F_UNLCK) {
         *newl1 = *lock;
-        insert_lock(lp, newl1);
+        lock_tree_insert(f, info, newl1);
         newl1 = NULL;
     }
 out:
@@ -2524,6 +4707,19 @@ out:
     return 0;
 }
 
+static int locks_update(struct fuse *f, fuse_ino_t ino, struct lock *lock)
+{
+    union lock_stripe *s = lock_stripe(f);
+    struct node *node = get_node(f, ino);
+    union lock_stripe *i = lock_info(f, node);
+    int res;
+
+    res = locks_insert(f, node, lock);
+    unlock_stripe(i);
+    unlock_stripe(s);
+    return res;
+}
+
 static void flock_to_lock(struct flock *flock, struct lock *lock)
 {
     memset(lock, 0, sizeof(struct lock));
@@ -2561,9 +4757,7 @@ static int fuse_flush_common(struct fuse *f, fuse_req_t req, fuse_ino_t ino,
     if (errlock != -ENOSYS) {
         flock_to_lock(&lock, &l);
         l.owner = fi->lock_owner;
-        pthread_mutex_lock(&f->lock);
-        locks_insert(get_node(f, ino), &l);
-        pthread_mutex_unlock(&f->lock);
+        locks_update(f, ino, &l);
 
         /* if op.lock() is defined FLUSH is needed regardless of op.flush() */
         if (err == -ENOSYS)
@@ -2580,7 +4774,6 @@ static void fuse_lib_release(fuse_req_t req, fuse_ino_t ino,
     char *path;
     int err = 0;
 
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (f->conf.debug)
         fprintf(stderr, "RELEASE%s[%llu] flags: 0x%x\n",
@@ -2596,8 +4789,7 @@ static void fuse_lib_release(fuse_req_t req, fuse_ino_t ino,
     fuse_prepare_interrupt(f, req, &d);
     fuse_do_release(f, ino, path, fi);
     fuse_finish_interrupt(f, req, &d);
-    free(path);
-    pthread_rwlock_unlock(&f->tree_lock);
+    free_path(f, ino, path);
 
     reply_err(req, err);
 }
@@ -2609,13 +4801,11 @@ static void fuse_lib_flush(fuse_req_t req, fuse_ino_t ino,
     char *path;
     int err;
 
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path && f->conf.debug)
         fprintf(stderr, "FLUSH[%llu]\n", (unsigned long long) fi->fh);
     err = fuse_flush_common(f, req, ino, path, fi);
-    free(path);
-    pthread_rwlock_unlock(&f->tree_lock);
+    free_path(f, ino, path);
     reply_err(req, err);
 }
 
@@ -2628,16 +4818,14 @@ static int fuse_lock_common(fuse_req_t req, fuse_ino_t ino,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         struct fuse_intr_data d;
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_lock(f->fs, path, fi, cmd, lock);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     return err;
 }
 
@@ -2646,16 +4834,23 @@ static void fuse_lib_getlk(fuse_req_t req, fuse_ino_t ino,
 {
     int err;
     struct lock l;
-    struct lock *conflict;
+    struct lock *conflict = NULL;
+    union lock_stripe *s;
+    union lock_stripe *i;
+    struct node *node;
     struct fuse *f = req_fuse(req);
 
     flock_to_lock(lock, &l);
     l.owner = fi->lock_owner;
-    pthread_mutex_lock(&f->lock);
-    conflict = locks_conflict(get_node(f, ino), &l);
+    s = lock_stripe(f);
+    node = get_node(f, ino);
+    i = lock_info(f, node);
+    if (node->info != NULL)
+        conflict = locks_conflict(node->info->locks, &l);
     if (conflict)
         lock_to_flock(conflict, lock);
-    pthread_mutex_unlock(&f->lock);
+    unlock_stripe(i);
+    unlock_stripe(s);
     if (!conflict)
         err = fuse_lock_common(req, ino, fi, lock, F_GETLK);
     else
@@ -2677,9 +4872,7 @@ static void fuse_lib_setlk(fuse_req_t req, fuse_ino_t ino,
         struct lock l;
         flock_to_lock(lock, &l);
         l.owner = fi->lock_owner;
-        pthread_mutex_lock(&f->lock);
-        locks_insert(get_node(f, ino), &l);
-        pthread_mutex_unlock(&f->lock);
+        locks_update(f, ino, &l);
     }
     reply_err(req, err);
 }
@@ -2693,15 +4886,13 @@ static void fuse_lib_bmap(fuse_req_t req, fuse_ino_t ino, size_t blocksize,
     int err;
 
     err = -ENOENT;
-    pthread_rwlock_rdlock(&f->tree_lock);
     path = get_path(f, ino);
     if (path != NULL) {
         fuse_prepare_interrupt(f, req, &d);
         err = fuse_fs_bmap(f->fs, path, blocksize, &idx);
         fuse_finish_interrupt(f, req, &d);
-        free(path);
+        free_path(f, ino, path);
     }
-    pthread_rwlock_unlock(&f->tree_lock);
     if (!err)
         fuse_reply_bmap(req, idx);
     else
@@ -2713,6 +4904,7 @@ static struct fuse_lowlevel_ops fuse_path_ops = {
     .destroy = fuse_lib_destroy,
     .lookup = fuse_lib_lookup,
     .forget = fuse_lib_forget,
+    .forget_multi = fuse_lib_forget_multi,
     .getattr = fuse_lib_getattr,
     .setattr = fuse_lib_setattr,
     .access = fuse_lib_access,
@@ -2733,6 +4925,7 @@ static struct fuse_lowlevel_ops fuse_path_ops = {
     .fsync = fuse_lib_fsync,
     .opendir = fuse_lib_opendir,
     .readdir = fuse_lib_readdir,
+    .readdirplus = fuse_lib_readdirplus,
     .releasedir = fuse_lib_releasedir,
     .fsyncdir = fuse_lib_fsyncdir,
     .statfs = fuse_lib_statfs,
@@ -2812,9 +5005,49 @@ int fuse_loop(struct fuse *f)
 
 int fuse_invalidate(struct fuse *f, const char *path)
 {
-    (void) f;
-    (void) path;
-    return -EINVAL;
+    struct node *node;
+    struct node *parent = NULL;
+    char *copy = NULL;
+    char *last = NULL;
+    char *s;
+    char *name;
+
+    if (path != NULL) {
+        copy = strdup(path);
+        if (copy == NULL)
+            return -ENOMEM;
+    }
+
+    lock_nodes(f);
+    if (copy == NULL) {
+        f->cache_generation++;
+        neg_clear(f);
+        goto out;
+    }
+
+    node = get_node(f, FUSE_ROOT_ID);
+    s = copy;
+    while ((name = strsep(&s, "/")) != NULL) {
+        if (!*name)
+            continue;
+        parent = node;
+        last = name;
+        node = lookup_node(f, parent->nodeid, name);
+        if (node == NULL)
+            break;
+    }
+    if (parent != NULL) {
+        /* The first missing component may be cached as negative,
+           nothing below it can be */
+        neg_remove(f, parent->nodeid, last);
+        invalidate_attr(parent);
+    }
+    if (node != NULL)
+        invalidate_attr(node);
+ out:
+    unlock_nodes(f);
+    free(copy);
+    return 0;
 }
 
 void fuse_exit(struct fuse *f)
@@ -2858,6 +5091,8 @@ static const struct fuse_opt fuse_lib_opts[] = {
     FUSE_LIB_OPT("kernel_cache",          kernel_cache, 1),
     FUSE_LIB_OPT("auto_cache",            auto_cache, 1),
     FUSE_LIB_OPT("noauto_cache",          auto_cache, 0),
+    FUSE_LIB_OPT("readdirplus",           readdirplus, 1),
+    FUSE_LIB_OPT("noreaddirplus",         readdirplus, 0),
     FUSE_LIB_OPT("umask=",                set_mode, 1),
     FUSE_LIB_OPT("umask=%o",              umask, 0),
     FUSE_LIB_OPT("uid=",                  set_uid, 1),
@@ -2869,6 +5104,8 @@ static const struct fuse_opt fuse_lib_opts[] = {
     FUSE_LIB_OPT("ac_attr_timeout=%lf",   ac_attr_timeout, 0),
     FUSE_LIB_OPT("ac_attr_timeout=",      ac_attr_timeout_set, 1),
     FUSE_LIB_OPT("negative_timeout=%lf",  negative_timeout, 0),
+    FUSE_LIB_OPT("attr_cache=%lf",        attr_cache_timeout, 0),
+    FUSE_LIB_OPT("negative_cache=%lf",    negative_cache_timeout, 0),
     FUSE_LIB_OPT("intr",                  intr, 1),
     FUSE_LIB_OPT("intr_signal=%d",        intr_signal, 0),
     FUSE_LIB_OPT("modules=%s",            modules, 0),
@@ -2884,6 +5121,7 @@ static void fuse_lib_help(void)
 "    -o direct_io           use direct I/O\n"
 "    -o kernel_cache        cache files in kernel\n"
 "    -o [no]auto_cache      enable caching based on modification times\n"
+"    -o [no]readdirplus     return attributes with directory entries (off)\n"
 "    -o umask=M             set file permissions (octal)\n"
 "    -o uid=N               set file owner\n"
 "    -o gid=N               set file group\n"
@@ -2891,6 +5129,8 @@ static void fuse_lib_help(void)
 "    -o negative_timeout=T  cache timeout for deleted names (0.0s)\n"
 "    -o attr_timeout=T      cache timeout for attributes (1.0s)\n"
 "    -o ac_attr_timeout=T   auto cache timeout for attributes (attr_timeout)\n"
+"    -o attr_cache=T        library cache timeout for attributes (0.0s)\n"
+"    -o negative_cache=T    library cache timeout for missing names (0.0s)\n"
 "    -o intr                allow requests to be interrupted\n"
 "    -o intr_signal=NUM     signal to send on interrupt (%i)\n"
 "    -o modules=M1[:M2...]  names of modules to push onto filesystem stack\n"
@@ -3022,6 +5262,7 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
     struct node *root;
     struct fuse_fs *fs;
     struct fuse_lowlevel_ops llop = fuse_path_ops;
+    int i;
 
     if (fuse_create_context_key() == -1)
         goto out;
@@ -3094,41 +5335,31 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 
     f->ctr = 0;
     f->generation = 0;
-    /* FIXME: Dynamic hash table */
-    f->name_table_size = 14057;
-    f->name_table = (struct node **)
-        calloc(1, sizeof(struct node *) * f->name_table_size);
-    if (f->name_table == NULL) {
-        fprintf(stderr, "fuse: memory allocation failed\n");
+    if (node_table_init(&f->name_table) == -1)
         goto out_free_session;
-    }
 
-    f->id_table_size = 14057;
-    f->id_table = (struct node **)
-        calloc(1, sizeof(struct node *) * f->id_table_size);
-    if (f->id_table == NULL) {
-        fprintf(stderr, "fuse: memory allocation failed\n");
+    if (node_table_init(&f->id_table) == -1)
         goto out_free_name_table;
-    }
 
     fuse_mutex_init(&f->lock);
-    pthread_rwlock_init(&f->tree_lock, NULL);
+    for (i = 0; i < FUSE_LOCK_STRIPES; i++) {
+        fuse_mutex_init(&f->stripes[i].lock);
+        fuse_mutex_init(&f->info_locks[i].lock);
+    }
+    pthread_cond_init(&f->tree_cond, NULL);
+    f->lock_seed = 2463534242U;
 
-    root = (struct node *) calloc(1, sizeof(struct node));
+    root = alloc_node(f, 1);
     if (root == NULL) {
         fprintf(stderr, "fuse: memory allocation failed\n");
         goto out_free_id_table;
     }
 
-    root->name = strdup("/");
-    if (root->name == NULL) {
-        fprintf(stderr, "fuse: memory allocation failed\n");
-        goto out_free_root;
-    }
+    set_node_name(root, "/");
 
     if (f->conf.intr &&
         fuse_init_intr_signal(f->conf.intr_signal, &f->intr_installed) == -1)
-        goto out_free_root_name;
+        goto out_free_root;
 
     root->parent = NULL;
     root->nodeid = FUSE_ROOT_ID;
@@ -3139,14 +5370,12 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 
     return f;
 
- out_free_root_name:
-    free(root->name);
  out_free_root:
-    free(root);
+    free_node_slabs(f);
  out_free_id_table:
-    free(f->id_table);
+    free(f->id_table.array);
  out_free_name_table:
-    free(f->name_table);
+    free(f->name_table.array);
  out_free_session:
     fuse_session_destroy(f->se);
  out_free_fs:
@@ -3183,33 +5412,41 @@ void fuse_destroy(struct fuse *f)
         memset(c, 0, sizeof(*c));
         c->ctx.fuse = f;
 
-        for (i = 0; i < f->id_table_size; i++) {
+        for (i = 0; i < f->id_table.size; i++) {
             struct node *node;
 
-            for (node = f->id_table[i]; node != NULL; node = node->id_next) {
+            for (node = f->id_table.array[i]; node != NULL;
+                 node = node->id_next) {
                 if (node->is_hidden) {
                     char *path = get_path(f, node->nodeid);
                     if (path) {
                         fuse_fs_unlink(f->fs, path);
-                        free(path);
+                        free_path(f, node->nodeid, path);
                     }
                 }
             }
         }
     }
-    for (i = 0; i < f->id_table_size; i++) {
+    for (i = 0; i < f->id_table.size; i++) {
         struct node *node;
         struct node *next;
 
-        for (node = f->id_table[i]; node != NULL; node = next) {
+        for (node = f->id_table.array[i]; node != NULL; node = next) {
             next = node->id_next;
-            free_node(node);
+            free_node(f, node);
         }
     }
-    free(f->id_table);
-    free(f->name_table);
+    free_node_slabs(f);
+    free(f->id_table.array);
+    free(f->name_table.array);
+    neg_clear(f);
+    free(f->neg_table.array);
+    for (i = 0; i < FUSE_LOCK_STRIPES; i++) {
+        pthread_mutex_destroy(&f->stripes[i].lock);
+        pthread_mutex_destroy(&f->info_locks[i].lock);
+    }
     pthread_mutex_destroy(&f->lock);
-    pthread_rwlock_destroy(&f->tree_lock);
+    pthread_cond_destroy(&f->tree_cond);
     fuse_session_destroy(f->se);
     free(f->conf.modules);
     free(f);
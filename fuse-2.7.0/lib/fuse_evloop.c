@@ -0,0 +1,510 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPL.
+    See the file COPYING.LIB
+*/
+
+/*
+ * Single threaded event loop on epoll.  The session's channels are
+ * non-blocking and registered next to the filesystem's own file
+ * descriptors, timers are kept in a heap ordered by expiry, and the
+ * next one to expire sets the epoll timeout.
+ */
+
+#include "fuse_lowlevel.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+
+/* Events returned by one epoll_wait() */
+#define FUSE_EVLOOP_EVENTS 64
+
+/* Requests read from a channel per wakeup, before others get a turn */
+#define FUSE_EVLOOP_BATCH 16
+
+struct fuse_evloop_fd {
+    struct fuse_evloop_fd *next;
+    int fd;
+    fuse_evloop_fd_func_t func;
+    void *data;
+    /* Set for the session's channels */
+    struct fuse_chan *ch;
+    int saved_flags;
+};
+
+struct fuse_evloop_timer {
+    size_t index;
+    struct timespec expires;
+    fuse_evloop_timer_func_t func;
+    void *data;
+};
+
+/* Index of a timer being called */
+#define TIMER_FIRING ((size_t) -1)
+
+struct fuse_evloop {
+    struct fuse_session *se;
+    int epfd;
+    struct fuse_evloop_fd **fds;
+    int fds_size;
+    /* Deleted while events for them may still be pending */
+    struct fuse_evloop_fd *dead;
+    struct fuse_evloop_fd *chans;
+    struct fuse_evloop_timer **timers;
+    size_t ntimers;
+    size_t timers_size;
+    char *buf;
+    size_t bufsize;
+};
+
+static void curr_time(struct timespec *now)
+{
+    static clockid_t clockid = CLOCK_MONOTONIC;
+    int res = clock_gettime(clockid, now);
+    if (res == -1 && errno == EINVAL) {
+        clockid = CLOCK_REALTIME;
+        res = clock_gettime(clockid, now);
+    }
+    if (res == -1) {
+        perror("fuse: clock_gettime");
+        abort();
+    }
+}
+
+static int time_before(const struct timespec *a, const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static unsigned int poll_to_epoll(int events)
+{
+    unsigned int ev = 0;
+
+    if (events & POLLIN)
+        ev |= EPOLLIN;
+    if (events & POLLOUT)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+static int epoll_to_poll(unsigned int ev)
+{
+    int events = 0;
+
+    if (ev & EPOLLIN)
+        events |= POLLIN;
+    if (ev & EPOLLOUT)
+        events |= POLLOUT;
+    if (ev & EPOLLERR)
+        events |= POLLERR;
+    if (ev & EPOLLHUP)
+        events |= POLLHUP;
+    return events;
+}
+
+static struct fuse_evloop_fd *evloop_get_fd(struct fuse_evloop *loop, int fd)
+{
+    if (fd < 0 || fd >= loop->fds_size)
+        return NULL;
+    return loop->fds[fd];
+}
+
+static int evloop_register(struct fuse_evloop *loop, struct fuse_evloop_fd *efd,
+                           unsigned int ev)
+{
+    struct epoll_event event;
+    int fd = efd->fd;
+
+    if (fd < 0)
+        return -EBADF;
+    if (evloop_get_fd(loop, fd))
+        return -EEXIST;
+    if (fd >= loop->fds_size) {
+        int newsize = loop->fds_size ? loop->fds_size : 64;
+        struct fuse_evloop_fd **newfds;
+
+        while (newsize <= fd)
+            newsize *= 2;
+        newfds = realloc(loop->fds, newsize * sizeof(loop->fds[0]));
+        if (newfds == NULL)
+            return -ENOMEM;
+        memset(newfds + loop->fds_size, 0,
+               (newsize - loop->fds_size) * sizeof(loop->fds[0]));
+        loop->fds = newfds;
+        loop->fds_size = newsize;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = ev;
+    event.data.ptr = efd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+        return -errno;
+
+    loop->fds[fd] = efd;
+    return 0;
+}
+
+static int evloop_add_chan(struct fuse_evloop *loop, struct fuse_chan *ch)
+{
+    struct fuse_evloop_fd *efd;
+    int fd = fuse_chan_fd(ch);
+    int res;
+
+    efd = calloc(1, sizeof(struct fuse_evloop_fd));
+    if (efd == NULL) {
+        fprintf(stderr, "fuse: failed to allocate event loop channel\n");
+        return -1;
+    }
+    efd->fd = fd;
+    efd->ch = ch;
+    efd->saved_flags = fcntl(fd, F_GETFL);
+    if (efd->saved_flags == -1 ||
+        fcntl(fd, F_SETFL, efd->saved_flags | O_NONBLOCK) == -1) {
+        perror("fuse: failed to make channel non-blocking");
+        free(efd);
+        return -1;
+    }
+    res = evloop_register(loop, efd, EPOLLIN);
+    if (res) {
+        fprintf(stderr, "fuse: failed to poll channel: %s\n", strerror(-res));
+        fcntl(fd, F_SETFL, efd->saved_flags);
+        free(efd);
+        return -1;
+    }
+    efd->next = loop->chans;
+    loop->chans = efd;
+
+    if (fuse_chan_bufsize(ch) > loop->bufsize)
+        loop->bufsize = fuse_chan_bufsize(ch);
+    return 0;
+}
+
+struct fuse_evloop *fuse_evloop_new(struct fuse_session *se)
+{
+    struct fuse_evloop *loop;
+    struct fuse_chan *ch;
+
+    loop = calloc(1, sizeof(struct fuse_evloop));
+    if (loop == NULL) {
+        fprintf(stderr, "fuse: failed to allocate event loop\n");
+        return NULL;
+    }
+    loop->se = se;
+    loop->epfd = epoll_create(FUSE_EVLOOP_EVENTS);
+    if (loop->epfd == -1) {
+        perror("fuse: epoll_create");
+        free(loop);
+        return NULL;
+    }
+    fcntl(loop->epfd, F_SETFD, FD_CLOEXEC);
+
+    /* Channels without a descriptor (e.g. loopback) are fed directly */
+    for (ch = fuse_session_next_chan(se, NULL); ch;
+         ch = fuse_session_next_chan(se, ch)) {
+        if (fuse_chan_fd(ch) != -1 && evloop_add_chan(loop, ch) == -1)
+            goto out_destroy;
+    }
+    if (loop->bufsize) {
+        loop->buf = malloc(loop->bufsize);
+        if (loop->buf == NULL) {
+            fprintf(stderr, "fuse: failed to allocate read buffer\n");
+            goto out_destroy;
+        }
+    }
+    return loop;
+
+ out_destroy:
+    fuse_evloop_destroy(loop);
+    return NULL;
+}
+
+static void evloop_free_dead(struct fuse_evloop *loop)
+{
+    while (loop->dead) {
+        struct fuse_evloop_fd *efd = loop->dead;
+        loop->dead = efd->next;
+        free(efd);
+    }
+}
+
+void fuse_evloop_destroy(struct fuse_evloop *loop)
+{
+    int fd;
+    size_t i;
+
+    while (loop->chans) {
+        struct fuse_evloop_fd *efd = loop->chans;
+        loop->chans = efd->next;
+        fcntl(efd->fd, F_SETFL, efd->saved_flags);
+        loop->fds[efd->fd] = NULL;
+        free(efd);
+    }
+    for (fd = 0; fd < loop->fds_size; fd++)
+        free(loop->fds[fd]);
+    evloop_free_dead(loop);
+    for (i = 0; i < loop->ntimers; i++)
+        free(loop->timers[i]);
+    free(loop->timers);
+    free(loop->fds);
+    free(loop->buf);
+    close(loop->epfd);
+    free(loop);
+}
+
+int fuse_evloop_add_fd(struct fuse_evloop *loop, int fd, int events,
+                       fuse_evloop_fd_func_t func, void *data)
+{
+    struct fuse_evloop_fd *efd;
+    int res;
+
+    efd = calloc(1, sizeof(struct fuse_evloop_fd));
+    if (efd == NULL)
+        return -ENOMEM;
+    efd->fd = fd;
+    efd->func = func;
+    efd->data = data;
+    res = evloop_register(loop, efd, poll_to_epoll(events));
+    if (res)
+        free(efd);
+    return res;
+}
+
+int fuse_evloop_mod_fd(struct fuse_evloop *loop, int fd, int events)
+{
+    struct fuse_evloop_fd *efd = evloop_get_fd(loop, fd);
+    struct epoll_event event;
+
+    if (efd == NULL || efd->ch)
+        return -ENOENT;
+
+    memset(&event, 0, sizeof(event));
+    event.events = poll_to_epoll(events);
+    event.data.ptr = efd;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &event) == -1)
+        return -errno;
+    return 0;
+}
+
+int fuse_evloop_del_fd(struct fuse_evloop *loop, int fd)
+{
+    struct fuse_evloop_fd *efd = evloop_get_fd(loop, fd);
+    int res = 0;
+
+    if (efd == NULL || efd->ch)
+        return -ENOENT;
+
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL) == -1)
+        res = -errno;
+    loop->fds[fd] = NULL;
+    /* Events already returned by epoll_wait() may still refer to it */
+    efd->fd = -1;
+    efd->next = loop->dead;
+    loop->dead = efd;
+    return res;
+}
+
+static void timer_set(struct fuse_evloop *loop, size_t i,
+                      struct fuse_evloop_timer *t)
+{
+    loop->timers[i] = t;
+    t->index = i;
+}
+
+static void timer_up(struct fuse_evloop *loop, size_t i)
+{
+    struct fuse_evloop_timer *t = loop->timers[i];
+
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!time_before(&t->expires, &loop->timers[parent]->expires))
+            break;
+        timer_set(loop, i, loop->timers[parent]);
+        i = parent;
+    }
+    timer_set(loop, i, t);
+}
+
+static void timer_down(struct fuse_evloop *loop, size_t i)
+{
+    struct fuse_evloop_timer *t = loop->timers[i];
+
+    while (1) {
+        size_t child = 2 * i + 1;
+        if (child >= loop->ntimers)
+            break;
+        if (child + 1 < loop->ntimers &&
+            time_before(&loop->timers[child + 1]->expires,
+                        &loop->timers[child]->expires))
+            child++;
+        if (!time_before(&loop->timers[child]->expires, &t->expires))
+            break;
+        timer_set(loop, i, loop->timers[child]);
+        i = child;
+    }
+    timer_set(loop, i, t);
+}
+
+static void timer_remove(struct fuse_evloop *loop, struct fuse_evloop_timer *t)
+{
+    size_t i = t->index;
+    struct fuse_evloop_timer *last = loop->timers[--loop->ntimers];
+
+    if (last != t) {
+        timer_set(loop, i, last);
+        timer_up(loop, i);
+        timer_down(loop, last->index);
+    }
+}
+
+struct fuse_evloop_timer *fuse_evloop_add_timer(struct fuse_evloop *loop,
+                                                double timeout,
+                                                fuse_evloop_timer_func_t func,
+                                                void *data)
+{
+    struct fuse_evloop_timer *t;
+
+    if (loop->ntimers == loop->timers_size) {
+        size_t newsize = loop->timers_size ? loop->timers_size * 2 : 16;
+        struct fuse_evloop_timer **newtimers;
+
+        newtimers = realloc(loop->timers, newsize * sizeof(loop->timers[0]));
+        if (newtimers == NULL)
+            return NULL;
+        loop->timers = newtimers;
+        loop->timers_size = newsize;
+    }
+    t = malloc(sizeof(struct fuse_evloop_timer));
+    if (t == NULL)
+        return NULL;
+
+    if (timeout < 0)
+        timeout = 0;
+    curr_time(&t->expires);
+    t->expires.tv_sec += (time_t) timeout;
+    t->expires.tv_nsec += (long) ((timeout - (time_t) timeout) * 1.0e9);
+    if (t->expires.tv_nsec >= 1000000000) {
+        t->expires.tv_sec++;
+        t->expires.tv_nsec -= 1000000000;
+    }
+    t->func = func;
+    t->data = data;
+    timer_set(loop, loop->ntimers++, t);
+    timer_up(loop, t->index);
+    return t;
+}
+
+void fuse_evloop_del_timer(struct fuse_evloop *loop,
+                           struct fuse_evloop_timer *timer)
+{
+    /* Freed by evloop_run_timers() once its callback returns */
+    if (timer->index == TIMER_FIRING) {
+        timer->func = NULL;
+        return;
+    }
+    timer_remove(loop, timer);
+    free(timer);
+}
+
+/* Call the expired timers, and return the epoll timeout until the
+   next one in milliseconds, or -1 if there are none */
+static int evloop_run_timers(struct fuse_evloop *loop)
+{
+    struct timespec now;
+
+    curr_time(&now);
+    while (loop->ntimers && !fuse_session_exited(loop->se)) {
+        struct fuse_evloop_timer *t = loop->timers[0];
+        long long msec;
+
+        if (time_before(&now, &t->expires)) {
+            msec = (long long) (t->expires.tv_sec - now.tv_sec) * 1000 +
+                (t->expires.tv_nsec - now.tv_nsec + 999999) / 1000000;
+            return msec > 3600000 ? 3600000 : (int) msec;
+        }
+        timer_remove(loop, t);
+        t->index = TIMER_FIRING;
+        if (t->func)
+            t->func(loop, t->data);
+        free(t);
+        curr_time(&now);
+    }
+    return loop->ntimers ? 0 : -1;
+}
+
+/* Returns 1 if the channel is still open, 0 if it was closed (e.g. by
+   unmounting) and -errno on error, like fuse_session_receive_buf() */
+static int evloop_receive(struct fuse_evloop *loop, struct fuse_chan *ch)
+{
+    struct fuse_session *se = loop->se;
+    int i;
+
+    for (i = 0; i < FUSE_EVLOOP_BATCH && !fuse_session_exited(se); i++) {
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf fbuf = {
+            .mem = loop->buf,
+            .size = loop->bufsize,
+        };
+        int res;
+
+        res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+        if (res == -EINTR)
+            continue;
+        if (res == -EAGAIN)
+            break;
+        if (res <= 0)
+            return res;
+        fuse_session_process_buf(se, &fbuf, tmpch);
+    }
+    return 1;
+}
+
+int fuse_evloop_run(struct fuse_evloop *loop)
+{
+    struct fuse_session *se = loop->se;
+    struct epoll_event events[FUSE_EVLOOP_EVENTS];
+    int res = 1;
+
+    while (res > 0 && !fuse_session_exited(se)) {
+        int timeout = evloop_run_timers(loop);
+        int n;
+        int i;
+
+        if (fuse_session_exited(se))
+            break;
+
+        n = epoll_wait(loop->epfd, events, FUSE_EVLOOP_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            perror("fuse: epoll_wait");
+            res = -1;
+            break;
+        }
+        for (i = 0; i < n && res > 0 && !fuse_session_exited(se); i++) {
+            struct fuse_evloop_fd *efd =
+                (struct fuse_evloop_fd *) events[i].data.ptr;
+
+            if (efd->fd == -1)
+                continue;
+            if (efd->ch)
+                res = evloop_receive(loop, efd->ch);
+            else
+                efd->func(loop, efd->fd, epoll_to_poll(events[i].events),
+                          efd->data);
+        }
+        evloop_free_dead(loop);
+    }
+
+    fuse_session_reset(se);
+    return res < 0 ? -1 : 0;
+}
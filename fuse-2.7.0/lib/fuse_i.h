@@ -12,6 +12,18 @@ struct fuse_session;
 struct fuse_chan;
 struct fuse_lowlevel_ops;
 struct fuse_req;
+struct fuse_buf;
+
+/* Thread pool settings for fuse_session_loop_mt(), zero means default */
+struct fuse_mt_conf {
+    unsigned min_threads;
+    unsigned max_threads;
+    unsigned max_idle_threads;
+    unsigned max_queue;
+    int affinity;
+    int reader_thread;
+    int clone_fd;
+};
 
 struct fuse_cmd {
     char *buf;
@@ -26,11 +38,60 @@ struct fuse *fuse_new_common(struct fuse_chan *ch, struct fuse_args *args,
 int fuse_sync_compat_args(struct fuse_args *args);
 
 struct fuse_chan *fuse_kern_chan_new(int fd);
+int fuse_kern_chan_is(struct fuse_chan *ch);
+struct fuse_chan *fuse_kern_chan_clone(struct fuse_chan *ch);
+int fuse_kern_chan_receive_splice(struct fuse_chan **chp, int pipefd,
+                                  size_t size);
+int fuse_kern_chan_send_splice(struct fuse_chan *ch, int pipefd, size_t len,
+                               int move);
 
 struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
                                        const struct fuse_lowlevel_ops *op,
                                        size_t op_size, void *userdata);
 
+size_t fuse_get_direntry(const char *buf, size_t bufsize, const char **name,
+                         size_t *namelen, struct stat *stbuf, off_t *off);
+
+struct fuse_mt_conf *fuse_session_mt_conf(struct fuse_session *se);
+void *fuse_session_data(struct fuse_session *se);
+void fuse_session_set_buf_ops(struct fuse_session *se,
+                              int (*receive_buf) (void *, struct fuse_buf *,
+                                                  struct fuse_chan **),
+                              void (*process_buf) (void *,
+                                                   const struct fuse_buf *,
+                                                   struct fuse_chan *));
+void fuse_session_set_check_signals(struct fuse_session *se,
+                                    void (*check_signals) (void *));
+void fuse_session_check_signals(struct fuse_session *se);
+
+/* Request tracing, see fuse_trace.c */
+#define FUSE_TRACE_DEFAULT_SIZE 16384
+
+extern int fuse_trace_enabled;
+
+int fuse_trace_init(unsigned size, const char *file, int signum);
+void fuse_trace_destroy(void);
+uint64_t fuse_trace_now(void);
+void fuse_trace_span(const char *name, uint64_t start);
+void fuse_trace_async(const char *name, uint64_t unique, const char *op,
+                      uint64_t start);
+void fuse_trace_set_request(uint64_t unique, const char *op);
+int fuse_trace_dump(const char *path);
+void fuse_trace_check_signal(void);
+
+/* Start of a span, zero if not tracing */
+static inline uint64_t fuse_trace_begin(void)
+{
+    return fuse_trace_enabled ? fuse_trace_now() : 0;
+}
+
+/* Record a span of the calling thread's request ending now */
+static inline void fuse_trace_end(const char *name, uint64_t start)
+{
+    if (start)
+        fuse_trace_span(name, start);
+}
+
 void fuse_kern_unmount_compat22(const char *mountpoint);
 void fuse_kern_unmount(const char *mountpoint, int fd);
 int fuse_kern_mount(const char *mountpoint, struct fuse_args *args);
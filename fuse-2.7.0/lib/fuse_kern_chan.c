@@ -6,6 +6,9 @@
     See the file COPYING.LIB
 */
 
+/* For splice() */
+#define _GNU_SOURCE
+
 #include "fuse_lowlevel.h"
 #include "fuse_kernel.h"
 #include "fuse_i.h"
@@ -13,7 +16,26 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <assert.h>
+#include <sys/ioctl.h>
+
+/* Channel data of all kernel channels, to tell them from other channels */
+static char fuse_kern_chan_tag;
+
+static int fuse_kern_chan_recv_error(struct fuse_session *se, int err)
+{
+    if (err == ENODEV) {
+        fuse_session_exit(se);
+        return 0;
+    }
+    /* Errors occuring during normal operation: EINTR (read
+       interrupted), EAGAIN (nonblocking I/O), ENODEV (filesystem
+       umounted) */
+    if (err != EINTR && err != EAGAIN)
+        perror("fuse: reading device");
+    return -err;
+}
 
 static int fuse_kern_chan_receive(struct fuse_chan **chp, char *buf,
                                   size_t size)
@@ -36,16 +58,7 @@ static int fuse_kern_chan_receive(struct fuse_chan **chp, char *buf,
         if (err == ENOENT)
             goto restart;
 
-        if (err == ENODEV) {
-            fuse_session_exit(se);
-            return 0;
-        }
-        /* Errors occuring during normal operation: EINTR (read
-           interrupted), EAGAIN (nonblocking I/O), ENODEV (filesystem
-           umounted) */
-        if (err != EINTR && err != EAGAIN)
-            perror("fuse: reading device");
-        return -err;
+        return fuse_kern_chan_recv_error(se, err);
     }
     if ((size_t) res < sizeof(struct fuse_in_header)) {
         fprintf(stderr, "short read on fuse device\n");
@@ -75,6 +88,126 @@ static int fuse_kern_chan_send(struct fuse_chan *ch, const struct iovec iov[],
     return 0;
 }
 
+#ifdef SPLICE_F_MOVE
+
+/* Move the next request from the device into a pipe.  Returns -EINVAL
+   if the device doesn't support splicing */
+int fuse_kern_chan_receive_splice(struct fuse_chan **chp, int pipefd,
+                                  size_t size)
+{
+    struct fuse_chan *ch = *chp;
+    int err;
+    ssize_t res;
+    struct fuse_session *se = fuse_chan_session(ch);
+    assert(se != NULL);
+
+ restart:
+    res = splice(fuse_chan_fd(ch), NULL, pipefd, NULL, size, 0);
+    err = errno;
+
+    if (fuse_session_exited(se))
+        return 0;
+    if (res == -1) {
+        if (err == ENOENT)
+            goto restart;
+        if (err == EINVAL)
+            return -EINVAL;
+
+        return fuse_kern_chan_recv_error(se, err);
+    }
+    if ((size_t) res < sizeof(struct fuse_in_header)) {
+        fprintf(stderr, "short splice from fuse device\n");
+        return -EIO;
+    }
+    return res;
+}
+
+/* Move a complete reply, header included, from a pipe to the device */
+int fuse_kern_chan_send_splice(struct fuse_chan *ch, int pipefd, size_t len,
+                               int move)
+{
+    ssize_t res = splice(pipefd, NULL, fuse_chan_fd(ch), NULL, len,
+                         move ? SPLICE_F_MOVE : 0);
+    int err = errno;
+
+    if (res == -1) {
+        struct fuse_session *se = fuse_chan_session(ch);
+
+        assert(se != NULL);
+
+        if (err == EINVAL)
+            return -EINVAL;
+        /* ENOENT means the operation was interrupted */
+        if (!fuse_session_exited(se) && err != ENOENT)
+            perror("fuse: splicing to device");
+        return -err;
+    }
+    if ((size_t) res != len) {
+        fprintf(stderr, "short splice to fuse device\n");
+        return -EIO;
+    }
+    return 0;
+}
+
+#else /* SPLICE_F_MOVE */
+
+int fuse_kern_chan_receive_splice(struct fuse_chan **chp, int pipefd,
+                                  size_t size)
+{
+    (void) chp;
+    (void) pipefd;
+    (void) size;
+    return -EINVAL;
+}
+
+int fuse_kern_chan_send_splice(struct fuse_chan *ch, int pipefd, size_t len,
+                               int move)
+{
+    (void) ch;
+    (void) pipefd;
+    (void) len;
+    (void) move;
+    return -EINVAL;
+}
+
+#endif /* SPLICE_F_MOVE */
+
+int fuse_kern_chan_is(struct fuse_chan *ch)
+{
+    return fuse_chan_data(ch) == &fuse_kern_chan_tag;
+}
+
+/*
+ * Open a new device file attached to the same connection, with its
+ * own request queue.  Returns NULL if the kernel doesn't support
+ * cloning, in which case the caller should keep sharing the channel.
+ */
+struct fuse_chan *fuse_kern_chan_clone(struct fuse_chan *ch)
+{
+    struct fuse_chan *clone;
+    uint32_t masterfd = fuse_chan_fd(ch);
+    int fd;
+
+    fd = open("/dev/fuse", O_RDWR);
+    if (fd == -1) {
+        perror("fuse: failed to open /dev/fuse");
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if (ioctl(fd, FUSE_DEV_IOC_CLONE, &masterfd) == -1) {
+        if (errno != ENOTTY && errno != EINVAL)
+            perror("fuse: failed to clone device fd");
+        close(fd);
+        return NULL;
+    }
+
+    clone = fuse_kern_chan_new(fd);
+    if (clone == NULL)
+        close(fd);
+    return clone;
+}
+
 static void fuse_kern_chan_destroy(struct fuse_chan *ch)
 {
     close(fuse_chan_fd(ch));
@@ -91,5 +224,5 @@ struct fuse_chan *fuse_kern_chan_new(int fd)
     };
     size_t bufsize = getpagesize() + 0x1000;
     bufsize = bufsize < MIN_BUFSIZE ? MIN_BUFSIZE : bufsize;
-    return fuse_chan_new(&op, fd, bufsize, NULL);
+    return fuse_chan_new(&op, fd, bufsize, &fuse_kern_chan_tag);
 }
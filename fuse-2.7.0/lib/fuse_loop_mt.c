@@ -6,9 +6,13 @@
     See the file COPYING.LIB.
 */
 
+/* For pthread_setaffinity_np() */
+#define _GNU_SOURCE
+
 #include "fuse_lowlevel.h"
 #include "fuse_misc.h"
 #include "fuse_kernel.h"
+#include "fuse_i.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,27 +21,62 @@
 #include <signal.h>
 #include <semaphore.h>
 #include <errno.h>
+#include <sched.h>
 #include <sys/time.h>
 
+/* Idle worker threads kept around, unless max_idle_threads is given */
+#define FUSE_DEFAULT_MAX_IDLE_THREADS 10
+
+/* A request read by the reader thread, waiting for a worker */
+struct fuse_mt_buf {
+    struct fuse_mt_buf *next;
+    struct fuse_chan *ch;
+    size_t len;
+    char *mem;
+    /* Time of queueing, if tracing */
+    uint64_t queued;
+};
+
+struct fuse_mt_queue {
+    pthread_mutex_t lock;
+    struct fuse_mt_buf *head;
+    struct fuse_mt_buf *tail;
+};
+
 struct fuse_worker {
     struct fuse_worker *prev;
     struct fuse_worker *next;
     pthread_t thread_id;
     size_t bufsize;
     char *buf;
+    int index;
     struct fuse_mt *mt;
+    /* Cloned device channel, if the worker has its own */
+    struct fuse_chan *ch;
 };
 
 struct fuse_mt {
     pthread_mutex_t lock;
     int numworker;
     int numavail;
+    int numstarted;
     struct fuse_session *se;
     struct fuse_chan *prevch;
     struct fuse_worker main;
     sem_t finish;
     int exit;
     int error;
+    struct fuse_mt_conf conf;
+    int ncpus;
+
+    /* Only used with a reader thread */
+    struct fuse_mt_queue *queues;
+    int numqueues;
+    int nextqueue;
+    struct fuse_mt_buf *bufs;
+    struct fuse_mt_buf *freebufs;
+    sem_t work;
+    sem_t free;
 };
 
 static void list_add_worker(struct fuse_worker *w, struct fuse_worker *next)
@@ -57,7 +96,26 @@ static void list_del_worker(struct fuse_worker *w)
     next->prev = prev;
 }
 
-static int fuse_start_thread(struct fuse_mt *mt);
+static void fuse_set_affinity(struct fuse_mt *mt, struct fuse_worker *w)
+{
+#ifdef __linux__
+    cpu_set_t cpus;
+    int res;
+
+    CPU_ZERO(&cpus);
+    CPU_SET(w->index % mt->ncpus, &cpus);
+    res = pthread_setaffinity_np(w->thread_id, sizeof(cpus), &cpus);
+    if (res != 0)
+        fprintf(stderr, "fuse: failed to set thread affinity: %s\n",
+                strerror(res));
+#else
+    (void) mt;
+    (void) w;
+#endif
+}
+
+static int fuse_start_thread(struct fuse_mt *mt, void *(*func)(void *),
+                             int withbuf);
 
 static void *fuse_do_work(void *data)
 {
@@ -66,8 +124,12 @@ static void *fuse_do_work(void *data)
 
     while (!fuse_session_exited(mt->se)) {
         int isforget = 0;
-        struct fuse_chan *ch = mt->prevch;
-        int res = fuse_chan_recv(&ch, w->buf, w->bufsize);
+        struct fuse_chan *ch = w->ch ? w->ch : mt->prevch;
+        struct fuse_buf fbuf = {
+            .mem = w->buf,
+            .size = w->bufsize,
+        };
+        int res = fuse_session_receive_buf(mt->se, &fbuf, &ch);
         if (res == -EINTR)
             continue;
         if (res <= 0) {
@@ -88,21 +150,30 @@ static void *fuse_do_work(void *data)
          * This disgusting hack is needed so that zillions of threads
          * are not created on a burst of FORGET messages
          */
-        if (((struct fuse_in_header *) w->buf)->opcode == FUSE_FORGET)
-            isforget = 1;
+        if (!(fbuf.flags & FUSE_BUF_IS_FD)) {
+            struct fuse_in_header *in = (struct fuse_in_header *) w->buf;
+            if (in->opcode == FUSE_FORGET ||
+                in->opcode == FUSE_BATCH_FORGET)
+                isforget = 1;
+        }
 
         if (!isforget)
             mt->numavail--;
-        if (mt->numavail == 0)
-            fuse_start_thread(mt);
+        if (mt->numavail == 0 && (!mt->conf.max_threads ||
+            (unsigned) mt->numworker < mt->conf.max_threads))
+            fuse_start_thread(mt, fuse_do_work, 1);
         pthread_mutex_unlock(&mt->lock);
 
-        fuse_session_process(mt->se, w->buf, res, ch);
+        fuse_session_process_buf(mt->se, &fbuf, ch);
 
+        /*
+         * Workers started for a burst go away once it's over, but up to
+         * max_idle_threads idle ones are kept for the next one
+         */
         pthread_mutex_lock(&mt->lock);
         if (!isforget)
             mt->numavail++;
-        if (mt->numavail > 10) {
+        if ((unsigned) mt->numavail > mt->conf.max_idle_threads) {
             if (mt->exit) {
                 pthread_mutex_unlock(&mt->lock);
                 return NULL;
@@ -110,9 +181,14 @@ static void *fuse_do_work(void *data)
             list_del_worker(w);
             mt->numavail--;
             mt->numworker--;
+            /* Channels are added to the session under mt->lock */
+            if (w->ch)
+                fuse_session_remove_chan(w->ch);
             pthread_mutex_unlock(&mt->lock);
 
             pthread_detach(w->thread_id);
+            if (w->ch)
+                fuse_chan_destroy(w->ch);
             free(w->buf);
             free(w);
             return NULL;
@@ -126,7 +202,137 @@ static void *fuse_do_work(void *data)
     return NULL;
 }
 
-static int fuse_start_thread(struct fuse_mt *mt)
+static void fuse_mt_enqueue(struct fuse_mt *mt, struct fuse_mt_buf *b)
+{
+    struct fuse_mt_queue *q = &mt->queues[mt->nextqueue];
+
+    mt->nextqueue = (mt->nextqueue + 1) % mt->numqueues;
+    b->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail)
+        q->tail->next = b;
+    else
+        q->head = b;
+    q->tail = b;
+    pthread_mutex_unlock(&q->lock);
+    sem_post(&mt->work);
+}
+
+static struct fuse_mt_buf *fuse_mt_pop(struct fuse_mt_queue *q)
+{
+    struct fuse_mt_buf *b;
+
+    pthread_mutex_lock(&q->lock);
+    b = q->head;
+    if (b) {
+        q->head = b->next;
+        if (!q->head)
+            q->tail = NULL;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return b;
+}
+
+/* Take a request from our own queue, or steal one from another worker */
+static struct fuse_mt_buf *fuse_mt_dequeue(struct fuse_mt *mt, int index)
+{
+    struct fuse_mt_buf *b;
+    int i;
+
+    while (1) {
+        for (i = 0; i < mt->numqueues; i++) {
+            b = fuse_mt_pop(&mt->queues[(index + i) % mt->numqueues]);
+            if (b)
+                return b;
+        }
+        /* Raced with another thief, our request is in a queue already
+           scanned.  There must be one, since we got past the semaphore */
+        sched_yield();
+    }
+}
+
+static void *fuse_do_queued_work(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+
+    while (1) {
+        struct fuse_mt_buf *b;
+
+        if (sem_wait(&mt->work) == -1)
+            continue;
+
+        b = fuse_mt_dequeue(mt, w->index);
+        if (b->queued)
+            fuse_trace_async("queue",
+                             ((struct fuse_in_header *) b->mem)->unique,
+                             NULL, b->queued);
+        fuse_session_process(mt->se, b->mem, b->len, b->ch);
+
+        pthread_mutex_lock(&mt->lock);
+        b->next = mt->freebufs;
+        mt->freebufs = b;
+        pthread_mutex_unlock(&mt->lock);
+        sem_post(&mt->free);
+    }
+
+    return NULL;
+}
+
+static void *fuse_do_read(void *data)
+{
+    struct fuse_worker *w = (struct fuse_worker *) data;
+    struct fuse_mt *mt = w->mt;
+
+    while (!fuse_session_exited(mt->se)) {
+        struct fuse_mt_buf *b;
+        uint64_t trace_start;
+        int res;
+
+        /* Blocks while max_queue requests are waiting or in progress */
+        if (sem_wait(&mt->free) == -1)
+            continue;
+
+        pthread_mutex_lock(&mt->lock);
+        b = mt->freebufs;
+        mt->freebufs = b->next;
+        pthread_mutex_unlock(&mt->lock);
+
+        /* The request is handed to another thread, so it can't be left
+           in this thread's splice pipe */
+        b->ch = mt->prevch;
+        fuse_session_check_signals(mt->se);
+        trace_start = fuse_trace_begin();
+        res = fuse_chan_recv(&b->ch, b->mem, w->bufsize);
+        if (res <= 0) {
+            pthread_mutex_lock(&mt->lock);
+            b->next = mt->freebufs;
+            mt->freebufs = b;
+            pthread_mutex_unlock(&mt->lock);
+            sem_post(&mt->free);
+            if (res == -EINTR)
+                continue;
+            if (res < 0) {
+                fuse_session_exit(mt->se);
+                mt->error = -1;
+            }
+            break;
+        }
+
+        fuse_trace_end("read", trace_start);
+        b->len = res;
+        b->queued = fuse_trace_begin();
+        fuse_mt_enqueue(mt, b);
+    }
+
+    sem_post(&mt->finish);
+    pause();
+
+    return NULL;
+}
+
+static int fuse_start_thread(struct fuse_mt *mt, void *(*func)(void *),
+                             int withbuf)
 {
     sigset_t oldset;
     sigset_t newset;
@@ -138,12 +344,26 @@ static int fuse_start_thread(struct fuse_mt *mt)
     }
     memset(w, 0, sizeof(struct fuse_worker));
     w->bufsize = fuse_chan_bufsize(mt->prevch);
-    w->buf = malloc(w->bufsize);
     w->mt = mt;
-    if (!w->buf) {
-        fprintf(stderr, "fuse: failed to allocate read buffer\n");
-        free(w);
-        return -1;
+    w->index = mt->numstarted;
+    if (withbuf) {
+        w->buf = malloc(w->bufsize);
+        if (!w->buf) {
+            fprintf(stderr, "fuse: failed to allocate read buffer\n");
+            free(w);
+            return -1;
+        }
+    }
+    /*
+     * The first worker reads the mounted device, the others each get a
+     * clone of it, so that worker N reads the kernel queue of CPU N
+     */
+    if (withbuf && mt->conf.clone_fd && w->index > 0) {
+        w->ch = fuse_kern_chan_clone(mt->prevch);
+        if (w->ch)
+            fuse_session_add_chan(mt->se, w->ch);
+        else
+            mt->conf.clone_fd = 0;
     }
 
     /* Disallow signal reception in worker threads */
@@ -153,14 +373,19 @@ static int fuse_start_thread(struct fuse_mt *mt)
     sigaddset(&newset, SIGHUP);
     sigaddset(&newset, SIGQUIT);
     pthread_sigmask(SIG_BLOCK, &newset, &oldset);
-    res = pthread_create(&w->thread_id, NULL, fuse_do_work, w);
+    res = pthread_create(&w->thread_id, NULL, func, w);
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
     if (res != 0) {
         fprintf(stderr, "fuse: error creating thread: %s\n", strerror(res));
+        if (w->ch)
+            fuse_chan_destroy(w->ch);
         free(w->buf);
         free(w);
         return -1;
     }
+    mt->numstarted++;
+    if (mt->conf.affinity && func != fuse_do_read)
+        fuse_set_affinity(mt, w);
     list_add_worker(w, &mt->main);
     mt->numavail ++;
     mt->numworker ++;
@@ -173,11 +398,81 @@ static void fuse_join_worker(struct fuse_mt *mt, struct fuse_worker *w)
     pthread_join(w->thread_id, NULL);
     pthread_mutex_lock(&mt->lock);
     list_del_worker(w);
+    if (w->ch)
+        fuse_session_remove_chan(w->ch);
     pthread_mutex_unlock(&mt->lock);
+    if (w->ch)
+        fuse_chan_destroy(w->ch);
     free(w->buf);
     free(w);
 }
 
+static int fuse_start_queues(struct fuse_mt *mt)
+{
+    size_t bufsize = fuse_chan_bufsize(mt->prevch);
+    unsigned i;
+
+    mt->numqueues = mt->conf.max_threads;
+    mt->queues = calloc(mt->numqueues, sizeof(struct fuse_mt_queue));
+    mt->bufs = calloc(mt->conf.max_queue, sizeof(struct fuse_mt_buf));
+    if (!mt->queues || !mt->bufs) {
+        fprintf(stderr, "fuse: failed to allocate request queues\n");
+        return -1;
+    }
+    sem_init(&mt->work, 0, 0);
+    sem_init(&mt->free, 0, 0);
+    for (i = 0; i < (unsigned) mt->numqueues; i++)
+        fuse_mutex_init(&mt->queues[i].lock);
+
+    for (i = 0; i < mt->conf.max_queue; i++) {
+        struct fuse_mt_buf *b = &mt->bufs[i];
+        b->mem = malloc(bufsize);
+        if (!b->mem) {
+            fprintf(stderr, "fuse: failed to allocate read buffer\n");
+            return -1;
+        }
+        b->next = mt->freebufs;
+        mt->freebufs = b;
+        sem_post(&mt->free);
+    }
+
+    for (i = 0; i < mt->conf.max_threads; i++)
+        if (fuse_start_thread(mt, fuse_do_queued_work, 0) == -1)
+            return -1;
+
+    return fuse_start_thread(mt, fuse_do_read, 0);
+}
+
+static void fuse_free_queues(struct fuse_mt *mt)
+{
+    unsigned i;
+
+    if (mt->queues && mt->bufs) {
+        for (i = 0; i < (unsigned) mt->numqueues; i++)
+            pthread_mutex_destroy(&mt->queues[i].lock);
+        for (i = 0; i < mt->conf.max_queue; i++)
+            free(mt->bufs[i].mem);
+        sem_destroy(&mt->work);
+        sem_destroy(&mt->free);
+    }
+    free(mt->queues);
+    free(mt->bufs);
+}
+
+static int fuse_start_workers(struct fuse_mt *mt)
+{
+    unsigned i;
+
+    if (mt->conf.reader_thread)
+        return fuse_start_queues(mt);
+
+    for (i = 0; i < mt->conf.min_threads; i++)
+        if (fuse_start_thread(mt, fuse_do_work, 1) == -1)
+            return -1;
+
+    return 0;
+}
+
 int fuse_session_loop_mt(struct fuse_session *se)
 {
     int err;
@@ -192,28 +487,54 @@ int fuse_session_loop_mt(struct fuse_session *se)
     mt.numavail = 0;
     mt.main.thread_id = pthread_self();
     mt.main.prev = mt.main.next = &mt.main;
+    mt.conf = *fuse_session_mt_conf(se);
+    if (!fuse_kern_chan_is(mt.prevch))
+        mt.conf.clone_fd = 0;
+    mt.ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (mt.ncpus < 1)
+        mt.ncpus = 1;
+    if (!mt.conf.min_threads)
+        mt.conf.min_threads = 1;
+    if (mt.conf.reader_thread) {
+        if (!mt.conf.max_threads)
+            mt.conf.max_threads = mt.ncpus;
+        if (!mt.conf.max_queue)
+            mt.conf.max_queue = 2 * mt.conf.max_threads;
+    } else {
+        /* Workers are started on demand, without a limit by default */
+        if (mt.conf.max_threads &&
+            mt.conf.min_threads > mt.conf.max_threads)
+            mt.conf.min_threads = mt.conf.max_threads;
+        if (!mt.conf.max_idle_threads)
+            mt.conf.max_idle_threads = FUSE_DEFAULT_MAX_IDLE_THREADS;
+        if (mt.conf.max_idle_threads < mt.conf.min_threads)
+            mt.conf.max_idle_threads = mt.conf.min_threads;
+    }
     sem_init(&mt.finish, 0, 0);
     fuse_mutex_init(&mt.lock);
 
     pthread_mutex_lock(&mt.lock);
-    err = fuse_start_thread(&mt);
+    err = fuse_start_workers(&mt);
     pthread_mutex_unlock(&mt.lock);
     if (!err) {
         /* sem_wait() is interruptible */
         while (!fuse_session_exited(se))
             sem_wait(&mt.finish);
+    }
 
-        for (w = mt.main.next; w != &mt.main; w = w->next)
-            pthread_cancel(w->thread_id);
-        mt.exit = 1;
-        pthread_mutex_unlock(&mt.lock);
+    pthread_mutex_lock(&mt.lock);
+    for (w = mt.main.next; w != &mt.main; w = w->next)
+        pthread_cancel(w->thread_id);
+    mt.exit = 1;
+    pthread_mutex_unlock(&mt.lock);
 
-        while (mt.main.next != &mt.main)
-            fuse_join_worker(&mt, mt.main.next);
+    while (mt.main.next != &mt.main)
+        fuse_join_worker(&mt, mt.main.next);
 
+    if (!err)
         err = mt.error;
-    }
 
+    fuse_free_queues(&mt);
     pthread_mutex_destroy(&mt.lock);
     sem_destroy(&mt.finish);
     fuse_session_reset(se);
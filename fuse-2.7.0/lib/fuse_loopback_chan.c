@@ -0,0 +1,186 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPL.
+    See the file COPYING.LIB
+*/
+
+/*
+ * In-process channel, standing in for /dev/fuse.  Requests are handed
+ * directly to fuse_session_process() by the caller, and the replies
+ * sent by the filesystem are captured into the caller's buffer.  This
+ * makes it possible to drive the library's request path without a
+ * mounted filesystem or the kernel module.
+ */
+
+#include "fuse_lowlevel.h"
+#include "fuse_kernel.h"
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+struct fuse_loopback {
+    /* Serializes fuse_loopback_chan_process() callers */
+    pthread_mutex_t req_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int waiting;
+    int done;
+    uint64_t unique;
+    char *reply;
+    size_t size;
+    size_t len;
+    unsigned long stray;
+};
+
+#define MIN_BUFSIZE 0x21000
+
+static int fuse_loopback_chan_receive(struct fuse_chan **chp, char *buf,
+                                      size_t size)
+{
+    struct fuse_session *se = fuse_chan_session(*chp);
+
+    (void) buf;
+    (void) size;
+
+    /* Requests are only ever pushed by fuse_loopback_chan_process(),
+       so a session loop on this channel behaves as if unmounted */
+    if (se)
+        fuse_session_exit(se);
+    return 0;
+}
+
+static void fuse_loopback_complete(struct fuse_loopback *lb, size_t len)
+{
+    lb->len = len;
+    lb->done = 1;
+    pthread_cond_signal(&lb->cond);
+}
+
+static int fuse_loopback_chan_send(struct fuse_chan *ch,
+                                   const struct iovec iov[], size_t count)
+{
+    struct fuse_loopback *lb = (struct fuse_loopback *) fuse_chan_data(ch);
+    const struct fuse_out_header *out;
+    size_t len;
+    size_t i;
+
+    pthread_mutex_lock(&lb->lock);
+    if (!lb->waiting || lb->done) {
+        lb->stray++;
+        goto out;
+    }
+    if (!iov) {
+        /* fuse_reply_none(): the request is finished without a reply */
+        fuse_loopback_complete(lb, 0);
+        goto out;
+    }
+    out = (const struct fuse_out_header *) iov[0].iov_base;
+    if (iov[0].iov_len < sizeof(*out) || out->unique != lb->unique) {
+        lb->stray++;
+        goto out;
+    }
+    len = 0;
+    for (i = 0; i < count; i++) {
+        size_t copy = iov[i].iov_len;
+        if (len < lb->size) {
+            if (copy > lb->size - len)
+                copy = lb->size - len;
+            memcpy(lb->reply + len, iov[i].iov_base, copy);
+        }
+        len += iov[i].iov_len;
+    }
+    fuse_loopback_complete(lb, len);
+ out:
+    pthread_mutex_unlock(&lb->lock);
+    return 0;
+}
+
+static void fuse_loopback_chan_destroy(struct fuse_chan *ch)
+{
+    struct fuse_loopback *lb = (struct fuse_loopback *) fuse_chan_data(ch);
+
+    if (lb->stray)
+        fprintf(stderr, "fuse: loopback channel dropped %lu stray replies\n",
+                lb->stray);
+    pthread_cond_destroy(&lb->cond);
+    pthread_mutex_destroy(&lb->lock);
+    pthread_mutex_destroy(&lb->req_lock);
+    free(lb);
+}
+
+struct fuse_chan *fuse_loopback_chan_new(size_t bufsize)
+{
+    struct fuse_chan_ops op = {
+        .receive = fuse_loopback_chan_receive,
+        .send = fuse_loopback_chan_send,
+        .destroy = fuse_loopback_chan_destroy,
+    };
+    struct fuse_loopback *lb;
+    struct fuse_chan *ch;
+
+    lb = (struct fuse_loopback *) calloc(1, sizeof(struct fuse_loopback));
+    if (lb == NULL) {
+        fprintf(stderr, "fuse: failed to allocate loopback channel\n");
+        return NULL;
+    }
+    pthread_mutex_init(&lb->req_lock, NULL);
+    pthread_mutex_init(&lb->lock, NULL);
+    pthread_cond_init(&lb->cond, NULL);
+
+    if (bufsize < MIN_BUFSIZE)
+        bufsize = MIN_BUFSIZE;
+    ch = fuse_chan_new(&op, -1, bufsize, lb);
+    if (ch == NULL) {
+        pthread_cond_destroy(&lb->cond);
+        pthread_mutex_destroy(&lb->lock);
+        pthread_mutex_destroy(&lb->req_lock);
+        free(lb);
+    }
+    return ch;
+}
+
+int fuse_loopback_chan_process(struct fuse_chan *ch, const void *req,
+                               size_t len, void *reply, size_t size)
+{
+    struct fuse_loopback *lb = (struct fuse_loopback *) fuse_chan_data(ch);
+    const struct fuse_in_header *in = (const struct fuse_in_header *) req;
+    struct fuse_session *se = fuse_chan_session(ch);
+    int res;
+
+    if (se == NULL || len < sizeof(*in) || in->len != len)
+        return -EINVAL;
+    if (len > fuse_chan_bufsize(ch))
+        return -E2BIG;
+
+    pthread_mutex_lock(&lb->req_lock);
+    pthread_mutex_lock(&lb->lock);
+    lb->waiting = 1;
+    lb->done = 0;
+    lb->unique = in->unique;
+    lb->reply = (char *) reply;
+    lb->size = reply ? size : 0;
+    lb->len = 0;
+    pthread_mutex_unlock(&lb->lock);
+
+    fuse_session_process(se, (const char *) req, len, ch);
+
+    pthread_mutex_lock(&lb->lock);
+    /* An interrupt is never answered by itself */
+    if (in->opcode != FUSE_INTERRUPT) {
+        while (!lb->done)
+            pthread_cond_wait(&lb->cond, &lb->lock);
+    }
+    res = lb->len;
+    lb->waiting = 0;
+    lb->reply = NULL;
+    pthread_mutex_unlock(&lb->lock);
+    pthread_mutex_unlock(&lb->req_lock);
+
+    return res;
+}
@@ -6,6 +6,9 @@
     See the file COPYING.LIB
 */
 
+/* For splice() and vmsplice() */
+#define _GNU_SOURCE
+
 #include "fuse_lowlevel.h"
 #include "fuse_kernel.h"
 #include "fuse_opt.h"
@@ -19,8 +22,14 @@
 #include <stddef.h>
 #include <string.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <limits.h>
 #include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
 
 #define PARAM(inarg) (((char *)(inarg)) + sizeof(*(inarg)))
 #define OFFSET_MAX 0x7fffffffffffffffLL
@@ -35,6 +44,11 @@ struct fuse_req {
     struct fuse_ctx ctx;
     struct fuse_chan *ch;
     int interrupted;
+    unsigned opcode;
+    int error;
+    struct timespec start;
+    uint64_t trace_start;
+    const char *trace_op;
     union {
         struct {
             uint64_t unique;
@@ -60,6 +74,29 @@ struct fuse_ll {
     struct fuse_req interrupts;
     pthread_mutex_t lock;
     int got_destroy;
+    int batch_forget;
+    struct fuse_mt_conf mt_conf;
+    int splice_read;
+    int splice_write;
+    int splice_move;
+    pthread_key_t pipe_key;
+    int stats;
+    unsigned stats_signal;
+    int stats_sigseen;
+    struct sigaction stats_old_sa;
+    pthread_key_t stats_key;
+    struct fuse_ll_stats *stats_list;
+    struct fuse_ll_stats *stats_retired;
+    int trace;
+    unsigned trace_size;
+    char *trace_file;
+    unsigned trace_signal;
+};
+
+/* Per-thread pipe used for splicing to and from the device */
+struct fuse_ll_pipe {
+    size_t size;
+    int pipe[2];
 };
 
 static void convert_stat(const struct stat *stbuf, struct fuse_attr *attr)
@@ -125,17 +162,99 @@ static void list_add_req(struct fuse_req *req, struct fuse_req *next)
     next->prev = req;
 }
 
+/*
+ * Finished requests are kept on a small per-thread freelist, so that the
+ * common case of processing and replying in the same thread doesn't go
+ * through the allocator at all
+ */
+#define FUSE_REQ_CACHE_MAX 32
+
+struct fuse_req_cache {
+    struct fuse_req *head;
+    int count;
+};
+
+static pthread_key_t fuse_req_cache_key;
+static pthread_once_t fuse_req_cache_once = PTHREAD_ONCE_INIT;
+static int fuse_req_cache_ok;
+
+static void fuse_req_cache_free(void *data)
+{
+    struct fuse_req_cache *cache = (struct fuse_req_cache *) data;
+
+    while (cache->head) {
+        struct fuse_req *req = cache->head;
+        cache->head = req->next;
+        free(req);
+    }
+    free(cache);
+}
+
+static void fuse_req_cache_init(void)
+{
+    if (pthread_key_create(&fuse_req_cache_key, fuse_req_cache_free) == 0)
+        fuse_req_cache_ok = 1;
+}
+
+static struct fuse_req_cache *fuse_get_req_cache(void)
+{
+    struct fuse_req_cache *cache;
+
+    pthread_once(&fuse_req_cache_once, fuse_req_cache_init);
+    if (!fuse_req_cache_ok)
+        return NULL;
+
+    cache = (struct fuse_req_cache *) pthread_getspecific(fuse_req_cache_key);
+    if (cache == NULL) {
+        cache = (struct fuse_req_cache *) calloc(1, sizeof(*cache));
+        if (cache != NULL)
+            pthread_setspecific(fuse_req_cache_key, cache);
+    }
+    return cache;
+}
+
+static struct fuse_req *alloc_req(void)
+{
+    struct fuse_req_cache *cache = fuse_get_req_cache();
+    struct fuse_req *req;
+
+    if (cache && cache->head) {
+        req = cache->head;
+        cache->head = req->next;
+        cache->count--;
+        memset(req, 0, sizeof(struct fuse_req));
+        return req;
+    }
+    return (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
+}
+
 static void destroy_req(fuse_req_t req)
 {
+    struct fuse_req_cache *cache;
+
     pthread_mutex_destroy(&req->lock);
-    free(req);
+    cache = fuse_get_req_cache();
+    if (cache && cache->count < FUSE_REQ_CACHE_MAX) {
+        req->next = cache->head;
+        cache->head = req;
+        cache->count++;
+    } else
+        free(req);
 }
 
+static void fuse_ll_stats_end(struct fuse_req *req);
+
 static void free_req(fuse_req_t req)
 {
     int ctr;
     struct fuse_ll *f = req->f;
 
+    if (req->opcode)
+        fuse_ll_stats_end(req);
+    if (req->trace_start)
+        fuse_trace_async(req->trace_op, req->unique, req->trace_op,
+                         req->trace_start);
+
     pthread_mutex_lock(&req->lock);
     req->u.ni.func = NULL;
     req->u.ni.data = NULL;
@@ -160,6 +279,7 @@ static int send_reply_iov(fuse_req_t req, int error, struct iovec *iov,
         error = -ERANGE;
     }
 
+    req->error = error;
     out.unique = req->unique;
     out.error = error;
     iov[0].iov_base = &out;
@@ -189,22 +309,521 @@ static int send_reply(fuse_req_t req, int error, const void *arg,
     return send_reply_iov(req, error, iov, count);
 }
 
+#define FUSE_REPLY_IOV_STACK 16
+
 int fuse_reply_iov(fuse_req_t req, const struct iovec *iov, int count)
 {
     int res;
-    struct iovec *padded_iov;
+    struct iovec stack_iov[FUSE_REPLY_IOV_STACK];
+    struct iovec *padded_iov = stack_iov;
 
-    padded_iov = malloc((count + 1) * sizeof(struct iovec));
-    if (padded_iov == NULL)
-        return fuse_reply_err(req, -ENOMEM);
+    if (count >= FUSE_REPLY_IOV_STACK) {
+        padded_iov = malloc((count + 1) * sizeof(struct iovec));
+        if (padded_iov == NULL)
+            return fuse_reply_err(req, ENOMEM);
+    }
 
     memcpy(padded_iov + 1, iov, count * sizeof(struct iovec));
     count++;
 
     res = send_reply_iov(req, 0, padded_iov, count);
-    free(padded_iov);
+    if (padded_iov != stack_iov)
+        free(padded_iov);
+
+    return res;
+}
+
+size_t fuse_buf_size(const struct fuse_bufvec *bufv)
+{
+    size_t i;
+    size_t size = 0;
+
+    for (i = 0; i < bufv->count; i++) {
+        if (bufv->buf[i].size == SIZE_MAX)
+            size = SIZE_MAX;
+        else
+            size += bufv->buf[i].size;
+    }
+
+    return size;
+}
+
+static ssize_t fuse_buf_write(const struct fuse_buf *dst, size_t dst_off,
+                              const struct fuse_buf *src, size_t src_off,
+                              size_t len)
+{
+    ssize_t res = 0;
+    size_t copied = 0;
+
+    while (len) {
+        if (dst->flags & FUSE_BUF_FD_SEEK)
+            res = pwrite(dst->fd, (char *) src->mem + src_off, len,
+                         dst->pos + dst_off);
+        else
+            res = write(dst->fd, (char *) src->mem + src_off, len);
+        if (res == -1) {
+            if (!copied)
+                return -errno;
+            break;
+        }
+        if (res == 0)
+            break;
+
+        copied += res;
+        if (!(dst->flags & FUSE_BUF_FD_RETRY))
+            break;
+
+        src_off += res;
+        dst_off += res;
+        len -= res;
+    }
+
+    return copied;
+}
+
+static ssize_t fuse_buf_read(const struct fuse_buf *dst, size_t dst_off,
+                             const struct fuse_buf *src, size_t src_off,
+                             size_t len)
+{
+    ssize_t res = 0;
+    size_t copied = 0;
+
+    while (len) {
+        if (src->flags & FUSE_BUF_FD_SEEK)
+            res = pread(src->fd, (char *) dst->mem + dst_off, len,
+                        src->pos + src_off);
+        else
+            res = read(src->fd, (char *) dst->mem + dst_off, len);
+        if (res == -1) {
+            if (!copied)
+                return -errno;
+            break;
+        }
+        if (res == 0)
+            break;
+
+        copied += res;
+        if (!(src->flags & FUSE_BUF_FD_RETRY))
+            break;
+
+        dst_off += res;
+        src_off += res;
+        len -= res;
+    }
+
+    return copied;
+}
+
+/* Copy between two file descriptors through a bounce buffer */
+static ssize_t fuse_buf_fd_to_fd(const struct fuse_buf *dst, size_t dst_off,
+                                 const struct fuse_buf *src, size_t src_off,
+                                 size_t len)
+{
+    char buf[4096];
+    struct fuse_buf tmp = {
+        .size = sizeof(buf),
+        .flags = (enum fuse_buf_flags) 0,
+        .mem = buf,
+    };
+    ssize_t res;
+    size_t copied = 0;
+
+    while (len) {
+        size_t this_len = len < sizeof(buf) ? len : sizeof(buf);
+        size_t read_len;
+
+        res = fuse_buf_read(&tmp, 0, src, src_off, this_len);
+        if (res < 0) {
+            if (!copied)
+                return res;
+            break;
+        }
+        if (res == 0)
+            break;
+
+        read_len = res;
+        res = fuse_buf_write(dst, dst_off, &tmp, 0, read_len);
+        if (res < 0) {
+            if (!copied)
+                return res;
+            break;
+        }
+        if (res == 0)
+            break;
+
+        copied += res;
+        if ((size_t) res < read_len)
+            break;
+
+        dst_off += res;
+        src_off += res;
+        len -= res;
+    }
+
+    return copied;
+}
+
+#ifdef SPLICE_F_MOVE
+static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
+                               const struct fuse_buf *src, size_t src_off,
+                               size_t len, enum fuse_buf_copy_flags flags)
+{
+    int splice_flags = 0;
+    off_t *srcpos = NULL;
+    off_t *dstpos = NULL;
+    off_t srcpos_val;
+    off_t dstpos_val;
+    ssize_t res;
+    size_t copied = 0;
+
+    if (flags & FUSE_BUF_SPLICE_MOVE)
+        splice_flags |= SPLICE_F_MOVE;
+
+    if (src->flags & FUSE_BUF_FD_SEEK) {
+        srcpos_val = src->pos + src_off;
+        srcpos = &srcpos_val;
+    }
+    if (dst->flags & FUSE_BUF_FD_SEEK) {
+        dstpos_val = dst->pos + dst_off;
+        dstpos = &dstpos_val;
+    }
+
+    while (len) {
+        res = splice(src->fd, srcpos, dst->fd, dstpos, len, splice_flags);
+        if (res == -1) {
+            if (copied)
+                break;
+
+            /* Neither end is a pipe, or splicing isn't supported */
+            if (errno == EINVAL)
+                return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
+
+            return -errno;
+        }
+        if (res == 0)
+            break;
+
+        copied += res;
+        if (!(src->flags & FUSE_BUF_FD_RETRY) &&
+            !(dst->flags & FUSE_BUF_FD_RETRY))
+            break;
+
+        len -= res;
+    }
+
+    return copied;
+}
+#else
+static ssize_t fuse_buf_splice(const struct fuse_buf *dst, size_t dst_off,
+                               const struct fuse_buf *src, size_t src_off,
+                               size_t len, enum fuse_buf_copy_flags flags)
+{
+    (void) flags;
+
+    return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
+}
+#endif
+
+static ssize_t fuse_buf_copy_one(const struct fuse_buf *dst, size_t dst_off,
+                                 const struct fuse_buf *src, size_t src_off,
+                                 size_t len, enum fuse_buf_copy_flags flags)
+{
+    int src_is_fd = src->flags & FUSE_BUF_IS_FD;
+    int dst_is_fd = dst->flags & FUSE_BUF_IS_FD;
+
+    if (!src_is_fd && !dst_is_fd) {
+        memcpy((char *) dst->mem + dst_off, (char *) src->mem + src_off, len);
+        return len;
+    } else if (!src_is_fd) {
+        return fuse_buf_write(dst, dst_off, src, src_off, len);
+    } else if (!dst_is_fd) {
+        return fuse_buf_read(dst, dst_off, src, src_off, len);
+    } else if (flags & FUSE_BUF_NO_SPLICE) {
+        return fuse_buf_fd_to_fd(dst, dst_off, src, src_off, len);
+    } else {
+        return fuse_buf_splice(dst, dst_off, src, src_off, len, flags);
+    }
+}
+
+static const struct fuse_buf *fuse_bufvec_current(struct fuse_bufvec *bufv)
+{
+    if (bufv->idx < bufv->count)
+        return &bufv->buf[bufv->idx];
+    else
+        return NULL;
+}
+
+static int fuse_bufvec_advance(struct fuse_bufvec *bufv, size_t len)
+{
+    const struct fuse_buf *buf = fuse_bufvec_current(bufv);
+
+    bufv->off += len;
+    assert(bufv->off <= buf->size);
+    if (bufv->off == buf->size) {
+        assert(bufv->idx < bufv->count);
+        bufv->idx++;
+        if (bufv->idx == bufv->count)
+            return 0;
+        bufv->off = 0;
+    }
+    return 1;
+}
+
+ssize_t fuse_buf_copy(struct fuse_bufvec *dstv, struct fuse_bufvec *srcv,
+                      enum fuse_buf_copy_flags flags)
+{
+    size_t copied = 0;
+
+    if (dstv == srcv)
+        return fuse_buf_size(dstv);
+
+    for (;;) {
+        const struct fuse_buf *src = fuse_bufvec_current(srcv);
+        const struct fuse_buf *dst = fuse_bufvec_current(dstv);
+        size_t src_len;
+        size_t dst_len;
+        size_t len;
+        ssize_t res;
+
+        if (src == NULL || dst == NULL)
+            break;
+
+        src_len = src->size - srcv->off;
+        dst_len = dst->size - dstv->off;
+        len = src_len < dst_len ? src_len : dst_len;
+
+        res = fuse_buf_copy_one(dst, dstv->off, src, srcv->off, len, flags);
+        if (res < 0) {
+            if (!copied)
+                return res;
+            break;
+        }
+        copied += res;
+
+        if (!fuse_bufvec_advance(srcv, res) ||
+            !fuse_bufvec_advance(dstv, res))
+            break;
+
+        if ((size_t) res < len)
+            break;
+    }
+
+    return copied;
+}
+
+static void fuse_ll_pipe_free(struct fuse_ll_pipe *llp)
+{
+    close(llp->pipe[0]);
+    close(llp->pipe[1]);
+    free(llp);
+}
+
+static void fuse_ll_pipe_destructor(void *data)
+{
+    fuse_ll_pipe_free((struct fuse_ll_pipe *) data);
+}
+
+/* Throw away the pipe of this thread, e.g. if it has leftover data */
+static void fuse_ll_clear_pipe(struct fuse_ll *f)
+{
+    struct fuse_ll_pipe *llp = pthread_getspecific(f->pipe_key);
+    if (llp) {
+        pthread_setspecific(f->pipe_key, NULL);
+        fuse_ll_pipe_free(llp);
+    }
+}
+
+static struct fuse_ll_pipe *fuse_ll_get_pipe(struct fuse_ll *f,
+                                             struct fuse_chan *ch)
+{
+    size_t bufsize = fuse_chan_bufsize(ch);
+    struct fuse_ll_pipe *llp = pthread_getspecific(f->pipe_key);
+
+    if (llp == NULL) {
+        llp = malloc(sizeof(struct fuse_ll_pipe));
+        if (llp == NULL)
+            return NULL;
+
+        if (pipe(llp->pipe) == -1) {
+            free(llp);
+            return NULL;
+        }
+
+        /* The whole request has to fit into the pipe */
+#ifdef F_SETPIPE_SZ
+        if (fcntl(llp->pipe[0], F_SETPIPE_SZ, bufsize) == -1) {
+            fuse_ll_pipe_free(llp);
+            return NULL;
+        }
+        llp->size = bufsize;
+#else
+        (void) bufsize;
+        fuse_ll_pipe_free(llp);
+        return NULL;
+#endif
+        pthread_setspecific(f->pipe_key, llp);
+    }
+
+    return llp;
+}
+
+static int fuse_ll_pipe_empty(int fd)
+{
+    int avail = 0;
+
+    return ioctl(fd, FIONREAD, &avail) == 0 && avail == 0;
+}
+
+static int read_back(int fd, char *buf, size_t len)
+{
+    ssize_t res = read(fd, buf, len);
+    if (res == -1) {
+        perror("fuse: internal error: failed to read back from pipe");
+        return -1;
+    }
+    if ((size_t) res != len) {
+        fprintf(stderr, "fuse: internal error: short read back from pipe: "
+                "%zi/%zu\n", res, len);
+        return -1;
+    }
+    return 0;
+}
+
+/* Send a reply by copying the data into a memory buffer */
+static int fuse_reply_data_copy(fuse_req_t req, struct fuse_bufvec *bufv,
+                                enum fuse_buf_copy_flags flags)
+{
+    size_t size = fuse_buf_size(bufv);
+    struct fuse_bufvec mem_buf = FUSE_BUFVEC_INIT(size);
+    char *mem;
+    ssize_t res;
+
+    if (bufv->count == 1 && bufv->idx == 0 && bufv->off == 0 &&
+        !(bufv->buf[0].flags & FUSE_BUF_IS_FD))
+        return fuse_reply_buf(req, (const char *) bufv->buf[0].mem, size);
+
+    mem = malloc(size);
+    if (mem == NULL)
+        return fuse_reply_err(req, ENOMEM);
+
+    mem_buf.buf[0].mem = mem;
+    res = fuse_buf_copy(&mem_buf, bufv, flags);
+    if (res < 0)
+        res = fuse_reply_err(req, -res);
+    else
+        res = fuse_reply_buf(req, mem, res);
+    free(mem);
+
+    return res;
+}
+
+/* Reply by splicing the header and the data into the device.  Returns
+   -EAGAIN with the request untouched if the copying path should be
+   used instead */
+static int fuse_reply_data_splice(fuse_req_t req, struct fuse_bufvec *bufv,
+                                  enum fuse_buf_copy_flags flags)
+{
+#ifdef SPLICE_F_MOVE
+    struct fuse_ll *f = req->f;
+    struct fuse_ll_pipe *llp;
+    struct fuse_out_header out;
+    struct iovec iov;
+    struct fuse_bufvec pipe_buf;
+    size_t len = fuse_buf_size(bufv);
+    size_t copied;
+    ssize_t res;
+    char *mem;
+
+    llp = fuse_ll_get_pipe(f, req->ch);
+    if (llp == NULL || len + sizeof(out) > llp->size)
+        return -EAGAIN;
+
+    out.unique = req->unique;
+    out.error = 0;
+    out.len = sizeof(out) + len;
+    iov.iov_base = &out;
+    iov.iov_len = sizeof(out);
+    res = vmsplice(llp->pipe[1], &iov, 1, 0);
+    if (res != sizeof(out)) {
+        fuse_ll_clear_pipe(f);
+        return -EAGAIN;
+    }
+
+    pipe_buf = FUSE_BUFVEC_INIT(len);
+    pipe_buf.buf[0].flags = FUSE_BUF_IS_FD;
+    pipe_buf.buf[0].fd = llp->pipe[1];
+    res = fuse_buf_copy(&pipe_buf, bufv, flags);
+    if (res < 0) {
+        fuse_ll_clear_pipe(f);
+        return fuse_reply_err(req, -res);
+    }
+
+    copied = res;
+    if (copied == len) {
+        if (f->debug)
+            fprintf(stderr, "   unique: %llu, success, outsize: %u (splice)\n",
+                    (unsigned long long) out.unique, out.len);
+
+        res = fuse_kern_chan_send_splice(req->ch, llp->pipe[0], out.len,
+                                         flags & FUSE_BUF_SPLICE_MOVE);
+        if (res != -EINVAL) {
+            if (res)
+                fuse_ll_clear_pipe(f);
+            free_req(req);
+            return res;
+        }
+        /* The device can't take spliced replies, stop trying */
+        f->splice_write = 0;
+    }
+
+    /* Short copy or no device support: fall back to writing what's in
+       the pipe, header excluded */
+    mem = malloc(copied ? copied : 1);
+    if (mem == NULL) {
+        fuse_ll_clear_pipe(f);
+        return fuse_reply_err(req, ENOMEM);
+    }
+    if (read_back(llp->pipe[0], (char *) &out, sizeof(out)) == -1 ||
+        read_back(llp->pipe[0], mem, copied) == -1) {
+        fuse_ll_clear_pipe(f);
+        free(mem);
+        return fuse_reply_err(req, EIO);
+    }
+    res = fuse_reply_buf(req, mem, copied);
+    free(mem);
 
     return res;
+#else
+    (void) req;
+    (void) bufv;
+    (void) flags;
+
+    return -EAGAIN;
+#endif
+}
+
+int fuse_reply_data(fuse_req_t req, struct fuse_bufvec *bufv,
+                    enum fuse_buf_copy_flags flags)
+{
+    struct fuse_ll *f = req->f;
+    size_t i;
+
+    if (f->splice_move)
+        flags |= FUSE_BUF_SPLICE_MOVE;
+
+    if (f->splice_write && !(flags & FUSE_BUF_NO_SPLICE) &&
+        fuse_kern_chan_is(req->ch)) {
+        for (i = bufv->idx; i < bufv->count; i++) {
+            if (bufv->buf[i].flags & FUSE_BUF_IS_FD) {
+                int res = fuse_reply_data_splice(req, bufv, flags);
+                if (res != -EAGAIN)
+                    return res;
+                break;
+            }
+        }
+    }
+
+    return fuse_reply_data_copy(req, bufv, flags);
 }
 
 size_t fuse_dirent_size(size_t namelen)
@@ -244,6 +863,30 @@ size_t fuse_add_direntry(fuse_req_t req, char *buf, size_t bufsize,
     return entsize;
 }
 
+/* Decode an entry added with fuse_add_direntry().  Returns the size
+   of the entry, or zero if the buffer doesn't hold a complete one.
+   The returned name is not NUL terminated */
+size_t fuse_get_direntry(const char *buf, size_t bufsize, const char **name,
+                         size_t *namelen, struct stat *stbuf, off_t *off)
+{
+    const struct fuse_dirent *dirent = (const struct fuse_dirent *) buf;
+    size_t entsize;
+
+    if (bufsize < FUSE_NAME_OFFSET)
+        return 0;
+    entsize = FUSE_DIRENT_SIZE(dirent);
+    if (entsize > bufsize)
+        return 0;
+
+    *name = dirent->name;
+    *namelen = dirent->namelen;
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = dirent->ino;
+    stbuf->st_mode = dirent->type << 12;
+    *off = dirent->off;
+    return entsize;
+}
+
 static void convert_statfs(const struct statvfs *stbuf,
                            struct fuse_kstatfs *kstatfs)
 {
@@ -306,6 +949,31 @@ static void fill_entry(struct fuse_entry_out *arg,
     convert_stat(&e->attr, &arg->attr);
 }
 
+size_t fuse_add_direntry_plus(fuse_req_t req, char *buf, size_t bufsize,
+                              const char *name,
+                              const struct fuse_entry_param *e, off_t off)
+{
+    struct fuse_direntplus *dp = (struct fuse_direntplus *) buf;
+    size_t namelen = strlen(name);
+    size_t entlen = FUSE_NAME_OFFSET_DIRENTPLUS + namelen;
+    size_t entsize = FUSE_DIRENT_ALIGN(entlen);
+
+    (void) req;
+    if (entsize > bufsize || !buf)
+        return entsize;
+
+    memset(&dp->entry_out, 0, sizeof(dp->entry_out));
+    fill_entry(&dp->entry_out, e);
+    dp->dirent.ino = e->attr.st_ino;
+    dp->dirent.off = off;
+    dp->dirent.namelen = namelen;
+    dp->dirent.type = (e->attr.st_mode & 0170000) >> 12;
+    memcpy(dp->dirent.name, name, namelen);
+    memset(buf + entlen, 0, entsize - entlen);
+
+    return entsize;
+}
+
 static void fill_open(struct fuse_open_out *arg,
                       const struct fuse_file_info *f)
 {
@@ -452,6 +1120,51 @@ static void do_forget(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         req->f->op.forget(req, nodeid, arg->nlookup);
 }
 
+static void do_batch_forget(fuse_req_t req, fuse_ino_t nodeid,
+                            const void *inarg)
+{
+    struct fuse_batch_forget_in *arg = (struct fuse_batch_forget_in *) inarg;
+    struct fuse_forget_one *param = (struct fuse_forget_one *) &arg[1];
+    struct fuse_ll *f = req->f;
+    unsigned i;
+
+    (void) nodeid;
+
+    if (f->op.forget_multi) {
+        struct fuse_forget_data *forgets = (struct fuse_forget_data *) param;
+
+        /* Narrow the array in place where fuse_ino_t is 32bit */
+        if (sizeof(struct fuse_forget_data) != sizeof(struct fuse_forget_one)) {
+            for (i = 0; i < arg->count; i++) {
+                fuse_ino_t ino = param[i].nodeid;
+                uint64_t nlookup = param[i].nlookup;
+                forgets[i].ino = ino;
+                forgets[i].nlookup = nlookup;
+            }
+        }
+        f->op.forget_multi(req, arg->count, forgets);
+        return;
+    }
+
+    if (f->op.forget) {
+        for (i = 0; i < arg->count; i++) {
+            struct fuse_req *dummy_req = alloc_req();
+            if (dummy_req == NULL)
+                break;
+
+            dummy_req->f = f;
+            dummy_req->unique = req->unique;
+            dummy_req->ctx = req->ctx;
+            dummy_req->ch = req->ch;
+            dummy_req->ctr = 1;
+            list_init_req(dummy_req);
+            fuse_mutex_init(&dummy_req->lock);
+            f->op.forget(dummy_req, param[i].nodeid, param[i].nlookup);
+        }
+    }
+    fuse_reply_none(req);
+}
+
 static void do_getattr(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     (void) inarg;
@@ -621,6 +1334,33 @@ static void do_read(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_err(req, ENOSYS);
 }
 
+/* The data of the write is either in the payload buffer (if spliced) or
+   follows the arguments in memory */
+static void do_write_buf(fuse_req_t req, fuse_ino_t nodeid, const void *inarg,
+                         const struct fuse_buf *payload)
+{
+    struct fuse_write_in *arg = (struct fuse_write_in *) inarg;
+    struct fuse_bufvec bufv = FUSE_BUFVEC_INIT(arg->size);
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+    fi.fh_old = fi.fh;
+    fi.writepage = arg->write_flags & FUSE_WRITE_CACHE;
+
+    if (payload) {
+        if (payload->size != arg->size) {
+            fprintf(stderr, "fuse: do_write_buf: buffer size mismatch\n");
+            fuse_reply_err(req, EIO);
+            return;
+        }
+        bufv.buf[0] = *payload;
+    } else
+        bufv.buf[0].mem = PARAM(arg);
+
+    req->f->op.write_buf(req, nodeid, &bufv, arg->offset, &fi);
+}
+
 static void do_write(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     struct fuse_write_in *arg = (struct fuse_write_in *) inarg;
@@ -629,9 +1369,11 @@ static void do_write(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     memset(&fi, 0, sizeof(fi));
     fi.fh = arg->fh;
     fi.fh_old = fi.fh;
-    fi.writepage = arg->write_flags & 1;
+    fi.writepage = arg->write_flags & FUSE_WRITE_CACHE;
 
-    if (req->f->op.write)
+    if (req->f->op.write_buf)
+        do_write_buf(req, nodeid, inarg, NULL);
+    else if (req->f->op.write)
         req->f->op.write(req, nodeid, PARAM(arg), arg->size, arg->offset, &fi);
     else
         fuse_reply_err(req, ENOSYS);
@@ -719,6 +1461,22 @@ static void do_readdir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         fuse_reply_err(req, ENOSYS);
 }
 
+static void do_readdirplus(fuse_req_t req, fuse_ino_t nodeid,
+                           const void *inarg)
+{
+    struct fuse_read_in *arg = (struct fuse_read_in *) inarg;
+    struct fuse_file_info fi;
+
+    memset(&fi, 0, sizeof(fi));
+    fi.fh = arg->fh;
+    fi.fh_old = fi.fh;
+
+    if (req->f->op.readdirplus)
+        req->f->op.readdirplus(req, nodeid, arg->size, arg->offset, &fi);
+    else
+        fuse_reply_err(req, ENOSYS);
+}
+
 static void do_releasedir(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
 {
     struct fuse_release_in *arg = (struct fuse_release_in *) inarg;
@@ -957,6 +1715,7 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     struct fuse_init_out outarg;
     struct fuse_ll *f = req->f;
     size_t bufsize = fuse_chan_bufsize(req->ch);
+    unsigned kernel_flags = 0;
 
     (void) nodeid;
     if (f->debug) {
@@ -977,14 +1736,25 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     }
 
     if (arg->major > 7 || (arg->major == 7 && arg->minor >= 6)) {
+        kernel_flags = arg->flags;
         if (f->conn.async_read)
             f->conn.async_read = arg->flags & FUSE_ASYNC_READ;
         if (arg->max_readahead < f->conn.max_readahead)
             f->conn.max_readahead = arg->max_readahead;
+        /* The direntplus layout is that of protocol 7.21, which both
+           sides must speak, or the kernel would misparse the reply */
+        if ((arg->flags & FUSE_DO_READDIRPLUS) && f->op.readdirplus &&
+            arg->minor >= FUSE_READDIRPLUS_MINOR &&
+            FUSE_KERNEL_MINOR_VERSION >= FUSE_READDIRPLUS_MINOR)
+            f->conn.readdirplus = 1;
+        if (arg->flags & FUSE_DO_BATCH_FORGET)
+            f->batch_forget = 1;
     } else {
         f->conn.async_read = 0;
         f->conn.max_readahead = 0;
     }
+    if (!(kernel_flags & FUSE_WRITEBACK_CACHE))
+        f->conn.writeback_cache = 0;
 
     if (bufsize < FUSE_MIN_READ_BUFFER) {
         fprintf(stderr, "fuse: warning: buffer size too small: %zu\n",
@@ -1000,6 +1770,10 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
     if (f->op.init)
         f->op.init(f->userdata, &f->conn);
 
+    /* The filesystem may only turn it on if the kernel offered it */
+    if (!(kernel_flags & FUSE_WRITEBACK_CACHE))
+        f->conn.writeback_cache = 0;
+
     memset(&outarg, 0, sizeof(outarg));
     outarg.major = FUSE_KERNEL_VERSION;
     outarg.minor = FUSE_KERNEL_MINOR_VERSION;
@@ -1007,6 +1781,12 @@ static void do_init(fuse_req_t req, fuse_ino_t nodeid, const void *inarg)
         outarg.flags |= FUSE_ASYNC_READ;
     if (f->op.getlk && f->op.setlk)
         outarg.flags |= FUSE_POSIX_LOCKS;
+    if (f->conn.readdirplus)
+        outarg.flags |= FUSE_DO_READDIRPLUS;
+    if (f->batch_forget)
+        outarg.flags |= FUSE_DO_BATCH_FORGET;
+    if (f->conn.writeback_cache)
+        outarg.flags |= FUSE_WRITEBACK_CACHE;
     outarg.max_readahead = f->conn.max_readahead;
     outarg.max_write = f->conn.max_write;
 
@@ -1106,6 +1886,8 @@ static struct {
     [FUSE_INTERRUPT]   = { do_interrupt,   "INTERRUPT"   },
     [FUSE_BMAP]        = { do_bmap,        "BMAP"        },
     [FUSE_DESTROY]     = { do_destroy,     "DESTROY"     },
+    [FUSE_BATCH_FORGET] = { do_batch_forget, "BATCH_FORGET" },
+    [FUSE_READDIRPLUS] = { do_readdirplus, "READDIRPLUS" },
 };
 
 #define FUSE_MAXOP (sizeof(fuse_ll_ops) / sizeof(fuse_ll_ops[0]))
@@ -1118,12 +1900,264 @@ static const char *opname(enum fuse_opcode opcode)
         return fuse_ll_ops[opcode].name;
 }
 
-static void fuse_ll_process(void *data, const char *buf, size_t len,
-                     struct fuse_chan *ch)
+/*
+ * Request statistics are collected per thread, so that recording them
+ * needs neither locking nor atomic operations.  The counters of exited
+ * threads are folded into stats_retired.
+ */
+struct fuse_ll_stats {
+    struct fuse_ll *f;
+    struct fuse_ll_stats *next;
+    struct fuse_opstats op[FUSE_MAXOP];
+};
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+static volatile sig_atomic_t fuse_ll_stats_signals;
+
+static void curr_time(struct timespec *now)
+{
+    static clockid_t clockid = CLOCK_MONOTONIC;
+    int res = clock_gettime(clockid, now);
+    if (res == -1 && errno == EINVAL) {
+        clockid = CLOCK_REALTIME;
+        res = clock_gettime(clockid, now);
+    }
+    if (res == -1) {
+        perror("fuse: clock_gettime");
+        abort();
+    }
+}
+
+static void fuse_ll_stats_handler(int sig)
+{
+    (void) sig;
+    fuse_ll_stats_signals++;
+}
+
+static void fuse_opstats_add(struct fuse_opstats *dst,
+                             const struct fuse_opstats *src)
+{
+    unsigned i;
+
+    dst->count += src->count;
+    dst->completed += src->completed;
+    dst->errors += src->errors;
+    dst->total_ns += src->total_ns;
+    if (src->max_ns > dst->max_ns)
+        dst->max_ns = src->max_ns;
+    for (i = 0; i < FUSE_OPSTATS_BUCKETS; i++)
+        dst->hist[i] += src->hist[i];
+}
+
+static void fuse_ll_stats_destructor(void *data)
+{
+    struct fuse_ll_stats *st = (struct fuse_ll_stats *) data;
+    struct fuse_ll *f = st->f;
+    struct fuse_ll_stats **stp;
+    unsigned i;
+
+    pthread_mutex_lock(&f->lock);
+    for (stp = &f->stats_list; *stp != st; stp = &(*stp)->next);
+    *stp = st->next;
+    for (i = 0; i < FUSE_MAXOP; i++)
+        fuse_opstats_add(&f->stats_retired->op[i], &st->op[i]);
+    pthread_mutex_unlock(&f->lock);
+    free(st);
+}
+
+static struct fuse_ll_stats *fuse_ll_get_stats(struct fuse_ll *f)
+{
+    struct fuse_ll_stats *st = pthread_getspecific(f->stats_key);
+
+    if (st == NULL) {
+        st = (struct fuse_ll_stats *) calloc(1, sizeof(struct fuse_ll_stats));
+        if (st == NULL)
+            return NULL;
+
+        st->f = f;
+        pthread_mutex_lock(&f->lock);
+        st->next = f->stats_list;
+        f->stats_list = st;
+        pthread_mutex_unlock(&f->lock);
+        pthread_setspecific(f->stats_key, st);
+    }
+    return st;
+}
+
+static void fuse_ll_stats_start(struct fuse_ll *f, struct fuse_req *req,
+                                unsigned opcode)
+{
+    struct fuse_ll_stats *st;
+
+    if (opcode == 0 || opcode >= FUSE_MAXOP)
+        return;
+
+    st = fuse_ll_get_stats(f);
+    if (st == NULL)
+        return;
+
+    st->op[opcode].count++;
+    req->opcode = opcode;
+    curr_time(&req->start);
+}
+
+/* Called when the request is freed, which happens right after replying */
+static void fuse_ll_stats_end(struct fuse_req *req)
+{
+    struct fuse_ll_stats *st = fuse_ll_get_stats(req->f);
+    struct fuse_opstats *os;
+    struct timespec now;
+    uint64_t ns;
+    uint64_t us;
+    unsigned bucket;
+
+    if (st == NULL)
+        return;
+
+    curr_time(&now);
+    ns = (uint64_t) (now.tv_sec - req->start.tv_sec) * 1000000000ULL +
+        now.tv_nsec - req->start.tv_nsec;
+
+    os = &st->op[req->opcode];
+    os->completed++;
+    if (req->error)
+        os->errors++;
+    os->total_ns += ns;
+    if (ns > os->max_ns)
+        os->max_ns = ns;
+    for (bucket = 0, us = ns / 1000;
+         us && bucket < FUSE_OPSTATS_BUCKETS - 1; us >>= 1)
+        bucket++;
+    os->hist[bucket]++;
+    req->opcode = 0;
+}
+
+static int fuse_ll_get_opstats(struct fuse_ll *f, unsigned opcode,
+                               struct fuse_opstats *stats)
+{
+    struct fuse_ll_stats *st;
+
+    if (!f->stats || opcode >= FUSE_MAXOP)
+        return -1;
+
+    memset(stats, 0, sizeof(struct fuse_opstats));
+    pthread_mutex_lock(&f->lock);
+    fuse_opstats_add(stats, &f->stats_retired->op[opcode]);
+    for (st = f->stats_list; st != NULL; st = st->next)
+        fuse_opstats_add(stats, &st->op[opcode]);
+    pthread_mutex_unlock(&f->lock);
+    stats->name = fuse_ll_ops[opcode].name;
+
+    return 0;
+}
+
+/* Upper bound of the histogram bucket containing the given percentile */
+static unsigned long long fuse_opstats_percentile(const struct fuse_opstats *st,
+                                                  unsigned pct)
+{
+    uint64_t want = (st->completed * pct + 99) / 100;
+    uint64_t n = 0;
+    unsigned i;
+
+    for (i = 0; i < FUSE_OPSTATS_BUCKETS - 1; i++) {
+        n += st->hist[i];
+        if (n >= want)
+            return 1ULL << i;
+    }
+    return st->max_ns / 1000;
+}
+
+static void fuse_ll_dump_stats(struct fuse_ll *f)
+{
+    unsigned opcode;
+
+    fprintf(stderr, "%-12s %10s %10s %10s %8s %8s %8s %10s\n", "opcode",
+            "count", "completed", "errors", "avg_us", "p50_us", "p99_us",
+            "max_us");
+    for (opcode = 0; opcode < FUSE_MAXOP; opcode++) {
+        struct fuse_opstats st;
+
+        if (fuse_ll_get_opstats(f, opcode, &st) == -1 || !st.count)
+            continue;
+
+        fprintf(stderr, "%-12s %10llu %10llu %10llu %8llu %8llu %8llu %10llu\n",
+                st.name, (unsigned long long) st.count,
+                (unsigned long long) st.completed,
+                (unsigned long long) st.errors,
+                st.completed ?
+                (unsigned long long) (st.total_ns / st.completed / 1000) : 0,
+                fuse_opstats_percentile(&st, 50),
+                fuse_opstats_percentile(&st, 99),
+                (unsigned long long) (st.max_ns / 1000));
+    }
+}
+
+/*
+ * The signal handler only counts the signals, the dump is done by the
+ * next thread passing by.  The handler is installed without
+ * SA_RESTART, so that threads waiting for requests notice right away.
+ */
+static void fuse_ll_stats_check_signal(struct fuse_ll *f)
+{
+    int sigs = fuse_ll_stats_signals;
+    int dump = 0;
+
+    if (sigs == f->stats_sigseen)
+        return;
+
+    pthread_mutex_lock(&f->lock);
+    if (sigs != f->stats_sigseen) {
+        f->stats_sigseen = sigs;
+        dump = 1;
+    }
+    pthread_mutex_unlock(&f->lock);
+    if (dump)
+        fuse_ll_dump_stats(f);
+}
+
+/* Dump the statistics or the trace if their signal arrived */
+static void fuse_ll_check_signals(void *data)
 {
     struct fuse_ll *f = (struct fuse_ll *) data;
+
+    if (f->stats_signal)
+        fuse_ll_stats_check_signal(f);
+    if (f->trace_signal)
+        fuse_trace_check_signal();
+}
+
+int fuse_lowlevel_get_stats(struct fuse_session *se, unsigned opcode,
+                            struct fuse_opstats *stats)
+{
+    return fuse_ll_get_opstats((struct fuse_ll *) fuse_session_data(se),
+                               opcode, stats);
+}
+
+void fuse_lowlevel_dump_stats(struct fuse_session *se)
+{
+    fuse_ll_dump_stats((struct fuse_ll *) fuse_session_data(se));
+}
+
+int fuse_lowlevel_dump_trace(struct fuse_session *se, const char *path)
+{
+    struct fuse_ll *f = (struct fuse_ll *) fuse_session_data(se);
+
+    if (!f->trace)
+        return -1;
+
+    return fuse_trace_dump(path);
+}
+
+static void fuse_ll_process_common(struct fuse_ll *f, const char *buf,
+                                   size_t len, const struct fuse_buf *payload,
+                                   struct fuse_chan *ch)
+{
     struct fuse_in_header *in = (struct fuse_in_header *) buf;
     const void *inarg = buf + sizeof(struct fuse_in_header);
+    uint64_t trace_start = fuse_trace_begin();
     struct fuse_req *req;
 
     if (f->debug)
@@ -1132,7 +2166,7 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
                 opname((enum fuse_opcode) in->opcode), in->opcode,
                 (unsigned long) in->nodeid, len);
 
-    req = (struct fuse_req *) calloc(1, sizeof(struct fuse_req));
+    req = alloc_req();
     if (req == NULL) {
         fprintf(stderr, "fuse: failed to allocate request\n");
         return;
@@ -1147,6 +2181,13 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
     req->ctr = 1;
     list_init_req(req);
     fuse_mutex_init(&req->lock);
+    if (f->stats)
+        fuse_ll_stats_start(f, req, in->opcode);
+    if (trace_start) {
+        req->trace_start = trace_start;
+        req->trace_op = opname((enum fuse_opcode) in->opcode);
+        fuse_trace_set_request(in->unique, req->trace_op);
+    }
 
     if (!f->got_init && in->opcode != FUSE_INIT)
         fuse_reply_err(req, EIO);
@@ -1168,8 +2209,119 @@ static void fuse_ll_process(void *data, const char *buf, size_t len,
             if (intr)
                 fuse_reply_err(intr, EAGAIN);
         }
-        fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
+        if (payload)
+            do_write_buf(req, in->nodeid, inarg, payload);
+        else
+            fuse_ll_ops[in->opcode].func(req, in->nodeid, inarg);
+    }
+
+    /* The request may have been replied and freed by now */
+    if (trace_start) {
+        fuse_trace_end("dispatch", trace_start);
+        fuse_trace_set_request(0, NULL);
+    }
+}
+
+static void fuse_ll_process(void *data, const char *buf, size_t len,
+                            struct fuse_chan *ch)
+{
+    fuse_ll_process_common((struct fuse_ll *) data, buf, len, NULL, ch);
+}
+
+#define WRITE_HEADER_SIZE \
+    (sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in))
+
+/*
+ * With splice_read the request is moved from the device into a pipe.
+ * Small requests are read from it right away, large ones are left there
+ * for fuse_ll_process_buf(), which hands the data of writes to the
+ * write_buf method without copying it to userspace
+ */
+static int fuse_ll_receive_buf(void *data, struct fuse_buf *buf,
+                               struct fuse_chan **chp)
+{
+    struct fuse_ll *f = (struct fuse_ll *) data;
+    size_t bufsize = buf->size;
+    struct fuse_ll_pipe *llp;
+    int res;
+
+    fuse_ll_check_signals(f);
+
+    if (!f->splice_read || !f->op.write_buf || !fuse_kern_chan_is(*chp))
+        goto fallback;
+
+    llp = fuse_ll_get_pipe(f, *chp);
+    if (llp == NULL)
+        goto fallback;
+
+    res = fuse_kern_chan_receive_splice(chp, llp->pipe[1], bufsize);
+    if (res == -EINVAL) {
+        /* The device can't splice, stop trying */
+        f->splice_read = 0;
+        goto fallback;
+    }
+    if (res <= 0)
+        return res;
+
+    if ((size_t) res < WRITE_HEADER_SIZE + (size_t) getpagesize()) {
+        if (read_back(llp->pipe[0], (char *) buf->mem, res) == -1) {
+            fuse_ll_clear_pipe(f);
+            return -EIO;
+        }
+        buf->flags = 0;
+    } else {
+        buf->flags = FUSE_BUF_IS_FD;
+        buf->fd = llp->pipe[0];
+    }
+    buf->size = res;
+    return res;
+
+ fallback:
+    res = fuse_chan_recv(chp, (char *) buf->mem, bufsize);
+    if (res > 0) {
+        buf->size = res;
+        buf->flags = 0;
+    }
+    return res;
+}
+
+static void fuse_ll_process_buf(void *data, const struct fuse_buf *buf,
+                                struct fuse_chan *ch)
+{
+    struct fuse_ll *f = (struct fuse_ll *) data;
+    struct fuse_in_header *in = (struct fuse_in_header *) buf->mem;
+    struct fuse_buf payload;
+
+    if (!(buf->flags & FUSE_BUF_IS_FD)) {
+        fuse_ll_process_common(f, (const char *) buf->mem, buf->size, NULL,
+                               ch);
+        return;
     }
+
+    if (read_back(buf->fd, (char *) buf->mem, WRITE_HEADER_SIZE) == -1)
+        goto clear_pipe;
+
+    if (in->opcode != FUSE_WRITE) {
+        /* Only the data of writes can stay in the pipe */
+        if (read_back(buf->fd, (char *) buf->mem + WRITE_HEADER_SIZE,
+                      buf->size - WRITE_HEADER_SIZE) == -1)
+            goto clear_pipe;
+        fuse_ll_process_common(f, (const char *) buf->mem, buf->size, NULL,
+                               ch);
+        return;
+    }
+
+    payload = *buf;
+    payload.size = buf->size - WRITE_HEADER_SIZE;
+    fuse_ll_process_common(f, (const char *) buf->mem, WRITE_HEADER_SIZE,
+                           &payload, ch);
+
+    /* The filesystem may not have consumed all of it, e.g. on error */
+    if (fuse_ll_pipe_empty(buf->fd))
+        return;
+
+ clear_pipe:
+    fuse_ll_clear_pipe(f);
 }
 
 enum {
@@ -1185,6 +2337,24 @@ static struct fuse_opt fuse_ll_opts[] = {
     { "max_readahead=%u", offsetof(struct fuse_ll, conn.max_readahead), 0 },
     { "async_read", offsetof(struct fuse_ll, conn.async_read), 1 },
     { "sync_read", offsetof(struct fuse_ll, conn.async_read), 0 },
+    { "writeback_cache", offsetof(struct fuse_ll, conn.writeback_cache), 1 },
+    { "min_threads=%u", offsetof(struct fuse_ll, mt_conf.min_threads), 0 },
+    { "max_threads=%u", offsetof(struct fuse_ll, mt_conf.max_threads), 0 },
+    { "max_idle_threads=%u",
+      offsetof(struct fuse_ll, mt_conf.max_idle_threads), 0 },
+    { "max_queue=%u", offsetof(struct fuse_ll, mt_conf.max_queue), 0 },
+    { "thread_affinity", offsetof(struct fuse_ll, mt_conf.affinity), 1 },
+    { "reader_thread", offsetof(struct fuse_ll, mt_conf.reader_thread), 1 },
+    { "clone_fd", offsetof(struct fuse_ll, mt_conf.clone_fd), 1 },
+    { "splice_read", offsetof(struct fuse_ll, splice_read), 1 },
+    { "splice_write", offsetof(struct fuse_ll, splice_write), 1 },
+    { "splice_move", offsetof(struct fuse_ll, splice_move), 1 },
+    { "stats", offsetof(struct fuse_ll, stats), 1 },
+    { "stats_signal=%u", offsetof(struct fuse_ll, stats_signal), 0 },
+    { "trace", offsetof(struct fuse_ll, trace), 1 },
+    { "trace_size=%u", offsetof(struct fuse_ll, trace_size), 0 },
+    { "trace_file=%s", offsetof(struct fuse_ll, trace_file), 0 },
+    { "trace_signal=%u", offsetof(struct fuse_ll, trace_signal), 0 },
     FUSE_OPT_KEY("max_read=", FUSE_OPT_KEY_DISCARD),
     FUSE_OPT_KEY("-h", KEY_HELP),
     FUSE_OPT_KEY("--help", KEY_HELP),
@@ -1205,7 +2375,25 @@ static void fuse_ll_help(void)
 "    -o max_write=N         set maximum size of write requests\n"
 "    -o max_readahead=N     set maximum readahead\n"
 "    -o async_read          perform reads asynchronously (default)\n"
-"    -o sync_read           perform reads synchronously\n");
+"    -o sync_read           perform reads synchronously\n"
+"    -o writeback_cache     cache writes in the kernel and send them later\n"
+"    -o min_threads=N       worker threads kept even when idle (1)\n"
+"    -o max_threads=N       maximum number of worker threads (no limit)\n"
+"    -o max_idle_threads=N  idle worker threads kept for later requests (10)\n"
+"    -o max_queue=N         requests queued by the reader thread (2*threads)\n"
+"    -o thread_affinity     pin each worker thread to a CPU\n"
+"    -o reader_thread       read requests in one thread and queue them to\n"
+"                           max_threads workers (default: one per CPU)\n"
+"    -o clone_fd            give each worker thread its own device queue\n"
+"    -o splice_read         splice write data from the device to write_buf\n"
+"    -o splice_write        splice fuse_reply_data() data into the device\n"
+"    -o splice_move         move pages instead of copying when splicing\n"
+"    -o stats               collect per opcode request statistics\n"
+"    -o stats_signal=N      print the statistics on signal N (implies stats)\n"
+"    -o trace               record a trace of the processed requests\n"
+"    -o trace_size=N        trace events kept per thread (16384)\n"
+"    -o trace_file=FILE     file the trace is written to (implies trace)\n"
+"    -o trace_signal=N      write the trace on signal N (implies trace)\n");
 }
 
 static int fuse_ll_opt_proc(void *data, const char *arg, int key,
@@ -1234,6 +2422,58 @@ int fuse_lowlevel_is_lib_option(const char *opt)
     return fuse_opt_match(fuse_ll_opts, opt);
 }
 
+static int fuse_ll_stats_init(struct fuse_ll *f)
+{
+    int err;
+
+    f->stats_retired =
+        (struct fuse_ll_stats *) calloc(1, sizeof(struct fuse_ll_stats));
+    if (f->stats_retired == NULL) {
+        fprintf(stderr, "fuse: failed to allocate statistics\n");
+        return -1;
+    }
+
+    err = pthread_key_create(&f->stats_key, fuse_ll_stats_destructor);
+    if (err) {
+        fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+                strerror(err));
+        goto out_free;
+    }
+
+    if (f->stats_signal) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(struct sigaction));
+        sa.sa_handler = fuse_ll_stats_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(f->stats_signal, &sa, &f->stats_old_sa) == -1) {
+            perror("fuse: cannot set signal handler");
+            goto out_key_delete;
+        }
+        f->stats_sigseen = fuse_ll_stats_signals;
+    }
+    return 0;
+
+ out_key_delete:
+    pthread_key_delete(f->stats_key);
+ out_free:
+    free(f->stats_retired);
+    return -1;
+}
+
+static void fuse_ll_stats_destroy(struct fuse_ll *f)
+{
+    if (f->stats_signal)
+        sigaction(f->stats_signal, &f->stats_old_sa, NULL);
+    pthread_key_delete(f->stats_key);
+    while (f->stats_list) {
+        struct fuse_ll_stats *st = f->stats_list;
+        f->stats_list = st->next;
+        free(st);
+    }
+    free(f->stats_retired);
+}
+
 static void fuse_ll_destroy(void *data)
 {
     struct fuse_ll *f = (struct fuse_ll *) data;
@@ -1243,6 +2483,12 @@ static void fuse_ll_destroy(void *data)
             f->op.destroy(f->userdata);
     }
 
+    if (f->stats)
+        fuse_ll_stats_destroy(f);
+    if (f->trace)
+        fuse_trace_destroy();
+    free(f->trace_file);
+    pthread_key_delete(f->pipe_key);
     pthread_mutex_destroy(&f->lock);
     free(f);
 }
@@ -1256,6 +2502,7 @@ struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
                                        const struct fuse_lowlevel_ops *op,
                                        size_t op_size, void *userdata)
 {
+    int err;
     struct fuse_ll *f;
     struct fuse_session *se;
     struct fuse_session_ops sop = {
@@ -1288,13 +2535,43 @@ struct fuse_session *fuse_lowlevel_new_common(struct fuse_args *args,
     f->owner = getuid();
     f->userdata = userdata;
 
+    err = pthread_key_create(&f->pipe_key, fuse_ll_pipe_destructor);
+    if (err) {
+        fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+                strerror(err));
+        goto out_free;
+    }
+
+    if (f->stats_signal)
+        f->stats = 1;
+    if (f->stats && fuse_ll_stats_init(f) == -1)
+        goto out_key_destroy;
+
+    if (f->trace_file || f->trace_signal)
+        f->trace = 1;
+    if (f->trace && fuse_trace_init(f->trace_size, f->trace_file,
+                                    f->trace_signal) == -1)
+        goto out_stats_destroy;
+
     se = fuse_session_new(&sop, f);
     if (!se)
-        goto out_free;
+        goto out_trace_destroy;
 
+    *fuse_session_mt_conf(se) = f->mt_conf;
+    fuse_session_set_buf_ops(se, fuse_ll_receive_buf, fuse_ll_process_buf);
+    fuse_session_set_check_signals(se, fuse_ll_check_signals);
     return se;
 
+ out_trace_destroy:
+    if (f->trace)
+        fuse_trace_destroy();
+ out_stats_destroy:
+    if (f->stats)
+        fuse_ll_stats_destroy(f);
+ out_key_destroy:
+    pthread_key_delete(f->pipe_key);
  out_free:
+    free(f->trace_file);
     free(f);
  out:
     return NULL;
@@ -7,6 +7,7 @@
 */
 
 #include "fuse_lowlevel.h"
+#include "fuse_i.h"
 #include "fuse_common_compat.h"
 #include "fuse_lowlevel_compat.h"
 
@@ -24,6 +25,16 @@ struct fuse_session {
     volatile int exited;
 
     struct fuse_chan *ch;
+
+    struct fuse_mt_conf mt_conf;
+
+    int (*receive_buf) (void *data, struct fuse_buf *buf,
+                        struct fuse_chan **chp);
+
+    void (*process_buf) (void *data, const struct fuse_buf *buf,
+                         struct fuse_chan *ch);
+
+    void (*check_signals) (void *data);
 };
 
 struct fuse_chan {
@@ -31,6 +42,9 @@ struct fuse_chan {
 
     struct fuse_session *se;
 
+    /* Next channel of the session */
+    struct fuse_chan *next;
+
     int fd;
 
     size_t bufsize;
@@ -55,11 +69,51 @@ struct fuse_session *fuse_session_new(struct fuse_session_ops *op, void *data)
     return se;
 }
 
+struct fuse_mt_conf *fuse_session_mt_conf(struct fuse_session *se)
+{
+    return &se->mt_conf;
+}
+
+void *fuse_session_data(struct fuse_session *se)
+{
+    return se->data;
+}
+
+void fuse_session_set_buf_ops(struct fuse_session *se,
+                              int (*receive_buf) (void *, struct fuse_buf *,
+                                                  struct fuse_chan **),
+                              void (*process_buf) (void *,
+                                                   const struct fuse_buf *,
+                                                   struct fuse_chan *))
+{
+    se->receive_buf = receive_buf;
+    se->process_buf = process_buf;
+}
+
+void fuse_session_set_check_signals(struct fuse_session *se,
+                                    void (*check_signals) (void *))
+{
+    se->check_signals = check_signals;
+}
+
+/* For loops that read the channel directly instead of going through
+   fuse_session_receive_buf(), which does this itself */
+void fuse_session_check_signals(struct fuse_session *se)
+{
+    if (se->check_signals)
+        se->check_signals(se->data);
+}
+
+/* Channels are kept in the order they were added, so the first one is
+   always the one the filesystem was mounted with */
 void fuse_session_add_chan(struct fuse_session *se, struct fuse_chan *ch)
 {
-    assert(se->ch == NULL);
+    struct fuse_chan **chp;
+
     assert(ch->se == NULL);
-    se->ch = ch;
+    for (chp = &se->ch; *chp != NULL; chp = &(*chp)->next);
+    *chp = ch;
+    ch->next = NULL;
     ch->se = se;
 }
 
@@ -67,8 +121,12 @@ void fuse_session_remove_chan(struct fuse_chan *ch)
 {
     struct fuse_session *se = ch->se;
     if (se) {
-        assert(se->ch == ch);
-        se->ch = NULL;
+        struct fuse_chan **chp;
+
+        for (chp = &se->ch; *chp != ch; chp = &(*chp)->next)
+            assert(*chp != NULL);
+        *chp = ch->next;
+        ch->next = NULL;
         ch->se = NULL;
     }
 }
@@ -76,11 +134,11 @@ void fuse_session_remove_chan(struct fuse_chan *ch)
 struct fuse_chan *fuse_session_next_chan(struct fuse_session *se,
                                          struct fuse_chan *ch)
 {
-    assert(ch == NULL || ch == se->ch);
+    assert(ch == NULL || ch->se == se);
     if (ch == NULL)
         return se->ch;
     else
-        return NULL;
+        return ch->next;
 }
 
 void fuse_session_process(struct fuse_session *se, const char *buf, size_t len,
@@ -89,11 +147,42 @@ void fuse_session_process(struct fuse_session *se, const char *buf, size_t len,
     se->op.process(se->data, buf, len, ch);
 }
 
+int fuse_session_receive_buf(struct fuse_session *se, struct fuse_buf *buf,
+                             struct fuse_chan **chp)
+{
+    uint64_t trace_start = fuse_trace_begin();
+    int res;
+
+    if (se->receive_buf)
+        res = se->receive_buf(se->data, buf, chp);
+    else {
+        res = fuse_chan_recv(chp, (char *) buf->mem, buf->size);
+        if (res > 0) {
+            buf->size = res;
+            buf->flags = 0;
+        }
+    }
+    if (res > 0)
+        fuse_trace_end("read", trace_start);
+    return res;
+}
+
+void fuse_session_process_buf(struct fuse_session *se,
+                              const struct fuse_buf *buf, struct fuse_chan *ch)
+{
+    if (se->process_buf)
+        se->process_buf(se->data, buf, ch);
+    else {
+        assert(!(buf->flags & FUSE_BUF_IS_FD));
+        fuse_session_process(se, (const char *) buf->mem, buf->size, ch);
+    }
+}
+
 void fuse_session_destroy(struct fuse_session *se)
 {
     if (se->op.destroy)
         se->op.destroy(se->data);
-    if (se->ch != NULL)
+    while (se->ch != NULL)
         fuse_chan_destroy(se->ch);
     free(se);
 }
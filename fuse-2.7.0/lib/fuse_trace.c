@@ -0,0 +1,402 @@
+/*
+    FUSE: Filesystem in Userspace
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPL.
+    See the file COPYING.LIB
+*/
+
+/*
+ * Request tracing.  Spans are recorded into a ring buffer per thread,
+ * found through a thread specific key, so recording takes no locks.
+ * The buffers are only ever read by fuse_trace_dump(), which copies
+ * each ring and drops the entries that were overwritten while copying.
+ * The buffers of exited threads are kept for the dump and are reused
+ * by new threads.
+ */
+
+#include "fuse_i.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC CLOCK_REALTIME
+#endif
+
+struct fuse_trace_event {
+    uint64_t start;
+    uint64_t end;
+    uint64_t unique;
+    /* Static strings */
+    const char *name;
+    const char *op;
+    unsigned tid;
+    int async;
+};
+
+struct fuse_trace_buf {
+    struct fuse_trace_buf *next;
+    int dead;
+    unsigned tid;
+    /* The request being processed by the thread */
+    uint64_t unique;
+    const char *op;
+    /* Number of events ever written, the ring holds the last ones */
+    volatile uint64_t head;
+    struct fuse_trace_event *ev;
+};
+
+int fuse_trace_enabled;
+
+static pthread_mutex_t fuse_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int fuse_trace_users;
+static unsigned fuse_trace_size;
+static pthread_key_t fuse_trace_key;
+static struct fuse_trace_buf *fuse_trace_bufs;
+static char *fuse_trace_file;
+static int fuse_trace_signal;
+static struct sigaction fuse_trace_old_sa;
+static volatile sig_atomic_t fuse_trace_signals;
+static int fuse_trace_sigseen;
+
+uint64_t fuse_trace_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    /* Zero means "not tracing" to the callers */
+    return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec + 1;
+}
+
+static unsigned fuse_trace_gettid(void)
+{
+#ifdef __linux__
+    return (unsigned) syscall(SYS_gettid);
+#else
+    static unsigned ctr;
+    return __sync_add_and_fetch(&ctr, 1);
+#endif
+}
+
+static void fuse_trace_buf_destructor(void *data)
+{
+    struct fuse_trace_buf *tb = (struct fuse_trace_buf *) data;
+
+    pthread_mutex_lock(&fuse_trace_lock);
+    tb->dead = 1;
+    pthread_mutex_unlock(&fuse_trace_lock);
+}
+
+static struct fuse_trace_buf *fuse_trace_get_buf(void)
+{
+    struct fuse_trace_buf *tb = pthread_getspecific(fuse_trace_key);
+
+    if (tb != NULL)
+        return tb;
+
+    pthread_mutex_lock(&fuse_trace_lock);
+    for (tb = fuse_trace_bufs; tb != NULL && !tb->dead; tb = tb->next);
+    if (tb != NULL)
+        tb->dead = 0;
+    pthread_mutex_unlock(&fuse_trace_lock);
+
+    if (tb == NULL) {
+        tb = (struct fuse_trace_buf *) calloc(1, sizeof(struct fuse_trace_buf));
+        if (tb == NULL)
+            return NULL;
+        tb->ev = (struct fuse_trace_event *)
+            calloc(fuse_trace_size, sizeof(struct fuse_trace_event));
+        if (tb->ev == NULL) {
+            free(tb);
+            return NULL;
+        }
+        pthread_mutex_lock(&fuse_trace_lock);
+        tb->next = fuse_trace_bufs;
+        fuse_trace_bufs = tb;
+        pthread_mutex_unlock(&fuse_trace_lock);
+    }
+    tb->tid = fuse_trace_gettid();
+    tb->unique = 0;
+    tb->op = NULL;
+    pthread_setspecific(fuse_trace_key, tb);
+    return tb;
+}
+
+static void fuse_trace_add(struct fuse_trace_buf *tb, const char *name,
+                           uint64_t unique, const char *op, int async,
+                           uint64_t start)
+{
+    struct fuse_trace_event *ev = &tb->ev[tb->head % fuse_trace_size];
+
+    ev->start = start;
+    ev->end = fuse_trace_now();
+    ev->unique = unique;
+    ev->name = name;
+    ev->op = op;
+    ev->tid = tb->tid;
+    ev->async = async;
+    /* The event must be complete before the dump can see it */
+    __sync_synchronize();
+    tb->head++;
+}
+
+void fuse_trace_span(const char *name, uint64_t start)
+{
+    struct fuse_trace_buf *tb = fuse_trace_get_buf();
+
+    if (tb != NULL)
+        fuse_trace_add(tb, name, tb->unique, tb->op, 0, start);
+}
+
+void fuse_trace_async(const char *name, uint64_t unique, const char *op,
+                      uint64_t start)
+{
+    struct fuse_trace_buf *tb = fuse_trace_get_buf();
+
+    if (tb != NULL)
+        fuse_trace_add(tb, name, unique, op, 1, start);
+}
+
+void fuse_trace_set_request(uint64_t unique, const char *op)
+{
+    struct fuse_trace_buf *tb = fuse_trace_get_buf();
+
+    if (tb != NULL) {
+        tb->unique = unique;
+        tb->op = op;
+    }
+}
+
+static void fuse_trace_handler(int sig)
+{
+    (void) sig;
+    fuse_trace_signals++;
+}
+
+int fuse_trace_init(unsigned size, const char *file, int signum)
+{
+    char buf[64];
+    int res = 0;
+
+    pthread_mutex_lock(&fuse_trace_lock);
+    if (fuse_trace_users++)
+        goto out;
+
+    res = pthread_key_create(&fuse_trace_key, fuse_trace_buf_destructor);
+    if (res) {
+        fprintf(stderr, "fuse: failed to create thread specific key: %s\n",
+                strerror(res));
+        goto out_err;
+    }
+    if (file == NULL) {
+        sprintf(buf, "fuse-trace.%i.json", (int) getpid());
+        file = buf;
+    }
+    fuse_trace_file = strdup(file);
+    if (fuse_trace_file == NULL) {
+        fprintf(stderr, "fuse: memory allocation failed\n");
+        goto out_key_delete;
+    }
+    if (signum) {
+        struct sigaction sa;
+
+        memset(&sa, 0, sizeof(struct sigaction));
+        sa.sa_handler = fuse_trace_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(signum, &sa, &fuse_trace_old_sa) == -1) {
+            perror("fuse: cannot set signal handler");
+            goto out_free_file;
+        }
+        fuse_trace_sigseen = fuse_trace_signals;
+    }
+    fuse_trace_signal = signum;
+    fuse_trace_size = size ? size : FUSE_TRACE_DEFAULT_SIZE;
+    fuse_trace_enabled = 1;
+    res = 0;
+ out:
+    pthread_mutex_unlock(&fuse_trace_lock);
+    return res;
+
+ out_free_file:
+    free(fuse_trace_file);
+    fuse_trace_file = NULL;
+ out_key_delete:
+    pthread_key_delete(fuse_trace_key);
+ out_err:
+    fuse_trace_users--;
+    res = -1;
+    goto out;
+}
+
+/* No threads may be recording at this point */
+void fuse_trace_destroy(void)
+{
+    pthread_mutex_lock(&fuse_trace_lock);
+    if (--fuse_trace_users) {
+        pthread_mutex_unlock(&fuse_trace_lock);
+        return;
+    }
+    fuse_trace_enabled = 0;
+    if (fuse_trace_signal)
+        sigaction(fuse_trace_signal, &fuse_trace_old_sa, NULL);
+    pthread_key_delete(fuse_trace_key);
+    while (fuse_trace_bufs) {
+        struct fuse_trace_buf *tb = fuse_trace_bufs;
+        fuse_trace_bufs = tb->next;
+        free(tb->ev);
+        free(tb);
+    }
+    free(fuse_trace_file);
+    fuse_trace_file = NULL;
+    pthread_mutex_unlock(&fuse_trace_lock);
+}
+
+/* Timestamps are in microseconds, the clock is in nanoseconds */
+static void fuse_trace_print_ts(FILE *fp, const char *key, uint64_t ns)
+{
+    fprintf(fp, ",\"%s\":%llu.%03llu", key,
+            (unsigned long long) (ns / 1000),
+            (unsigned long long) (ns % 1000));
+}
+
+static void fuse_trace_print(FILE *fp, const struct fuse_trace_event *ev,
+                             int pid)
+{
+    const char *name = ev->name;
+
+    fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"fuse\",\"pid\":%i,\"tid\":%u",
+            name, pid, ev->tid);
+    if (ev->async) {
+        fprintf(fp, ",\"ph\":\"b\",\"id\":%llu",
+                (unsigned long long) ev->unique);
+        fuse_trace_print_ts(fp, "ts", ev->start);
+        fprintf(fp, "},\n{\"name\":\"%s\",\"cat\":\"fuse\",\"pid\":%i,"
+                "\"tid\":%u,\"ph\":\"e\",\"id\":%llu",
+                name, pid, ev->tid, (unsigned long long) ev->unique);
+        fuse_trace_print_ts(fp, "ts", ev->end);
+    } else {
+        fprintf(fp, ",\"ph\":\"X\"");
+        fuse_trace_print_ts(fp, "ts", ev->start);
+        fuse_trace_print_ts(fp, "dur", ev->end - ev->start);
+    }
+    if (ev->unique)
+        fprintf(fp, ",\"args\":{\"unique\":%llu,\"opcode\":\"%s\"}",
+                (unsigned long long) ev->unique, ev->op ? ev->op : "?");
+    fprintf(fp, "}");
+}
+
+/* Copy out the events of one buffer which are known to be intact */
+static size_t fuse_trace_copy(struct fuse_trace_buf *tb,
+                              struct fuse_trace_event *ev)
+{
+    uint64_t head1;
+    uint64_t head2;
+    uint64_t first;
+    uint64_t i;
+    size_t n = 0;
+
+    head1 = tb->head;
+    __sync_synchronize();
+    first = head1 > fuse_trace_size ? head1 - fuse_trace_size : 0;
+    for (i = first; i < head1; i++)
+        ev[n++] = tb->ev[i % fuse_trace_size];
+    __sync_synchronize();
+    head2 = tb->head;
+
+    /* Slots written since, and the one being written, are torn */
+    if (head2 + 1 > first + fuse_trace_size) {
+        uint64_t skip = head2 + 1 - fuse_trace_size - first;
+        if (skip >= n)
+            return 0;
+        memmove(ev, ev + skip, (n - skip) * sizeof(*ev));
+        n -= skip;
+    }
+    return n;
+}
+
+int fuse_trace_dump(const char *path)
+{
+    struct fuse_trace_event *ev;
+    struct fuse_trace_buf *tb;
+    int pid = getpid();
+    FILE *fp;
+    int res = 0;
+
+    pthread_mutex_lock(&fuse_trace_lock);
+    if (!fuse_trace_enabled) {
+        pthread_mutex_unlock(&fuse_trace_lock);
+        return -1;
+    }
+    if (path == NULL)
+        path = fuse_trace_file;
+
+    ev = (struct fuse_trace_event *)
+        malloc(fuse_trace_size * sizeof(struct fuse_trace_event));
+    if (ev == NULL) {
+        fprintf(stderr, "fuse: memory allocation failed\n");
+        res = -1;
+        goto out;
+    }
+    fp = fopen(path, "w");
+    if (fp == NULL) {
+        fprintf(stderr, "fuse: failed to open %s: %s\n", path,
+                strerror(errno));
+        res = -1;
+        goto out_free;
+    }
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+            "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%i,"
+            "\"args\":{\"name\":\"fuse\"}}", pid);
+    for (tb = fuse_trace_bufs; tb != NULL; tb = tb->next) {
+        size_t n = fuse_trace_copy(tb, ev);
+        size_t i;
+
+        for (i = 0; i < n; i++)
+            fuse_trace_print(fp, &ev[i], pid);
+    }
+    fprintf(fp, "\n]}\n");
+    if (fclose(fp) == EOF) {
+        fprintf(stderr, "fuse: failed to write %s: %s\n", path,
+                strerror(errno));
+        res = -1;
+    }
+
+ out_free:
+    free(ev);
+ out:
+    pthread_mutex_unlock(&fuse_trace_lock);
+    return res;
+}
+
+/*
+ * Like for the statistics, the signal handler only counts signals and
+ * the dump is done by the next thread receiving a request
+ */
+void fuse_trace_check_signal(void)
+{
+    int sigs = fuse_trace_signals;
+    int dump = 0;
+
+    if (!fuse_trace_signal || sigs == fuse_trace_sigseen)
+        return;
+
+    pthread_mutex_lock(&fuse_trace_lock);
+    if (sigs != fuse_trace_sigseen) {
+        fuse_trace_sigseen = sigs;
+        dump = 1;
+    }
+    pthread_mutex_unlock(&fuse_trace_lock);
+    if (dump && fuse_trace_dump(NULL) == 0)
+        fprintf(stderr, "fuse: trace written to %s\n", fuse_trace_file);
+}
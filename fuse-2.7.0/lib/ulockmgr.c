@@ -9,6 +9,7 @@
 /* #define DEBUG 1 */
 
 #include "ulockmgr.h"
+#include "ulockmgr_i.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -37,36 +38,75 @@ struct fd_store {
     int inuse;
 };
 
+/* A request queued on its owner, see ulockmgr_flush() */
+struct ulockmgr_req {
+    struct ulockmgr_req *next;
+    struct message *msg;
+    int fds[2];
+    int numfds;
+    int blocking;
+    int failed;
+    int done;
+};
+
 struct owner {
     struct owner *next;
-    struct owner *prev;
     struct fd_store *fds;
+    struct ulockmgr_req *queue;
+    struct ulockmgr_req **queue_tail;
+    int busy;
+    int users;
+    pthread_cond_t cond;
+    uint32_t hash;
     void *id;
     size_t id_len;
     int cfd;
 };
 
+/*
+ * Owners are hashed into shards, each with its own lock, so that lock
+ * operations of unrelated owners don't wait for each other.
+ */
+#define ULOCKMGR_SHARDS 16
+#define ULOCKMGR_BUCKETS 64
+
+struct ulockmgr_shard {
+    pthread_mutex_t lock;
+    struct owner *owners[ULOCKMGR_BUCKETS];
+};
+
 static pthread_mutex_t ulockmgr_lock;
 static int ulockmgr_cfd = -1;
-static struct owner owner_list = { .next = &owner_list, .prev = &owner_list };
+static struct ulockmgr_shard ulockmgr_shards[ULOCKMGR_SHARDS];
 
-#define MAX_SEND_FDS 2
+/* Requests sent to the server in one message */
+#define MAX_BATCH 16
+#define MAX_SEND_FDS (2 * MAX_BATCH)
 
-static void list_del_owner(struct owner *owner)
+static uint32_t owner_hash(const unsigned char *id, size_t id_len)
 {
-    struct owner *prev = owner->prev;
-    struct owner *next = owner->next;
-    prev->next = next;
-    next->prev = prev;
+    uint32_t h = 2166136261U;
+    size_t i;
+    for (i = 0; i < id_len; i++)
+        h = (h ^ id[i]) * 16777619;
+
+    return h;
 }
 
-static void list_add_owner(struct owner *owner, struct owner *next)
+static struct owner **owner_bucket(struct ulockmgr_shard *sh, uint32_t hash)
 {
-    struct owner *prev = next->prev;
-    owner->next = next;
-    owner->prev = prev;
-    prev->next = owner;
-    next->prev = owner;
+    return &sh->owners[(hash / ULOCKMGR_SHARDS) % ULOCKMGR_BUCKETS];
+}
+
+static void del_owner(struct ulockmgr_shard *sh, struct owner *owner)
+{
+    struct owner **op;
+
+    for (op = owner_bucket(sh, owner->hash); *op != owner; op = &(*op)->next);
+    *op = owner->next;
+    close(owner->cfd);
+    pthread_cond_destroy(&owner->cond);
+    free(owner);
 }
 
 /*
@@ -94,14 +134,18 @@ static int ulockmgr_send_message(int sock, void *buf, size_t buflen,
     int res;
 
     assert(numfds <= MAX_SEND_FDS);
-    msg.msg_control = cmsgbuf;
-    msg.msg_controllen = sizeof(cmsgbuf);
-    p_cmsg = CMSG_FIRSTHDR(&msg);
-    p_cmsg->cmsg_level = SOL_SOCKET;
-    p_cmsg->cmsg_type = SCM_RIGHTS;
-    p_cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numfds);
-    memcpy(CMSG_DATA(p_cmsg), fdp, sizeof(int) * numfds);
-    msg.msg_controllen = p_cmsg->cmsg_len;
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+    if (numfds) {
+        msg.msg_control = cmsgbuf;
+        msg.msg_controllen = sizeof(cmsgbuf);
+        p_cmsg = CMSG_FIRSTHDR(&msg);
+        p_cmsg->cmsg_level = SOL_SOCKET;
+        p_cmsg->cmsg_type = SCM_RIGHTS;
+        p_cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numfds);
+        memcpy(CMSG_DATA(p_cmsg), fdp, sizeof(int) * numfds);
+        msg.msg_controllen = p_cmsg->cmsg_len;
+    }
     msg.msg_name = NULL;
     msg.msg_namelen = 0;
     msg.msg_iov = &vec;
@@ -143,73 +187,175 @@ static int ulockmgr_start_daemon(void)
     return 0;
 }
 
-static struct owner *ulockmgr_new_owner(const void *id, size_t id_len)
+/* Ask the server for a new owner process, connected by a socket which
+   keeps the boundaries of the batches sent on it */
+static int ulockmgr_connect_owner(void)
 {
     int sv[2];
     int res;
     char c = 'm';
-    struct owner *o;
 
+    pthread_mutex_lock(&ulockmgr_lock);
     if (ulockmgr_cfd == -1 && ulockmgr_start_daemon() == -1)
-        return NULL;
+        goto out_err;
 
-    o = calloc(1, sizeof(struct owner) + id_len);
-    if (!o) {
-        fprintf(stderr, "libulockmgr: failed to allocate memory\n");
-        return NULL;
-    }
-    o->id = o + 1;
-    o->id_len = id_len;
-    res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+    res = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv);
     if (res == -1) {
         perror("libulockmgr: socketpair");
-        goto out_free;
+        goto out_err;
     }
     res = ulockmgr_send_message(ulockmgr_cfd, &c, sizeof(c), &sv[0], 1);
     close(sv[0]);
     if (res == -1) {
         close(ulockmgr_cfd);
         ulockmgr_cfd = -1;
-        goto out_close;
+        close(sv[1]);
+        goto out_err;
     }
+    pthread_mutex_unlock(&ulockmgr_lock);
+    return sv[1];
+
+ out_err:
+    pthread_mutex_unlock(&ulockmgr_lock);
+    return -1;
+}
 
-    o->cfd = sv[1];
+static struct owner *ulockmgr_new_owner(struct ulockmgr_shard *sh,
+                                        uint32_t hash, const void *id,
+                                        size_t id_len)
+{
+    struct owner **op;
+    struct owner *o;
+
+    o = calloc(1, sizeof(struct owner) + id_len);
+    if (!o) {
+        fprintf(stderr, "libulockmgr: failed to allocate memory\n");
+        return NULL;
+    }
+    o->cfd = ulockmgr_connect_owner();
+    if (o->cfd == -1) {
+        free(o);
+        return NULL;
+    }
+    o->id = o + 1;
+    o->id_len = id_len;
+    o->hash = hash;
+    o->queue_tail = &o->queue;
+    pthread_cond_init(&o->cond, NULL);
     memcpy(o->id, id, id_len);
-    list_add_owner(o, &owner_list);
+    op = owner_bucket(sh, hash);
+    o->next = *op;
+    *op = o;
 
     return o;
+}
+
+/* Send a batch of requests, and receive the replies to the ones that
+   can't block, which come back together in one message */
+static void ulockmgr_send_batch(struct owner *o, struct ulockmgr_req **batch,
+                                int n)
+{
+    struct message msgs[MAX_BATCH];
+    int fds[MAX_SEND_FDS];
+    int numfds = 0;
+    int nreplies = 0;
+    int res;
+    int i;
+    int j;
+
+    for (i = 0; i < n; i++) {
+        msgs[i] = *batch[i]->msg;
+        for (j = 0; j < batch[i]->numfds; j++)
+            fds[numfds++] = batch[i]->fds[j];
+        if (!batch[i]->blocking)
+            nreplies++;
+    }
+    res = ulockmgr_send_message(o->cfd, msgs, n * sizeof(struct message),
+                                fds, numfds);
+    if (res == -1)
+        goto out_err;
+
+    if (nreplies) {
+        res = recv(o->cfd, msgs, sizeof(msgs), 0);
+        if (res == -1) {
+            perror("libulockmgr: recv");
+            goto out_err;
+        }
+        if ((size_t) res != nreplies * sizeof(struct message)) {
+            fprintf(stderr, "libulockmgr: recv short\n");
+            goto out_err;
+        }
+        for (i = 0, j = 0; i < n; i++)
+            if (!batch[i]->blocking)
+                *batch[i]->msg = msgs[j++];
+    }
+    return;
 
- out_close:
-    close(sv[1]);
- out_free:
-    free(o);
-    return NULL;
+ out_err:
+    for (i = 0; i < n; i++) {
+        batch[i]->failed = 1;
+        batch[i]->msg->error = EIO;
+    }
 }
 
-static int ulockmgr_send_request(struct message *msg, const void *id,
+/*
+ * Requests of an owner are queued, and whichever thread finds the
+ * owner idle sends all that are queued as a single message.  Called
+ * with the shard locked, which is dropped while on the socket.
+ */
+static void ulockmgr_flush(struct ulockmgr_shard *sh, struct owner *o,
+                           struct ulockmgr_req *req)
+{
+    while (!req->done) {
+        struct ulockmgr_req *batch[MAX_BATCH];
+        int n = 0;
+        int i;
+
+        if (o->busy) {
+            pthread_cond_wait(&o->cond, &sh->lock);
+            continue;
+        }
+        while (o->queue && n < MAX_BATCH) {
+            batch[n++] = o->queue;
+            o->queue = o->queue->next;
+        }
+        if (!o->queue)
+            o->queue_tail = &o->queue;
+
+        o->busy = 1;
+        pthread_mutex_unlock(&sh->lock);
+        ulockmgr_send_batch(o, batch, n);
+        pthread_mutex_lock(&sh->lock);
+        o->busy = 0;
+        for (i = 0; i < n; i++)
+            batch[i]->done = 1;
+        pthread_cond_broadcast(&o->cond);
+    }
+}
+
+static int ulockmgr_send_request(struct ulockmgr_shard *sh, uint32_t hash,
+                                 struct message *msg, const void *id,
                                  size_t id_len)
 {
     int sv[2];
-    int cfd;
+    int cfd = -1;
     struct owner *o;
     struct fd_store *f = NULL;
     struct fd_store *newf = NULL;
     struct fd_store **fp;
+    struct ulockmgr_req req;
     int fd = msg->fd;
     int cmd = msg->cmd;
     int res;
     int unlockall = (cmd == F_SETLK && msg->lock.l_type == F_UNLCK &&
                      msg->lock.l_start == 0 && msg->lock.l_len == 0);
 
-    for (o = owner_list.next; o != &owner_list; o = o->next)
+    for (o = *owner_bucket(sh, hash); o; o = o->next)
         if (o->id_len == id_len && memcmp(o->id, id, id_len) == 0)
             break;
 
-    if (o == &owner_list)
-        o = NULL;
-
     if (!o && cmd != F_GETLK && msg->lock.l_type != F_UNLCK)
-        o = ulockmgr_new_owner(id, id_len);
+        o = ulockmgr_new_owner(sh, hash, id, id_len);
 
     if (!o) {
         if (cmd == F_GETLK) {
@@ -241,23 +387,22 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
         }
     }
 
-    res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
-    if (res == -1) {
-        perror("libulockmgr: socketpair");
-        free(newf);
-        return -ENOLCK;
-    }
-
-    cfd = sv[1];
-    sv[1] = msg->fd;
-    res = ulockmgr_send_message(o->cfd, msg, sizeof(struct message), sv,
-                                msg->nofd ? 1 : 2);
-    close(sv[0]);
-    if (res == -1) {
-        free(newf);
-        close(cfd);
-        return -EIO;
+    memset(&req, 0, sizeof(req));
+    req.msg = msg;
+    req.blocking = ulockmgr_blocking(cmd, &msg->lock);
+    if (req.blocking) {
+        /* The reply may take a while, it gets a socket of its own */
+        res = socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+        if (res == -1) {
+            perror("libulockmgr: socketpair");
+            free(newf);
+            return -ENOLCK;
+        }
+        cfd = sv[1];
+        req.fds[req.numfds++] = sv[0];
     }
+    if (!msg->nofd)
+        req.fds[req.numfds++] = msg->fd;
 
     if (newf) {
         newf->fd = msg->fd;
@@ -266,59 +411,71 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
     }
     if (f)
         f->inuse++;
-
-    res = do_recv(cfd, msg, sizeof(struct message), MSG_WAITALL);
-    if (res == -1) {
-        perror("libulockmgr: recv");
-        msg->error = EIO;
-    } else if (res != sizeof(struct message)) {
-        fprintf(stderr, "libulockmgr: recv short\n");
-        msg->error = EIO;
-    } else if (cmd == F_SETLKW && msg->error == EAGAIN) {
-        pthread_mutex_unlock(&ulockmgr_lock);
-        while (1) {
-            sigset_t old;
-            sigset_t unblock;
-            int errno_save;
-
-            sigemptyset(&unblock);
-            sigaddset(&unblock, SIGUSR1);
-            pthread_sigmask(SIG_UNBLOCK, &unblock, &old);
-            res = do_recv(cfd, msg, sizeof(struct message), MSG_WAITALL);
-            errno_save = errno;
-            pthread_sigmask(SIG_SETMASK, &old, NULL);
-            if (res == sizeof(struct message))
-                break;
-            else if (res >= 0) {
-                fprintf(stderr, "libulockmgr: recv short\n");
-                msg->error = EIO;
-                break;
-            } else if (errno_save != EINTR) {
-                errno = errno_save;
-                perror("libulockmgr: recv");
-                msg->error = EIO;
-                break;
-            }
-            msg->intr = 1;
-            res = send(o->cfd, msg, sizeof(struct message), MSG_NOSIGNAL);
-            if (res == -1) {
-                perror("libulockmgr: send");
-                msg->error = EIO;
-                break;
-            }
-            if (res != sizeof(struct message)) {
-                fprintf(stderr, "libulockmgr: send short\n");
-                msg->error = EIO;
-                break;
+    o->users++;
+    *o->queue_tail = &req;
+    o->queue_tail = &req.next;
+    ulockmgr_flush(sh, o, &req);
+    if (req.blocking)
+        close(sv[0]);
+
+    if (req.failed) {
+        if (cfd != -1)
+            close(cfd);
+        cfd = -1;
+    } else if (req.blocking) {
+        res = do_recv(cfd, msg, sizeof(struct message), MSG_WAITALL);
+        if (res == -1) {
+            perror("libulockmgr: recv");
+            msg->error = EIO;
+        } else if (res != sizeof(struct message)) {
+            fprintf(stderr, "libulockmgr: recv short\n");
+            msg->error = EIO;
+        } else if (msg->error == EAGAIN) {
+            pthread_mutex_unlock(&sh->lock);
+            while (1) {
+                sigset_t old;
+                sigset_t unblock;
+                int errno_save;
+
+                sigemptyset(&unblock);
+                sigaddset(&unblock, SIGUSR1);
+                pthread_sigmask(SIG_UNBLOCK, &unblock, &old);
+                res = do_recv(cfd, msg, sizeof(struct message), MSG_WAITALL);
+                errno_save = errno;
+                pthread_sigmask(SIG_SETMASK, &old, NULL);
+                if (res == sizeof(struct message))
+                    break;
+                else if (res >= 0) {
+                    fprintf(stderr, "libulockmgr: recv short\n");
+                    msg->error = EIO;
+                    break;
+                } else if (errno_save != EINTR) {
+                    errno = errno_save;
+                    perror("libulockmgr: recv");
+                    msg->error = EIO;
+                    break;
+                }
+                msg->intr = 1;
+                res = send(o->cfd, msg, sizeof(struct message), MSG_NOSIGNAL);
+                if (res == -1) {
+                    perror("libulockmgr: send");
+                    msg->error = EIO;
+                    break;
+                }
+                if (res != sizeof(struct message)) {
+                    fprintf(stderr, "libulockmgr: send short\n");
+                    msg->error = EIO;
+                    break;
+                }
             }
+            pthread_mutex_lock(&sh->lock);
         }
-        pthread_mutex_lock(&ulockmgr_lock);
-
+        close(cfd);
     }
     if (f)
         f->inuse--;
-    close(cfd);
-    if (unlockall) {
+    o->users--;
+    if (unlockall || (req.failed && newf)) {
         for (fp = &o->fds; *fp;) {
             f = *fp;
             if (f->fd == fd && !f->inuse) {
@@ -327,11 +484,10 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
             } else
                 fp = &f->next;
         }
-        if (!o->fds) {
-            list_del_owner(o);
-            close(o->cfd);
-            free(o);
-        }
+    }
+    if (unlockall) {
+        if (!o->fds && !o->users)
+            del_owner(sh, o);
         /* Force OK on unlock-all, since it _will_ succeed once the
            owner is deleted */
         msg->error = 0;
@@ -340,18 +496,6 @@ static int ulockmgr_send_request(struct message *msg, const void *id,
     return -msg->error;
 }
 
-#ifdef DEBUG
-static uint32_t owner_hash(const unsigned char *id, size_t id_len)
-{
-    uint32_t h = 0;
-    size_t i;
-    for (i = 0; i < id_len; i++)
-        h = ((h << 8) | (h >> 24)) ^ id[i];
-
-    return h;
-}
-#endif
-
 static int ulockmgr_canonicalize(int fd, struct flock *lock)
 {
     off_t offset;
@@ -392,6 +536,8 @@ int ulockmgr_op(int fd, int cmd, struct flock *lock, const void *owner,
 {
     int err;
     struct message msg;
+    struct ulockmgr_shard *sh;
+    uint32_t hash;
     sigset_t old;
     sigset_t block;
 
@@ -420,12 +566,14 @@ int ulockmgr_op(int fd, int cmd, struct flock *lock, const void *owner,
     if (err)
         return err;
 
+    hash = owner_hash(owner, owner_len);
+    sh = &ulockmgr_shards[hash % ULOCKMGR_SHARDS];
     sigemptyset(&block);
     sigaddset(&block, SIGUSR1);
     pthread_sigmask(SIG_BLOCK, &block, &old);
-    pthread_mutex_lock(&ulockmgr_lock);
-    err = ulockmgr_send_request(&msg, owner, owner_len);
-    pthread_mutex_unlock(&ulockmgr_lock);
+    pthread_mutex_lock(&sh->lock);
+    err = ulockmgr_send_request(sh, hash, &msg, owner, owner_len);
+    pthread_mutex_unlock(&sh->lock);
     pthread_sigmask(SIG_SETMASK, &old, NULL);
     if (!err && cmd == F_GETLK) {
         if (msg.lock.l_type == F_UNLCK)
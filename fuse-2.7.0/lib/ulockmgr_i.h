@@ -0,0 +1,16 @@
+/*
+    libulockmgr: Userspace Lock Manager Library
+    Copyright (C) 2006  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU LGPL.
+    See the file COPYING.LIB
+*/
+
+/* Shared by the library and ulockmgr_server, which must agree on it */
+
+#include <fcntl.h>
+
+/* A request that may have to wait for the lock is answered on a socket
+   of its own.  An unlock never waits, whatever the command. */
+#define ulockmgr_blocking(cmd, lock) \
+    ((cmd) == F_SETLKW && (lock)->l_type != F_UNLCK)
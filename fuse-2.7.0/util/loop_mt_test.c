@@ -0,0 +1,141 @@
+/*
+    loop_mt_test: tests for the multithreaded session loop
+    Copyright (C) 2001-2007  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Feeds requests to fuse_session_loop_mt() one at a time, each only
+   after the previous one was processed, and counts the worker threads
+   reading them.  At most two workers are ever busy, the one processing
+   a request and the one that processed the previous one and hasn't
+   made itself available yet, so a third is the most that may be
+   started.  The idle ones must be kept for the next request. */
+
+#define FUSE_USE_VERSION 26
+
+#include <fuse_lowlevel.h>
+#include <fuse_kernel.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define NUM_REQUESTS 200
+#define MAX_THREADS 3
+
+static struct fuse_session *se;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int pending = 1;
+static int sent;
+static int processed;
+static int threads;
+static __thread int seen;
+
+static int test_receive(struct fuse_chan **chp, char *buf, size_t size)
+{
+    struct fuse_in_header *in = (struct fuse_in_header *) buf;
+
+    (void) chp;
+    (void) size;
+
+    pthread_mutex_lock(&lock);
+    /* Thread local storage starts out zeroed in every new thread, even
+       if it reuses the stack or the id of one that has exited */
+    if (!seen) {
+        seen = 1;
+        threads++;
+    }
+    while (!pending && processed < NUM_REQUESTS)
+        pthread_cond_wait(&cond, &lock);
+    if (processed == NUM_REQUESTS) {
+        pthread_mutex_unlock(&lock);
+        return 0;
+    }
+    pending = 0;
+    sent++;
+    pthread_mutex_unlock(&lock);
+
+    memset(in, 0, sizeof(*in));
+    in->len = sizeof(*in);
+    in->opcode = FUSE_GETATTR;
+    in->unique = sent;
+    return sizeof(*in);
+}
+
+static int test_send(struct fuse_chan *ch, const struct iovec iov[],
+                     size_t count)
+{
+    (void) ch;
+    (void) iov;
+    (void) count;
+
+    return 0;
+}
+
+static void test_process(void *data, const char *buf, size_t len,
+                         struct fuse_chan *ch)
+{
+    (void) data;
+    (void) buf;
+    (void) len;
+    (void) ch;
+
+    pthread_mutex_lock(&lock);
+    processed++;
+    if (processed == NUM_REQUESTS)
+        fuse_session_exit(se);
+    else
+        pending = 1;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+}
+
+int main(void)
+{
+    struct fuse_session_ops sop = {
+        .process = test_process,
+    };
+    struct fuse_chan_ops cop = {
+        .receive = test_receive,
+        .send = test_send,
+    };
+    struct fuse_chan *ch;
+    int res;
+
+    /* A worker that never picks up the next request would hang here */
+    alarm(10);
+
+    se = fuse_session_new(&sop, NULL);
+    if (!se) {
+        fprintf(stderr, "loop_mt_test: failed to create session\n");
+        return 1;
+    }
+    ch = fuse_chan_new(&cop, -1, getpagesize(), NULL);
+    if (!ch) {
+        fprintf(stderr, "loop_mt_test: failed to create channel\n");
+        return 1;
+    }
+    fuse_session_add_chan(se, ch);
+
+    res = fuse_session_loop_mt(se);
+    fuse_session_destroy(se);
+    if (res == -1) {
+        fprintf(stderr, "loop_mt_test: session loop failed\n");
+        return 1;
+    }
+    if (processed != NUM_REQUESTS) {
+        fprintf(stderr, "loop_mt_test: %i requests processed, expected %i\n",
+                processed, NUM_REQUESTS);
+        return 1;
+    }
+    if (threads > MAX_THREADS) {
+        fprintf(stderr, "loop_mt_test: %i threads started for %i requests, "
+                "expected at most %i\n", threads, NUM_REQUESTS, MAX_THREADS);
+        return 1;
+    }
+    return 0;
+}
@@ -22,6 +22,8 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 
+#include "ulockmgr_i.h"
+
 struct message {
     unsigned intr : 1;
     unsigned nofd : 1;
@@ -53,6 +55,10 @@ struct req_data {
 
 #define MAX_SEND_FDS 2
 
+/* Requests received from an owner in one message, see receive_batch() */
+#define MAX_BATCH 16
+#define MAX_BATCH_FDS (2 * MAX_BATCH)
+
 static int receive_message(int sock, void *buf, size_t buflen, int *fdp,
                            int *numfds)
 {
@@ -121,6 +127,65 @@ static int receive_message(int sock, void *buf, size_t buflen, int *fdp,
     return res;
 }
 
+/*
+ * The owner sockets keep message boundaries, each message carries up
+ * to MAX_BATCH requests, and the file descriptors they need in order.
+ * Returns the number of requests, 0 on disconnect and -1 on error.
+ */
+static int receive_batch(int sock, struct message *msgs, int *fdp,
+                         int *numfds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    size_t ccmsg[CMSG_SPACE(sizeof(int) * MAX_BATCH_FDS) / sizeof(size_t)];
+    struct cmsghdr *cmsg;
+    int res;
+    int i;
+
+    iov.iov_base = msgs;
+    iov.iov_len = sizeof(struct message) * MAX_BATCH;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ccmsg;
+    msg.msg_controllen = sizeof(ccmsg);
+
+    *numfds = 0;
+    res = recvmsg(sock, &msg, 0);
+    if (res == -1) {
+        perror("ulockmgr_server: recvmsg");
+        return -1;
+    }
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+        if (cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS) {
+            fprintf(stderr, "ulockmgr_server: unknown control message %d\n",
+                    cmsg->cmsg_type);
+            continue;
+        }
+        if (n > MAX_BATCH_FDS - *numfds)
+            n = MAX_BATCH_FDS - *numfds;
+        memcpy(fdp + *numfds, CMSG_DATA(cmsg), sizeof(int) * n);
+        *numfds += n;
+    }
+    if (msg.msg_flags & MSG_CTRUNC) {
+        fprintf(stderr, "ulockmgr_server: control message truncated\n");
+        for (i = 0; i < *numfds; i++)
+            close(fdp[i]);
+        *numfds = 0;
+    }
+    if (res % sizeof(struct message) != 0) {
+        fprintf(stderr, "ulockmgr_server: short message received\n");
+        for (i = 0; i < *numfds; i++)
+            close(fdp[i]);
+        return -1;
+    }
+    return res / sizeof(struct message);
+}
+
 static int closefrom(int minfd)
 {
     DIR *dir = opendir("/proc/self/fd");
@@ -138,16 +203,29 @@ static int closefrom(int minfd)
     return 0;
 }
 
-static void send_reply(int cfd, struct message *msg)
+static void send_reply(int cfd, struct message *msg, int count)
 {
-    int res = send(cfd, msg, sizeof(struct message), MSG_NOSIGNAL);
+    int res = send(cfd, msg, sizeof(struct message) * count, MSG_NOSIGNAL);
     if (res == -1)
         perror("ulockmgr_server: sending reply");
 #ifdef DEBUG
-    fprintf(stderr, "ulockmgr_server: error: %i\n", msg->error);
+    fprintf(stderr, "ulockmgr_server: error: %i\n", msg[count - 1].error);
 #endif
 }
 
+/* Answer on the request's own socket if it has one, otherwise leave
+   the reply to be batched by the caller */
+static int finish_message(int cfd, struct message *msg, int error)
+{
+    msg->error = error;
+    if (cfd == -1)
+        return 0;
+
+    send_reply(cfd, msg, 1);
+    close(cfd);
+    return 1;
+}
+
 static void *process_request(void *d_)
 {
     struct req_data *d = d_;
@@ -158,22 +236,27 @@ static void *process_request(void *d_)
     if (res == -1 && errno == EAGAIN) {
         d->msg.error = EAGAIN;
         d->msg.thr = pthread_self();
-        send_reply(d->cfd, &d->msg);
+        send_reply(d->cfd, &d->msg, 1);
         res = fcntl(d->f->fd, F_SETLKW, &d->msg.lock);
     }
     d->msg.error = (res == -1) ? errno : 0;
     pthread_mutex_lock(&d->o->lock);
     d->f->inuse--;
     pthread_mutex_unlock(&d->o->lock);
-    send_reply(d->cfd, &d->msg);
+    send_reply(d->cfd, &d->msg, 1);
     close(d->cfd);
     free(d);
 
     return NULL;
 }
 
-static void process_message(struct owner *o, struct message *msg, int cfd,
-                            int fd)
+/*
+ * Blocking requests come with a socket (cfd) of their own to be
+ * answered on, for the others it is -1.  Returns 0 if the reply is
+ * left to the caller, 1 if it has been or will be sent here.
+ */
+static int process_message(struct owner *o, struct message *msg, int cfd,
+                           int fd)
 {
     struct fd_store *f = NULL;
     struct fd_store *newf = NULL;
@@ -202,10 +285,7 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
         if (!msg->nofd)
             close(fd);
 
-        msg->error = 0;
-        send_reply(cfd, msg);
-        close(cfd);
-        return;
+        return finish_message(cfd, msg, 0);
     }
 
     if (msg->nofd) {
@@ -216,18 +296,13 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
         }
         if (!*fp) {
             fprintf(stderr, "ulockmgr_server: fd %i not found\n", msg->fd);
-            msg->error = EIO;
-            send_reply(cfd, msg);
-            close(cfd);
-            return;
+            return finish_message(cfd, msg, EIO);
         }
     } else {
         newf = f = malloc(sizeof(struct fd_store));
         if (!f) {
-            msg->error = ENOLCK;
-            send_reply(cfd, msg);
-            close(cfd);
-            return;
+            close(fd);
+            return finish_message(cfd, msg, ENOLCK);
         }
 
         f->fd = fd;
@@ -235,26 +310,21 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
         f->inuse = 0;
     }
 
-    if (msg->cmd == F_GETLK || msg->cmd == F_SETLK ||
-        msg->lock.l_type == F_UNLCK) {
+    if (!ulockmgr_blocking(msg->cmd, &msg->lock)) {
         res = fcntl(f->fd, msg->cmd, &msg->lock);
-        msg->error = (res == -1) ? errno : 0;
-        send_reply(cfd, msg);
-        close(cfd);
         if (newf) {
             newf->next = o->fds;
             o->fds = newf;
         }
-        return;
+        return finish_message(cfd, msg, (res == -1) ? errno : 0);
     }
 
     d = malloc(sizeof(struct req_data));
     if (!d) {
-        msg->error = ENOLCK;
-        send_reply(cfd, msg);
-        close(cfd);
+        if (newf)
+            close(fd);
         free(newf);
-        return;
+        return finish_message(cfd, msg, ENOLCK);
     }
 
     f->inuse++;
@@ -264,13 +334,12 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
     d->msg = *msg;
     res = pthread_create(&tid, NULL, process_request, d);
     if (res) {
-        msg->error = ENOLCK;
-        send_reply(cfd, msg);
-        close(cfd);
         free(d);
         f->inuse--;
+        if (newf)
+            close(fd);
         free(newf);
-        return;
+        return finish_message(cfd, msg, ENOLCK);
     }
 
     if (newf) {
@@ -278,6 +347,7 @@ static void process_message(struct owner *o, struct message *msg, int cfd,
         o->fds = newf;
     }
     pthread_detach(tid);
+    return 1;
 }
 
 static void sigusr1_handler(int sig)
@@ -303,29 +373,56 @@ static void process_owner(int cfd)
     memset(&o, 0, sizeof(struct owner));
     pthread_mutex_init(&o.lock, NULL);
     while (1) {
-        struct message msg;
-        int rfds[2];
-        int res;
-        int numfds = 2;
-
-        res  = receive_message(cfd, &msg, sizeof(msg), rfds, &numfds);
-        if (!res)
+        struct message msgs[MAX_BATCH];
+        struct message replies[MAX_BATCH];
+        int rfds[MAX_BATCH_FDS];
+        int nreplies = 0;
+        int numfds;
+        int nmsg;
+        int i;
+        int j = 0;
+
+        nmsg = receive_batch(cfd, msgs, rfds, &numfds);
+        if (!nmsg)
             break;
-        if (res == -1)
+        if (nmsg == -1)
             exit(1);
 
-        if (msg.intr) {
-            if (numfds != 0)
-                fprintf(stderr, "ulockmgr_server: too many fds for intr\n");
-            pthread_kill(msg.thr, SIGUSR1);
-        } else {
-            if (numfds != 2)
+        for (i = 0; i < nmsg; i++) {
+            struct message *msg = &msgs[i];
+            int blocking = ulockmgr_blocking(msg->cmd, &msg->lock);
+            int rfd = -1;
+            int fd = -1;
+
+            if (msg->intr) {
+                pthread_kill(msg->thr, SIGUSR1);
                 continue;
+            }
+            if (numfds - j < blocking + !msg->nofd) {
+                fprintf(stderr, "ulockmgr_server: missing file descriptor\n");
+                /* A blocking request notices its socket closing */
+                while (j < numfds)
+                    close(rfds[j++]);
+                if (!blocking) {
+                    msg->error = EIO;
+                    replies[nreplies++] = *msg;
+                }
+                continue;
+            }
+            if (blocking)
+                rfd = rfds[j++];
+            if (!msg->nofd)
+                fd = rfds[j++];
 
             pthread_mutex_lock(&o.lock);
-            process_message(&o, &msg, rfds[0], rfds[1]);
+            if (!process_message(&o, msg, rfd, fd))
+                replies[nreplies++] = *msg;
             pthread_mutex_unlock(&o.lock);
         }
+        while (j < numfds)
+            close(rfds[j++]);
+        if (nreplies)
+            send_reply(cfd, replies, nreplies);
     }
     if (o.fds)
         fprintf(stderr, "ulockmgr_server: open file descriptors on exit\n");
@@ -0,0 +1,95 @@
+/*
+    ulockmgr_test: Userspace Lock Manager tests
+    Copyright (C) 2006  Miklos Szeredi <miklos@szeredi.hu>
+
+    This program can be distributed under the terms of the GNU GPL.
+    See the file COPYING.
+*/
+
+/* Needs ulockmgr_server in the PATH, "make check" runs it from here */
+
+#include <ulockmgr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+static const char owner[] = "ulockmgr_test";
+static int fd;
+static int failed;
+
+static int lock_op(int cmd, short type, off_t start, off_t len)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    return ulockmgr_op(fd, cmd, &lock, owner, sizeof(owner));
+}
+
+/* The locks are held by the server, so they show up as another
+   process's locks here */
+static short lock_type(off_t start, off_t len)
+{
+    struct flock lock;
+
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    if (fcntl(fd, F_GETLK, &lock) == -1) {
+        perror("ulockmgr_test: F_GETLK");
+        exit(1);
+    }
+    return lock.l_type;
+}
+
+static void check(const char *what, int res, int expect)
+{
+    if (res != expect) {
+        fprintf(stderr, "ulockmgr_test: %s: %i, expected %i\n", what, res,
+                expect);
+        failed = 1;
+    }
+}
+
+int main(void)
+{
+    char name[] = "/tmp/ulockmgr_test.XXXXXX";
+
+    fd = mkstemp(name);
+    if (fd == -1) {
+        perror("ulockmgr_test: mkstemp");
+        return 1;
+    }
+    unlink(name);
+    /* An unlock that blocked for a reply would hang here */
+    alarm(10);
+
+    check("lock", lock_op(F_SETLK, F_WRLCK, 0, 100), 0);
+    check("locked", lock_type(0, 100), F_WRLCK);
+
+    check("F_SETLKW partial unlock", lock_op(F_SETLKW, F_UNLCK, 0, 50), 0);
+    check("unlocked part", lock_type(0, 50), F_UNLCK);
+    check("locked part", lock_type(50, 50), F_WRLCK);
+
+    check("F_SETLKW unlock", lock_op(F_SETLKW, F_UNLCK, 0, 0), 0);
+    check("unlocked", lock_type(0, 0), F_UNLCK);
+
+    /* Nothing is locked any more, unlocking again must still succeed */
+    check("F_SETLKW unlock of nothing", lock_op(F_SETLKW, F_UNLCK, 0, 0), 0);
+
+    check("F_SETLKW lock", lock_op(F_SETLKW, F_WRLCK, 10, 10), 0);
+    check("locked again", lock_type(10, 10), F_WRLCK);
+    check("final unlock", lock_op(F_SETLK, F_UNLCK, 0, 0), 0);
+    check("unlocked again", lock_type(0, 0), F_UNLCK);
+
+    close(fd);
+    return failed;
+}
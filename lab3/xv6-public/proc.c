@@ -7,11 +7,35 @@
 #include "proc.h"
 #include "spinlock.h"
 
+#define NRQWORD ((NPRIO+31)/32)
+#define BALANCE_TICKS 10  // how often a busy CPU evens out the queues
+
+// RUNNABLE processes, in one FIFO queue per priority.  Bit i of
+// bits[] is set when queue i is non-empty and bit w of top when
+// bits[w] is non-zero, so the first non-empty queue is found
+// with two bsf instructions however many processes there are.
+//
+// Each CPU has its own run queue and lock, so that picking the
+// next process doesn't serialize all CPUs on ptable.lock.  n and
+// best are read without the lock to choose a queue.
+struct runq {
+  struct spinlock lock;
+  volatile int n;              // Number of queued processes
+  volatile int best;           // Highest queued priority, NPRIO if none
+  uint balanced;               // ticks at the last balance()
+  uint top;
+  uint bits[NRQWORD];
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+};
+
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
 } ptable;
 
+static struct runq runqs[NCPU];
+
 static struct proc *initproc;
 
 int nextpid = 1;
@@ -20,10 +44,142 @@ extern void trapret(void);
 
 static void wakeup1(void *chan);
 
+// Append p to the queue of its priority.  rq->lock must be held.
+static void
+runqpush(struct runq *rq, struct proc *p)
+{
+  int prio = p->priority;
+
+  p->cpu = rq - runqs;
+  p->rqnext = 0;
+  if(rq->tail[prio])
+    rq->tail[prio]->rqnext = p;
+  else {
+    rq->head[prio] = p;
+    rq->bits[prio/32] |= 1U << (prio%32);
+    rq->top |= 1U << (prio/32);
+  }
+  rq->tail[prio] = p;
+  rq->n++;
+  if(prio < rq->best)
+    rq->best = prio;
+}
+
+// Remove and return the first process of the highest priority
+// non-empty queue, or 0 if rq is empty.  rq->lock must be held.
+static struct proc*
+runqpop(struct runq *rq)
+{
+  struct proc *p;
+  int w, prio;
+
+  if(rq->top == 0)
+    return 0;
+  w = bsf(rq->top);
+  prio = w*32 + bsf(rq->bits[w]);
+  p = rq->head[prio];
+  rq->head[prio] = p->rqnext;
+  if(rq->head[prio] == 0){
+    rq->tail[prio] = 0;
+    rq->bits[w] &= ~(1U << (prio%32));
+    if(rq->bits[w] == 0)
+      rq->top &= ~(1U << w);
+  }
+  p->rqnext = 0;
+  rq->n--;
+  if(rq->top == 0)
+    rq->best = NPRIO;
+  else {
+    w = bsf(rq->top);
+    rq->best = w*32 + bsf(rq->bits[w]);
+  }
+  return p;
+}
+
+// Mark p RUNNABLE and queue it on the CPU it last ran on, or on
+// this CPU if it is new.  The ptable lock must be held.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runqs[p->cpu >= 0 ? p->cpu : cpuid()];
+
+  p->state = RUNNABLE;
+  acquire(&rq->lock);
+  runqpush(rq, p);
+  release(&rq->lock);
+}
+
+// Take the next process to run on the CPU owning mine.  This is
+// the highest priority process of all the queues, from our own
+// queue if it has one as good.  Otherwise it is stolen, from the
+// longest of the queues holding such a process.
+// Returns 0 if there is nothing to run, or the queue was emptied
+// under us.
+static struct proc*
+runqnext(struct runq *mine)
+{
+  struct runq *rq, *from = mine;
+  struct proc *p;
+
+  for(rq = runqs; rq < &runqs[ncpu]; rq++){
+    if(rq->best < from->best ||
+       (rq->best == from->best && from != mine && rq->n > from->n))
+      from = rq;
+  }
+  if(from->best == NPRIO)
+    return 0;
+
+  acquire(&from->lock);
+  p = runqpop(from);
+  release(&from->lock);
+  return p;
+}
+
+// Pull processes from the longest queue to mine until they are
+// within one of each other, highest priorities first, so that the
+// CPUs share the work without waiting to run out of it.
+static void
+balance(struct runq *mine)
+{
+  struct runq *rq, *busiest = 0;
+  struct proc *p;
+  int n;
+
+  mine->balanced = ticks;
+  for(rq = runqs; rq < &runqs[ncpu]; rq++){
+    if(rq != mine && (busiest == 0 || rq->n > busiest->n))
+      busiest = rq;
+  }
+  if(busiest == 0 || busiest->n <= mine->n + 1)
+    return;
+
+  // Lock in array order to avoid deadlock with another balance().
+  if(busiest < mine){
+    acquire(&busiest->lock);
+    acquire(&mine->lock);
+  } else {
+    acquire(&mine->lock);
+    acquire(&busiest->lock);
+  }
+  for(n = (busiest->n - mine->n) / 2; n > 0; n--){
+    if((p = runqpop(busiest)) == 0)
+      break;
+    runqpush(mine, p);
+  }
+  release(&busiest->lock);
+  release(&mine->lock);
+}
+
 void
 pinit(void)
 {
+  struct runq *rq;
+
   initlock(&ptable.lock, "ptable");
+  for(rq = runqs; rq < &runqs[NCPU]; rq++){
+    initlock(&rq->lock, "runq");
+    rq->best = NPRIO;
+  }
 }
 
 // Must be called with interrupts disabled
@@ -89,6 +245,7 @@ found:
   p->state = EMBRYO;
   p->pid = nextpid++;
   p->priority = 50;
+  p->cpu = -1;
   release(&ptable.lock);
 
   // Allocate kernel stack.
@@ -148,7 +305,7 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  setrunnable(p);
 
   release(&ptable.lock);
 }
@@ -214,7 +371,7 @@ fork(void)
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  setrunnable(np);
 
   release(&ptable.lock);
 
@@ -319,6 +476,7 @@ wait(void)
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
+// Unused, it does not take processes off the run queues.
 void
 scheduler_old(void)
 {
@@ -356,50 +514,47 @@ scheduler_old(void)
 }
 
 //Lab 3 My own scheduler
+// Runs the highest priority process of the run queues (see
+// runqnext()).  A process that yields goes to the back of its
+// queue, so processes of the same priority take turns.
+// ptable.lock is only taken once there is a process to switch to.
 void scheduler(void) {
   struct proc *p;
-  int max_priority = 201; 
   struct cpu *c = mycpu();
+  struct runq *rq = &runqs[c - cpus];
   c->proc = 0;
   
   for(;;){
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
-    max_priority = 201;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if(p->state != RUNNABLE)
-        continue;
-
-      if(p->priority < max_priority) {
-        max_priority = p->priority;
-      }
-    }
-
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-      if(p->state != RUNNABLE)
-        continue;
-
-      if(p->priority == max_priority) {
-        // Switch to chosen process.  It is the process's job 
-        // to release ptable.lock and then reacquire it
-        // before jumping back to us.
-        c->proc = p;
-        switchuvm(p);
-        p->state = RUNNING;
+    if((p = runqnext(rq)) == 0)
+      continue;
 
-        swtch(&(c->scheduler), p->context);
-        switchkvm();
+    // p is off the run queues, so nobody else will run it.  If it
+    // has just yielded on another CPU, this waits until that CPU
+    // has switched away from it.
+    acquire(&ptable.lock);
 
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-    }
+    // Switch to chosen process.  It is the process's job 
+    // to release ptable.lock and then reacquire it
+    // before jumping back to us.
+    c->proc = p;
+    switchuvm(p);
+    p->state = RUNNING;
+    p->cpu = rq - runqs;
+
+    swtch(&(c->scheduler), p->context);
+    switchkvm();
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    // If it is RUNNABLE again it has been queued already.
+    c->proc = 0;
     release(&ptable.lock);
 
+    if(ticks - rq->balanced >= BALANCE_TICKS)
+      balance(rq);
   }
 }
 
@@ -435,7 +590,7 @@ void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  setrunnable(myproc());
   sched();
   release(&ptable.lock);
 }
@@ -510,7 +665,7 @@ wakeup1(void *chan)
 
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
     if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+      setrunnable(p);
 }
 
 // Wake up all processes sleeping on chan.
@@ -536,7 +691,7 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        setrunnable(p);
       release(&ptable.lock);
       return 0;
     }
@@ -50,6 +50,8 @@ struct proc {
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
   int priority;
+  int cpu;                     // CPU whose run queue it uses, -1 if none yet
+  struct proc *rqnext;         // Next process on its run queue
 };
 
 // Process memory is laid out contiguously, low addresses first:
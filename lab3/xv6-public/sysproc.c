@@ -98,7 +98,7 @@ sys_setpriority(void)
 
   struct proc *curproc = myproc();
   argint(0, &priority);
-  if(priority < 0 || priority > 200)
+  if(priority < 0 || priority >= NPRIO)
     return -1;
   int old_priority = curproc->priority;
   curproc->priority = priority;
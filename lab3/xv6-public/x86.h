@@ -130,6 +130,16 @@ xchg(volatile uint *addr, uint newval)
   return result;
 }
 
+// Index of the lowest set bit of x, which must not be zero.
+static inline uint
+bsf(uint x)
+{
+  uint result;
+
+  asm("bsfl %1,%0" : "=r" (result) : "rm" (x) : "cc");
+  return result;
+}
+
 static inline uint
 rcr2(void)
 {